@@ -0,0 +1,769 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * sol_bench, a simple MQTT load generator to measure the broker.
+ *
+ * Opens N publishers and M subscribers connections, each one served by its
+ * own thread with blocking sockets. Publishers embed the monotonic time of
+ * the send and a sequence number at the start of every payload, subscribers
+ * use it to track the end-to-end latency of each message into a per thread
+ * histogram, merged at the end of the run. Clocks are the same as long as
+ * the broker is benchmarked from the same host (loopback or unix socket).
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../src/mqtt.h"
+#include "../src/pack.h"
+#include "../src/util.h"
+#include "../src/memory.h"
+#include "../src/histogram.h"
+
+#define DEFAULT_HOST            "127.0.0.1"
+#define DEFAULT_PORT            "1883"
+#define DEFAULT_PUBLISHERS      1
+#define DEFAULT_SUBSCRIBERS     1
+#define DEFAULT_PAYLOAD_SIZE    64
+#define DEFAULT_MESSAGES        10000
+#define DEFAULT_DEPTH           1
+
+#define TOPIC_PREFIX            "sol_bench"
+
+/* Every payload carries the send timestamp and a sequence number */
+#define MIN_PAYLOAD_SIZE        (2 * sizeof(uint64_t))
+
+/* Wait time for messages still in flight after the publishers are done */
+#define DRAIN_TIMEOUT_NS        2000000000ULL
+
+/* Receive timeout of the sockets, to periodically check for the end */
+#define RECV_TIMEOUT_MS         100
+
+enum topic_mode {
+    TOPIC_FIXED,        /* Everyone on the same topic */
+    TOPIC_PER_CLIENT,   /* A topic for each publisher */
+    TOPIC_WILDCARD      /* A topic for each publisher, subscribed with # */
+};
+
+static const char *const topic_modes[] = { "fixed", "per-client", "wildcard" };
+
+static struct {
+    const char *host;
+    const char *port;
+    const char *unix_socket;
+    const char *username;
+    const char *password;
+    int publishers;
+    int subscribers;
+    int qos;
+    size_t payload_size;
+    int depth;
+    double rate;
+    long messages;
+    int duration;
+    enum topic_mode mode;
+    bool json;
+} opts = {
+    .host = DEFAULT_HOST,
+    .port = DEFAULT_PORT,
+    .publishers = DEFAULT_PUBLISHERS,
+    .subscribers = DEFAULT_SUBSCRIBERS,
+    .payload_size = DEFAULT_PAYLOAD_SIZE,
+    .depth = DEFAULT_DEPTH,
+    .messages = DEFAULT_MESSAGES,
+    .mode = TOPIC_FIXED
+};
+
+/* A single benchmark connection, publisher or subscriber */
+struct bench_client {
+    pthread_t thread;
+    int id;
+    int fd;
+    char client_id[MQTT_CLIENT_ID_LEN];
+    char topic[64];
+    unsigned long messages;
+    unsigned long bytes;
+    bool failed;
+    uint64_t start;
+    uint64_t end;
+    struct histogram latency;
+};
+
+/* Number of publishers still running */
+static atomic_int publishers_running = ATOMIC_VAR_INIT(0);
+
+/* Time the last publisher finished, 0 while some are still running */
+static atomic_ullong publishers_end = ATOMIC_VAR_INIT(0);
+
+static void usage(const char *me) {
+    fprintf(stderr,
+            "Usage: %s [options]\n\n"
+            " -a addr     Broker address, default %s\n"
+            " -p port     Broker port, default %s\n"
+            " -U path     Connect through a unix socket instead of TCP\n"
+            " -u user     Username\n"
+            " -w passwd   Password\n"
+            " -P N        Number of publishers, default %d\n"
+            " -S M        Number of subscribers, default %d\n"
+            " -q qos      QoS of the messages (0, 1 or 2), default 0\n"
+            " -s size     Payload size in bytes (min %zu), default %d\n"
+            " -t mode     Topic pattern: fixed, per-client or wildcard, "
+            "default fixed\n"
+            " -r rate     Messages per second of each publisher, default "
+            "unlimited\n"
+            " -d depth    Messages in flight of each publisher, default %d\n"
+            " -n count    Messages sent by each publisher, default %d\n"
+            " -T seconds  Publish for a duration instead of a count\n"
+            " -j          Print the report as JSON\n"
+            " -h          Print this help\n",
+            me, DEFAULT_HOST, DEFAULT_PORT, DEFAULT_PUBLISHERS,
+            DEFAULT_SUBSCRIBERS, MIN_PAYLOAD_SIZE, DEFAULT_PAYLOAD_SIZE,
+            DEFAULT_DEPTH, DEFAULT_MESSAGES);
+}
+
+/*
+ * ==============================
+ *  Network and protocol helpers
+ * ==============================
+ */
+
+static int open_connection(void) {
+    int fd = -1;
+    if (opts.unix_socket) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        strncpy(addr.sun_path, opts.unix_socket, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+            goto err;
+    } else {
+        struct addrinfo hints = {
+            .ai_family = AF_UNSPEC,
+            .ai_socktype = SOCK_STREAM
+        }, *result, *rp;
+        if (getaddrinfo(opts.host, opts.port, &hints, &result) != 0)
+            return -1;
+        for (rp = result; rp; rp = rp->ai_next) {
+            fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+            if (fd < 0)
+                continue;
+            if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(result);
+        if (fd < 0)
+            return -1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int));
+    }
+    struct timeval tv = { 0, RECV_TIMEOUT_MS * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+
+err:
+    close(fd);
+    return -1;
+}
+
+static int write_all(int fd, const u8 *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Read exactly len bytes, waiting on receive timeouts only if some bytes of
+ * the packet have already been read, returns 0 on success, 1 on timeout and
+ * -1 on error or connection closed
+ */
+static int read_all(int fd, u8 *buf, size_t len, bool started) {
+    while (len > 0) {
+        ssize_t n = recv(fd, buf, len, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!started)
+                return 1;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        started = true;
+    }
+    return 0;
+}
+
+/*
+ * Read a whole MQTT packet into buf, returning the first byte of the fixed
+ * header and the remaining length in len. Returns 0 on success, 1 on timeout
+ * and -1 on errors or malformed packets.
+ */
+static int read_packet(int fd, u8 *buf, size_t size, u8 *byte, size_t *len) {
+    int rc = read_all(fd, byte, 1, false);
+    if (rc != 0)
+        return rc;
+    // Remaining length, 1 to 4 bytes with continuation bit
+    u8 encoded[4];
+    int i = 0;
+    do {
+        if (i == 4 || read_all(fd, &encoded[i], 1, true) != 0)
+            return -1;
+    } while (encoded[i++] & 128);
+    unsigned pos = 0;
+    *len = mqtt_decode_length(encoded, &pos);
+    if (*len > size)
+        return -1;
+    return read_all(fd, buf, *len, true);
+}
+
+static int send_packet(int fd, const struct mqtt_packet *pkt) {
+    u8 buf[512];
+    usize len = mqtt_pack(pkt, buf);
+    return write_all(fd, buf, len);
+}
+
+static int send_ack(int fd, u8 type, u16 pkt_id) {
+    u8 buf[MQTT_ACK_LEN];
+    mqtt_pack_mono(buf, type, pkt_id);
+    return write_all(fd, buf, MQTT_ACK_LEN);
+}
+
+/* Wait for a packet of the given type, skipping timeouts */
+static int expect_packet(int fd, u8 type, u8 *buf, size_t size,
+                         struct mqtt_packet *pkt) {
+    u8 byte = 0;
+    size_t len = 0;
+    int rc;
+    while ((rc = read_packet(fd, buf, size, &byte, &len)) == 1)
+        ;
+    if (rc < 0 || (byte >> 4) != type)
+        return -1;
+    return mqtt_unpack(buf, pkt, byte, len) == MQTT_OK ? 0 : -1;
+}
+
+static int mqtt_handshake(struct bench_client *c) {
+    struct mqtt_packet pkt = { .header = { .byte = CONNECT_B } };
+    pkt.connect.bits.clean_session = 1;
+    pkt.connect.payload.keepalive = 60;
+    snprintf((char *) pkt.connect.payload.client_id, MQTT_CLIENT_ID_LEN,
+             "%s", c->client_id);
+    if (opts.username) {
+        pkt.connect.bits.username = 1;
+        pkt.connect.payload.username = (u8 *) opts.username;
+    }
+    if (opts.password) {
+        pkt.connect.bits.password = 1;
+        pkt.connect.payload.password = (u8 *) opts.password;
+    }
+    if (send_packet(c->fd, &pkt) < 0)
+        return -1;
+    u8 buf[16];
+    struct mqtt_packet connack;
+    if (expect_packet(c->fd, CONNACK, buf, sizeof(buf), &connack) < 0)
+        return -1;
+    if (connack.connack.rc != MQTT_CONNECTION_ACCEPTED) {
+        fprintf(stderr, "%s: connection refused (%u)\n",
+                c->client_id, connack.connack.rc);
+        return -1;
+    }
+    return 0;
+}
+
+static int mqtt_subscribe(struct bench_client *c, const char *topic) {
+    struct mqtt_packet pkt = { .header = { .byte = SUBSCRIBE_B } };
+    struct mqtt_subscribe_tuple tuple = { opts.qos, strlen(topic), (u8 *) topic };
+    pkt.subscribe.pkt_id = 1;
+    pkt.subscribe.tuples_len = 1;
+    pkt.subscribe.tuples = &tuple;
+    if (send_packet(c->fd, &pkt) < 0)
+        return -1;
+    u8 buf[16];
+    struct mqtt_packet suback;
+    if (expect_packet(c->fd, SUBACK, buf, sizeof(buf), &suback) < 0)
+        return -1;
+    int rc = suback.suback.rcs[0];
+    mqtt_packet_destroy(&suback);
+    return rc > 2 ? -1 : 0;
+}
+
+static void disconnect(struct bench_client *c) {
+    struct mqtt_packet pkt = { .header = { .byte = DISCONNECT_B } };
+    send_packet(c->fd, &pkt);
+    close(c->fd);
+}
+
+/*
+ * =========
+ *  Clients
+ * =========
+ */
+
+static void publisher_topic(int id, char *topic, size_t len) {
+    if (opts.mode == TOPIC_FIXED)
+        snprintf(topic, len, "%s/topic", TOPIC_PREFIX);
+    else
+        snprintf(topic, len, "%s/%d", TOPIC_PREFIX, id);
+}
+
+static void subscriber_topic(int id, char *topic, size_t len) {
+    if (opts.mode == TOPIC_WILDCARD)
+        snprintf(topic, len, "%s/#", TOPIC_PREFIX);
+    else
+        publisher_topic(id % opts.publishers, topic, len);
+}
+
+/* Sleep till the given monotonic time */
+static void sleep_until(uint64_t deadline) {
+    uint64_t now = monotonic_ns();
+    if (deadline <= now)
+        return;
+    uint64_t wait = deadline - now;
+    struct timespec ts = { wait / 1000000000ULL, wait % 1000000000ULL };
+    nanosleep(&ts, NULL);
+}
+
+/*
+ * Handle an ack received by a publisher, returns the number of messages
+ * concluded, 1 for PUBACK and PUBCOMP, 0 otherwise, or -1 on error
+ */
+static int publisher_ack(struct bench_client *c, u8 *buf, size_t size) {
+    u8 byte = 0;
+    size_t len = 0;
+    int rc = read_packet(c->fd, buf, size, &byte, &len);
+    if (rc != 0)
+        return rc == 1 ? 0 : -1;
+    switch (byte >> 4) {
+        case PUBACK:
+        case PUBCOMP:
+            return 1;
+        case PUBREC:
+            return send_ack(c->fd, PUBREL, unpacku16(buf)) < 0 ? -1 : 0;
+        default:
+            return 0;
+    }
+}
+
+static bool publisher_done(const struct bench_client *c, uint64_t deadline) {
+    if (opts.duration > 0)
+        return monotonic_ns() >= deadline;
+    return c->messages >= (unsigned long) opts.messages;
+}
+
+static void *publisher_run(void *arg) {
+    struct bench_client *c = arg;
+    u8 *payload = try_alloc(opts.payload_size);
+    memset(payload, 'x', opts.payload_size);
+    struct mqtt_packet pkt = {
+        .header = { .bits = { .type = PUBLISH, .qos = opts.qos } },
+        .publish = {
+            .topiclen = strlen(c->topic),
+            .topic = (u8 *) c->topic,
+            .payloadlen = opts.payload_size,
+            .payload = payload
+        }
+    };
+    size_t pktsize = mqtt_size(&pkt, NULL);
+    size_t bufsize = pktsize * opts.depth;
+    u8 *wbuf = try_alloc(bufsize);
+    u8 rbuf[16];
+    int inflight = 0;
+    u16 next_id = 0;
+    uint64_t interval = opts.rate > 0 ? 1e9 / opts.rate : 0;
+    c->start = monotonic_ns();
+    uint64_t deadline = c->start + opts.duration * 1000000000ULL;
+    while (!publisher_done(c, deadline)) {
+        /*
+         * QoS 0 messages are written in batches of depth messages, QoS > 0
+         * ones are sent till there's depth of them waiting for an ack
+         */
+        size_t batch = 0;
+        int window = opts.qos == 0 ? opts.depth : opts.depth - inflight;
+        for (; window > 0 && !publisher_done(c, deadline); --window) {
+            if (interval > 0)
+                sleep_until(c->start + c->messages * interval);
+            if (opts.qos > 0) {
+                next_id = next_id == 0xFFFF ? 1 : next_id + 1;
+                pkt.publish.pkt_id = next_id;
+                inflight++;
+            }
+            packi64(payload, monotonic_ns());
+            packi64(payload + sizeof(uint64_t), c->messages);
+            batch += mqtt_pack(&pkt, wbuf + batch);
+            c->messages++;
+            c->bytes += opts.payload_size;
+        }
+        if (batch > 0 && write_all(c->fd, wbuf, batch) < 0)
+            goto err;
+        if (opts.qos > 0 && inflight >= opts.depth) {
+            int acked = publisher_ack(c, rbuf, sizeof(rbuf));
+            if (acked < 0)
+                goto err;
+            inflight -= acked;
+        }
+    }
+    // Wait for the acks still pending
+    while (inflight > 0) {
+        int acked = publisher_ack(c, rbuf, sizeof(rbuf));
+        if (acked < 0)
+            goto err;
+        inflight -= acked;
+    }
+    c->end = monotonic_ns();
+    goto exit;
+
+err:
+    c->failed = true;
+    c->end = monotonic_ns();
+    fprintf(stderr, "%s: connection error\n", c->client_id);
+
+exit:
+    if (atomic_fetch_sub(&publishers_running, 1) == 1)
+        atomic_store(&publishers_end, monotonic_ns());
+    free_memory(wbuf);
+    free_memory(payload);
+    return NULL;
+}
+
+static void *subscriber_run(void *arg) {
+    struct bench_client *c = arg;
+    size_t size = opts.payload_size + sizeof(c->topic) + 16;
+    u8 *buf = try_alloc(size);
+    uint64_t last = 0;
+    histogram_init(&c->latency);
+    while (1) {
+        u8 byte = 0;
+        size_t len = 0;
+        int rc = read_packet(c->fd, buf, size, &byte, &len);
+        if (rc < 0) {
+            c->failed = true;
+            fprintf(stderr, "%s: connection error\n", c->client_id);
+            break;
+        }
+        uint64_t now = monotonic_ns();
+        if (rc == 1) {
+            // Publishers done and nothing received for a while, stop
+            uint64_t end = atomic_load(&publishers_end);
+            if (end > 0 && now - (last > end ? last : end) > DRAIN_TIMEOUT_NS)
+                break;
+            continue;
+        }
+        if ((byte >> 4) == PUBREL) {
+            if (send_ack(c->fd, PUBCOMP, unpacku16(buf)) < 0)
+                break;
+            continue;
+        }
+        if ((byte >> 4) != PUBLISH)
+            continue;
+        struct mqtt_packet pkt;
+        if (mqtt_unpack(buf, &pkt, byte, len) != MQTT_OK)
+            continue;
+        if (pkt.publish.payloadlen >= MIN_PAYLOAD_SIZE) {
+            histogram_record(&c->latency, now - unpacku64(pkt.publish.payload));
+            if (c->messages == 0)
+                c->start = now;
+            c->end = last = now;
+            c->messages++;
+            c->bytes += pkt.publish.payloadlen;
+        }
+        if (pkt.header.bits.qos == AT_LEAST_ONCE)
+            rc = send_ack(c->fd, PUBACK, pkt.publish.pkt_id);
+        else if (pkt.header.bits.qos == EXACTLY_ONCE)
+            rc = send_ack(c->fd, PUBREC, pkt.publish.pkt_id);
+        mqtt_packet_destroy(&pkt);
+        if (rc < 0)
+            break;
+    }
+    free_memory(buf);
+    return NULL;
+}
+
+static int client_start(struct bench_client *c, int id, const char *prefix) {
+    c->id = id;
+    snprintf(c->client_id, MQTT_CLIENT_ID_LEN, "%s-%s-%d-%d",
+             TOPIC_PREFIX, prefix, (int) getpid(), id);
+    c->fd = open_connection();
+    if (c->fd < 0) {
+        fprintf(stderr, "%s: unable to connect: %s\n",
+                c->client_id, strerror(errno));
+        return -1;
+    }
+    return mqtt_handshake(c);
+}
+
+/*
+ * ========
+ *  Report
+ * ========
+ */
+
+struct report {
+    unsigned long sent;
+    unsigned long received;
+    unsigned long bytes_received;
+    double publish_secs;
+    double receive_secs;
+    int failed;
+    struct histogram latency;
+};
+
+static const struct {
+    const char *name;
+    double percentile;
+} quantiles[] = {
+    { "p50", 50.0 },
+    { "p90", 90.0 },
+    { "p99", 99.0 },
+    { "p999", 99.9 },
+    { "max", 100.0 }
+};
+
+#define QUANTILES (sizeof(quantiles) / sizeof(quantiles[0]))
+
+static void report_collect(struct report *r, struct bench_client *pubs,
+                           struct bench_client *subs) {
+    uint64_t pub_start = UINT64_MAX, pub_end = 0;
+    uint64_t sub_start = UINT64_MAX, sub_end = 0;
+    memset(r, 0x00, sizeof(*r));
+    histogram_init(&r->latency);
+    for (int i = 0; i < opts.publishers; ++i) {
+        r->sent += pubs[i].messages;
+        r->failed += pubs[i].failed;
+        if (pubs[i].start && pubs[i].start < pub_start)
+            pub_start = pubs[i].start;
+        if (pubs[i].end > pub_end)
+            pub_end = pubs[i].end;
+    }
+    for (int i = 0; i < opts.subscribers; ++i) {
+        r->received += subs[i].messages;
+        r->bytes_received += subs[i].bytes;
+        r->failed += subs[i].failed;
+        histogram_merge(&r->latency, &subs[i].latency);
+        if (subs[i].messages == 0)
+            continue;
+        if (subs[i].start < sub_start)
+            sub_start = subs[i].start;
+        if (subs[i].end > sub_end)
+            sub_end = subs[i].end;
+    }
+    r->publish_secs = pub_end > pub_start ? (pub_end - pub_start) / 1e9 : 0;
+    r->receive_secs = sub_end > sub_start ? (sub_end - sub_start) / 1e9 : 0;
+}
+
+static double rate(double count, double secs) {
+    return secs > 0 ? count / secs : 0;
+}
+
+static void report_print(const struct report *r) {
+    printf("Publishers: %d, subscribers: %d, QoS %d, payload %zu bytes, "
+           "topics %s, depth %d\n\n", opts.publishers, opts.subscribers,
+           opts.qos, opts.payload_size, topic_modes[opts.mode], opts.depth);
+    printf("Sent:     %lu messages in %.3f s, %.0f msg/s\n",
+           r->sent, r->publish_secs, rate(r->sent, r->publish_secs));
+    printf("Received: %lu messages in %.3f s, %.0f msg/s, %.3f MB/s\n",
+           r->received, r->receive_secs, rate(r->received, r->receive_secs),
+           rate(r->bytes_received, r->receive_secs) / (1024 * 1024));
+    if (r->failed > 0)
+        printf("Failed connections: %d\n", r->failed);
+    printf("\nEnd-to-end latency (us):\n");
+    for (size_t i = 0; i < QUANTILES; ++i)
+        printf("  %-5s %10.3f\n", quantiles[i].name,
+               histogram_percentile(&r->latency, quantiles[i].percentile) / 1e3);
+}
+
+static void report_json(const struct report *r) {
+    printf("{\"publishers\":%d,\"subscribers\":%d,\"qos\":%d,"
+           "\"payload_size\":%zu,\"topics\":\"%s\",\"depth\":%d,"
+           "\"sent\":%lu,\"received\":%lu,\"failed\":%d,"
+           "\"publish_seconds\":%.6f,\"receive_seconds\":%.6f,"
+           "\"publish_rate\":%.3f,\"receive_rate\":%.3f,"
+           "\"receive_bytes_rate\":%.3f,\"latency_us\":{",
+           opts.publishers, opts.subscribers, opts.qos, opts.payload_size,
+           topic_modes[opts.mode], opts.depth, r->sent, r->received,
+           r->failed, r->publish_secs, r->receive_secs,
+           rate(r->sent, r->publish_secs), rate(r->received, r->receive_secs),
+           rate(r->bytes_received, r->receive_secs));
+    for (size_t i = 0; i < QUANTILES; ++i)
+        printf("%s\"%s\":%.3f", i > 0 ? "," : "", quantiles[i].name,
+               histogram_percentile(&r->latency, quantiles[i].percentile) / 1e3);
+    printf("}}\n");
+}
+
+static bool parse_topic_mode(const char *arg) {
+    for (size_t i = 0; i < sizeof(topic_modes) / sizeof(topic_modes[0]); ++i) {
+        if (strcmp(arg, topic_modes[i]) == 0) {
+            opts.mode = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char **argv) {
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:p:U:u:w:P:S:q:s:t:r:d:n:T:jh")) != -1) {
+        switch (opt) {
+            case 'a':
+                opts.host = optarg;
+                break;
+            case 'p':
+                opts.port = optarg;
+                break;
+            case 'U':
+                opts.unix_socket = optarg;
+                break;
+            case 'u':
+                opts.username = optarg;
+                break;
+            case 'w':
+                opts.password = optarg;
+                break;
+            case 'P':
+                opts.publishers = atoi(optarg);
+                break;
+            case 'S':
+                opts.subscribers = atoi(optarg);
+                break;
+            case 'q':
+                opts.qos = atoi(optarg);
+                break;
+            case 's':
+                opts.payload_size = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                if (!parse_topic_mode(optarg)) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                opts.rate = atof(optarg);
+                break;
+            case 'd':
+                opts.depth = atoi(optarg);
+                break;
+            case 'n':
+                opts.messages = atol(optarg);
+                break;
+            case 'T':
+                opts.duration = atoi(optarg);
+                break;
+            case 'j':
+                opts.json = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (opts.publishers < 1 || opts.subscribers < 0 || opts.qos < 0
+        || opts.qos > 2 || opts.depth < 1
+        || opts.payload_size < MIN_PAYLOAD_SIZE) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    struct bench_client *pubs = try_calloc(opts.publishers, sizeof(*pubs));
+    struct bench_client *subs = try_calloc(opts.subscribers, sizeof(*subs));
+
+    /*
+     * Connect everyone and set up the subscriptions before starting, so no
+     * message is lost and connection times don't affect the measures
+     */
+    for (int i = 0; i < opts.publishers; ++i) {
+        if (client_start(&pubs[i], i, "pub") < 0)
+            exit(EXIT_FAILURE);
+        publisher_topic(i, pubs[i].topic, sizeof(pubs[i].topic));
+    }
+    for (int i = 0; i < opts.subscribers; ++i) {
+        if (client_start(&subs[i], i, "sub") < 0)
+            exit(EXIT_FAILURE);
+        subscriber_topic(i, subs[i].topic, sizeof(subs[i].topic));
+        if (mqtt_subscribe(&subs[i], subs[i].topic) < 0) {
+            fprintf(stderr, "%s: subscription to %s failed\n",
+                    subs[i].client_id, subs[i].topic);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < opts.subscribers; ++i)
+        pthread_create(&subs[i].thread, NULL, subscriber_run, &subs[i]);
+    atomic_store(&publishers_running, opts.publishers);
+    for (int i = 0; i < opts.publishers; ++i)
+        pthread_create(&pubs[i].thread, NULL, publisher_run, &pubs[i]);
+
+    for (int i = 0; i < opts.publishers; ++i)
+        pthread_join(pubs[i].thread, NULL);
+    for (int i = 0; i < opts.subscribers; ++i)
+        pthread_join(subs[i].thread, NULL);
+
+    struct report report;
+    report_collect(&report, pubs, subs);
+    if (opts.json)
+        report_json(&report);
+    else
+        report_print(&report);
+
+    for (int i = 0; i < opts.publishers; ++i)
+        disconnect(&pubs[i]);
+    for (int i = 0; i < opts.subscribers; ++i)
+        disconnect(&subs[i]);
+    free_memory(pubs);
+    free_memory(subs);
+
+    return report.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,715 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * sol_harness, runs the broker core inside the process and measures the
+ * handlers in isolation from the network stack.
+ *
+ * The topic store, the sessions and one or more event loops are set up with
+ * server_init, synthetic clients are attached over socketpair(AF_UNIX) with
+ * server_attach and scripted workloads are driven through them. The loops
+ * are not run on their own threads, the harness steps them in turn with
+ * ev_step, only the time spent inside the loops and the allocations done
+ * there are accounted to the broker, so packing and reading on the clients
+ * side is excluded. Everything runs on a single thread, allocations and lock
+ * acquisitions are exactly the same run after run and timings are stable
+ * enough to be compared across commits; locks are never contended, their
+ * wait time is the cost of the uncontended acquisitions.
+ *
+ * Cron jobs (stats publishing, inflight retransmissions) are not run.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "../src/ev.h"
+#include "../src/mqtt.h"
+#include "../src/util.h"
+#include "../src/trace.h"
+#include "../src/config.h"
+#include "../src/memory.h"
+#include "../src/server.h"
+#include "../src/acl.h"
+#include "../src/logging.h"
+#include "allocs.h"
+
+#define DEFAULT_LOOPS       1
+#define DEFAULT_CLIENTS     500
+#define DEFAULT_MESSAGES    200
+#define DEFAULT_TOPICS      10
+#define DEFAULT_ROUNDS      3
+#define DEFAULT_PAYLOAD     64
+#define DEFAULT_RUNS        3
+
+/*
+ * Every client preallocates its buffers of max_request_size bytes, keep them
+ * small to run thousands of clients
+ */
+#define MAX_REQUEST_SIZE    (64 * 1024)
+
+/* Topics distinct subscriptions of the storms are spread on */
+#define TOPIC_GROUPS        100
+
+/*
+ * Topics each client of the publish storm cycles through, more than the
+ * checks memoized by the ACLs
+ */
+#define PUBLISH_TOPICS      64
+
+/* Rounds without any progress after which a scenario is considered stuck */
+#define MAX_IDLE_ROUNDS     1000
+
+static struct {
+    int loops;
+    int clients;
+    int messages;
+    int topics;
+    int rounds;
+    int runs;
+    int acl_rules;
+    size_t payload_size;
+    const char *filter;
+    const char *trace_path;
+    bool json;
+} opts = {
+    .loops = DEFAULT_LOOPS,
+    .clients = DEFAULT_CLIENTS,
+    .messages = DEFAULT_MESSAGES,
+    .topics = DEFAULT_TOPICS,
+    .rounds = DEFAULT_ROUNDS,
+    .runs = DEFAULT_RUNS,
+    .payload_size = DEFAULT_PAYLOAD
+};
+
+/*
+ * Client side of a synthetic connection, incoming bytes are parsed on the
+ * fly just enough to count the packets received by type
+ */
+struct synth_client {
+    int fd;
+    char id[MQTT_CLIENT_ID_LEN];
+    usize skip;         /* Bytes left of the packet being received */
+    usize len;          /* Remaining length being decoded */
+    usize mul;          /* Multiplier of the next remaining length byte */
+    u8 type;            /* Type of the packet being received */
+    bool in_length;     /* Decoding the remaining length */
+};
+
+/* Broker time and resources spent by the loops since the last reset */
+static struct {
+    uint64_t ns;
+    size_t allocs;
+    size_t fired;
+} busy;
+
+/* Packets received by all the clients, by type */
+static size_t received[16];
+
+static struct ev_ctx *loops;
+
+static struct synth_client *clients;
+
+/* Watches the client side of the connections, to read only the ready ones */
+static int client_epoll = -1;
+
+static u8 *payload;
+
+/*
+ * =================
+ *  Driving the core
+ * =================
+ */
+
+static int next_loop = 0;
+
+/* Attach a new synthetic client to the broker, round-robin on the loops */
+static int client_open(struct synth_client *c) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+    c->fd = fds[0];
+    c->skip = c->len = 0;
+    c->in_length = false;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    epoll_ctl(client_epoll, EPOLL_CTL_ADD, c->fd, &ev);
+    uint64_t start = monotonic_ns();
+    size_t allocs = allocations();
+    server_attach(&loops[next_loop], fds[1]);
+    busy.ns += monotonic_ns() - start;
+    busy.allocs += allocations() - allocs;
+    next_loop = (next_loop + 1) % opts.loops;
+    return 0;
+}
+
+static void client_close(struct synth_client *c) {
+    if (c->fd < 0)
+        return;
+    epoll_ctl(client_epoll, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+}
+
+/* Count the packets in a chunk of bytes received by a client */
+static void client_parse(struct synth_client *c, const u8 *buf, size_t n) {
+    for (size_t i = 0; i < n; ) {
+        if (c->skip > 0) {
+            size_t chunk = n - i < c->skip ? n - i : c->skip;
+            c->skip -= chunk;
+            i += chunk;
+            if (c->skip == 0)
+                received[c->type]++;
+        } else if (c->in_length == false) {
+            c->type = buf[i++] >> 4;
+            c->len = 0;
+            c->mul = 1;
+            c->in_length = true;
+        } else {
+            c->len += (buf[i] & 127) * c->mul;
+            c->mul *= 128;
+            if ((buf[i++] & 128) == 0) {
+                c->in_length = false;
+                if (c->len == 0)
+                    received[c->type]++;
+                else
+                    c->skip = c->len;
+            }
+        }
+    }
+}
+
+/* Read everything available on the client side, returns the bytes read */
+static size_t clients_drain(void) {
+    struct epoll_event events[256];
+    u8 buf[16384];
+    size_t total = 0;
+    int n = 0;
+    while ((n = epoll_wait(client_epoll, events, 256, 0)) > 0) {
+        for (int i = 0; i < n; ++i) {
+            struct synth_client *c = events[i].data.ptr;
+            ssize_t nread;
+            while ((nread = read(c->fd, buf, sizeof(buf))) > 0) {
+                client_parse(c, buf, nread);
+                total += nread;
+            }
+            // Closed by the broker, stop watching it
+            if (nread == 0)
+                client_close(c);
+        }
+    }
+    return total;
+}
+
+/*
+ * Step every loop once, then drain the clients, returns false if nothing
+ * happened
+ */
+static bool pump(void) {
+    int fired = 0;
+    for (int i = 0; i < opts.loops; ++i) {
+        uint64_t start = monotonic_ns();
+        size_t allocs = allocations();
+        int n = ev_step(&loops[i], 0);
+        busy.ns += monotonic_ns() - start;
+        busy.allocs += allocations() - allocs;
+        fired += n > 0 ? n : 0;
+    }
+    busy.fired += fired;
+    return clients_drain() > 0 || fired > 0;
+}
+
+/* Pump till the counter reaches the expected value, false if stuck */
+static bool pump_until(const size_t *counter, size_t expected) {
+    int idle = 0;
+    while (*counter < expected) {
+        if (pump())
+            idle = 0;
+        else if (++idle == MAX_IDLE_ROUNDS)
+            return false;
+    }
+    return true;
+}
+
+/* Pump till the broker is idle */
+static void pump_all(void) {
+    int idle = 0;
+    while (idle < 2)
+        idle = pump() ? 0 : idle + 1;
+}
+
+static size_t active_connections(void) {
+    struct loop_stats stats;
+    stats_aggregate(&stats);
+    return stats.active_connections;
+}
+
+/* Write a whole packet, stepping the loops if the socket buffer is full */
+static void client_send(struct synth_client *c, const struct mqtt_packet *pkt) {
+    u8 buf[MAX_REQUEST_SIZE];
+    usize len = mqtt_pack(pkt, buf);
+    usize sent = 0;
+    while (sent < len) {
+        ssize_t n = write(c->fd, buf + sent, len - sent);
+        if (n < 0 && errno != EAGAIN) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        if (n > 0)
+            sent += n;
+        else
+            pump();
+    }
+}
+
+static void send_connect(struct synth_client *c) {
+    struct mqtt_packet pkt = { .header = { .byte = CONNECT_B } };
+    pkt.connect.bits.clean_session = 1;
+    pkt.connect.payload.keepalive = 60;
+    snprintf((char *) pkt.connect.payload.client_id, MQTT_CLIENT_ID_LEN,
+             "%s", c->id);
+    client_send(c, &pkt);
+}
+
+static void send_subscribe(struct synth_client *c, const char *topic) {
+    struct mqtt_packet pkt = { .header = { .byte = SUBSCRIBE_B } };
+    pkt.subscribe.pkt_id = 1;
+    pkt.subscribe.tuples_len = 1;
+    pkt.subscribe.tuples = try_calloc(1, sizeof(*pkt.subscribe.tuples));
+    pkt.subscribe.tuples[0].qos = AT_MOST_ONCE;
+    pkt.subscribe.tuples[0].topic_len = strlen(topic);
+    pkt.subscribe.tuples[0].topic = (u8 *) topic;
+    client_send(c, &pkt);
+    free_memory(pkt.subscribe.tuples);
+}
+
+static void send_publish(struct synth_client *c, const char *topic) {
+    struct mqtt_packet pkt = { .header = { .byte = PUBLISH_B } };
+    mqtt_packet_publish(&pkt, 0, strlen(topic), (u8 *) topic,
+                        opts.payload_size, payload);
+    client_send(c, &pkt);
+}
+
+/* At least once, to be acknowledged with a PUBACK */
+static void send_publish_qos1(struct synth_client *c, const char *topic,
+                              u16 mid) {
+    struct mqtt_packet pkt = { .header = { .byte = PUBLISH_B } };
+    pkt.header.bits.qos = AT_LEAST_ONCE;
+    mqtt_packet_publish(&pkt, mid, strlen(topic), (u8 *) topic,
+                        opts.payload_size, payload);
+    client_send(c, &pkt);
+}
+
+static void send_disconnect(struct synth_client *c) {
+    struct mqtt_packet pkt = { .header = { .byte = DISCONNECT_B } };
+    client_send(c, &pkt);
+}
+
+/* Connect the first n clients, waiting for all the CONNACKs */
+static bool clients_connect(int n) {
+    size_t expected = received[CONNACK] + n;
+    for (int i = 0; i < n; ++i) {
+        if (client_open(&clients[i]) < 0)
+            return false;
+        send_connect(&clients[i]);
+    }
+    return pump_until(&received[CONNACK], expected);
+}
+
+/* Subscribe each of the first n clients to a topic, waiting for the SUBACKs */
+static bool clients_subscribe(int n, const char *fmt, int groups) {
+    char topic[128];
+    size_t expected = received[SUBACK] + n;
+    for (int i = 0; i < n; ++i) {
+        snprintf(topic, sizeof(topic), fmt, i % groups);
+        send_subscribe(&clients[i], topic);
+    }
+    return pump_until(&received[SUBACK], expected);
+}
+
+/* Disconnect all the clients still connected, waiting for the broker */
+static void clients_disconnect(void) {
+    for (int i = 0; i < opts.clients + 1; ++i) {
+        if (clients[i].fd < 0)
+            continue;
+        send_disconnect(&clients[i]);
+    }
+    pump_all();
+    for (int i = 0; i < opts.clients + 1; ++i)
+        client_close(&clients[i]);
+    pump_all();
+}
+
+/*
+ * ===========
+ *  Scenarios
+ * ===========
+ */
+
+/*
+ * Every scenario prepares its clients, then resets the accounting and runs
+ * the measured workload, returning the number of operations done or 0 on
+ * failure. Clients are all disconnected afterwards.
+ */
+struct scenario {
+    const char *name;
+    const char *unit;
+    size_t (*run)(void);
+};
+
+static void measure_start(void) {
+    memset(&busy, 0x00, sizeof(busy));
+}
+
+/*
+ * All the clients subscribe the same topic, one more client publishes there,
+ * every message is delivered to all of them
+ */
+static size_t fanout_storm(void) {
+    struct synth_client *publisher = &clients[opts.clients];
+    if (!clients_connect(opts.clients + 1))
+        return 0;
+    if (!clients_subscribe(opts.clients, "harness/fanout", 1))
+        return 0;
+    size_t deliveries = (size_t) opts.clients * opts.messages;
+    size_t expected = received[PUBLISH] + deliveries;
+    measure_start();
+    for (int i = 0; i < opts.messages; ++i)
+        send_publish(publisher, "harness/fanout");
+    return pump_until(&received[PUBLISH], expected) ? deliveries : 0;
+}
+
+/*
+ * Connected clients publish at least once on topics nobody subscribed, the
+ * cost is the one of receiving and acknowledging, checking the ACLs if set
+ */
+static size_t publish_storm(void) {
+    if (!clients_connect(opts.clients))
+        return 0;
+    char topic[128];
+    size_t publishes = (size_t) opts.clients * opts.messages;
+    size_t expected = received[PUBACK] + publishes;
+    measure_start();
+    for (int j = 0; j < opts.messages; ++j) {
+        for (int i = 0; i < opts.clients; ++i) {
+            snprintf(topic, sizeof(topic), "harness/publish/%d/%d",
+                     i % TOPIC_GROUPS, j % PUBLISH_TOPICS);
+            send_publish_qos1(&clients[i], topic, j % 0xFFFF + 1);
+        }
+    }
+    return pump_until(&received[PUBACK], expected) ? publishes : 0;
+}
+
+/* Connected clients subscribe a batch of topics each, one per request */
+static size_t subscribe_storm(void) {
+    if (!clients_connect(opts.clients))
+        return 0;
+    char topic[128];
+    size_t subscriptions = (size_t) opts.clients * opts.topics;
+    size_t expected = received[SUBACK] + subscriptions;
+    measure_start();
+    for (int i = 0; i < opts.clients; ++i) {
+        for (int j = 0; j < opts.topics; ++j) {
+            snprintf(topic, sizeof(topic), "harness/storm/%d/%d",
+                     i % TOPIC_GROUPS, j);
+            send_subscribe(&clients[i], topic);
+        }
+    }
+    return pump_until(&received[SUBACK], expected) ? subscriptions : 0;
+}
+
+/*
+ * Clients connect and disconnect cleanly, rounds after rounds, with the same
+ * client IDs
+ */
+static size_t reconnect_storm(void) {
+    measure_start();
+    for (int r = 0; r < opts.rounds; ++r) {
+        if (!clients_connect(opts.clients))
+            return 0;
+        for (int i = 0; i < opts.clients; ++i)
+            send_disconnect(&clients[i]);
+        pump_all();
+        for (int i = 0; i < opts.clients; ++i)
+            client_close(&clients[i]);
+    }
+    return (size_t) opts.clients * opts.rounds;
+}
+
+/*
+ * Clients with a plain and a wildcard subscription each drop their
+ * connection all at once
+ */
+static size_t mass_disconnect(void) {
+    if (!clients_connect(opts.clients))
+        return 0;
+    if (!clients_subscribe(opts.clients, "harness/mass/%d", TOPIC_GROUPS))
+        return 0;
+    if (!clients_subscribe(opts.clients, "harness/mass/%d/#", TOPIC_GROUPS))
+        return 0;
+    size_t active = active_connections();
+    measure_start();
+    for (int i = 0; i < opts.clients; ++i)
+        client_close(&clients[i]);
+    size_t left = active - opts.clients;
+    int idle = 0;
+    while (active_connections() > left) {
+        if (pump())
+            idle = 0;
+        else if (++idle == MAX_IDLE_ROUNDS)
+            return 0;
+    }
+    return opts.clients;
+}
+
+static const struct scenario scenarios[] = {
+    { "fanout_storm", "deliveries", fanout_storm },
+    { "publish_storm", "publishes", publish_storm },
+    { "subscribe_storm", "subscriptions", subscribe_storm },
+    { "reconnect_storm", "connections", reconnect_storm },
+    { "mass_disconnect", "disconnections", mass_disconnect }
+};
+
+#define SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+struct result {
+    size_t ops;
+    double ns_op;
+    double allocs_op;
+    double locks_op;
+    double lock_wait_op;
+    double events_op;
+};
+
+static int result_cmp(const void *a, const void *b) {
+    double x = ((const struct result *) a)->ns_op;
+    double y = ((const struct result *) b)->ns_op;
+    return (x > y) - (x < y);
+}
+
+/* Run a scenario opts.runs times, the run with the median ns/op is kept */
+static bool scenario_execute(const struct scenario *s, struct result *r) {
+    struct result results[opts.runs];
+    for (int i = 0; i < opts.runs; ++i) {
+        uint64_t wait = 0, locks = 0, wait_after = 0, locks_after = 0;
+        trace_lock_stats(&wait, &locks);
+        size_t ops = s->run();
+        trace_lock_stats(&wait_after, &locks_after);
+        clients_disconnect();
+        if (ops == 0)
+            return false;
+        results[i] = (struct result) {
+            .ops = ops,
+            .ns_op = (double) busy.ns / ops,
+            .allocs_op = (double) busy.allocs / ops,
+            .locks_op = (double) (locks_after - locks) / ops,
+            .lock_wait_op = (double) (wait_after - wait) / ops,
+            .events_op = (double) busy.fired / ops
+        };
+    }
+    qsort(results, opts.runs, sizeof(*results), result_cmp);
+    *r = results[opts.runs / 2];
+    return true;
+}
+
+/*
+ * Half of the rules grant the anonymous harness clients their topics, the
+ * other half belong to users never connecting, growing the tree
+ */
+static void acl_generate(int rules) {
+    char filter[128], user[32];
+    server.acl = acl_new();
+    for (int i = 0; i < rules; ++i) {
+        if (i % 2 == 0) {
+            snprintf(filter, sizeof(filter), "harness/publish/%d/#", i / 2);
+            acl_add(server.acl, NULL, filter, ACL_READ | ACL_WRITE);
+        } else {
+            snprintf(user, sizeof(user), "tenant-%d", i);
+            snprintf(filter, sizeof(filter), "tenants/%d/+/data", i);
+            acl_add(server.acl, user, filter, ACL_READ | ACL_WRITE);
+        }
+    }
+}
+
+static void usage(const char *me) {
+    fprintf(stderr,
+            "Usage: %s [options]\n\n"
+            " -l loops    Event loops, default %d\n"
+            " -c clients  Synthetic clients, default %d\n"
+            " -m count    Messages published in the fan-out storm, default %d\n"
+            " -k count    Topics subscribed by each client in the subscribe "
+            "storm, default %d\n"
+            " -r rounds   Rounds of the reconnect storm, default %d\n"
+            " -s size     Payload size in bytes, default %d\n"
+            " -n runs     Runs of each scenario, the median is reported, "
+            "default %d\n"
+            " -a rules    Load generated ACLs of this many rules, default none\n"
+            " -f filter   Run only scenarios whose name contains filter\n"
+            " -o path     Dump a Chrome trace of the whole execution\n"
+            " -j          Print the results as JSON\n"
+            " -h          Print this help\n",
+            me, DEFAULT_LOOPS, DEFAULT_CLIENTS, DEFAULT_MESSAGES,
+            DEFAULT_TOPICS, DEFAULT_ROUNDS, DEFAULT_PAYLOAD, DEFAULT_RUNS);
+}
+
+int main(int argc, char **argv) {
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:c:m:k:r:s:n:a:f:o:jh")) != -1) {
+        switch (opt) {
+            case 'l':
+                opts.loops = atoi(optarg);
+                break;
+            case 'c':
+                opts.clients = atoi(optarg);
+                break;
+            case 'm':
+                opts.messages = atoi(optarg);
+                break;
+            case 'k':
+                opts.topics = atoi(optarg);
+                break;
+            case 'r':
+                opts.rounds = atoi(optarg);
+                break;
+            case 's':
+                opts.payload_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                opts.runs = atoi(optarg);
+                break;
+            case 'a':
+                opts.acl_rules = atoi(optarg);
+                break;
+            case 'f':
+                opts.filter = optarg;
+                break;
+            case 'o':
+                opts.trace_path = optarg;
+                break;
+            case 'j':
+                opts.json = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (opts.loops < 1 || opts.clients < 1 || opts.messages < 1
+        || opts.topics < 1 || opts.rounds < 1 || opts.runs < 1
+        || opts.acl_rules < 0
+        || opts.payload_size > MAX_REQUEST_SIZE / 2) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    config_set_default();
+    conf->max_request_size = MAX_REQUEST_SIZE;
+    // Deliveries are never held back, the harness drains as fast as it can
+    conf->backpressure_threshold = 0;
+    // Dropped connections are logged as errors, keep the report clean
+    sol_log_level = FATAL;
+
+    // Tracing is needed to account the lock waits, spans are dumped if asked
+    trace_init(opts.trace_path);
+    server_init();
+    if (opts.acl_rules > 0)
+        acl_generate(opts.acl_rules);
+
+    loops = try_calloc(opts.loops, sizeof(*loops));
+    for (int i = 0; i < opts.loops; ++i)
+        ev_init(&loops[i], EVENTLOOP_MAX_EVENTS);
+    client_epoll = epoll_create1(0);
+    clients = try_calloc(opts.clients + 1, sizeof(*clients));
+    for (int i = 0; i < opts.clients + 1; ++i) {
+        clients[i].fd = -1;
+        snprintf(clients[i].id, MQTT_CLIENT_ID_LEN, "harness-%d", i);
+    }
+    payload = try_calloc(opts.payload_size, 1);
+
+    if (opts.json)
+        printf("{\"loops\":%d,\"clients\":%d,\"runs\":%d,\"scenarios\":[",
+               opts.loops, opts.clients, opts.runs);
+    else
+        printf("%-16s %10s %-14s %11s %10s %9s %12s %9s\n", "scenario", "ops",
+               "unit", "ns/op", "allocs/op", "locks/op", "lock ns/op",
+               "events/op");
+
+    int rc = EXIT_SUCCESS;
+    bool first = true;
+    for (size_t i = 0; i < SCENARIOS; ++i) {
+        const struct scenario *s = &scenarios[i];
+        if (opts.filter && !strstr(s->name, opts.filter))
+            continue;
+        struct result r;
+        if (!scenario_execute(s, &r)) {
+            fprintf(stderr, "%s: stuck, not all the replies arrived\n",
+                    s->name);
+            rc = EXIT_FAILURE;
+            continue;
+        }
+        if (opts.json)
+            printf("%s{\"name\":\"%s\",\"ops\":%zu,\"unit\":\"%s\","
+                   "\"ns_op\":%.3f,\"allocs_op\":%.3f,\"locks_op\":%.3f,"
+                   "\"lock_wait_ns_op\":%.3f,\"events_op\":%.3f}",
+                   first ? "" : ",", s->name, r.ops, s->unit, r.ns_op,
+                   r.allocs_op, r.locks_op, r.lock_wait_op, r.events_op);
+        else
+            printf("%-16s %10zu %-14s %11.2f %10.3f %9.3f %12.2f %9.3f\n",
+                   s->name, r.ops, s->unit, r.ns_op, r.allocs_op, r.locks_op,
+                   r.lock_wait_op, r.events_op);
+        fflush(stdout);
+        first = false;
+    }
+
+    if (opts.json)
+        printf("]}\n");
+
+    if (opts.trace_path)
+        trace_dump();
+
+    for (int i = 0; i < opts.loops; ++i)
+        ev_destroy(&loops[i]);
+    close(client_epoll);
+    free_memory(clients);
+    free_memory(loops);
+    free_memory(payload);
+    trace_close();
+    server_cleanup();
+
+    return rc;
+}
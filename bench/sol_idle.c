@@ -0,0 +1,689 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * sol_idle, opens and holds a large number of idle clients against a running
+ * broker, to measure what an idle connection costs.
+ *
+ * Every client connects with a clean session, subscribes to a topic of its
+ * own and then just keeps the connection alive with a PINGREQ every 3/4 of
+ * the keepalive, pings are spread over the interval so the broker sees a
+ * steady trickle instead of bursts. A loopback address gives only as many
+ * connections as the ephemeral ports, so clients are spread over a range of
+ * source addresses starting from 127.0.0.1.
+ *
+ * Everything runs on a single thread with non-blocking sockets, handshakes
+ * are pipelined (CONNECT and SUBSCRIBE in a single write) and bounded by a
+ * window of handshakes in progress. With the metrics endpoint of the broker,
+ * its footprint is sampled before the connections and while they're held,
+ * and reported per connection broken down by component.
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../src/mqtt.h"
+#include "../src/pack.h"
+#include "../src/util.h"
+#include "../src/memory.h"
+#include "../src/histogram.h"
+
+#define DEFAULT_HOST            "127.0.0.1"
+#define DEFAULT_PORT            "1883"
+#define DEFAULT_SOURCE          "127.0.0.1"
+#define DEFAULT_CONNECTIONS     10000
+#define DEFAULT_KEEPALIVE       60
+#define DEFAULT_WINDOW          512
+#define DEFAULT_HOLD            10
+
+/*
+ * Connections opened from a single source address, a bit less than the
+ * default ephemeral port range of Linux
+ */
+#define CONNECTIONS_PER_SOURCE  25000
+
+#define TOPIC_PREFIX            "sol_idle"
+
+/* Upper bound of a single wait on the sockets */
+#define MAX_WAIT_MS             100
+
+/* Time to wait for the handshakes in progress once all are started */
+#define HANDSHAKE_TIMEOUT_NS    30000000000ULL
+
+/* Size of the response read from the metrics endpoint */
+#define METRICS_BUFSIZE         32768
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+enum idle_state {
+    IDLE_CONNECTING,    /* TCP handshake in progress */
+    IDLE_HANDSHAKE,     /* CONNECT and SUBSCRIBE sent, waiting the acks */
+    IDLE_READY,         /* Subscribed, just pinging */
+    IDLE_CLOSED
+};
+
+static struct {
+    const char *host;
+    const char *port;
+    const char *source;
+    const char *metrics_port;
+    long connections;
+    int sources;
+    int keepalive;
+    int window;
+    int hold;
+    long max_footprint;
+    bool json;
+} opts = {
+    .host = DEFAULT_HOST,
+    .port = DEFAULT_PORT,
+    .source = DEFAULT_SOURCE,
+    .connections = DEFAULT_CONNECTIONS,
+    .keepalive = DEFAULT_KEEPALIVE,
+    .window = DEFAULT_WINDOW,
+    .hold = DEFAULT_HOLD
+};
+
+/*
+ * A held client, replies are small (CONNACK, SUBACK and PINGRESP) and are
+ * assembled in a fixed buffer
+ */
+struct idle_client {
+    int fd;
+    enum idle_state state;
+    bool connack;
+    unsigned char rlen;
+    unsigned char rbuf[8];
+    uint64_t start;
+};
+
+/*
+ * Broker footprint as exposed by the metrics endpoint, see
+ * server_footprint in src/server.h
+ */
+struct footprint_sample {
+    bool valid;
+    double connections;
+    double rss;
+    double clients;
+    double buffers;
+    double sessions;
+    double inflight;
+    double epoll;
+};
+
+struct report {
+    unsigned long established;
+    unsigned long failed;           /* Connections refused or timed out */
+    unsigned long dropped;          /* Connections closed by the broker */
+    unsigned long pings;
+    unsigned long pongs;
+    int sources;
+    uint64_t setup_ns;              /* Time to get all the clients ready */
+    struct histogram handshake;     /* TCP connect to SUBACK */
+    struct footprint_sample before;
+    struct footprint_sample after;
+};
+
+static struct report report;
+
+static struct idle_client *clients = NULL;
+
+static int epfd = -1;
+
+static void usage(const char *me) {
+    fprintf(stderr,
+            "Usage: %s [options]\n\n"
+            " -a addr     Broker IPv4 address, default %s\n"
+            " -p port     Broker port, default %s\n"
+            " -c count    Number of idle clients, default %d\n"
+            " -s addr     First loopback source address, default %s\n"
+            " -S count    Number of source addresses, default one every %d "
+            "clients\n"
+            " -k seconds  Keepalive of the clients, default %d\n"
+            " -w count    Handshakes in progress at the same time, default %d\n"
+            " -T seconds  Time to hold the clients once ready, default %d\n"
+            " -M port     Metrics port of the broker, to report its footprint\n"
+            " -F bytes    Fail if the broker RSS per client exceeds the "
+            "bytes, requires -M\n"
+            " -j          Print the report as JSON\n"
+            " -h          Print this help\n",
+            me, DEFAULT_HOST, DEFAULT_PORT, DEFAULT_CONNECTIONS,
+            DEFAULT_SOURCE, CONNECTIONS_PER_SOURCE, DEFAULT_KEEPALIVE,
+            DEFAULT_WINDOW, DEFAULT_HOLD);
+}
+
+/*
+ * ==================
+ *  Broker footprint
+ * ==================
+ */
+
+/* Value of a sample line, 0 if the metric is not found */
+static double metric_value(const char *body, const char *name) {
+    size_t len = strlen(name);
+    for (const char *p = strstr(body, name); p; p = strstr(p + 1, name)) {
+        if ((p == body || p[-1] == '\n') && p[len] == ' ')
+            return strtod(p + len + 1, NULL);
+    }
+    return 0.0;
+}
+
+/*
+ * Fetch /metrics from the broker and extract the footprint gauges, blocking
+ * as the endpoint replies with a single write and closes the connection
+ */
+static void footprint_sample(struct footprint_sample *s) {
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM
+    }, *result;
+    memset(s, 0x00, sizeof(*s));
+    if (!opts.metrics_port
+        || getaddrinfo(opts.host, opts.metrics_port, &hints, &result) != 0)
+        return;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, result->ai_addr, result->ai_addrlen) < 0) {
+        perror("metrics");
+        freeaddrinfo(result);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    freeaddrinfo(result);
+    const char req[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    char *buf = try_alloc(METRICS_BUFSIZE);
+    size_t len = 0;
+    ssize_t n;
+    if (send(fd, req, sizeof(req) - 1, MSG_NOSIGNAL) < 0)
+        goto out;
+    while (len < METRICS_BUFSIZE - 1
+           && (n = recv(fd, buf + len, METRICS_BUFSIZE - 1 - len, 0)) > 0)
+        len += n;
+    buf[len] = '\0';
+    s->connections = 0;
+    for (int i = 0; i < 16; ++i) {
+        char name[64];
+        snprintf(name, sizeof(name), "sol_connections_active{loop=\"%d\"}", i);
+        s->connections += metric_value(buf, name);
+    }
+    s->rss = metric_value(buf, "sol_memory_rss_bytes");
+#define COMPONENT(c) \
+    metric_value(buf, "sol_connections_memory_bytes{component=\"" c "\"}")
+    s->clients = COMPONENT("client");
+    s->buffers = COMPONENT("buffers");
+    s->sessions = COMPONENT("session");
+    s->inflight = COMPONENT("inflight");
+    s->epoll = COMPONENT("epoll");
+#undef COMPONENT
+    s->valid = s->rss > 0;
+out:
+    free_memory(buf);
+    close(fd);
+}
+
+/*
+ * =========
+ *  Clients
+ * =========
+ */
+
+static void client_close(struct idle_client *c, enum idle_state state) {
+    if (c->fd >= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    c->fd = -1;
+    c->state = state;
+}
+
+/*
+ * Start the TCP connection of the client i, bound to its source address with
+ * the port chosen at connect time, so that every source gets the whole
+ * ephemeral range toward the broker
+ */
+static int client_open(long i, const struct sockaddr_in *broker,
+                       struct in_addr source) {
+    struct idle_client *c = &clients[i];
+    struct sockaddr_in src = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(ntohl(source.s_addr)
+                                 + (uint32_t) (i % report.sources))
+    };
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0)
+        return -1;
+    c->start = monotonic_ns();
+    setsockopt(c->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &(int) {1},
+               sizeof(int));
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int));
+    if (bind(c->fd, (struct sockaddr *) &src, sizeof(src)) < 0)
+        goto err;
+    if (connect(c->fd, (struct sockaddr *) broker, sizeof(*broker)) < 0
+        && errno != EINPROGRESS)
+        goto err;
+    struct epoll_event ev = {
+        .events = EPOLLOUT,
+        .data.u64 = (uint64_t) i
+    };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+        goto err;
+    c->state = IDLE_CONNECTING;
+    return 0;
+
+err:
+    client_close(c, IDLE_CLOSED);
+    return -1;
+}
+
+/* CONNECT and SUBSCRIBE of the client i, packed in the same buffer */
+static size_t handshake_pack(long i, u8 *buf) {
+    char topic[64];
+    struct mqtt_packet pkt = { .header = { .byte = CONNECT_B } };
+    pkt.connect.bits.clean_session = 1;
+    pkt.connect.payload.keepalive = opts.keepalive;
+    snprintf((char *) pkt.connect.payload.client_id, MQTT_CLIENT_ID_LEN,
+             TOPIC_PREFIX "-%ld-%d", i, getpid());
+    size_t len = mqtt_pack(&pkt, buf);
+    snprintf(topic, sizeof(topic), TOPIC_PREFIX "/%ld", i);
+    struct mqtt_subscribe_tuple tuple = { 0, strlen(topic), (u8 *) topic };
+    pkt = (struct mqtt_packet) { .header = { .byte = SUBSCRIBE_B } };
+    pkt.subscribe.pkt_id = 1;
+    pkt.subscribe.tuples_len = 1;
+    pkt.subscribe.tuples = &tuple;
+    return len + mqtt_pack(&pkt, buf + len);
+}
+
+/* The TCP connection is up, the handshake fits the socket buffer */
+static void client_connected(long i) {
+    struct idle_client *c = &clients[i];
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    u8 buf[256];
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+    size_t len = err == 0 ? handshake_pack(i, buf) : 0;
+    if (err != 0 || send(c->fd, buf, len, MSG_NOSIGNAL) != (ssize_t) len) {
+        report.failed++;
+        client_close(c, IDLE_CLOSED);
+        return;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = (uint64_t) i };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->state = IDLE_HANDSHAKE;
+}
+
+/*
+ * Read the replies of a client, only CONNACK, SUBACK and PINGRESP are
+ * expected, every one with a single byte of remaining length
+ */
+static void client_read(long i) {
+    struct idle_client *c = &clients[i];
+    for (;;) {
+        ssize_t n = recv(c->fd, c->rbuf + c->rlen,
+                         sizeof(c->rbuf) - c->rlen, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            goto closed;
+        c->rlen += n;
+        while (c->rlen >= MQTT_HEADER_LEN
+               && c->rlen >= MQTT_HEADER_LEN + c->rbuf[1]) {
+            if (c->rbuf[1] & 128)
+                goto closed;
+            size_t plen = MQTT_HEADER_LEN + c->rbuf[1];
+            switch (c->rbuf[0] >> 4) {
+                case CONNACK:
+                    if (plen < 4 || c->rbuf[3] != MQTT_CONNECTION_ACCEPTED)
+                        goto closed;
+                    c->connack = true;
+                    break;
+                case SUBACK:
+                    if (!c->connack || plen < 5 || c->rbuf[4] > 2)
+                        goto closed;
+                    c->state = IDLE_READY;
+                    report.established++;
+                    histogram_record(&report.handshake,
+                                     monotonic_ns() - c->start);
+                    break;
+                case PINGRESP:
+                    report.pongs++;
+                    break;
+                default:
+                    break;
+            }
+            memmove(c->rbuf, c->rbuf + plen, c->rlen - plen);
+            c->rlen -= plen;
+        }
+    }
+
+closed:
+    if (c->state == IDLE_READY)
+        report.dropped++;
+    else
+        report.failed++;
+    client_close(c, IDLE_CLOSED);
+}
+
+/* Wait on the sockets, returns the number of handshakes completed or failed */
+static long poll_clients(int timeout) {
+    struct epoll_event events[1024];
+    long done = 0;
+    int n = epoll_wait(epfd, events, 1024, timeout);
+    for (int j = 0; j < n; ++j) {
+        long i = (long) events[j].data.u64;
+        struct idle_client *c = &clients[i];
+        enum idle_state state = c->state;
+        if (state == IDLE_CONNECTING)
+            client_connected(i);
+        else
+            client_read(i);
+        if (state != IDLE_READY
+            && (c->state == IDLE_READY || c->state == IDLE_CLOSED))
+            done++;
+    }
+    return done;
+}
+
+/*
+ * Open all the clients, keeping at most opts.window handshakes in progress,
+ * returns when every client is either ready or failed
+ */
+static void clients_open(const struct sockaddr_in *broker,
+                         struct in_addr source) {
+    long next = 0, pending = 0;
+    uint64_t start = monotonic_ns(), deadline = 0;
+    while (next < opts.connections || pending > 0) {
+        while (next < opts.connections && pending < opts.window) {
+            if (client_open(next, broker, source) < 0) {
+                if (report.failed++ == 0)
+                    perror("connect");
+            } else {
+                pending++;
+            }
+            next++;
+        }
+        pending -= poll_clients(MAX_WAIT_MS);
+        if (next < opts.connections)
+            continue;
+        if (deadline == 0)
+            deadline = monotonic_ns() + HANDSHAKE_TIMEOUT_NS;
+        if (monotonic_ns() > deadline)
+            break;
+    }
+    // Whatever is still pending at this point is not coming anymore
+    for (long i = 0; i < opts.connections; ++i) {
+        if (clients[i].state == IDLE_CONNECTING
+            || clients[i].state == IDLE_HANDSHAKE) {
+            report.failed++;
+            client_close(&clients[i], IDLE_CLOSED);
+        }
+    }
+    report.setup_ns = monotonic_ns() - start;
+}
+
+/*
+ * Hold the clients for opts.hold seconds, every one pinging once every 3/4
+ * of the keepalive, walking the array at a steady pace
+ */
+static void clients_hold(void) {
+    const u8 pingreq[MQTT_HEADER_LEN] = { PINGREQ_B, 0 };
+    uint64_t start = monotonic_ns();
+    uint64_t end = start + opts.hold * 1000000000ULL;
+    uint64_t interval = opts.keepalive * 750000000ULL;
+    long cursor = 0;
+    uint64_t now;
+    while ((now = monotonic_ns()) < end) {
+        // Clients due by now since the start of the hold
+        long due = (long) ((double) (now - start) / interval * opts.connections);
+        for (; cursor < due; ++cursor) {
+            struct idle_client *c = &clients[cursor % opts.connections];
+            if (c->state != IDLE_READY)
+                continue;
+            if (send(c->fd, pingreq, MQTT_HEADER_LEN, MSG_NOSIGNAL) < 0) {
+                report.dropped++;
+                client_close(c, IDLE_CLOSED);
+                continue;
+            }
+            report.pings++;
+        }
+        poll_clients(MAX_WAIT_MS);
+    }
+}
+
+/*
+ * Raise the limit of open descriptors to fit the clients, returns -1 if the
+ * hard limit doesn't allow it
+ */
+static int raise_nofile(long count) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return -1;
+    rlim_t needed = (rlim_t) count + 64;
+    if (rl.rlim_cur >= needed)
+        return 0;
+    rl.rlim_cur = rl.rlim_max != RLIM_INFINITY && rl.rlim_max < needed
+        ? rl.rlim_max : needed;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur < needed) {
+        fprintf(stderr, "Open files limit %lu too low for %ld clients\n",
+                (unsigned long) rl.rlim_cur, count);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * =========
+ *  Report
+ * =========
+ */
+
+#define QUANTILES 4
+
+static const struct {
+    const char *name;
+    double percentile;
+} quantiles[QUANTILES] = {
+    { "p50", 50.0 },
+    { "p99", 99.0 },
+    { "p999", 99.9 },
+    { "max", 100.0 }
+};
+
+/* Broker RSS per connection grown since the sample before the clients */
+static double rss_per_client(const struct report *r) {
+    if (!r->before.valid || !r->after.valid || r->established == 0)
+        return 0.0;
+    return (r->after.rss - r->before.rss) / r->established;
+}
+
+static double per_conn(const struct footprint_sample *s, double value) {
+    return s->connections > 0 ? value / s->connections : 0.0;
+}
+
+static void report_human(const struct report *r) {
+    printf("Clients:     %lu ready, %lu failed, %lu closed by the broker "
+           "(%d source addresses)\n", r->established, r->failed, r->dropped,
+           r->sources);
+    printf("Setup:       %.3f s, %.0f clients/s\n", r->setup_ns / 1e9,
+           r->setup_ns ? r->established / (r->setup_ns / 1e9) : 0.0);
+    printf("Pings:       %lu sent, %lu answered\n", r->pings, r->pongs);
+    printf("\nHandshake, connect to SUBACK (us):\n");
+    for (size_t i = 0; i < QUANTILES; ++i)
+        printf("  %-5s %10.3f\n", quantiles[i].name,
+               histogram_percentile(&r->handshake, quantiles[i].percentile) / 1e3);
+    if (!r->after.valid)
+        return;
+    const struct footprint_sample *s = &r->after;
+    printf("\nBroker footprint with %.0f connections:\n", s->connections);
+    printf("  RSS       %12.0f bytes, %10.0f before the clients\n",
+           s->rss, r->before.rss);
+    printf("  RSS/conn  %12.0f bytes\n", rss_per_client(r));
+    printf("\nPer connection (bytes):\n");
+    printf("  client    %12.0f\n", per_conn(s, s->clients));
+    printf("  buffers   %12.0f (allocated, mostly not resident)\n",
+           per_conn(s, s->buffers));
+    printf("  session   %12.0f\n", per_conn(s, s->sessions));
+    printf("  inflight  %12.0f\n", per_conn(s, s->inflight));
+    printf("  epoll     %12.0f\n", per_conn(s, s->epoll));
+}
+
+static void report_json(const struct report *r) {
+    printf("{\"clients\":%lu,\"failed\":%lu,\"dropped\":%lu,"
+           "\"sources\":%d,\"setup_seconds\":%.6f,"
+           "\"pings\":%lu,\"pongs\":%lu,\"handshake_us\":{",
+           r->established, r->failed, r->dropped, r->sources,
+           r->setup_ns / 1e9, r->pings, r->pongs);
+    for (size_t i = 0; i < QUANTILES; ++i)
+        printf("%s\"%s\":%.3f", i > 0 ? "," : "", quantiles[i].name,
+               histogram_percentile(&r->handshake, quantiles[i].percentile) / 1e3);
+    printf("}");
+    if (r->after.valid) {
+        const struct footprint_sample *s = &r->after;
+        printf(",\"broker\":{\"connections\":%.0f,\"rss\":%.0f,"
+               "\"rss_before\":%.0f,\"rss_per_conn\":%.0f,\"per_conn\":{"
+               "\"client\":%.0f,\"buffers\":%.0f,\"session\":%.0f,"
+               "\"inflight\":%.0f,\"epoll\":%.0f}}",
+               s->connections, s->rss, r->before.rss, rss_per_client(r),
+               per_conn(s, s->clients), per_conn(s, s->buffers),
+               per_conn(s, s->sessions), per_conn(s, s->inflight),
+               per_conn(s, s->epoll));
+    }
+    printf("}\n");
+}
+
+int main(int argc, char **argv) {
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:p:c:s:S:k:w:T:M:F:jh")) != -1) {
+        switch (opt) {
+            case 'a':
+                opts.host = optarg;
+                break;
+            case 'p':
+                opts.port = optarg;
+                break;
+            case 'c':
+                opts.connections = atol(optarg);
+                break;
+            case 's':
+                opts.source = optarg;
+                break;
+            case 'S':
+                opts.sources = atoi(optarg);
+                break;
+            case 'k':
+                opts.keepalive = atoi(optarg);
+                break;
+            case 'w':
+                opts.window = atoi(optarg);
+                break;
+            case 'T':
+                opts.hold = atoi(optarg);
+                break;
+            case 'M':
+                opts.metrics_port = optarg;
+                break;
+            case 'F':
+                opts.max_footprint = atol(optarg);
+                break;
+            case 'j':
+                opts.json = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    struct sockaddr_in broker = { .sin_family = AF_INET };
+    struct in_addr source;
+    if (opts.connections < 1 || opts.sources < 0 || opts.keepalive < 1
+        || opts.keepalive > 0xFFFF || opts.window < 1 || opts.hold < 0
+        || opts.max_footprint < 0 || (opts.max_footprint && !opts.metrics_port)
+        || inet_pton(AF_INET, opts.host, &broker.sin_addr) != 1
+        || inet_pton(AF_INET, opts.source, &source) != 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    broker.sin_port = htons(atoi(opts.port));
+    report.sources = opts.sources > 0 ? opts.sources
+        : (int) ((opts.connections + CONNECTIONS_PER_SOURCE - 1)
+                 / CONNECTIONS_PER_SOURCE);
+
+    if (raise_nofile(opts.connections) < 0)
+        exit(EXIT_FAILURE);
+
+    clients = try_calloc(opts.connections, sizeof(*clients));
+    for (long i = 0; i < opts.connections; ++i)
+        clients[i].fd = -1;
+    histogram_init(&report.handshake);
+    epfd = epoll_create1(0);
+
+    footprint_sample(&report.before);
+    clients_open(&broker, source);
+    clients_hold();
+    footprint_sample(&report.after);
+
+    for (long i = 0; i < opts.connections; ++i)
+        client_close(&clients[i], IDLE_CLOSED);
+    free_memory(clients);
+    close(epfd);
+
+    if (opts.json)
+        report_json(&report);
+    else
+        report_human(&report);
+
+    if (report.established < (unsigned long) opts.connections)
+        return EXIT_FAILURE;
+    if (opts.max_footprint > 0 && rss_per_client(&report) > opts.max_footprint) {
+        fprintf(stderr, "RSS per client %.0f exceeds %ld bytes\n",
+                rss_per_client(&report), opts.max_footprint);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,675 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * sol_microbench, microbenchmarks of the core data structures and of the
+ * MQTT codec.
+ *
+ * Every benchmark is an untimed setup, a timed run performing a known number
+ * of operations and an untimed teardown. After some warmup rounds each
+ * benchmark is run a number of times, reporting the min and median ns/op and
+ * the heap allocations per operation, counted by wrapping malloc, calloc and
+ * realloc at link time (see allocs.h). The JSON output is meant to be stored
+ * and compared across commits.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "../src/util.h"
+#include "../src/trie.h"
+#include "../src/mqtt.h"
+#include "../src/memory.h"
+#include "../src/memorypool.h"
+#include "../src/acl.h"
+#include "../src/sol_internal.h"
+#include "allocs.h"
+
+#define DEFAULT_RUNS        10
+#define DEFAULT_WARMUP      2
+
+/* Topic set, sensors/site-<S>/device-<D>/<metric>/ */
+#define SITES               10
+#define DEVICES             100
+#define TOPICS              (SITES * DEVICES * METRICS)
+
+/* Operations of the benchmarks not bound to a data set size */
+#define POOL_BLOCKS         100000
+#define POOL_BLOCKSIZE      256
+#define PACKET_OPS          100000
+#define LENGTH_OPS          1000000
+#define PREFIX_MAP_OPS      100
+#define ACL_RULES           10000
+
+static const char *const metrics[] = {
+    "temperature", "humidity", "pressure", "co2", "voltage",
+    "current", "power", "energy", "status", "rssi"
+};
+
+#define METRICS (sizeof(metrics) / sizeof(metrics[0]))
+
+static struct {
+    int runs;
+    int warmup;
+    const char *filter;
+    bool json;
+    bool list;
+} opts = {
+    .runs = DEFAULT_RUNS,
+    .warmup = DEFAULT_WARMUP
+};
+
+/* Results are written here, so the compiler can't drop the work */
+static volatile size_t sink;
+
+/*
+ * A single benchmark, run performs the timed part and returns the number of
+ * operations done, arg is passed as is to every function
+ */
+struct microbench {
+    const char *name;
+    void (*setup)(size_t);
+    size_t (*run)(size_t);
+    void (*teardown)(size_t);
+    size_t arg;
+};
+
+struct result {
+    size_t ops;
+    double ns_op_min;
+    double ns_op_median;
+    double allocs_op;
+};
+
+static char *topics[TOPICS];
+
+static Trie *trie = NULL;
+
+/*
+ * ======
+ *  Trie
+ * ======
+ */
+
+/* Topics are owned by the topics array, nothing to release */
+static bool keep_data(struct trie_node *node, bool flag) {
+    (void) flag;
+    node->data = NULL;
+    return true;
+}
+
+static void trie_empty(size_t arg) {
+    (void) arg;
+    trie = trie_new(keep_data);
+}
+
+static void trie_populate(size_t arg) {
+    trie_empty(arg);
+    for (size_t i = 0; i < TOPICS; ++i)
+        trie_insert(trie, topics[i], topics[i]);
+}
+
+static void trie_release(size_t arg) {
+    (void) arg;
+    trie_destroy(trie);
+    trie = NULL;
+}
+
+static size_t bench_trie_insert(size_t arg) {
+    (void) arg;
+    for (size_t i = 0; i < TOPICS; ++i)
+        trie_insert(trie, topics[i], topics[i]);
+    return TOPICS;
+}
+
+static size_t bench_trie_find(size_t arg) {
+    (void) arg;
+    void *data = NULL;
+    size_t found = 0;
+    for (size_t i = 0; i < TOPICS; ++i)
+        found += trie_find(trie, topics[i], &data);
+    sink = found;
+    return TOPICS;
+}
+
+static void count_topic(struct trie_node *node, void *arg) {
+    if (node && node->data)
+        (*(size_t *) arg)++;
+}
+
+/* Like a subscription to sensors/site-3/#, touching a tenth of the topics */
+static size_t bench_trie_prefix_map(size_t arg) {
+    (void) arg;
+    size_t count = 0;
+    for (size_t i = 0; i < PREFIX_MAP_OPS; ++i)
+        trie_prefix_map(trie->root, "sensors/site-3/", count_topic, &count);
+    sink = count;
+    return PREFIX_MAP_OPS;
+}
+
+/*
+ * ====================
+ *  Wildcard matching
+ * ====================
+ */
+
+/* Wildcards are stored as the subscribe handler does, '/#' is stripped */
+static size_t bench_match_single(size_t arg) {
+    (void) arg;
+    size_t matched = 0;
+    for (size_t i = 0; i < TOPICS; ++i)
+        matched += match_subscription(topics[i], "sensors/+/device-42/co2/",
+                                      false) == SOL_OK;
+    sink = matched;
+    return TOPICS;
+}
+
+static size_t bench_match_multi(size_t arg) {
+    (void) arg;
+    size_t matched = 0;
+    for (size_t i = 0; i < TOPICS; ++i)
+        matched += match_subscription(topics[i], "sensors/site-3/",
+                                      true) == SOL_OK;
+    sink = matched;
+    return TOPICS;
+}
+
+/*
+ * =================================
+ *  Client maps, keyed by client ID
+ * =================================
+ */
+
+struct map_entry {
+    char client_id[MQTT_CLIENT_ID_LEN];
+    UT_hash_handle hh;
+};
+
+static struct map_entry *entries = NULL;
+
+static struct map_entry *map = NULL;
+
+static void map_entries(size_t n) {
+    entries = try_calloc(n, sizeof(*entries));
+    for (size_t i = 0; i < n; ++i)
+        snprintf(entries[i].client_id, MQTT_CLIENT_ID_LEN, "sol-client-%zu", i);
+}
+
+static void map_populate(size_t n) {
+    map_entries(n);
+    for (size_t i = 0; i < n; ++i)
+        HASH_ADD_STR(map, client_id, &entries[i]);
+}
+
+static void map_release(size_t n) {
+    (void) n;
+    HASH_CLEAR(hh, map);
+    free_memory(entries);
+    entries = NULL;
+}
+
+static size_t bench_map_add(size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        HASH_ADD_STR(map, client_id, &entries[i]);
+    return n;
+}
+
+static size_t bench_map_find(size_t n) {
+    struct map_entry *e = NULL;
+    size_t found = 0;
+    for (size_t i = 0; i < n; ++i) {
+        HASH_FIND_STR(map, entries[i].client_id, e);
+        found += e != NULL;
+    }
+    sink = found;
+    return n;
+}
+
+static size_t bench_map_delete(size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        HASH_DEL(map, &entries[i]);
+    return n;
+}
+
+/*
+ * ==============
+ *  Memory pools
+ * ==============
+ */
+
+static struct memorypool *pool = NULL;
+
+static void *blocks[POOL_BLOCKS];
+
+/* Sized with some slack, a resize would move the blocks already handed out */
+static void pool_new(size_t arg) {
+    (void) arg;
+    pool = memorypool_new(POOL_BLOCKS + 4, POOL_BLOCKSIZE);
+}
+
+static void pool_release(size_t arg) {
+    (void) arg;
+    memorypool_destroy(pool);
+    pool = NULL;
+}
+
+static size_t bench_memorypool(size_t arg) {
+    (void) arg;
+    for (size_t i = 0; i < POOL_BLOCKS; ++i)
+        blocks[i] = memorypool_alloc(pool);
+    for (size_t i = 0; i < POOL_BLOCKS; ++i)
+        memorypool_free(pool, blocks[i]);
+    return 2 * POOL_BLOCKS;
+}
+
+/* Baseline for the pool, the general purpose allocator on the same blocks */
+static size_t bench_try_alloc(size_t arg) {
+    (void) arg;
+    for (size_t i = 0; i < POOL_BLOCKS; ++i)
+        blocks[i] = try_alloc(POOL_BLOCKSIZE);
+    for (size_t i = 0; i < POOL_BLOCKS; ++i)
+        free_memory(blocks[i]);
+    return 2 * POOL_BLOCKS;
+}
+
+/*
+ * ======
+ *  ACLs
+ * ======
+ */
+
+static struct acl *acl = NULL;
+
+static struct acl_client *acl_client = NULL;
+
+/*
+ * A grant for every device, the rest of the rules belong to other users,
+ * growing the tree
+ */
+static void acl_populate(size_t arg) {
+    (void) arg;
+    char filter[128], user[32];
+    acl = acl_new();
+    for (int s = 0; s < SITES; ++s)
+        for (int d = 0; d < DEVICES; ++d) {
+            snprintf(filter, sizeof(filter), "sensors/site-%d/device-%d/#",
+                     s, d);
+            acl_add(acl, NULL, filter, ACL_WRITE);
+        }
+    for (int i = SITES * DEVICES; i < ACL_RULES; ++i) {
+        snprintf(user, sizeof(user), "tenant-%d", i);
+        snprintf(filter, sizeof(filter), "tenants/%d/+/data", i);
+        acl_add(acl, user, filter, ACL_READ | ACL_WRITE);
+    }
+    acl_client = acl_client_new("tenant-42");
+}
+
+static void acl_release(size_t arg) {
+    (void) arg;
+    acl_client_free(acl_client);
+    acl_free(acl);
+    acl_client = NULL;
+    acl = NULL;
+}
+
+/* Topics are stored with a trailing '/', not part of what clients publish */
+static size_t bench_acl_check(size_t arg) {
+    (void) arg;
+    size_t allowed = 0;
+    for (size_t i = 0; i < TOPICS; ++i)
+        allowed += acl_check(acl, "tenant-42", "bench", topics[i],
+                             strlen(topics[i]) - 1, ACL_WRITE);
+    sink = allowed;
+    return TOPICS;
+}
+
+/* A client publishing on a few topics, all found memoized */
+static size_t bench_acl_memoized(size_t arg) {
+    (void) arg;
+    size_t allowed = 0;
+    for (size_t i = 0; i < TOPICS; ++i) {
+        const char *topic = topics[i % METRICS];
+        allowed += acl_can_publish(acl, acl_client, "bench", topic,
+                                   strlen(topic) - 1);
+    }
+    sink = allowed;
+    return TOPICS;
+}
+
+/*
+ * ============
+ *  MQTT codec
+ * ============
+ */
+
+enum sample_type {
+    SAMPLE_CONNECT,
+    SAMPLE_CONNACK,
+    SAMPLE_PUBLISH,
+    SAMPLE_SUBSCRIBE,
+    SAMPLE_SUBACK,
+    SAMPLE_PUBACK,
+    SAMPLE_PINGREQ,
+    SAMPLES
+};
+
+/* A packet of each type, with its packed form */
+static struct {
+    struct mqtt_packet pkt;
+    u8 buf[256];
+    usize len;
+} samples[SAMPLES];
+
+static u8 publish_topic[] = "sensors/site-3/device-42/temperature";
+
+static u8 publish_payload[64];
+
+static u8 subscribe_topic[] = "sensors/site-3/#";
+
+static u8 suback_rcs[] = { AT_LEAST_ONCE };
+
+static void samples_init(void) {
+    struct mqtt_packet *p = &samples[SAMPLE_CONNECT].pkt;
+    p->header.byte = CONNECT_B;
+    p->connect.bits.clean_session = 1;
+    p->connect.bits.username = 1;
+    p->connect.bits.password = 1;
+    p->connect.payload.keepalive = 60;
+    snprintf((char *) p->connect.payload.client_id, MQTT_CLIENT_ID_LEN,
+             "sol-client-42");
+    p->connect.payload.username = (u8 *) "sensor";
+    p->connect.payload.password = (u8 *) "secret";
+
+    p = &samples[SAMPLE_CONNACK].pkt;
+    p->header.byte = CONNACK_B;
+    mqtt_connack(p, 0, MQTT_CONNECTION_ACCEPTED);
+
+    p = &samples[SAMPLE_PUBLISH].pkt;
+    p->header.byte = PUBLISH_B;
+    p->header.bits.qos = AT_LEAST_ONCE;
+    mqtt_packet_publish(p, 42, sizeof(publish_topic) - 1, publish_topic,
+                        sizeof(publish_payload), publish_payload);
+
+    p = &samples[SAMPLE_SUBSCRIBE].pkt;
+    p->header.byte = SUBSCRIBE_B;
+    p->subscribe.pkt_id = 42;
+    p->subscribe.tuples_len = 1;
+    p->subscribe.tuples = try_calloc(1, sizeof(*p->subscribe.tuples));
+    p->subscribe.tuples[0].qos = AT_LEAST_ONCE;
+    p->subscribe.tuples[0].topic_len = sizeof(subscribe_topic) - 1;
+    p->subscribe.tuples[0].topic = subscribe_topic;
+
+    p = &samples[SAMPLE_SUBACK].pkt;
+    p->header.byte = SUBACK_B;
+    mqtt_suback(p, 42, suback_rcs, sizeof(suback_rcs));
+
+    p = &samples[SAMPLE_PUBACK].pkt;
+    p->header.byte = PUBACK_B;
+    mqtt_ack(p, 42);
+
+    samples[SAMPLE_PINGREQ].pkt.header.byte = PINGREQ_B;
+
+    for (int i = 0; i < SAMPLES; ++i)
+        samples[i].len = mqtt_pack(&samples[i].pkt, samples[i].buf);
+}
+
+static size_t bench_pack(size_t type) {
+    u8 buf[256];
+    usize len = 0;
+    for (size_t i = 0; i < PACKET_OPS; ++i)
+        len += mqtt_pack(&samples[type].pkt, buf);
+    sink = len;
+    return PACKET_OPS;
+}
+
+/* Unpack the packet body, allocated fields are released as the broker does */
+static size_t bench_unpack(size_t type) {
+    struct mqtt_packet pkt;
+    unsigned pos = 0;
+    usize len = mqtt_decode_length(samples[type].buf + 1, &pos);
+    u8 *body = samples[type].buf + pos + 1;
+    u8 byte = samples[type].buf[0];
+    for (size_t i = 0; i < PACKET_OPS; ++i) {
+        mqtt_unpack(body, &pkt, byte, len);
+        mqtt_packet_destroy(&pkt);
+    }
+    return PACKET_OPS;
+}
+
+/* Remaining lengths at the boundaries of the 1 to 4 bytes encodings */
+static const usize lengths[] = {
+    0, 127, 128, 16383, 16384, 2097151, 2097152, 268435455
+};
+
+#define LENGTHS (sizeof(lengths) / sizeof(lengths[0]))
+
+static size_t bench_encode_length(size_t arg) {
+    (void) arg;
+    u8 buf[4];
+    size_t bytes = 0;
+    for (size_t i = 0; i < LENGTH_OPS; ++i)
+        bytes += mqtt_encode_length(buf, lengths[i % LENGTHS]);
+    sink = bytes;
+    return LENGTH_OPS;
+}
+
+static size_t bench_decode_length(size_t arg) {
+    (void) arg;
+    u8 encoded[LENGTHS][4];
+    for (size_t i = 0; i < LENGTHS; ++i)
+        mqtt_encode_length(encoded[i], lengths[i]);
+    size_t total = 0;
+    unsigned pos = 0;
+    for (size_t i = 0; i < LENGTH_OPS; ++i)
+        total += mqtt_decode_length(encoded[i % LENGTHS], &pos);
+    sink = total;
+    return LENGTH_OPS;
+}
+
+static const struct microbench benchmarks[] = {
+    { "trie_insert", trie_empty, bench_trie_insert, trie_release, 0 },
+    { "trie_find", trie_populate, bench_trie_find, trie_release, 0 },
+    { "trie_prefix_map", trie_populate, bench_trie_prefix_map, trie_release, 0 },
+    { "match_subscription/single", NULL, bench_match_single, NULL, 0 },
+    { "match_subscription/multi", NULL, bench_match_multi, NULL, 0 },
+    { "uthash_add/100k", map_entries, bench_map_add, map_release, 100000 },
+    { "uthash_find/100k", map_populate, bench_map_find, map_release, 100000 },
+    { "uthash_delete/100k", map_populate, bench_map_delete, map_release, 100000 },
+    { "uthash_add/1M", map_entries, bench_map_add, map_release, 1000000 },
+    { "uthash_find/1M", map_populate, bench_map_find, map_release, 1000000 },
+    { "uthash_delete/1M", map_populate, bench_map_delete, map_release, 1000000 },
+    { "memorypool_alloc_free", pool_new, bench_memorypool, pool_release, 0 },
+    { "try_alloc_free", NULL, bench_try_alloc, NULL, 0 },
+    { "acl_check/10k", acl_populate, bench_acl_check, acl_release, 0 },
+    { "acl_memoized/10k", acl_populate, bench_acl_memoized, acl_release, 0 },
+    { "mqtt_pack/connect", NULL, bench_pack, NULL, SAMPLE_CONNECT },
+    { "mqtt_pack/connack", NULL, bench_pack, NULL, SAMPLE_CONNACK },
+    { "mqtt_pack/publish", NULL, bench_pack, NULL, SAMPLE_PUBLISH },
+    { "mqtt_pack/subscribe", NULL, bench_pack, NULL, SAMPLE_SUBSCRIBE },
+    { "mqtt_pack/suback", NULL, bench_pack, NULL, SAMPLE_SUBACK },
+    { "mqtt_pack/puback", NULL, bench_pack, NULL, SAMPLE_PUBACK },
+    { "mqtt_pack/pingreq", NULL, bench_pack, NULL, SAMPLE_PINGREQ },
+    { "mqtt_unpack/connect", NULL, bench_unpack, NULL, SAMPLE_CONNECT },
+    { "mqtt_unpack/connack", NULL, bench_unpack, NULL, SAMPLE_CONNACK },
+    { "mqtt_unpack/publish", NULL, bench_unpack, NULL, SAMPLE_PUBLISH },
+    { "mqtt_unpack/subscribe", NULL, bench_unpack, NULL, SAMPLE_SUBSCRIBE },
+    { "mqtt_unpack/suback", NULL, bench_unpack, NULL, SAMPLE_SUBACK },
+    { "mqtt_unpack/puback", NULL, bench_unpack, NULL, SAMPLE_PUBACK },
+    { "mqtt_encode_length", NULL, bench_encode_length, NULL, 0 },
+    { "mqtt_decode_length", NULL, bench_decode_length, NULL, 0 }
+};
+
+#define BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+/*
+ * ===========
+ *  Execution
+ * ===========
+ */
+
+static void topics_init(void) {
+    char topic[128];
+    size_t n = 0;
+    for (int s = 0; s < SITES; ++s)
+        for (int d = 0; d < DEVICES; ++d)
+            for (size_t m = 0; m < METRICS; ++m) {
+                snprintf(topic, sizeof(topic), "sensors/site-%d/device-%d/%s/",
+                         s, d, metrics[m]);
+                topics[n++] = try_strdup(topic);
+            }
+}
+
+static int double_cmp(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static size_t bench_once(const struct microbench *b, uint64_t *ns,
+                         size_t *allocs) {
+    if (b->setup)
+        b->setup(b->arg);
+    size_t before = allocations();
+    uint64_t start = monotonic_ns();
+    size_t ops = b->run(b->arg);
+    *ns = monotonic_ns() - start;
+    *allocs = allocations() - before;
+    if (b->teardown)
+        b->teardown(b->arg);
+    return ops;
+}
+
+static void bench_execute(const struct microbench *b, struct result *r) {
+    uint64_t ns = 0;
+    size_t allocs = 0, total_allocs = 0;
+    double ns_op[opts.runs];
+    for (int i = 0; i < opts.warmup; ++i)
+        bench_once(b, &ns, &allocs);
+    for (int i = 0; i < opts.runs; ++i) {
+        r->ops = bench_once(b, &ns, &allocs);
+        ns_op[i] = (double) ns / r->ops;
+        total_allocs += allocs;
+    }
+    qsort(ns_op, opts.runs, sizeof(double), double_cmp);
+    r->ns_op_min = ns_op[0];
+    r->ns_op_median = opts.runs % 2 ? ns_op[opts.runs / 2] :
+        (ns_op[opts.runs / 2 - 1] + ns_op[opts.runs / 2]) / 2;
+    r->allocs_op = (double) total_allocs / ((double) r->ops * opts.runs);
+}
+
+static void usage(const char *me) {
+    fprintf(stderr,
+            "Usage: %s [options]\n\n"
+            " -r runs     Measured runs of each benchmark, default %d\n"
+            " -w runs     Warmup runs of each benchmark, default %d\n"
+            " -f filter   Run only benchmarks whose name contains filter\n"
+            " -l          List the benchmarks\n"
+            " -j          Print the results as JSON\n"
+            " -h          Print this help\n",
+            me, DEFAULT_RUNS, DEFAULT_WARMUP);
+}
+
+int main(int argc, char **argv) {
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:w:f:ljh")) != -1) {
+        switch (opt) {
+            case 'r':
+                opts.runs = atoi(optarg);
+                break;
+            case 'w':
+                opts.warmup = atoi(optarg);
+                break;
+            case 'f':
+                opts.filter = optarg;
+                break;
+            case 'l':
+                opts.list = true;
+                break;
+            case 'j':
+                opts.json = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (opts.runs < 1 || opts.warmup < 0) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts.list) {
+        for (size_t i = 0; i < BENCHMARKS; ++i)
+            printf("%s\n", benchmarks[i].name);
+        return EXIT_SUCCESS;
+    }
+
+    topics_init();
+    samples_init();
+
+    if (opts.json)
+        printf("{\"runs\":%d,\"warmup\":%d,\"benchmarks\":[",
+               opts.runs, opts.warmup);
+    else
+        printf("%-28s %12s %12s %10s %10s\n",
+               "benchmark", "ns/op", "min ns/op", "allocs/op", "ops");
+
+    bool first = true;
+    for (size_t i = 0; i < BENCHMARKS; ++i) {
+        const struct microbench *b = &benchmarks[i];
+        if (opts.filter && !strstr(b->name, opts.filter))
+            continue;
+        struct result r = { 0 };
+        bench_execute(b, &r);
+        if (opts.json)
+            printf("%s{\"name\":\"%s\",\"ops\":%zu,\"ns_op\":%.3f,"
+                   "\"ns_op_min\":%.3f,\"allocs_op\":%.3f}",
+                   first ? "" : ",", b->name, r.ops, r.ns_op_median,
+                   r.ns_op_min, r.allocs_op);
+        else
+            printf("%-28s %12.2f %12.2f %10.3f %10zu\n", b->name,
+                   r.ns_op_median, r.ns_op_min, r.allocs_op, r.ops);
+        fflush(stdout);
+        first = false;
+    }
+
+    if (opts.json)
+        printf("]}\n");
+
+    for (size_t i = 0; i < TOPICS; ++i)
+        free_memory(topics[i]);
+    mqtt_packet_destroy(&samples[SAMPLE_SUBACK].pkt);
+    free_memory(samples[SAMPLE_SUBSCRIBE].pkt.subscribe.tuples);
+
+    return EXIT_SUCCESS;
+}
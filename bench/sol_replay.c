@@ -0,0 +1,636 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * sol_replay, replays a traffic capture recorded by the broker with the
+ * capture_path option against a running instance, see src/capture.h.
+ *
+ * Every connection of the capture is opened again when its OPEN record is
+ * met, its packets are sent unchanged and it's closed on its CLOSE record,
+ * so the broker sees the same connections, with the same client IDs, and the
+ * same packets in the same order. Records are scheduled at their original
+ * time, scaled by a speed factor, or sent as fast as possible; the report
+ * tells how far behind the schedule the replay went, a replay lagging
+ * behind is not reproducing the original traffic shape anymore.
+ *
+ * Acknowledgements of packets sent by the broker (PUBACK, PUBREC and PUBCOMP)
+ * are the exception: the packet IDs the broker assigns must have been seen
+ * on the connection before the matching ack is sent, or the broker would
+ * ignore it and keep the message in flight. Replies are parsed just enough
+ * to track those IDs and acks met too early are held back till the broker
+ * sends the packet they refer to.
+ *
+ * Everything runs on a single thread with non-blocking sockets, whatever the
+ * broker sends back is read and discarded, so that it never stops reading
+ * from us because of a connection not draining its replies.
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../src/mqtt.h"
+#include "../src/pack.h"
+#include "../src/util.h"
+#include "../src/memory.h"
+#include "../src/capture.h"
+#include "../src/histogram.h"
+
+#define DEFAULT_HOST            "127.0.0.1"
+#define DEFAULT_PORT            "1883"
+#define DEFAULT_SPEED           1.0
+#define DEFAULT_DRAIN_MS        1000
+
+/* Largest packet accepted from a capture, as per MQTT max remaining length */
+#define MAX_FRAME_SIZE          (256 * 1024 * 1024)
+
+/* Bytes of the bitmap of the packet IDs a connection owes an ack for */
+#define OWED_SIZE               ((0xFFFF + 1) / 8)
+
+/* Minimum room in the reply buffer of a connection for each read */
+#define READ_CHUNK              16384
+
+/* Upper bound of a single wait for the next record, replies are read meanwhile */
+#define MAX_WAIT_MS             100
+
+static struct {
+    const char *host;
+    const char *port;
+    const char *unix_socket;
+    const char *path;
+    double speed;
+    int drain_ms;
+    bool json;
+} opts = {
+    .host = DEFAULT_HOST,
+    .port = DEFAULT_PORT,
+    .speed = DEFAULT_SPEED,
+    .drain_ms = DEFAULT_DRAIN_MS
+};
+
+struct report {
+    unsigned long connections;
+    unsigned long failed;           /* Connections that couldn't be opened */
+    unsigned long dropped;          /* Connections closed by the broker */
+    unsigned long frames;
+    unsigned long skipped;          /* Frames of connections not open */
+    unsigned long held;             /* Acks held back waiting for a packet */
+    unsigned long unmatched;        /* Acks whose packet never arrived */
+    unsigned long bytes_sent;
+    unsigned long bytes_received;
+    uint64_t captured_ns;           /* Time span of the capture */
+    uint64_t elapsed_ns;            /* Time span of the replay */
+    struct histogram lag;           /* Delay of the records on the schedule */
+};
+
+static struct report report;
+
+/*
+ * A replayed connection. Replies are assembled into complete packets, to
+ * track the packet IDs the broker is waiting an ack for
+ */
+struct replay_conn {
+    int fd;                         /* -1 if not open */
+    unsigned char *rbuf;            /* Reply being assembled */
+    size_t rlen;
+    size_t rcap;
+    uint64_t *owed;                 /* Bitmap of the IDs waiting an ack */
+    unsigned char *held;            /* Acks held back, MQTT_ACK_LEN each */
+    size_t held_len;
+    size_t held_cap;
+};
+
+/* Replayed connections indexed by the connection id of the capture */
+static struct replay_conn *conns = NULL;
+static size_t conns_len = 0;
+
+static int epfd = -1;
+
+static void usage(const char *me) {
+    fprintf(stderr,
+            "Usage: %s [options] capture\n\n"
+            " -a addr     Broker address, default %s\n"
+            " -p port     Broker port, default %s\n"
+            " -U path     Connect through a unix socket instead of TCP\n"
+            " -x speed    Speed factor over the original timing, 0 to replay "
+            "as fast as possible, default %.0f\n"
+            " -d ms       Time to keep reading replies after the last record, "
+            "default %d\n"
+            " -j          Print the report as JSON\n"
+            " -h          Print this help\n",
+            me, DEFAULT_HOST, DEFAULT_PORT, DEFAULT_SPEED, DEFAULT_DRAIN_MS);
+}
+
+/*
+ * ==================
+ *  Replay sockets
+ * ==================
+ */
+
+static int open_connection(void) {
+    int fd = -1;
+    if (opts.unix_socket) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        strncpy(addr.sun_path, opts.unix_socket, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+            goto err;
+    } else {
+        struct addrinfo hints = {
+            .ai_family = AF_UNSPEC,
+            .ai_socktype = SOCK_STREAM
+        }, *result, *rp;
+        if (getaddrinfo(opts.host, opts.port, &hints, &result) != 0)
+            return -1;
+        for (rp = result; rp; rp = rp->ai_next) {
+            fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+            if (fd < 0)
+                continue;
+            if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(result);
+        if (fd < 0)
+            return -1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int));
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+
+err:
+    close(fd);
+    return -1;
+}
+
+static struct replay_conn *conn_get(uint32_t id) {
+    if (id >= conns_len) {
+        size_t len = conns_len ? conns_len : 1024;
+        while (len <= id)
+            len *= 2;
+        conns = try_realloc(conns, len * sizeof(*conns));
+        memset(conns + conns_len, 0x00, (len - conns_len) * sizeof(*conns));
+        for (size_t i = conns_len; i < len; ++i)
+            conns[i].fd = -1;
+        conns_len = len;
+    }
+    return &conns[id];
+}
+
+static void conn_close(struct replay_conn *c) {
+    if (c->fd >= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+    }
+    c->fd = -1;
+    c->rlen = c->held_len = 0;
+    if (c->owed)
+        memset(c->owed, 0x00, OWED_SIZE);
+}
+
+static void conn_free(struct replay_conn *c) {
+    conn_close(c);
+    free_memory(c->rbuf);
+    free_memory(c->owed);
+    free_memory(c->held);
+}
+
+static void drain(int);
+
+/* Send a whole frame, reading replies while the socket buffer is full */
+static int send_frame(struct replay_conn *c, const unsigned char *buf,
+                      size_t len) {
+    while (len > 0 && c->fd >= 0) {
+        ssize_t n = send(c->fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            drain(1);
+            continue;
+        }
+        buf += n;
+        len -= n;
+        report.bytes_sent += n;
+    }
+    return c->fd >= 0 ? 0 : -1;
+}
+
+static inline bool owed_test(const struct replay_conn *c, unsigned id) {
+    return c->owed && (c->owed[id / 64] & (1ULL << (id % 64)));
+}
+
+static inline void owed_set(struct replay_conn *c, unsigned id, bool value) {
+    if (!c->owed)
+        c->owed = try_calloc(1, OWED_SIZE);
+    if (value)
+        c->owed[id / 64] |= 1ULL << (id % 64);
+    else
+        c->owed[id / 64] &= ~(1ULL << (id % 64));
+}
+
+/* True for the acks a client sends in response to a packet of the broker */
+static inline bool is_owed_ack(const unsigned char *frame, size_t len) {
+    unsigned type = frame[0] >> 4;
+    return len == MQTT_ACK_LEN
+        && (type == PUBACK || type == PUBREC || type == PUBCOMP);
+}
+
+/*
+ * Send an ack of a packet of the broker if the broker already sent it,
+ * otherwise hold it back till it does
+ */
+static int send_ack(struct replay_conn *c, const unsigned char *frame) {
+    unsigned id = unpacku16((unsigned char *) frame + 2);
+    if (owed_test(c, id)) {
+        owed_set(c, id, false);
+        return send_frame(c, frame, MQTT_ACK_LEN);
+    }
+    if (c->held_len == c->held_cap) {
+        c->held_cap = c->held_cap ? c->held_cap * 2 : 16 * MQTT_ACK_LEN;
+        c->held = try_realloc(c->held, c->held_cap);
+    }
+    memcpy(c->held + c->held_len, frame, MQTT_ACK_LEN);
+    c->held_len += MQTT_ACK_LEN;
+    report.held++;
+    return 0;
+}
+
+/* Send the acks held back that the broker is now waiting for */
+static void release_acks(struct replay_conn *c) {
+    size_t kept = 0;
+    for (size_t i = 0; i < c->held_len; i += MQTT_ACK_LEN) {
+        unsigned id = unpacku16(c->held + i + 2);
+        if (owed_test(c, id) && c->fd >= 0) {
+            owed_set(c, id, false);
+            if (send_frame(c, c->held + i, MQTT_ACK_LEN) == 0)
+                continue;
+        }
+        memmove(c->held + kept, c->held + i, MQTT_ACK_LEN);
+        kept += MQTT_ACK_LEN;
+    }
+    c->held_len = kept;
+}
+
+/*
+ * Track the IDs of the packets the broker expects an ack for, PUBLISH with
+ * QoS > 0 and PUBREL, returns true if a new one was seen
+ */
+static bool track_reply(struct replay_conn *c, unsigned char *pkt,
+                        size_t hlen, size_t len) {
+    unsigned type = pkt[0] >> 4, qos = (pkt[0] >> 1) & 0x03;
+    unsigned char *body = pkt + hlen;
+    if (type == PUBLISH && qos > AT_MOST_ONCE && len >= 2) {
+        size_t topic_len = unpacku16(body);
+        if (len < topic_len + 4)
+            return false;
+        owed_set(c, unpacku16(body + 2 + topic_len), true);
+        return true;
+    }
+    if (type == PUBREL && len >= 2) {
+        owed_set(c, unpacku16(body), true);
+        return true;
+    }
+    return false;
+}
+
+/* Split the replies into packets, returns true if new IDs are owed */
+static bool parse_replies(struct replay_conn *c) {
+    bool owed = false;
+    size_t pos = 0;
+    while (c->rlen - pos >= 2) {
+        unsigned char *pkt = c->rbuf + pos;
+        size_t len = 0, mul = 1, hlen = 1;
+        bool complete = false;
+        while (hlen < c->rlen - pos && hlen <= 4) {
+            len += (pkt[hlen] & 127) * mul;
+            mul *= 128;
+            if ((pkt[hlen++] & 128) == 0) {
+                complete = true;
+                break;
+            }
+        }
+        if (!complete || c->rlen - pos < hlen + len)
+            break;
+        owed |= track_reply(c, pkt, hlen, len);
+        pos += hlen + len;
+    }
+    memmove(c->rbuf, c->rbuf + pos, c->rlen - pos);
+    c->rlen -= pos;
+    return owed;
+}
+
+/*
+ * Read whatever the broker sent back, waiting at most timeout milliseconds
+ * for something to arrive
+ */
+static void drain(int timeout) {
+    struct epoll_event events[256];
+    int n = epoll_wait(epfd, events, 256, timeout);
+    for (int i = 0; i < n; ++i) {
+        struct replay_conn *c = conn_get(events[i].data.u32);
+        ssize_t nread;
+        for (;;) {
+            if (c->rcap - c->rlen < READ_CHUNK) {
+                c->rcap = c->rcap ? c->rcap * 2 : 2 * READ_CHUNK;
+                c->rbuf = try_realloc(c->rbuf, c->rcap);
+            }
+            nread = read(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen);
+            if (nread <= 0)
+                break;
+            c->rlen += nread;
+            report.bytes_received += nread;
+            if (parse_replies(c) && c->held_len > 0)
+                release_acks(c);
+        }
+        if (nread == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            report.dropped++;
+            conn_close(c);
+        }
+    }
+}
+
+/* Wait till the monotonic time due, reading replies meanwhile */
+static void wait_until(uint64_t due) {
+    uint64_t now;
+    while ((now = monotonic_ns()) < due) {
+        uint64_t ms = (due - now) / 1000000;
+        drain(ms < MAX_WAIT_MS ? (int) ms : MAX_WAIT_MS);
+    }
+}
+
+/*
+ * ==================
+ *  Capture reading
+ * ==================
+ */
+
+static int read_header(FILE *fp) {
+    unsigned char header[CAPTURE_HEADER_LEN];
+    if (fread(header, CAPTURE_HEADER_LEN, 1, fp) != 1
+        || memcmp(header, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+        fprintf(stderr, "%s: not a capture file\n", opts.path);
+        return -1;
+    }
+    u16 version = unpacku16(header + CAPTURE_MAGIC_LEN);
+    if (version != CAPTURE_VERSION) {
+        fprintf(stderr, "%s: unsupported capture version %u\n",
+                opts.path, version);
+        return -1;
+    }
+    return 0;
+}
+
+static int replay(FILE *fp) {
+    unsigned char rec[CAPTURE_RECORD_LEN], flen[sizeof(uint32_t)];
+    unsigned char *frame = NULL;
+    size_t frame_cap = 0;
+    uint64_t start = monotonic_ns();
+    int rc = 0;
+    while (fread(rec, CAPTURE_RECORD_LEN, 1, fp) == 1) {
+        uint32_t id = unpacku32(rec + 1);
+        uint64_t ts = unpacku64(rec + 5);
+        size_t len = 0;
+        if (rec[0] == CAPTURE_FRAME) {
+            if (fread(flen, sizeof(flen), 1, fp) != 1)
+                goto truncated;
+            len = unpacku32(flen);
+            if (len > MAX_FRAME_SIZE)
+                goto corrupted;
+            if (len > frame_cap) {
+                frame_cap = len;
+                frame = try_realloc(frame, frame_cap);
+            }
+            if (len > 0 && fread(frame, len, 1, fp) != 1)
+                goto truncated;
+        } else if (rec[0] != CAPTURE_OPEN && rec[0] != CAPTURE_CLOSE) {
+            goto corrupted;
+        }
+        report.captured_ns = ts;
+        if (opts.speed > 0) {
+            uint64_t due = start + (uint64_t) (ts / opts.speed);
+            wait_until(due);
+            histogram_record(&report.lag, monotonic_ns() - due);
+        }
+        struct replay_conn *c = conn_get(id);
+        switch (rec[0]) {
+            case CAPTURE_OPEN:
+                // Descriptors are closed before being reused, just in case
+                conn_close(c);
+                c->fd = open_connection();
+                if (c->fd < 0) {
+                    report.failed++;
+                    break;
+                }
+                struct epoll_event ev = { .events = EPOLLIN, .data.u32 = id };
+                epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+                report.connections++;
+                break;
+            case CAPTURE_FRAME:
+                if (c->fd < 0) {
+                    report.skipped++;
+                    break;
+                }
+                if (is_owed_ack(frame, len))
+                    rc = send_ack(c, frame);
+                else
+                    rc = send_frame(c, frame, len);
+                if (rc < 0) {
+                    report.skipped++;
+                    conn_close(c);
+                } else {
+                    report.frames++;
+                }
+                rc = 0;
+                break;
+            case CAPTURE_CLOSE:
+                report.unmatched += c->held_len / MQTT_ACK_LEN;
+                conn_close(c);
+                break;
+        }
+        // Keep up with replies without waiting, the schedule comes first
+        drain(0);
+    }
+    if (ferror(fp))
+        goto truncated;
+    goto exit;
+
+truncated:
+    fprintf(stderr, "%s: capture truncated, replayed up to the last "
+            "complete record\n", opts.path);
+    goto exit;
+
+corrupted:
+    fprintf(stderr, "%s: corrupted record, stopping\n", opts.path);
+    rc = -1;
+
+exit:
+    report.elapsed_ns = monotonic_ns() - start;
+    free_memory(frame);
+    return rc;
+}
+
+/*
+ * =========
+ *  Report
+ * =========
+ */
+
+#define QUANTILES 4
+
+static const struct {
+    const char *name;
+    double percentile;
+} quantiles[QUANTILES] = {
+    { "p50", 50.0 },
+    { "p99", 99.0 },
+    { "p999", 99.9 },
+    { "max", 100.0 }
+};
+
+static void report_human(const struct report *r) {
+    printf("Connections: %lu opened, %lu failed, %lu closed by the broker\n",
+           r->connections, r->failed, r->dropped);
+    printf("Frames:      %lu sent (%lu bytes), %lu skipped\n",
+           r->frames, r->bytes_sent, r->skipped);
+    printf("Acks:        %lu held back, %lu never matched\n",
+           r->held, r->unmatched);
+    printf("Received:    %lu bytes\n", r->bytes_received);
+    printf("Duration:    %.3f s replayed, %.3f s captured\n",
+           r->elapsed_ns / 1e9, r->captured_ns / 1e9);
+    if (opts.speed <= 0)
+        return;
+    printf("\nLag behind the schedule (us):\n");
+    for (size_t i = 0; i < QUANTILES; ++i)
+        printf("  %-5s %10.3f\n", quantiles[i].name,
+               histogram_percentile(&r->lag, quantiles[i].percentile) / 1e3);
+}
+
+static void report_json(const struct report *r) {
+    printf("{\"speed\":%.3f,\"connections\":%lu,\"failed\":%lu,"
+           "\"dropped\":%lu,\"frames\":%lu,\"skipped\":%lu,"
+           "\"held\":%lu,\"unmatched\":%lu,"
+           "\"bytes_sent\":%lu,\"bytes_received\":%lu,"
+           "\"replay_seconds\":%.6f,\"capture_seconds\":%.6f,\"lag_us\":{",
+           opts.speed, r->connections, r->failed, r->dropped, r->frames,
+           r->skipped, r->held, r->unmatched, r->bytes_sent,
+           r->bytes_received, r->elapsed_ns / 1e9, r->captured_ns / 1e9);
+    for (size_t i = 0; i < QUANTILES; ++i)
+        printf("%s\"%s\":%.3f", i > 0 ? "," : "", quantiles[i].name,
+               histogram_percentile(&r->lag, quantiles[i].percentile) / 1e3);
+    printf("}}\n");
+}
+
+int main(int argc, char **argv) {
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:p:U:x:d:jh")) != -1) {
+        switch (opt) {
+            case 'a':
+                opts.host = optarg;
+                break;
+            case 'p':
+                opts.port = optarg;
+                break;
+            case 'U':
+                opts.unix_socket = optarg;
+                break;
+            case 'x':
+                opts.speed = strtod(optarg, NULL);
+                break;
+            case 'd':
+                opts.drain_ms = atoi(optarg);
+                break;
+            case 'j':
+                opts.json = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1 || opts.speed < 0 || opts.drain_ms < 0) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    opts.path = argv[optind];
+    FILE *fp = fopen(opts.path, "r");
+    if (!fp) {
+        perror(opts.path);
+        exit(EXIT_FAILURE);
+    }
+
+    if (read_header(fp) < 0) {
+        fclose(fp);
+        exit(EXIT_FAILURE);
+    }
+
+    histogram_init(&report.lag);
+    epfd = epoll_create1(0);
+
+    int rc = replay(fp);
+    fclose(fp);
+
+    // Give the broker time to deliver what's still in flight
+    uint64_t deadline = monotonic_ns() + opts.drain_ms * 1000000ULL;
+    while (monotonic_ns() < deadline)
+        drain(MAX_WAIT_MS);
+
+    for (size_t i = 0; i < conns_len; ++i) {
+        report.unmatched += conns[i].held_len / MQTT_ACK_LEN;
+        conn_free(&conns[i]);
+    }
+    free_memory(conns);
+    close(epfd);
+
+    if (opts.json)
+        report_json(&report);
+    else
+        report_human(&report);
+
+    return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,336 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * sol_shmbench, measures the round trip of small messages through a running
+ * broker, over the shared memory transport or, to compare, over a socket.
+ *
+ * A single client subscribes to a topic of its own and then publishes QoS 0
+ * messages on it one at a time, each one timed from the PUBLISH sent to the
+ * same message received back, so the latency includes the routing in the
+ * broker and both directions of the transport.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../src/shm.h"
+#include "../src/mqtt.h"
+#include "../src/pack.h"
+#include "../src/util.h"
+#include "../src/histogram.h"
+
+#define DEFAULT_HOST        "127.0.0.1"
+#define DEFAULT_PORT        "1883"
+#define DEFAULT_MESSAGES    100000
+#define DEFAULT_PAYLOAD     64
+#define DEFAULT_WARMUP      1000
+
+#define TOPIC_PREFIX        "sol_shmbench"
+
+/* Max time to wait for a reply before giving up */
+#define REPLY_TIMEOUT_MS    5000
+
+#define BUFSIZE             (64 * 1024)
+
+static struct {
+    const char *host;
+    const char *port;
+    const char *unix_path;
+    const char *shm_path;
+    long messages;
+    long payload;
+    bool json;
+} opts = {
+    .host = DEFAULT_HOST,
+    .port = DEFAULT_PORT,
+    .messages = DEFAULT_MESSAGES,
+    .payload = DEFAULT_PAYLOAD
+};
+
+/* The connection to the broker, either shared memory or a socket */
+static struct {
+    bool shm;
+    struct shm_client client;
+    int fd;
+    unsigned char rbuf[BUFSIZE];
+    size_t rlen;
+} conn = { .fd = -1 };
+
+static void usage(const char *me) {
+    fprintf(stderr,
+            "Usage: %s [options]\n\n"
+            " -s path     Shared memory socket of the broker (shm_socket)\n"
+            " -u path     Unix socket of the broker, to compare\n"
+            " -a addr     Broker IPv4 address, default %s, to compare\n"
+            " -p port     Broker port, default %s\n"
+            " -n count    Number of messages, default %d\n"
+            " -b bytes    Payload size, default %d\n"
+            " -j          Print the report as JSON\n"
+            " -h          Print this help\n",
+            me, DEFAULT_HOST, DEFAULT_PORT, DEFAULT_MESSAGES, DEFAULT_PAYLOAD);
+}
+
+static int socket_connect(void) {
+    int fd;
+    if (opts.unix_path) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", opts.unix_path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+            goto err;
+    } else {
+        struct sockaddr_in addr = { .sin_family = AF_INET };
+        addr.sin_port = htons(atoi(opts.port));
+        if (inet_pton(AF_INET, opts.host, &addr.sin_addr) != 1)
+            return -1;
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+            goto err;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int));
+    }
+    return fd;
+
+err:
+
+    close(fd);
+    return -1;
+}
+
+static bool conn_send(const unsigned char *buf, size_t len) {
+    if (conn.shm)
+        return shm_client_send(&conn.client, buf, len) == (ssize_t) len;
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(conn.fd, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+static ssize_t conn_recv(unsigned char *buf, size_t len) {
+    if (conn.shm)
+        return shm_client_recv(&conn.client, buf, len, REPLY_TIMEOUT_MS);
+    return recv(conn.fd, buf, len, 0);
+}
+
+/*
+ * Read the next packet, returns its type and leaves it at the start of the
+ * read buffer, its length in len, or -1 on errors
+ */
+static int packet_read(size_t *len) {
+    for (;;) {
+        if (conn.rlen >= 2) {
+            size_t rem = 0, pos = 1;
+            unsigned mul = 1;
+            do {
+                rem += (conn.rbuf[pos] & 127) * mul;
+                mul *= 128;
+            } while ((conn.rbuf[pos++] & 128) && pos < conn.rlen && pos < 5);
+            if (!(conn.rbuf[pos - 1] & 128) && conn.rlen >= pos + rem) {
+                *len = pos + rem;
+                return conn.rbuf[0] >> 4;
+            }
+        }
+        if (conn.rlen == BUFSIZE)
+            return -1;
+        ssize_t n = conn_recv(conn.rbuf + conn.rlen, BUFSIZE - conn.rlen);
+        if (n <= 0)
+            return -1;
+        conn.rlen += n;
+    }
+}
+
+/* Drop the packet just read from the read buffer */
+static void packet_consume(size_t len) {
+    memmove(conn.rbuf, conn.rbuf + len, conn.rlen - len);
+    conn.rlen -= len;
+}
+
+/* Wait for a packet of the given type, skipping any other */
+static bool packet_wait(int type) {
+    size_t len;
+    int t;
+    while ((t = packet_read(&len)) >= 0) {
+        packet_consume(len);
+        if (t == type)
+            return true;
+    }
+    return false;
+}
+
+static bool handshake(const char *topic) {
+    unsigned char buf[256];
+    struct mqtt_packet pkt = { .header = { .byte = CONNECT_B } };
+    pkt.connect.bits.clean_session = 1;
+    pkt.connect.payload.keepalive = 60;
+    snprintf((char *) pkt.connect.payload.client_id, MQTT_CLIENT_ID_LEN,
+             TOPIC_PREFIX "-%d", getpid());
+    size_t len = mqtt_pack(&pkt, buf);
+    if (!conn_send(buf, len) || !packet_wait(CONNACK))
+        return false;
+    struct mqtt_subscribe_tuple tuple = { 0, strlen(topic), (u8 *) topic };
+    pkt = (struct mqtt_packet) { .header = { .byte = SUBSCRIBE_B } };
+    pkt.subscribe.pkt_id = 1;
+    pkt.subscribe.tuples_len = 1;
+    pkt.subscribe.tuples = &tuple;
+    len = mqtt_pack(&pkt, buf);
+    return conn_send(buf, len) && packet_wait(SUBACK);
+}
+
+#define QUANTILES 4
+
+static const struct {
+    const char *name;
+    double percentile;
+} quantiles[QUANTILES] = {
+    { "p50", 50.0 },
+    { "p99", 99.0 },
+    { "p999", 99.9 },
+    { "max", 100.0 }
+};
+
+int main(int argc, char **argv) {
+
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:u:a:p:n:b:jh")) != -1) {
+        switch (opt) {
+            case 's':
+                opts.shm_path = optarg;
+                break;
+            case 'u':
+                opts.unix_path = optarg;
+                break;
+            case 'a':
+                opts.host = optarg;
+                break;
+            case 'p':
+                opts.port = optarg;
+                break;
+            case 'n':
+                opts.messages = atol(optarg);
+                break;
+            case 'b':
+                opts.payload = atol(optarg);
+                break;
+            case 'j':
+                opts.json = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (opts.messages < 1 || opts.payload < 1 || opts.payload > BUFSIZE / 2) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    const char *transport = opts.shm_path ? "shm" : opts.unix_path ? "unix" : "tcp";
+    if (opts.shm_path) {
+        conn.shm = true;
+        if (shm_client_connect(&conn.client, opts.shm_path) < 0) {
+            fprintf(stderr, "Connecting to %s: %s\n",
+                    opts.shm_path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    } else if ((conn.fd = socket_connect()) < 0) {
+        fprintf(stderr, "Connecting to the broker: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    char topic[64];
+    snprintf(topic, sizeof(topic), TOPIC_PREFIX "/%d", getpid());
+    if (!handshake(topic)) {
+        fprintf(stderr, "Handshake with the broker failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned char *payload = calloc(1, opts.payload);
+    unsigned char buf[BUFSIZE];
+    struct mqtt_packet pkt = { .header = { .byte = PUBLISH_B } };
+    pkt.publish.topiclen = strlen(topic);
+    pkt.publish.topic = (u8 *) topic;
+    pkt.publish.payloadlen = opts.payload;
+    pkt.publish.payload = payload;
+    size_t len = mqtt_pack(&pkt, buf);
+
+    struct histogram rtt;
+    histogram_init(&rtt);
+    uint64_t start = 0;
+    for (long i = 0; i < opts.messages + DEFAULT_WARMUP; ++i) {
+        if (i == DEFAULT_WARMUP)
+            start = monotonic_ns();
+        uint64_t sent = monotonic_ns();
+        if (!conn_send(buf, len) || !packet_wait(PUBLISH)) {
+            fprintf(stderr, "Message %ld lost, broker gone or too slow\n", i);
+            exit(EXIT_FAILURE);
+        }
+        if (i >= DEFAULT_WARMUP)
+            histogram_record(&rtt, monotonic_ns() - sent);
+    }
+    double elapsed = (monotonic_ns() - start) / 1e9;
+
+    if (opts.json) {
+        printf("{\"transport\":\"%s\",\"messages\":%ld,\"payload\":%ld,"
+               "\"msgs_per_sec\":%.0f,\"rtt_us\":{", transport, opts.messages,
+               opts.payload, opts.messages / elapsed);
+        for (size_t i = 0; i < QUANTILES; ++i)
+            printf("%s\"%s\":%.3f", i > 0 ? "," : "", quantiles[i].name,
+                   histogram_percentile(&rtt, quantiles[i].percentile) / 1e3);
+        printf("}}\n");
+    } else {
+        printf("Transport:   %s, %ld messages of %ld bytes, %.0f msgs/s\n",
+               transport, opts.messages, opts.payload, opts.messages / elapsed);
+        printf("\nRound trip, PUBLISH to PUBLISH received (us):\n");
+        for (size_t i = 0; i < QUANTILES; ++i)
+            printf("  %-5s %10.3f\n", quantiles[i].name,
+                   histogram_percentile(&rtt, quantiles[i].percentile) / 1e3);
+    }
+
+    free(payload);
+    if (conn.shm)
+        shm_client_close(&conn.client);
+    else
+        close(conn.fd);
+    return 0;
+}
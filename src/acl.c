@@ -0,0 +1,496 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "memory.h"
+#include "logging.h"
+#include "uthash.h"
+#include "acl.h"
+
+/* Accesses granted or denied to a user on a node */
+struct acl_owner {
+    char *user;
+    unsigned access;
+    UT_hash_handle hh;
+};
+
+struct acl_node {
+    char *level;
+    unsigned any;               /* Access of every client */
+    struct acl_owner *owners;   /* Access by username */
+    bool deny_below;            /* A deny rule ends here or below */
+    struct acl_node *children;  /* Exact levels */
+    struct acl_node *plus;
+    struct acl_node *hash;
+    struct acl_node *user;      /* %u */
+    struct acl_node *client;    /* %c */
+    UT_hash_handle hh;
+};
+
+struct acl {
+    struct acl_node root;
+    size_t rules;
+    unsigned generation;
+};
+
+struct acl_level {
+    const char *s;
+    size_t len;
+};
+
+/* A check in progress, the levels of the topic and the access collected */
+struct acl_walk {
+    struct acl_level levels[ACL_MAX_LEVELS];
+    int n;
+    const char *user;
+    const char *cid;
+    bool dollar;
+    unsigned access;
+};
+
+/* Every set of rules gets its own, memos of older ones are stale */
+static atomic_uint generations = ATOMIC_VAR_INIT(0);
+
+static bool acl_split(struct acl_walk *w, const char *topic, size_t len) {
+    const char *start = topic, *end = topic + len;
+    w->n = 0;
+    w->dollar = len > 0 && topic[0] == '$';
+    for (const char *p = topic; ; ++p) {
+        if (p == end || *p == '/') {
+            if (w->n == ACL_MAX_LEVELS)
+                return false;
+            w->levels[w->n++] = (struct acl_level) { start, p - start };
+            if (p == end)
+                break;
+            start = p + 1;
+        }
+    }
+    return true;
+}
+
+static inline bool level_is(const struct acl_level *l, const char *s) {
+    return s && strlen(s) == l->len && memcmp(l->s, s, l->len) == 0;
+}
+
+static inline unsigned node_access(const struct acl_node *n, const char *user) {
+    unsigned access = n->any;
+    if (user && n->owners) {
+        struct acl_owner *o = NULL;
+        HASH_FIND_STR(n->owners, user, o);
+        if (o)
+            access |= o->access;
+    }
+    return access;
+}
+
+static inline bool node_denied(const struct acl_node *n, const char *user) {
+    return (node_access(n, user) & ACL_DENY) != 0;
+}
+
+static struct acl_node *acl_node_new(const struct acl_level *l) {
+    struct acl_node *n = try_calloc(1, sizeof(*n));
+    n->level = try_alloc(l->len + 1);
+    memcpy(n->level, l->s, l->len);
+    n->level[l->len] = '\0';
+    return n;
+}
+
+static void acl_node_free(struct acl_node *n, bool self) {
+    if (!n)
+        return;
+    struct acl_owner *o, *otmp;
+    HASH_ITER(hh, n->owners, o, otmp) {
+        HASH_DEL(n->owners, o);
+        free_memory(o->user);
+        free_memory(o);
+    }
+    struct acl_node *c, *ctmp;
+    HASH_ITER(hh, n->children, c, ctmp) {
+        HASH_DEL(n->children, c);
+        acl_node_free(c, true);
+    }
+    acl_node_free(n->plus, true);
+    acl_node_free(n->hash, true);
+    acl_node_free(n->user, true);
+    acl_node_free(n->client, true);
+    free_memory(n->level);
+    if (self)
+        free_memory(n);
+}
+
+static struct acl_node *acl_child(struct acl_node *n, const struct acl_level *l) {
+    struct acl_node **slot = NULL;
+    if (level_is(l, "+"))
+        slot = &n->plus;
+    else if (level_is(l, "#"))
+        slot = &n->hash;
+    else if (level_is(l, "%u"))
+        slot = &n->user;
+    else if (level_is(l, "%c"))
+        slot = &n->client;
+    if (slot) {
+        if (!*slot)
+            *slot = acl_node_new(l);
+        return *slot;
+    }
+    struct acl_node *c = NULL;
+    HASH_FIND(hh, n->children, l->s, l->len, c);
+    if (!c) {
+        c = acl_node_new(l);
+        HASH_ADD_KEYPTR(hh, n->children, c->level, l->len, c);
+    }
+    return c;
+}
+
+struct acl *acl_new(void) {
+    struct acl *acl = try_calloc(1, sizeof(*acl));
+    acl->generation = atomic_fetch_add(&generations, 1) + 1;
+    return acl;
+}
+
+void acl_free(struct acl *acl) {
+    if (!acl)
+        return;
+    acl_node_free(&acl->root, false);
+    free_memory(acl);
+}
+
+size_t acl_size(const struct acl *acl) {
+    return acl->rules;
+}
+
+bool acl_add(struct acl *acl, const char *user,
+             const char *filter, unsigned access) {
+    struct acl_walk w;
+    size_t len = strlen(filter);
+    if (len == 0 || !acl_split(&w, filter, len))
+        return false;
+    // Wildcards must take a whole level, # only the last one
+    for (int i = 0; i < w.n; ++i) {
+        const struct acl_level *l = &w.levels[i];
+        if ((memchr(l->s, '#', l->len) && (!level_is(l, "#") || i != w.n - 1))
+            || (memchr(l->s, '+', l->len) && !level_is(l, "+")))
+            return false;
+    }
+    struct acl_node *n = &acl->root;
+    for (int i = 0; i < w.n; ++i) {
+        if (access & ACL_DENY)
+            n->deny_below = true;
+        n = acl_child(n, &w.levels[i]);
+    }
+    if (access & ACL_DENY)
+        n->deny_below = true;
+    if (user) {
+        struct acl_owner *o = NULL;
+        HASH_FIND_STR(n->owners, user, o);
+        if (!o) {
+            o = try_calloc(1, sizeof(*o));
+            o->user = try_strdup(user);
+            HASH_ADD_KEYPTR(hh, n->owners, o->user, strlen(o->user), o);
+        }
+        o->access |= access;
+    } else {
+        n->any |= access;
+    }
+    acl->rules++;
+    return true;
+}
+
+/*
+ * Collect the accesses of the rules matching a topic, the rules ending with
+ * # match the parent level as well
+ */
+static void walk_topic(const struct acl_node *n, struct acl_walk *w, int i) {
+    bool wild = !(i == 0 && w->dollar);
+    if (n->hash && wild)
+        w->access |= node_access(n->hash, w->user);
+    if (i == w->n) {
+        w->access |= node_access(n, w->user);
+        return;
+    }
+    const struct acl_level *l = &w->levels[i];
+    struct acl_node *c = NULL;
+    HASH_FIND(hh, n->children, l->s, l->len, c);
+    if (c)
+        walk_topic(c, w, i + 1);
+    if (n->plus && wild)
+        walk_topic(n->plus, w, i + 1);
+    if (n->user && level_is(l, w->user))
+        walk_topic(n->user, w, i + 1);
+    if (n->client && level_is(l, w->cid))
+        walk_topic(n->client, w, i + 1);
+}
+
+/*
+ * Collect the accesses of the rules covering a whole filter, a + of the
+ * filter is covered only by a + or a # rule, a # only by a # rule
+ */
+static void walk_filter(const struct acl_node *n, struct acl_walk *w, int i) {
+    bool wild = !(i == 0 && w->dollar);
+    if (n->hash && wild)
+        w->access |= node_access(n->hash, w->user);
+    if (i == w->n) {
+        w->access |= node_access(n, w->user);
+        return;
+    }
+    const struct acl_level *l = &w->levels[i];
+    if (level_is(l, "#"))
+        return;
+    if (n->plus && wild)
+        walk_filter(n->plus, w, i + 1);
+    if (level_is(l, "+"))
+        return;
+    struct acl_node *c = NULL;
+    HASH_FIND(hh, n->children, l->s, l->len, c);
+    if (c)
+        walk_filter(c, w, i + 1);
+    if (n->user && level_is(l, w->user))
+        walk_filter(n->user, w, i + 1);
+    if (n->client && level_is(l, w->cid))
+        walk_filter(n->client, w, i + 1);
+}
+
+/* Any deny rule on a node or below, wildcards at the first level skip $ */
+static bool subtree_denied(const struct acl_node *n, const char *user, bool top) {
+    if (!n->deny_below)
+        return false;
+    if (node_denied(n, user))
+        return true;
+    struct acl_node *c, *tmp;
+    HASH_ITER(hh, n->children, c, tmp)
+        if (!(top && c->level[0] == '$') && subtree_denied(c, user, false))
+            return true;
+    return (n->plus && subtree_denied(n->plus, user, false))
+        || (n->hash && subtree_denied(n->hash, user, false))
+        || (n->user && user && subtree_denied(n->user, user, false))
+        || (n->client && subtree_denied(n->client, user, false));
+}
+
+/* Check if a deny rule matches any of the topics a filter may match */
+static bool walk_deny(const struct acl_node *n, const struct acl_walk *w, int i) {
+    if (!n->deny_below)
+        return false;
+    bool wild = !(i == 0 && w->dollar);
+    if (n->hash && wild && node_denied(n->hash, w->user))
+        return true;
+    if (i == w->n)
+        return node_denied(n, w->user);
+    const struct acl_level *l = &w->levels[i];
+    if (level_is(l, "#"))
+        return subtree_denied(n, w->user, i == 0);
+    struct acl_node *c, *tmp;
+    if (level_is(l, "+")) {
+        HASH_ITER(hh, n->children, c, tmp)
+            if (!(i == 0 && c->level[0] == '$') && walk_deny(c, w, i + 1))
+                return true;
+        return (n->plus && walk_deny(n->plus, w, i + 1))
+            || (n->user && w->user && walk_deny(n->user, w, i + 1))
+            || (n->client && walk_deny(n->client, w, i + 1));
+    }
+    c = NULL;
+    HASH_FIND(hh, n->children, l->s, l->len, c);
+    return (c && walk_deny(c, w, i + 1))
+        || (n->plus && wild && walk_deny(n->plus, w, i + 1))
+        || (n->user && level_is(l, w->user) && walk_deny(n->user, w, i + 1))
+        || (n->client && level_is(l, w->cid) && walk_deny(n->client, w, i + 1));
+}
+
+bool acl_check(const struct acl *acl, const char *user, const char *cid,
+               const char *topic, size_t len, unsigned access) {
+    struct acl_walk w = { .user = user, .cid = cid, .access = 0 };
+    if (len == 0 || !acl_split(&w, topic, len))
+        return false;
+    walk_topic(&acl->root, &w, 0);
+    return (w.access & access) == access && !(w.access & ACL_DENY);
+}
+
+static uint64_t acl_hash(const char *s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char) s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static void acl_memo_clear(struct acl_client *ac) {
+    for (int i = 0; i < ACL_MEMO_SIZE; ++i) {
+        free_memory(ac->memo[i].topic);
+        ac->memo[i].topic = NULL;
+    }
+}
+
+bool acl_can_publish(const struct acl *acl, struct acl_client *ac,
+                     const char *cid, const char *topic, size_t len) {
+    if (!ac)
+        return acl_check(acl, NULL, cid, topic, len, ACL_WRITE);
+    if (!ac->memo)
+        ac->memo = try_calloc(ACL_MEMO_SIZE, sizeof(*ac->memo));
+    else if (ac->generation != acl->generation)
+        acl_memo_clear(ac);
+    ac->generation = acl->generation;
+    uint64_t h = acl_hash(topic, len);
+    struct acl_memo_entry *e = &ac->memo[h & (ACL_MEMO_SIZE - 1)];
+    if (e->topic && e->hash == h
+        && strncmp(e->topic, topic, len) == 0 && e->topic[len] == '\0')
+        return e->allowed;
+    bool allowed = acl_check(acl, ac->username, cid, topic, len, ACL_WRITE);
+    // Entries are rewritten in place when the topic fits
+    if (e->topic && alloc_size(e->topic) < len + 1) {
+        free_memory(e->topic);
+        e->topic = NULL;
+    }
+    if (!e->topic)
+        e->topic = try_alloc(len + 1);
+    memcpy(e->topic, topic, len);
+    e->topic[len] = '\0';
+    e->hash = h;
+    e->allowed = allowed;
+    return allowed;
+}
+
+bool acl_can_subscribe(const struct acl *acl, const struct acl_client *ac,
+                       const char *cid, const char *filter, size_t len) {
+    struct acl_walk w = {
+        .user = ac ? ac->username : NULL,
+        .cid = cid,
+        .access = 0
+    };
+    if (len == 0 || !acl_split(&w, filter, len))
+        return false;
+    walk_filter(&acl->root, &w, 0);
+    if (!(w.access & ACL_READ))
+        return false;
+    return !walk_deny(&acl->root, &w, 0);
+}
+
+struct acl_client *acl_client_new(const char *username) {
+    struct acl_client *ac = try_calloc(1, sizeof(*ac));
+    ac->username = username ? try_strdup(username) : NULL;
+    return ac;
+}
+
+void acl_client_free(struct acl_client *ac) {
+    if (!ac)
+        return;
+    if (ac->memo) {
+        acl_memo_clear(ac);
+        free_memory(ac->memo);
+    }
+    free_memory(ac->username);
+    free_memory(ac);
+}
+
+/*
+ * File loading
+ */
+
+static char *acl_token(char **line) {
+    char *s = *line;
+    while (isspace((unsigned char) *s))
+        ++s;
+    if (*s == '\0')
+        return NULL;
+    char *start = s;
+    while (*s && !isspace((unsigned char) *s))
+        ++s;
+    if (*s)
+        *s++ = '\0';
+    *line = s;
+    return start;
+}
+
+/* The rest of a line, surrounding spaces trimmed, topics may have spaces */
+static char *acl_rest(char *line) {
+    while (isspace((unsigned char) *line))
+        ++line;
+    char *end = line + strlen(line);
+    while (end > line && isspace((unsigned char) end[-1]))
+        *--end = '\0';
+    return line;
+}
+
+static int acl_access(const char *s) {
+    if (strcmp(s, "read") == 0)
+        return ACL_READ;
+    if (strcmp(s, "write") == 0)
+        return ACL_WRITE;
+    if (strcmp(s, "readwrite") == 0)
+        return ACL_READ | ACL_WRITE;
+    if (strcmp(s, "deny") == 0)
+        return ACL_DENY;
+    return -1;
+}
+
+struct acl *acl_load(const char *path) {
+    FILE *fh = fopen(path, "r");
+    if (!fh) {
+        log_error("Unable to open ACL file %s", path);
+        return NULL;
+    }
+    struct acl *acl = acl_new();
+    char line[0xFFF], *user = NULL;
+    int linenr = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), fh)) {
+        linenr++;
+        char *p = line, *kind = acl_token(&p);
+        if (!kind || kind[0] == '#')
+            continue;
+        if (strcmp(kind, "user") == 0) {
+            char *name = acl_rest(p);
+            free_memory(user);
+            user = name[0] ? try_strdup(name) : NULL;
+            ok = user != NULL;
+        } else if (strcmp(kind, "topic") == 0 || strcmp(kind, "pattern") == 0) {
+            char *q = p, *word = acl_token(&q);
+            int access = word ? acl_access(word) : -1;
+            // The access is optional, what follows is the filter
+            if (access < 0) {
+                access = ACL_READ | ACL_WRITE;
+                if (word && *q)
+                    q[-1] = ' ';
+                q = word ? word : q;
+            }
+            const char *owner = kind[0] == 't' ? user : NULL;
+            ok = acl_add(acl, owner, acl_rest(q), access);
+        } else {
+            ok = false;
+        }
+    }
+    fclose(fh);
+    free_memory(user);
+    if (!ok) {
+        log_error("ACL file %s, line %d not valid", path, linenr);
+        acl_free(acl);
+        return NULL;
+    }
+    return acl;
+}
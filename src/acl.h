@@ -0,0 +1,125 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ACL_H
+#define ACL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Topic access control lists, loaded from the file set by acl_file, one rule
+ * per line:
+ *
+ *   user <username>             following topic rules apply to this user
+ *   topic [access] <filter>     rule of the current user, or of every client
+ *                               if before any user line
+ *   pattern [access] <filter>   rule of every client, %u and %c levels are
+ *                               replaced with username and client ID
+ *
+ * Access is read, write, readwrite (the default) or deny, a deny rule matching
+ * wins over any grant. With ACLs loaded, everything not granted is refused.
+ *
+ * Rules are compiled into a tree of topic levels, each node has its exact
+ * children hashed by level and a child for each of +, #, %u and %c, the rules
+ * ending on a node are stored as an access for every client plus a map of
+ * accesses by username. A check walks the levels of the topic, following the
+ * exact child and the wildcard ones, so it costs O(levels) whatever the
+ * number of rules. The outcome of the publish checks of a client are
+ * memoized in a small table indexed by topic.
+ *
+ * A subscription is granted if a read rule covers its whole filter and no
+ * deny rule matches any of the topics it may match, e.g. sensors/# is refused
+ * if sensors/private is denied, there are no further checks on delivery.
+ */
+
+#define ACL_READ    0x01
+#define ACL_WRITE   0x02
+#define ACL_DENY    0x04
+
+/* Max levels of a topic checked, deeper ones are always refused */
+#define ACL_MAX_LEVELS  64
+
+/* Publish checks memoized for each client */
+#define ACL_MEMO_SIZE   16
+
+struct acl;
+
+struct acl_memo_entry {
+    uint64_t hash;
+    char *topic;
+    bool allowed;
+};
+
+/* What a client carries to be checked against the ACLs */
+struct acl_client {
+    char *username;         /* NULL for anonymous clients */
+    unsigned generation;    /* Of the ACLs the memo refers to */
+    struct acl_memo_entry *memo;
+};
+
+/* An empty set of rules, refusing everything */
+struct acl *acl_new(void);
+
+void acl_free(struct acl *);
+
+/*
+ * Add a rule to a set, user is NULL for the rules of every client. Returns
+ * false if the filter is not valid, e.g. # not as the last level.
+ */
+bool acl_add(struct acl *, const char *, const char *, unsigned);
+
+/*
+ * Compile the rules of a file, returns NULL if it can't be read or a line is
+ * not valid, logging the reason
+ */
+struct acl *acl_load(const char *);
+
+/* Number of rules of a set */
+size_t acl_size(const struct acl *);
+
+/*
+ * Check if a user, with a client ID, has an access to a topic, wildcards in
+ * the topic are taken literally
+ */
+bool acl_check(const struct acl *, const char *, const char *,
+               const char *, size_t, unsigned);
+
+/* Like acl_check for ACL_WRITE, memoized on the client */
+bool acl_can_publish(const struct acl *, struct acl_client *, const char *,
+                     const char *, size_t);
+
+/* Check a subscription to a filter, see above */
+bool acl_can_subscribe(const struct acl *, const struct acl_client *,
+                       const char *, const char *, size_t);
+
+struct acl_client *acl_client_new(const char *);
+
+void acl_client_free(struct acl_client *);
+
+#endif
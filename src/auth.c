@@ -0,0 +1,200 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <time.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <openssl/evp.h>
+#include "ev.h"
+#include "config.h"
+#include "memory.h"
+#include "logging.h"
+#include "server.h"
+#include "sol_internal.h"
+#include "auth.h"
+#include "authcache.h"
+
+/* A password check handed off to the workers */
+struct auth_job {
+    struct io_event io;     /* The CONNECT, resumed once checked */
+    char *hash;             /* Copy of the hash of the password file */
+    unsigned char digest[AUTH_DIGEST_LEN];
+    struct auth_job *next;
+};
+
+static struct {
+    pthread_t *workers;
+    int workers_nr;
+    struct auth_job *head;
+    struct auth_job *tail;
+    bool stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /*
+     * Logins verified, the digest covers username, password and stored hash,
+     * a new password file makes the old entries unreachable
+     */
+    struct auth_cache cache;
+} auth = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+static void auth_digest(const struct io_event *e, const char *hash,
+                        unsigned char *digest) {
+    const struct mqtt_connect *c = &e->data.connect;
+    const char *user = (const char *) c->payload.username;
+    const char *pass = (const char *) c->payload.password;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    EVP_DigestUpdate(ctx, user, strlen(user) + 1);
+    EVP_DigestUpdate(ctx, pass, strlen(pass) + 1);
+    EVP_DigestUpdate(ctx, hash, strlen(hash));
+    EVP_DigestFinal_ex(ctx, digest, NULL);
+    EVP_MD_CTX_free(ctx);
+}
+
+static void auth_job_free(struct auth_job *job, bool drop) {
+    if (drop)
+        mqtt_packet_destroy(&job->io.data);
+    free_memory(job->hash);
+    free_memory(job);
+}
+
+/*
+ * Back on the loop of the client, the outcome is already set on it, run the
+ * CONNECT again
+ */
+static void auth_resume(struct ev_ctx *ctx, void *arg) {
+    struct auth_job *job = arg;
+    struct io_event io = job->io;
+    auth_job_free(job, false);
+    server_resume(ctx, &io);
+}
+
+static void *auth_worker(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&auth.lock);
+    while (auth.stopping == false) {
+        if (!auth.head) {
+            pthread_cond_wait(&auth.cond, &auth.lock);
+            continue;
+        }
+        struct auth_job *job = auth.head;
+        auth.head = job->next;
+        if (!auth.head)
+            auth.tail = NULL;
+        pthread_mutex_unlock(&auth.lock);
+
+        const char *pass = (const char *) job->io.data.connect.payload.password;
+        bool granted = check_passwd(pass, job->hash);
+        if (granted == true)
+            auth_cache_put(&auth.cache, job->digest, time(NULL));
+        struct client *c = job->io.client;
+        c->auth = granted == true ? AUTH_GRANTED : AUTH_DENIED;
+
+        pthread_mutex_lock(&auth.lock);
+        // The loops may be gone already, the client memory is freed with them
+        if (auth.stopping == true) {
+            auth_job_free(job, true);
+            break;
+        }
+        ev_register_event(c->ctx, c->conn.fd, EV_WRITE, auth_resume, job);
+    }
+    pthread_mutex_unlock(&auth.lock);
+    return NULL;
+}
+
+void auth_init(void) {
+    if (conf->allow_anonymous == true)
+        return;
+    auth_cache_init(&auth.cache, conf->auth_cache_size);
+    auth.stopping = false;
+    auth.workers_nr = conf->auth_workers;
+    if (auth.workers_nr == 0)
+        return;
+    auth.workers = try_alloc(auth.workers_nr * sizeof(pthread_t));
+    for (int i = 0; i < auth.workers_nr; ++i)
+        pthread_create(&auth.workers[i], NULL, auth_worker, NULL);
+}
+
+int auth_check(const struct io_event *e, const char *hash) {
+    unsigned char digest[AUTH_DIGEST_LEN];
+    auth_digest(e, hash, digest);
+    if (auth_cache_hit(&auth.cache, digest, time(NULL)) == true)
+        return AUTH_GRANTED;
+    if (auth.workers_nr == 0) {
+        const char *pass = (const char *) e->data.connect.payload.password;
+        if (check_passwd(pass, hash) == false)
+            return AUTH_DENIED;
+        auth_cache_put(&auth.cache, digest, time(NULL));
+        return AUTH_GRANTED;
+    }
+    struct auth_job *job = try_alloc(sizeof(*job));
+    job->io = *e;
+    job->hash = try_strdup(hash);
+    memcpy(job->digest, digest, AUTH_DIGEST_LEN);
+    job->next = NULL;
+    /*
+     * Out of the loop before a worker gets the job, it will be added back
+     * by the worker once done
+     */
+    ev_del_fd(e->client->ctx, e->client->conn.fd);
+    pthread_mutex_lock(&auth.lock);
+    if (auth.tail)
+        auth.tail->next = job;
+    else
+        auth.head = job;
+    auth.tail = job;
+    pthread_cond_signal(&auth.cond);
+    pthread_mutex_unlock(&auth.lock);
+    return AUTH_PENDING;
+}
+
+void auth_stop(void) {
+    pthread_mutex_lock(&auth.lock);
+    auth.stopping = true;
+    pthread_cond_broadcast(&auth.cond);
+    pthread_mutex_unlock(&auth.lock);
+}
+
+void auth_shutdown(void) {
+    auth_stop();
+    for (int i = 0; i < auth.workers_nr; ++i)
+        pthread_join(auth.workers[i], NULL);
+    while (auth.head) {
+        struct auth_job *job = auth.head;
+        auth.head = job->next;
+        auth_job_free(job, true);
+    }
+    auth.tail = NULL;
+    free_memory(auth.workers);
+    auth_cache_free(&auth.cache);
+    auth.workers = NULL;
+    auth.workers_nr = 0;
+}
@@ -0,0 +1,79 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AUTH_H
+#define AUTH_H
+
+#include <stdbool.h>
+
+struct io_event;
+
+/*
+ * Password checks of the CONNECT packets, with allow_anonymous false. Hashing
+ * a password with crypt is deliberately slow, a reconnection storm would stall
+ * the event loops behind it, so the checks are handed off to a pool of
+ * auth_workers threads.
+ *
+ * The loop receiving a CONNECT first looks up a digest of the credentials in
+ * a bounded cache of the ones recently verified, a reconnecting client found
+ * there is let in right away. Otherwise its descriptor is removed from the
+ * loop and the packet queued to the workers, once checked the descriptor is
+ * added back with a write event resuming the CONNECT on the loop, with the
+ * outcome set on the client. Failed checks are never cached.
+ *
+ * With auth_workers set to 0 passwords are checked on the loops, as before.
+ */
+
+/* Outcome of the password check of a client, see struct client */
+enum auth_state {
+    AUTH_UNCHECKED,
+    AUTH_GRANTED,
+    AUTH_DENIED,
+    AUTH_PENDING
+};
+
+/* Start the workers and allocate the cache, if passwords are required */
+void auth_init(void);
+
+/*
+ * Check the password of a CONNECT against the hash stored for its username,
+ * returns AUTH_PENDING if the check has been handed off to the workers, the
+ * packet is then owned by them till the CONNECT is resumed. Must be called
+ * from the loop serving the client.
+ */
+int auth_check(const struct io_event *, const char *);
+
+/*
+ * Stop resuming clients, called as the loops stop, the checks still queued
+ * are dropped
+ */
+void auth_stop(void);
+
+/* Join the workers and release the cache and the checks left */
+void auth_shutdown(void);
+
+#endif
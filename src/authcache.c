@@ -0,0 +1,80 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <openssl/crypto.h>
+#include "memory.h"
+#include "authcache.h"
+
+static inline struct auth_entry *auth_slot(const struct auth_cache *cache,
+                                           const unsigned char *digest) {
+    size_t idx;
+    memcpy(&idx, digest, sizeof(idx));
+    return &cache->entries[idx & cache->mask];
+}
+
+void auth_cache_init(struct auth_cache *cache, size_t size) {
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->entries = NULL;
+    cache->mask = 0;
+    if (size == 0)
+        return;
+    size_t slots = 1;
+    while (slots < size)
+        slots <<= 1;
+    cache->entries = try_calloc(slots, sizeof(*cache->entries));
+    cache->mask = slots - 1;
+}
+
+bool auth_cache_hit(struct auth_cache *cache,
+                    const unsigned char *digest, time_t now) {
+    if (!cache->entries)
+        return false;
+    pthread_mutex_lock(&cache->lock);
+    const struct auth_entry *e = auth_slot(cache, digest);
+    bool hit = e->expires > now
+        && CRYPTO_memcmp(e->digest, digest, AUTH_DIGEST_LEN) == 0;
+    pthread_mutex_unlock(&cache->lock);
+    return hit;
+}
+
+void auth_cache_put(struct auth_cache *cache,
+                    const unsigned char *digest, time_t now) {
+    if (!cache->entries)
+        return;
+    pthread_mutex_lock(&cache->lock);
+    struct auth_entry *e = auth_slot(cache, digest);
+    memcpy(e->digest, digest, AUTH_DIGEST_LEN);
+    e->expires = now + AUTH_CACHE_TTL;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void auth_cache_free(struct auth_cache *cache) {
+    free_memory(cache->entries);
+    cache->entries = NULL;
+    cache->mask = 0;
+}
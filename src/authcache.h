@@ -0,0 +1,66 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AUTHCACHE_H
+#define AUTHCACHE_H
+
+#include <time.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/*
+ * Bounded cache of the logins recently verified, keyed by a digest of the
+ * credentials. Direct mapped, a new entry replaces whatever is in its slot,
+ * and entries last AUTH_CACHE_TTL seconds. Thread safe.
+ */
+
+#define AUTH_DIGEST_LEN 32
+
+/* How long a verified login stays in the cache, in seconds */
+#define AUTH_CACHE_TTL  300
+
+struct auth_entry {
+    unsigned char digest[AUTH_DIGEST_LEN];
+    time_t expires;
+};
+
+struct auth_cache {
+    struct auth_entry *entries;
+    size_t mask;
+    pthread_mutex_t lock;
+};
+
+/* Size is rounded up to a power of 2, 0 disables the cache */
+void auth_cache_init(struct auth_cache *, size_t);
+
+bool auth_cache_hit(struct auth_cache *, const unsigned char *, time_t);
+
+void auth_cache_put(struct auth_cache *, const unsigned char *, time_t);
+
+void auth_cache_free(struct auth_cache *);
+
+#endif
@@ -0,0 +1,175 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "link.h"
+#include "config.h"
+#include "memory.h"
+#include "handlers.h"
+#include "bridge.h"
+#include "sol_internal.h"
+
+/* Enough for a prefix followed by a filter */
+#define BRIDGE_PATTERN_LEN  (0xFF * 2)
+
+bool bridge_enabled = false;
+
+/*
+ * A configured topic, the patterns are the filter prefixed by the local and
+ * remote prefix respectively, outbound rules match the local one, inbound
+ * rules the remote one
+ */
+struct bridge_rule {
+    bool in;
+    int qos;
+    char local[BRIDGE_PATTERN_LEN];
+    char remote[BRIDGE_PATTERN_LEN];
+    size_t local_plen;
+    size_t remote_plen;
+};
+
+static struct bridge_rule rules[BRIDGE_MAX_TOPICS];
+
+static int rules_nr = 0;
+
+static struct link bridge_link;
+
+/* Subscribe to all the inbound patterns on the remote broker */
+static void bridge_connected(struct link *l) {
+    for (int i = 0; i < rules_nr; ++i)
+        if (rules[i].in == true)
+            link_subscribe(l, rules[i].remote, rules[i].qos);
+}
+
+/*
+ * A message published on the remote broker, remap its topic with the first
+ * inbound rule matching it and publish it to the local subscribers
+ */
+static void bridge_receive(struct link *l, struct mqtt_packet *pkt) {
+    (void) l;
+    const struct bridge_rule *rule = NULL;
+    for (int i = 0; i < rules_nr && !rule; ++i)
+        if (rules[i].in == true
+            && pkt->publish.topiclen >= rules[i].remote_plen
+            && match_filter(rules[i].remote, (const char *) pkt->publish.topic,
+                            pkt->publish.topiclen))
+            rule = &rules[i];
+    if (!rule)
+        return;
+    size_t rest = pkt->publish.topiclen - rule->remote_plen;
+    size_t topiclen = rule->local_plen + rest;
+    if (topiclen == 0)
+        return;
+    u8 *topic = try_alloc(topiclen + 1);
+    memcpy(topic, conf->bridge_topics[rule - rules].local_prefix,
+           rule->local_plen);
+    memcpy(topic + rule->local_plen,
+           pkt->publish.topic + rule->remote_plen, rest + 1);
+    free_memory(pkt->publish.topic);
+    pkt->publish.topic = topic;
+    pkt->publish.topiclen = topiclen;
+    pkt->header.bits.dup = 0;
+    if (pkt->header.bits.qos > rule->qos)
+        pkt->header.bits.qos = rule->qos;
+    publish_external(pkt);
+}
+
+void bridge_init(void) {
+    for (int i = 0; i < conf->bridge_topics_nr; ++i) {
+        const struct bridge_topic *bt = &conf->bridge_topics[i];
+        struct bridge_rule *r = &rules[i];
+        r->in = bt->in;
+        r->qos = bt->qos;
+        r->local_plen = strlen(bt->local_prefix);
+        r->remote_plen = strlen(bt->remote_prefix);
+        snprintf(r->local, BRIDGE_PATTERN_LEN, "%s%s",
+                 bt->local_prefix, bt->filter);
+        snprintf(r->remote, BRIDGE_PATTERN_LEN, "%s%s",
+                 bt->remote_prefix, bt->filter);
+    }
+    rules_nr = conf->bridge_topics_nr;
+    bridge_link.name = "Bridge";
+    snprintf(bridge_link.address, sizeof(bridge_link.address), "%s",
+             conf->bridge_address);
+    snprintf(bridge_link.client_id, sizeof(bridge_link.client_id), "%.*s",
+             MQTT_CLIENT_ID_LEN - 1, conf->bridge_client_id);
+    bridge_link.username = conf->bridge_username;
+    bridge_link.password = conf->bridge_password;
+    bridge_link.keepalive = conf->bridge_keepalive;
+    bridge_link.buffer = conf->bridge_buffer;
+    bridge_link.on_connect = bridge_connected;
+    bridge_link.on_publish = bridge_receive;
+    link_init(&bridge_link);
+    bridge_enabled = true;
+}
+
+void bridge_start(struct ev_ctx *ctx) {
+    link_start(&bridge_link, ctx);
+}
+
+void bridge_forward(const struct mqtt_publish *p, unsigned qos, bool retain) {
+    const struct bridge_rule *rule = NULL;
+    for (int i = 0; i < rules_nr && !rule; ++i)
+        if (rules[i].in == false
+            && p->topiclen >= rules[i].local_plen
+            && match_filter(rules[i].local, (const char *) p->topic,
+                            p->topiclen))
+            rule = &rules[i];
+    if (!rule)
+        return;
+    // Remap the topic swapping the local prefix for the remote one
+    size_t rest = p->topiclen - rule->local_plen;
+    size_t topiclen = rule->remote_plen + rest;
+    if (topiclen == 0 || topiclen > 0xFFFF)
+        return;
+    char topic[topiclen];
+    memcpy(topic, conf->bridge_topics[rule - rules].remote_prefix,
+           rule->remote_plen);
+    memcpy(topic + rule->remote_plen, p->topic + rule->local_plen, rest);
+    if (qos > (unsigned) rule->qos)
+        qos = rule->qos;
+    struct mqtt_packet pkt = {
+        .header = { .byte = PUBLISH_B | (qos << 1) | (retain ? 1 : 0) },
+        .publish = {
+            .topiclen = topiclen,
+            .topic = (u8 *) topic,
+            .payloadlen = p->payloadlen,
+            .payload = p->payload
+        }
+    };
+    link_publish(&bridge_link, &pkt);
+}
+
+void bridge_get_stats(struct link_stats *stats) {
+    link_get_stats(&bridge_link, stats);
+}
+
+void bridge_shutdown(void) {
+    if (bridge_enabled == true)
+        link_shutdown(&bridge_link);
+}
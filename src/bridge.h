@@ -0,0 +1,72 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BRIDGE_H
+#define BRIDGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "mqtt.h"
+#include "link.h"
+
+struct ev_ctx;
+
+/*
+ * Broker to broker bridge, a link to another broker configured by the
+ * bridge_* options. Messages published by the local clients on a topic
+ * matching a bridge_out filter are forwarded to the remote broker, messages
+ * published on the remote broker matching a bridge_in filter are published
+ * locally, both directions can remap the topic swapping a prefix for another.
+ * See link.h for how messages are batched, acknowledged and buffered.
+ *
+ * Messages coming in from the bridge are never forwarded back out.
+ */
+
+/* Set once on startup, never changed while the loops are running */
+extern bool bridge_enabled;
+
+/*
+ * Setup the bridge as configured, must be called before starting the event
+ * loops, messages forwarded are buffered till bridge_start is called
+ */
+void bridge_init(void);
+
+/* Start connecting to the remote broker, from the loop running the cron jobs */
+void bridge_start(struct ev_ctx *);
+
+/*
+ * Forward a message published by a local client, if its topic matches an
+ * outbound filter. Can be called from any loop.
+ */
+void bridge_forward(const struct mqtt_publish *, unsigned, bool);
+
+void bridge_get_stats(struct link_stats *);
+
+/* Close the connection and free all the pending messages */
+void bridge_shutdown(void);
+
+#endif
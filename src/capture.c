@@ -0,0 +1,336 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "pack.h"
+#include "util.h"
+#include "memory.h"
+#include "logging.h"
+#include "capture.h"
+
+/* Length of the windows the rate is bounded on */
+#define CAPTURE_WINDOW_NS   1000000000ULL
+
+/* Size of the stdio buffer of the file, flushed after every drain */
+#define CAPTURE_BUFSIZE     (64 * 1024)
+
+/* Bytes of each per-thread ring, must be a power of 2 */
+#define CAPTURE_RING_SIZE   (1024 * 1024)
+
+/* Sleep time of the writer thread when there's nothing to write out */
+#define CAPTURE_WRITER_IDLE_NS 5000000
+
+/* Descriptors tracked for dropped packets if the limit can't be read */
+#define CAPTURE_FDS         65536
+
+bool capture_enabled = false;
+
+/*
+ * Single producer single consumer byte ring, every thread capturing owns one
+ * and appends its records to it encoded as they'll land in the file, the
+ * writer thread is the only consumer. Positions grow indefinitely and are
+ * masked to index the bytes. A packet not fitting is dropped as if over the
+ * rate bound, OPEN and CLOSE records wait for room instead.
+ */
+struct capture_ring {
+    atomic_size_t head; /* Next byte to read, consumer owned */
+    /*
+     * Keep head and tail on different cache lines, plain padding as the
+     * allocator gives no alignment guarantee beyond max_align_t
+     */
+    char pad[64 - sizeof(atomic_size_t)];
+    atomic_size_t tail; /* Next byte to write, producer owned */
+    struct capture_ring *next;
+    unsigned char data[CAPTURE_RING_SIZE];
+};
+
+static FILE *capture_fp = NULL;
+
+static char *capture_buf = NULL;
+
+/* Reference time of the records, timestamps are relative to it */
+static uint64_t capture_epoch = 0;
+
+/* Bytes of packets allowed per window, 0 means no bound */
+static size_t capture_rate = 0;
+
+/* Start of the current window and bytes captured in it, by all the threads */
+static atomic_ullong window_start = ATOMIC_VAR_INIT(0);
+static atomic_size_t window_bytes = ATOMIC_VAR_INIT(0);
+
+/*
+ * Connections that had a packet dropped, indexed by descriptor, sized on the
+ * limit of descriptors on startup
+ */
+static atomic_bool *truncated = NULL;
+static size_t truncated_len = 0;
+
+static atomic_size_t dropped = ATOMIC_VAR_INIT(0);
+
+/* Ring of the calling thread, lazily allocated on the first record */
+static _Thread_local struct capture_ring *ring = NULL;
+
+/* All the rings allocated, new ones are pushed on the head */
+static _Atomic(struct capture_ring *) rings = NULL;
+
+/* Set while the writer thread is running */
+static atomic_bool running = ATOMIC_VAR_INIT(false);
+
+static pthread_t writer;
+
+static struct capture_ring *capture_ring_new(void) {
+    struct capture_ring *r = try_calloc(1, sizeof(*r));
+    r->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+        ;
+    return r;
+}
+
+static void ring_copy_in(struct capture_ring *r, size_t pos,
+                         const unsigned char *buf, size_t len) {
+    size_t off = pos & (CAPTURE_RING_SIZE - 1);
+    size_t first = len < CAPTURE_RING_SIZE - off ? len : CAPTURE_RING_SIZE - off;
+    memcpy(r->data + off, buf, first);
+    memcpy(r->data, buf + first, len - first);
+}
+
+static void ring_copy_out(const struct capture_ring *r, size_t pos,
+                          unsigned char *buf, size_t len) {
+    size_t off = pos & (CAPTURE_RING_SIZE - 1);
+    size_t first = len < CAPTURE_RING_SIZE - off ? len : CAPTURE_RING_SIZE - off;
+    memcpy(buf, r->data + off, first);
+    memcpy(buf + first, r->data, len - first);
+}
+
+/*
+ * Append a record to the ring of the calling thread, with the packet bytes
+ * for a CAPTURE_FRAME one, returns false if there's no room for it
+ */
+static bool capture_push(enum capture_record type, int fd, uint64_t now,
+                         const unsigned char *buf, size_t len) {
+    if (!ring)
+        ring = capture_ring_new();
+    unsigned char rec[CAPTURE_RECORD_LEN + sizeof(uint32_t)];
+    size_t rec_len = CAPTURE_RECORD_LEN;
+    rec[0] = type;
+    packi32(rec + 1, fd);
+    packi64(rec + 5, now - capture_epoch);
+    if (type == CAPTURE_FRAME) {
+        packi32(rec + CAPTURE_RECORD_LEN, len);
+        rec_len += sizeof(uint32_t);
+    }
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (CAPTURE_RING_SIZE - (tail - head) < rec_len + len)
+        return false;
+    ring_copy_in(ring, tail, rec, rec_len);
+    ring_copy_in(ring, tail + rec_len, buf, len);
+    atomic_store_explicit(&ring->tail, tail + rec_len + len,
+                          memory_order_release);
+    return true;
+}
+
+/* OPEN and CLOSE records can't be dropped, wait for the writer to make room */
+static void capture_push_wait(enum capture_record type, int fd, uint64_t now) {
+    while (capture_push(type, fd, now, NULL, 0) == false)
+        sched_yield();
+}
+
+/*
+ * Write out the records of every ring stamped before until, merged by
+ * timestamp. A record stamped before until is pushed before any other record
+ * it happened before is stamped, e.g. a CLOSE before the OPEN of the same
+ * descriptor reused, so records land in the file in an order consistent
+ * with the one they were seen in. Runs on the writer thread only, or after
+ * it's been stopped. Returns the number of records written.
+ */
+static size_t capture_drain(uint64_t until) {
+    size_t drained = 0;
+    unsigned char rec[CAPTURE_RECORD_LEN + sizeof(uint32_t)];
+    for (;;) {
+        struct capture_ring *next = NULL;
+        uint64_t next_ts = until;
+        for (struct capture_ring *r = atomic_load(&rings); r; r = r->next) {
+            size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+            size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+            if (head == tail)
+                continue;
+            ring_copy_out(r, head, rec, CAPTURE_RECORD_LEN);
+            uint64_t ts = unpacku64(rec + 5);
+            if (ts < next_ts) {
+                next_ts = ts;
+                next = r;
+            }
+        }
+        if (!next)
+            break;
+        size_t head = atomic_load_explicit(&next->head, memory_order_relaxed);
+        size_t len = CAPTURE_RECORD_LEN;
+        ring_copy_out(next, head, rec, CAPTURE_RECORD_LEN);
+        if (rec[0] == CAPTURE_FRAME) {
+            ring_copy_out(next, head + CAPTURE_RECORD_LEN,
+                          rec + CAPTURE_RECORD_LEN, sizeof(uint32_t));
+            len += sizeof(uint32_t) + unpacku32(rec + CAPTURE_RECORD_LEN);
+        }
+        size_t off = head & (CAPTURE_RING_SIZE - 1);
+        size_t first = len < CAPTURE_RING_SIZE - off ? len : CAPTURE_RING_SIZE - off;
+        fwrite(next->data + off, first, 1, capture_fp);
+        if (len > first)
+            fwrite(next->data, len - first, 1, capture_fp);
+        atomic_store_explicit(&next->head, head + len, memory_order_release);
+        drained++;
+    }
+    if (drained > 0)
+        fflush(capture_fp);
+    return drained;
+}
+
+static void *capture_writer(void *arg) {
+    (void) arg;
+    struct timespec idle = { 0, CAPTURE_WRITER_IDLE_NS };
+    while (atomic_load(&running) == true) {
+        if (capture_drain(monotonic_ns() - capture_epoch) == 0)
+            nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+/* Mark a connection as missing packets, or clear it on a new connection */
+static void capture_truncate(int fd, bool value) {
+    if (fd >= 0 && (size_t) fd < truncated_len)
+        atomic_store_explicit(&truncated[fd], value, memory_order_relaxed);
+}
+
+/*
+ * Check the bound on the rate, the window is moved forward by the first
+ * thread finding it passed
+ */
+static bool capture_admit(int fd, size_t len, uint64_t now) {
+    if (fd >= 0 && (size_t) fd < truncated_len
+        && atomic_load_explicit(&truncated[fd], memory_order_relaxed) == true)
+        return false;
+    if (capture_rate == 0)
+        return true;
+    unsigned long long start =
+        atomic_load_explicit(&window_start, memory_order_relaxed);
+    if (now > start && now - start >= CAPTURE_WINDOW_NS
+        && atomic_compare_exchange_strong(&window_start, &start, now))
+        atomic_store_explicit(&window_bytes, 0, memory_order_relaxed);
+    size_t used = atomic_fetch_add_explicit(&window_bytes, len,
+                                            memory_order_relaxed);
+    return used + len <= capture_rate;
+}
+
+int capture_init(const char *path, size_t rate) {
+    capture_fp = fopen(path, "w");
+    if (!capture_fp) {
+        log_error("Unable to open capture file %s", path);
+        return -1;
+    }
+    capture_buf = try_alloc(CAPTURE_BUFSIZE);
+    setvbuf(capture_fp, capture_buf, _IOFBF, CAPTURE_BUFSIZE);
+    unsigned char header[CAPTURE_HEADER_LEN];
+    memcpy(header, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+    packi16(header + CAPTURE_MAGIC_LEN, CAPTURE_VERSION);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    packi64(header + CAPTURE_MAGIC_LEN + sizeof(uint16_t),
+            (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+    fwrite(header, CAPTURE_HEADER_LEN, 1, capture_fp);
+    long fds = get_fh_soft_limit();
+    truncated_len = fds > 0 ? (size_t) fds : CAPTURE_FDS;
+    truncated = try_calloc(truncated_len, sizeof(*truncated));
+    capture_rate = rate;
+    capture_epoch = monotonic_ns();
+    atomic_store(&window_start, capture_epoch);
+    atomic_store(&running, true);
+    if (pthread_create(&writer, NULL, capture_writer, NULL) != 0) {
+        log_error("Unable to start the capture writer");
+        atomic_store(&running, false);
+        fclose(capture_fp);
+        free_memory(capture_buf);
+        free_memory(truncated);
+        capture_fp = NULL;
+        capture_buf = NULL;
+        truncated = NULL;
+        truncated_len = 0;
+        return -1;
+    }
+    capture_enabled = true;
+    return 0;
+}
+
+void capture_open(int fd) {
+    uint64_t now = monotonic_ns();
+    capture_truncate(fd, false);
+    capture_push_wait(CAPTURE_OPEN, fd, now);
+}
+
+void capture_frame(int fd, const unsigned char *buf, size_t len) {
+    uint64_t now = monotonic_ns();
+    if (capture_admit(fd, len, now) == false
+        || capture_push(CAPTURE_FRAME, fd, now, buf, len) == false) {
+        capture_truncate(fd, true);
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    }
+}
+
+void capture_close(int fd) {
+    capture_push_wait(CAPTURE_CLOSE, fd, monotonic_ns());
+}
+
+void capture_shutdown(void) {
+    if (capture_enabled == false)
+        return;
+    capture_enabled = false;
+    if (atomic_exchange(&running, false) == true)
+        pthread_join(writer, NULL);
+    capture_drain(UINT64_MAX);
+    fclose(capture_fp);
+    struct capture_ring *r = atomic_exchange(&rings, NULL);
+    while (r) {
+        struct capture_ring *next = r->next;
+        free_memory(r);
+        r = next;
+    }
+    ring = NULL;
+    free_memory(capture_buf);
+    free_memory(truncated);
+    capture_fp = NULL;
+    capture_buf = NULL;
+    truncated = NULL;
+    truncated_len = 0;
+    size_t n = atomic_load(&dropped);
+    if (n > 0)
+        log_warning("Capture: %lu packets dropped over the rate bound or "
+                    "with the buffers full", n);
+}
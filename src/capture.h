@@ -0,0 +1,92 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Opt-in capture of the inbound traffic, meant to reproduce offline the
+ * performance problems seen in production, see sol_replay. Every complete
+ * MQTT packet read from a client is appended to a binary capture file,
+ * together with the connection it came from and a monotonic timestamp;
+ * connections opening and closing are recorded as well, so replaying the
+ * file can rebuild the same set of connections.
+ *
+ * File layout, integers are in network byte order:
+ *
+ *   header: "SOLCAP" | version (u16) | wall clock of the start in ns (u64)
+ *   record: type (u8) | connection (u32) | ns since the start (u64)
+ *           followed, for CAPTURE_FRAME records only, by the length of the
+ *           packet (u32) and the packet bytes
+ *
+ * Connections are identified by their descriptor, which the kernel may reuse
+ * once closed, a connection is unique between its OPEN and CLOSE records.
+ *
+ * Records are buffered per thread and written out by a background thread,
+ * the loops never touch the file. Captured bytes are bounded per second,
+ * packets exceeding the bound, or not fitting the buffer of their thread,
+ * are dropped, together with all the following packets of the same
+ * connection, as a connection missing packets in the middle would not be
+ * replayable.
+ */
+
+#define CAPTURE_MAGIC       "SOLCAP"
+#define CAPTURE_MAGIC_LEN   6
+#define CAPTURE_VERSION     1
+#define CAPTURE_HEADER_LEN  (CAPTURE_MAGIC_LEN + sizeof(uint16_t) + sizeof(uint64_t))
+#define CAPTURE_RECORD_LEN  (sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint64_t))
+
+enum capture_record { CAPTURE_OPEN, CAPTURE_FRAME, CAPTURE_CLOSE };
+
+/* Set once on startup, never changed while the loops are running */
+extern bool capture_enabled;
+
+/*
+ * Start capturing to the file at path, truncating it, at most rate bytes of
+ * packets per second, 0 means no bound. Must be called before starting the
+ * event loops, returns -1 if the file can't be opened or the writer thread
+ * started.
+ */
+int capture_init(const char *, size_t);
+
+/* Record a new connection */
+void capture_open(int);
+
+/* Record a complete packet read from a connection */
+void capture_frame(int, const unsigned char *, size_t);
+
+/* Record a connection closing, must be called before closing its descriptor */
+void capture_close(int);
+
+/* Stop the writer thread, flush the pending records and close the file */
+void capture_shutdown(void);
+
+#endif
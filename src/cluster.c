@@ -0,0 +1,554 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <openssl/crypto.h>
+#include "ev.h"
+#include "config.h"
+#include "server.h"
+#include "memory.h"
+#include "logging.h"
+#include "handlers.h"
+#include "trace.h"
+#include "cluster.h"
+#include "sol_internal.h"
+
+#define CLUSTER_PREFIX          "$CLUSTER/"
+#define CLUSTER_INTEREST        CLUSTER_PREFIX "interest"
+#define CLUSTER_INTEREST_ADD    CLUSTER_PREFIX "interest/add"
+#define CLUSTER_TAKEOVER        CLUSTER_PREFIX "takeover"
+#define CLUSTER_SESSION         CLUSTER_PREFIX "session"
+
+/*
+ * Keepalive of the links between the nodes, short enough to notice a node
+ * gone in a matter of seconds
+ */
+#define CLUSTER_KEEPALIVE       10
+
+/*
+ * Past this size the summary of the interest of a node is collapsed into a
+ * single '#', the other nodes will forward everything to it
+ */
+#define CLUSTER_SUMMARY_MAX     (32 * 1024)
+
+bool cluster_enabled = false;
+
+/* A filter of an interest summary, UTHASH keyed by the filter itself */
+struct cluster_filter {
+    char *filter;
+    UT_hash_handle hh;
+};
+
+/*
+ * Another node of the cluster, the link to it and what its clients are
+ * subscribed to: exact topics are looked up by hash, filters with wildcards
+ * are matched one by one, a '#' subscription matches everything
+ */
+struct cluster_peer {
+    struct link link;
+    pthread_mutex_t lock;
+    bool everything;
+    struct cluster_filter *exact;
+    struct cluster_filter *wildcards;
+};
+
+/* A growing buffer of newline separated lines */
+struct cluster_buf {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+static struct cluster_peer peers[CLUSTER_MAX_PEERS];
+
+static int peers_nr = 0;
+
+/* Local subscriptions changed, the summary must be sent again */
+static atomic_bool dirty = false;
+
+static inline bool is_control(const char *topic, size_t len) {
+    return len >= sizeof(CLUSTER_PREFIX) - 1
+        && strncmp(topic, CLUSTER_PREFIX, sizeof(CLUSTER_PREFIX) - 1) == 0;
+}
+
+static inline bool is_topic(const struct mqtt_publish *p, const char *topic) {
+    return p->topiclen == strlen(topic)
+        && strncmp((const char *) p->topic, topic, p->topiclen) == 0;
+}
+
+static void buf_append(struct cluster_buf *b, const char *s, size_t len) {
+    if (b->len + len + 1 > b->size) {
+        b->size = (b->len + len + 1) * 2;
+        b->data = try_realloc(b->data, b->size);
+    }
+    memcpy(b->data + b->len, s, len);
+    b->len += len;
+    b->data[b->len++] = '\n';
+}
+
+/* Add a filter to a set, returns false if it was already there */
+static bool filter_add(struct cluster_filter **set, const char *f, size_t len) {
+    struct cluster_filter *cf = NULL;
+    HASH_FIND(hh, *set, f, len, cf);
+    if (cf)
+        return false;
+    cf = try_alloc(sizeof(*cf));
+    cf->filter = try_alloc(len + 1);
+    memcpy(cf->filter, f, len);
+    cf->filter[len] = '\0';
+    HASH_ADD_KEYPTR(hh, *set, cf->filter, len, cf);
+    return true;
+}
+
+static bool filter_covered(struct cluster_filter *set, const char *topic,
+                           size_t len) {
+    struct cluster_filter *cf, *tmp;
+    HASH_ITER(hh, set, cf, tmp)
+        if (match_filter(cf->filter, topic, len))
+            return true;
+    return false;
+}
+
+static void filter_clear(struct cluster_filter **set) {
+    struct cluster_filter *cf, *tmp;
+    HASH_ITER(hh, *set, cf, tmp) {
+        HASH_DEL(*set, cf);
+        free_memory(cf->filter);
+        free_memory(cf);
+    }
+}
+
+/*
+ * Publish a message to the local subscribers, that is, through the links the
+ * other nodes keep with this one
+ */
+static void cluster_publish(const char *topic, const char *payload,
+                            size_t len, bool retain) {
+    struct mqtt_packet *pkt =
+        mqtt_packet_alloc(PUBLISH_B | (AT_LEAST_ONCE << 1) | (retain ? 1 : 0));
+    pkt->publish.topiclen = strlen(topic);
+    pkt->publish.topic = (u8 *) try_strdup(topic);
+    pkt->publish.payloadlen = len;
+    pkt->publish.payload = try_alloc(len + 1);
+    memcpy(pkt->publish.payload, payload, len);
+    pkt->publish.payload[len] = '\0';
+    publish_external(pkt);
+}
+
+/*
+ * Interest summaries
+ */
+
+struct summary {
+    struct cluster_filter *wildcards;
+    struct cluster_buf buf;
+};
+
+static void summary_topic(struct trie_node *node, void *arg) {
+    struct summary *s = arg;
+    const struct topic *t = node->data;
+    if (!t || HASH_COUNT(t->subscribers) == 0)
+        return;
+    // Topic names end with a '/'
+    size_t len = strlen(t->name) - 1;
+    if (len == 0 || is_control(t->name, len)
+        || filter_covered(s->wildcards, t->name, len))
+        return;
+    buf_append(&s->buf, t->name, len);
+}
+
+/*
+ * Write the filters all the local clients are subscribed to, one per line:
+ * the wildcard subscriptions first, then the topics with subscribers not
+ * already covered by them. Must be called with the global lock held.
+ */
+static void summary_build(struct summary *s) {
+    topic_store_wildcards_foreach(item, server.store) {
+        const struct subscription *sub = item->data;
+        size_t len = strlen(sub->topic);
+        char filter[len + 1];
+        // Wildcards are stored as normalized topics, ending with a '/'
+        memcpy(filter, sub->topic, len);
+        if (sub->multilevel == true)
+            filter[len++] = '#';
+        else
+            len--;
+        if (len > 0 && filter_add(&s->wildcards, filter, len))
+            buf_append(&s->buf, filter, len);
+    }
+    topic_store_map(server.store, NULL, summary_topic, s);
+}
+
+static void summary_publish(void) {
+    struct summary s = { .wildcards = NULL, .buf = { NULL, 0, 0 } };
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    summary_build(&s);
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    filter_clear(&s.wildcards);
+    if (s.buf.len > CLUSTER_SUMMARY_MAX) {
+        s.buf.len = 0;
+        buf_append(&s.buf, "#", 1);
+    }
+    log_debug("Cluster interest summary (%lu bytes)", s.buf.len);
+    cluster_publish(CLUSTER_INTEREST, s.buf.data ? s.buf.data : "",
+                    s.buf.len, true);
+    free_memory(s.buf.data);
+}
+
+static void cluster_cron(struct ev_ctx *ctx, void *arg) {
+    (void) ctx;
+    (void) arg;
+    if (atomic_exchange(&dirty, false) == true)
+        summary_publish();
+}
+
+/* Must be called with the lock of the peer held */
+static void peer_interest_add(struct cluster_peer *peer,
+                              const char *lines, size_t len) {
+    const char *end = lines + len;
+    while (lines < end) {
+        const char *nl = memchr(lines, '\n', end - lines);
+        size_t flen = (nl ? nl : end) - lines;
+        if (flen == 1 && lines[0] == '#')
+            peer->everything = true;
+        else if (flen > 0 && (memchr(lines, '+', flen)
+                              || memchr(lines, '#', flen)))
+            filter_add(&peer->wildcards, lines, flen);
+        else if (flen > 0)
+            filter_add(&peer->exact, lines, flen);
+        lines += flen + 1;
+    }
+}
+
+static void peer_interest_clear(struct cluster_peer *peer) {
+    filter_clear(&peer->exact);
+    filter_clear(&peer->wildcards);
+    peer->everything = false;
+}
+
+static bool peer_interested(struct cluster_peer *peer,
+                            const char *topic, size_t len) {
+    struct cluster_filter *cf = NULL;
+    pthread_mutex_lock(&peer->lock);
+    bool interested = peer->everything;
+    if (interested == false) {
+        size_t klen = len > 1 && topic[len - 1] == '/' ? len - 1 : len;
+        HASH_FIND(hh, peer->exact, topic, klen, cf);
+        interested = cf || filter_covered(peer->wildcards, topic, len);
+    }
+    pthread_mutex_unlock(&peer->lock);
+    return interested;
+}
+
+/*
+ * Session takeover
+ */
+
+/*
+ * Write the subscriptions of a session to be restored on another node, the
+ * client ID first, then a "qos filter" line for each one. Must be called with
+ * the global lock held.
+ */
+static void session_dump(const struct client_session *session,
+                         struct cluster_buf *b) {
+    struct cluster_filter *seen = NULL;
+    char line[0xFFFF + 3];
+    buf_append(b, session->session_id, strlen(session->session_id));
+    topic_store_wildcards_foreach(item, server.store) {
+        const struct subscription *sub = item->data;
+        if (sub->subscriber->session != session)
+            continue;
+        int n = snprintf(line, sizeof(line), "%u %s%s",
+                         sub->subscriber->granted_qos, sub->topic,
+                         sub->multilevel == true ? "#" : "");
+        // Single level wildcards are stored with the trailing '/'
+        if (sub->multilevel == false)
+            n--;
+        if (filter_add(&seen, line + 2, n - 2))
+            buf_append(b, line, n);
+    }
+    list_foreach(item, session->subscriptions) {
+        const struct topic *t = item->data;
+        size_t len = strlen(t->name) - 1;
+        struct subscriber *sub = NULL;
+        HASH_FIND_STR(t->subscribers, session->session_id, sub);
+        if (!sub || len == 0 || filter_covered(seen, t->name, len))
+            continue;
+        int n = snprintf(line, sizeof(line), "%u %.*s",
+                         sub->granted_qos, (int) len, t->name);
+        filter_add(&seen, line + 2, n - 2);
+        buf_append(b, line, n);
+    }
+    filter_clear(&seen);
+}
+
+/*
+ * A client connected to another node, disconnect it here and if it has a
+ * persistent session send its subscriptions over to that node, the session
+ * is then dropped here
+ */
+static void takeover(struct cluster_peer *peer, const char *id, size_t len) {
+    if (len == 0 || len >= MQTT_CLIENT_ID_LEN)
+        return;
+    char client_id[MQTT_CLIENT_ID_LEN];
+    snprintf(client_id, sizeof(client_id), "%.*s", (int) len, id);
+    struct cluster_buf b = { NULL, 0, 0 };
+    struct client_session *session = NULL;
+    struct client *c = NULL;
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    HASH_FIND_STR(server.sessions, client_id, session);
+    if (!session)
+        goto exit;
+    if (session->clean_session == false)
+        session_dump(session, &b);
+    // Marked clean, the session is dropped as soon as the client is gone
+    session->clean_session = true;
+    log_info("%s taken over by %s", client_id, peer->link.address);
+    HASH_FIND_STR(server.clients_map, client_id, c);
+    if (c && c->online == true && c->session == session)
+        shutdown(c->conn.fd, SHUT_RDWR);
+    else
+        session_drop(session);
+
+exit:
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    if (b.len > 0) {
+        struct mqtt_packet pkt = {
+            .header = { .byte = PUBLISH_B | (AT_LEAST_ONCE << 1) },
+            .publish = {
+                .topiclen = sizeof(CLUSTER_SESSION) - 1,
+                .topic = (u8 *) CLUSTER_SESSION,
+                .payloadlen = b.len,
+                .payload = (u8 *) b.data
+            }
+        };
+        link_publish(&peer->link, &pkt);
+        free_memory(b.data);
+    }
+    if (session)
+        atomic_store(&dirty, true);
+}
+
+/*
+ * Link callbacks
+ */
+
+static void peer_connected(struct link *l) {
+    struct cluster_peer *peer = l->data;
+    // The retained summary of the node is sent again on subscription
+    pthread_mutex_lock(&peer->lock);
+    peer_interest_clear(peer);
+    pthread_mutex_unlock(&peer->lock);
+    link_subscribe(l, CLUSTER_INTEREST, AT_LEAST_ONCE);
+    link_subscribe(l, CLUSTER_INTEREST_ADD, AT_LEAST_ONCE);
+    link_subscribe(l, CLUSTER_TAKEOVER, AT_LEAST_ONCE);
+}
+
+static void peer_receive(struct link *l, struct mqtt_packet *pkt) {
+    struct cluster_peer *peer = l->data;
+    const struct mqtt_publish *p = &pkt->publish;
+    if (is_topic(p, CLUSTER_INTEREST) || is_topic(p, CLUSTER_INTEREST_ADD)) {
+        pthread_mutex_lock(&peer->lock);
+        if (is_topic(p, CLUSTER_INTEREST))
+            peer_interest_clear(peer);
+        peer_interest_add(peer, (const char *) p->payload, p->payloadlen);
+        pthread_mutex_unlock(&peer->lock);
+    } else if (is_topic(p, CLUSTER_TAKEOVER)) {
+        takeover(peer, (const char *) p->payload, p->payloadlen);
+    }
+}
+
+void cluster_init(void) {
+    for (int i = 0; i < conf->cluster_peers_nr; ++i) {
+        struct cluster_peer *peer = &peers[i];
+        struct link *l = &peer->link;
+        l->name = "Cluster link";
+        snprintf(l->address, sizeof(l->address), "%s", conf->cluster_peers[i]);
+        snprintf(l->client_id, sizeof(l->client_id), "%s%.*s",
+                 CLUSTER_ID_PREFIX,
+                 (int) (MQTT_CLIENT_ID_LEN - sizeof(CLUSTER_ID_PREFIX)),
+                 conf->cluster_node_id);
+        l->username = conf->cluster_username;
+        l->password = conf->cluster_password;
+        l->keepalive = CLUSTER_KEEPALIVE;
+        l->buffer = conf->cluster_buffer;
+        l->on_connect = peer_connected;
+        l->on_publish = peer_receive;
+        l->data = peer;
+        link_init(l);
+        pthread_mutex_init(&peer->lock, NULL);
+        peer->everything = false;
+        peer->exact = peer->wildcards = NULL;
+    }
+    peers_nr = conf->cluster_peers_nr;
+    if (conf->cluster_username[0] == '\0' || conf->cluster_password[0] == '\0')
+        log_warning("cluster_username or cluster_password not set, the other "
+                    "nodes will be refused");
+    // The other nodes may hold a summary from a previous run
+    atomic_store(&dirty, true);
+    cluster_enabled = true;
+}
+
+void cluster_start(struct ev_ctx *ctx) {
+    for (int i = 0; i < peers_nr; ++i)
+        link_start(&peers[i].link, ctx);
+    ev_register_cron(ctx, cluster_cron, NULL, 1, 0);
+}
+
+bool cluster_is_peer(const char *client_id) {
+    return strncmp(client_id, CLUSTER_ID_PREFIX,
+                   sizeof(CLUSTER_ID_PREFIX) - 1) == 0;
+}
+
+bool cluster_is_control(const char *topic, size_t len) {
+    return is_control(topic, len);
+}
+
+/* Compare a credential sent by a client to the configured one in fixed time */
+static bool credential_equal(const u8 *sent, const char *expected) {
+    size_t len = strlen(expected);
+    return strlen((const char *) sent) == len
+        && CRYPTO_memcmp(sent, expected, len) == 0;
+}
+
+bool cluster_authenticate(const struct mqtt_connect *c) {
+    if (cluster_enabled == false || conf->cluster_username[0] == '\0'
+        || conf->cluster_password[0] == '\0')
+        return false;
+    if (c->bits.username == 0 || c->bits.password == 0)
+        return false;
+    // Both compared anyway, not to tell which one is wrong by the timing
+    bool username = credential_equal(c->payload.username, conf->cluster_username);
+    bool password = credential_equal(c->payload.password, conf->cluster_password);
+    return username && password;
+}
+
+void cluster_forward(const struct mqtt_publish *p, unsigned qos, bool retain) {
+    const char *topic = (const char *) p->topic;
+    if (p->topiclen == 0 || is_control(topic, p->topiclen))
+        return;
+    struct mqtt_packet pkt = {
+        .header = { .byte = PUBLISH_B | (qos << 1) | (retain ? 1 : 0) },
+        .publish = {
+            .topiclen = p->topiclen,
+            .topic = p->topic,
+            .payloadlen = p->payloadlen,
+            .payload = p->payload
+        }
+    };
+    for (int i = 0; i < peers_nr; ++i)
+        if (peer_interested(&peers[i], topic, p->topiclen))
+            link_publish(&peers[i].link, &pkt);
+}
+
+void cluster_subscribed(const char *filter, size_t len) {
+    if (len == 0 || is_control(filter, len))
+        return;
+    cluster_publish(CLUSTER_INTEREST_ADD, filter, len, false);
+    /*
+     * A summary built before the subscription may be still on its way, the
+     * next one will include it
+     */
+    atomic_store(&dirty, true);
+}
+
+void cluster_interest_changed(void) {
+    atomic_store(&dirty, true);
+}
+
+void cluster_connected(const char *client_id) {
+    cluster_publish(CLUSTER_TAKEOVER, client_id, strlen(client_id), false);
+}
+
+bool cluster_control(const struct mqtt_publish *p, bool from_peer) {
+    if (!is_control((const char *) p->topic, p->topiclen))
+        return false;
+    // Only the nodes, authenticated on CONNECT, can restore a session here
+    if (from_peer == false || !is_topic(p, CLUSTER_SESSION))
+        return true;
+    const char *data = (const char *) p->payload;
+    const char *end = data + p->payloadlen;
+    const char *nl = memchr(data, '\n', p->payloadlen);
+    if (!nl || nl - data >= MQTT_CLIENT_ID_LEN)
+        return true;
+    char client_id[MQTT_CLIENT_ID_LEN];
+    snprintf(client_id, sizeof(client_id), "%.*s", (int) (nl - data), data);
+    struct cluster_buf added = { NULL, 0, 0 };
+    struct client_session *session = NULL;
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    HASH_FIND_STR(server.sessions, client_id, session);
+    // Restore the subscriptions only on a persistent session
+    for (data = nl + 1; session && session->clean_session == false
+         && data < end; data = nl + 1) {
+        nl = memchr(data, '\n', end - data);
+        if (!nl)
+            nl = end;
+        if (nl - data < 3 || data[1] != ' ' || data[0] < '0' || data[0] > '2')
+            continue;
+        session_subscribe(session, data + 2, nl - data - 2, data[0] - '0');
+        buf_append(&added, data + 2, nl - data - 2);
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    if (added.len > 0) {
+        log_info("Restored the session of %s from another node", client_id);
+        // Drop the last newline
+        cluster_subscribed(added.data, added.len - 1);
+    }
+    free_memory(added.data);
+    return true;
+}
+
+int cluster_get_stats(struct link_stats *stats) {
+    for (int i = 0; i < peers_nr; ++i)
+        link_get_stats(&peers[i].link, &stats[i]);
+    return peers_nr;
+}
+
+void cluster_shutdown(void) {
+    if (cluster_enabled == false)
+        return;
+    for (int i = 0; i < peers_nr; ++i) {
+        link_shutdown(&peers[i].link);
+        peer_interest_clear(&peers[i]);
+        pthread_mutex_destroy(&peers[i].lock);
+    }
+}
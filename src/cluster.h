@@ -0,0 +1,120 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "mqtt.h"
+#include "link.h"
+
+struct ev_ctx;
+
+/*
+ * Cluster mode, a full mesh of Sol nodes, each one configured with the
+ * addresses of all the others in cluster_peers. Every node keeps a link to
+ * each other node, connecting as a client with a reserved client ID, through
+ * which:
+ *
+ * - it learns the interest of the node, a compact summary of the filters its
+ *   clients are subscribed to, published by the node as a retained message
+ *   on $CLUSTER/interest, one filter per line, and refreshed on changes;
+ *   new subscriptions are sent right away on $CLUSTER/interest/add, the
+ *   subscriptions gone are dropped with the next summary
+ * - it forwards the messages published by its own clients, only to the
+ *   nodes with subscribers matching them, pipelined by the link; nodes never
+ *   forward messages received from other nodes
+ * - it learns about the clients connecting to the node from
+ *   $CLUSTER/takeover, disconnecting them locally, and sends back the
+ *   subscriptions of their persistent session on $CLUSTER/session, moving
+ *   the session to the node
+ */
+
+/* Set once on startup, never changed while the loops are running */
+extern bool cluster_enabled;
+
+/* Prefix of the client IDs the nodes connect to each other with */
+#define CLUSTER_ID_PREFIX   "$cluster:"
+
+/*
+ * Setup the links to the other nodes, must be called before starting the
+ * event loops
+ */
+void cluster_init(void);
+
+/* Start connecting to the other nodes, from the loop running the cron jobs */
+void cluster_start(struct ev_ctx *);
+
+/* Check if a client ID is in the range reserved to the nodes of the cluster */
+bool cluster_is_peer(const char *);
+
+/*
+ * Check if a topic, len bytes long, is one of the reserved ones the nodes
+ * talk to each other on, only them can subscribe to it
+ */
+bool cluster_is_control(const char *, size_t);
+
+/*
+ * Check the credentials of a CONNECT with a reserved client ID, it's granted
+ * only with cluster_username and cluster_password both set and matching.
+ * Clients can't pose as other nodes by their client ID alone.
+ */
+bool cluster_authenticate(const struct mqtt_connect *);
+
+/*
+ * Forward a message published by a local client to the nodes interested in
+ * it. Can be called from any loop.
+ */
+void cluster_forward(const struct mqtt_publish *, unsigned, bool);
+
+/* A local client subscribed to a filter, tell the other nodes */
+void cluster_subscribed(const char *, size_t);
+
+/*
+ * Subscriptions may be gone, the summary is refreshed with the next run of
+ * the cron job
+ */
+void cluster_interest_changed(void);
+
+/* A local client connected, take it over from the other nodes */
+void cluster_connected(const char *);
+
+/*
+ * Handle a message sent by another node to this one, returns false if it's
+ * just a message to be routed. The flag tells if it comes from another node,
+ * the ones published by clients on the reserved topics are discarded.
+ */
+bool cluster_control(const struct mqtt_publish *, bool);
+
+/* Links to the other nodes, up to CLUSTER_MAX_PEERS, returns their number */
+int cluster_get_stats(struct link_stats *);
+
+/* Close the links and free all the pending messages */
+void cluster_shutdown(void);
+
+#endif
@@ -26,6 +26,7 @@
  */
 
 #include <ctype.h>
+#include <stddef.h>
 #include <assert.h>
 #ifdef __linux__
 #include <sys/eventfd.h>
@@ -42,6 +43,10 @@
 static struct config config;
 struct config *conf;
 
+/* The configuration before the file was loaded, and the file path */
+static struct config base;
+static char config_path[0xFFF];
+
 struct llevel {
     const char *lname;
     int loglevel;
@@ -94,6 +99,9 @@ static size_t read_time_with_mul(const char *time_string) {
         case 'm':
             mul = 60;
             break;
+        case 'h':
+            mul = 60 * 60;
+            break;
         case 'd':
             mul = 60 * 60 * 24;
             break;
@@ -194,61 +202,192 @@ static int parse_config_tls_protocols(char *token) {
     return protocols;
 }
 
+/*
+ * Parse a bridge topic in the form filter[,qos[,local_prefix[,remote_prefix]]],
+ * fields can be left empty, e.g. sensors/#,1,,edge/ forwards sensors/# with
+ * QoS 1 as edge/sensors/#
+ */
+static void parse_config_bridge_topic(struct config *c, const char *value,
+                                      bool in) {
+    if (c->bridge_topics_nr == BRIDGE_MAX_TOPICS) {
+        log_warning("WARNING: Too many bridge topics, ignoring %s", value);
+        return;
+    }
+    struct bridge_topic *bt = &c->bridge_topics[c->bridge_topics_nr];
+    char *fields[4] = { bt->filter, NULL, bt->local_prefix, bt->remote_prefix };
+    char qos[4] = {0};
+    fields[1] = qos;
+    memset(bt, 0x00, sizeof(*bt));
+    for (int i = 0; i < 4 && *value; ++i) {
+        const char *end = strchr(value, ',');
+        size_t len = end ? (size_t) (end - value) : strlen(value);
+        size_t size = i == 1 ? sizeof(qos) : 0xFF;
+        snprintf(fields[i], size, "%.*s", (int) len, value);
+        value = end ? end + 1 : value + len;
+    }
+    if (bt->filter[0] == '\0'
+        || strpbrk(bt->local_prefix, "+#") || strpbrk(bt->remote_prefix, "+#")) {
+        log_warning("WARNING: Invalid bridge topic %s, ignoring", bt->filter);
+        return;
+    }
+    bt->in = in;
+    // QoS 2 is not supported by the bridge, it's downgraded to 1
+    bt->qos = qos[0] ? parse_int(qos) : 0;
+    bt->qos = bt->qos > 0 ? 1 : 0;
+    c->bridge_topics_nr++;
+}
+
+/*
+ * Parse a TTL by topic in the form filter,ttl, e.g. sensors/#,10m
+ */
+static void parse_config_expiry_topic(struct config *c, const char *value) {
+    if (c->expiry.topics_nr == EXPIRY_MAX_TOPICS) {
+        log_warning("WARNING: Too many message expiry topics, ignoring %s",
+                    value);
+        return;
+    }
+    const char *ttl = strrchr(value, ',');
+    if (!ttl || ttl == value || !isdigit(ttl[1])) {
+        log_warning("WARNING: Invalid message expiry topic %s, ignoring", value);
+        return;
+    }
+    int i = c->expiry.topics_nr++;
+    snprintf(c->expiry.topics[i].filter, sizeof(c->expiry.topics[i].filter),
+             "%.*s", (int) (ttl - value), value);
+    c->expiry.topics[i].ttl = read_time_with_mul(ttl + 1);
+}
+
 /* Set configuration values based on what is read from the persistent
    configuration on disk */
-static void add_config_value(const char *key, const char *value) {
+static void add_config_value(struct config *c,
+                             const char *key, const char *value) {
 
     size_t klen = strlen(key);
     size_t vlen = strlen(value);
 
     if (STREQ("log_level", key, klen) == true) {
-        for (int i = 0; i < 3; i++) {
+        for (size_t i = 0; i < sizeof(lmap) / sizeof(lmap[0]); i++) {
             if (STREQ(lmap[i].lname, value, vlen) == true)
-                config.loglevel = lmap[i].loglevel;
+                c->loglevel = lmap[i].loglevel;
         }
     } else if (STREQ("log_path", key, klen) == true) {
-        strcpy(config.logpath, value);
+        strcpy(c->logpath, value);
     } else if (STREQ("unix_socket", key, klen) == true) {
-        config.socket_family = UNIX;
-        strcpy(config.hostname, value);
+        c->socket_family = UNIX;
+        strcpy(c->hostname, value);
     } else if (STREQ("ip_address", key, klen) == true) {
-        config.socket_family = INET;
-        strcpy(config.hostname, value);
+        c->socket_family = INET;
+        strcpy(c->hostname, value);
     } else if (STREQ("ip_port", key, klen) == true) {
-        strcpy(config.port, value);
+        strcpy(c->port, value);
+    } else if (STREQ("metrics_port", key, klen) == true) {
+        strcpy(c->metrics_port, value);
+    } else if (STREQ("trace_path", key, klen) == true) {
+        strcpy(c->trace_path, value);
+    } else if (STREQ("capture_path", key, klen) == true) {
+        strcpy(c->capture_path, value);
+    } else if (STREQ("capture_rate", key, klen) == true) {
+        c->capture_rate = read_memory_with_mul(value);
+    } else if (STREQ("bridge_address", key, klen) == true) {
+        strcpy(c->bridge_address, value);
+    } else if (STREQ("bridge_client_id", key, klen) == true) {
+        strcpy(c->bridge_client_id, value);
+    } else if (STREQ("bridge_username", key, klen) == true) {
+        strcpy(c->bridge_username, value);
+    } else if (STREQ("bridge_password", key, klen) == true) {
+        strcpy(c->bridge_password, value);
+    } else if (STREQ("bridge_buffer", key, klen) == true) {
+        c->bridge_buffer = read_memory_with_mul(value);
+    } else if (STREQ("bridge_keepalive", key, klen) == true) {
+        c->bridge_keepalive = read_time_with_mul(value);
+    } else if (STREQ("bridge_out", key, klen) == true) {
+        parse_config_bridge_topic(c, value, false);
+    } else if (STREQ("bridge_in", key, klen) == true) {
+        parse_config_bridge_topic(c, value, true);
+    } else if (STREQ("cluster_node_id", key, klen) == true) {
+        snprintf(c->cluster_node_id, sizeof(c->cluster_node_id),
+                 "%.*s", (int) sizeof(c->cluster_node_id) - 1, value);
+    } else if (STREQ("cluster_peers", key, klen) == true) {
+        c->cluster_peers_nr = 0;
+        char *token = strtok((char *) value, ",");
+        while (token && c->cluster_peers_nr < CLUSTER_MAX_PEERS) {
+            snprintf(c->cluster_peers[c->cluster_peers_nr++], 0xFF,
+                     "%s", token);
+            token = strtok(NULL, ",");
+        }
+        if (token)
+            log_warning("WARNING: Too many cluster peers, ignoring %s", token);
+    } else if (STREQ("cluster_username", key, klen) == true) {
+        strcpy(c->cluster_username, value);
+    } else if (STREQ("cluster_password", key, klen) == true) {
+        strcpy(c->cluster_password, value);
+    } else if (STREQ("cluster_buffer", key, klen) == true) {
+        c->cluster_buffer = read_memory_with_mul(value);
+    } else if (STREQ("shm_socket", key, klen) == true) {
+        snprintf(c->shm_socket, sizeof(c->shm_socket),
+                 "%.*s", (int) sizeof(c->shm_socket) - 1, value);
+    } else if (STREQ("shm_ring_size", key, klen) == true) {
+        c->shm_ring_size = read_memory_with_mul(value);
     } else if (STREQ("max_memory", key, klen) == true) {
-        config.max_memory = read_memory_with_mul(value);
+        c->max_memory = read_memory_with_mul(value);
     } else if (STREQ("max_request_size", key, klen) == true) {
-        config.max_request_size = read_memory_with_mul(value);
+        c->max_request_size = read_memory_with_mul(value);
     } else if (STREQ("tcp_backlog", key, klen) == true) {
         int tcp_backlog = parse_int(value);
-        config.tcp_backlog = tcp_backlog <= SOMAXCONN ? tcp_backlog : SOMAXCONN;
+        c->tcp_backlog = tcp_backlog <= SOMAXCONN ? tcp_backlog : SOMAXCONN;
     } else if (STREQ("stats_publish_interval", key, klen) == true) {
-        config.stats_pub_interval = read_time_with_mul(value);
+        c->stats_pub_interval = read_time_with_mul(value);
     } else if (STREQ("keepalive", key, klen) == true) {
-        config.keepalive = read_time_with_mul(value);
+        c->keepalive = read_time_with_mul(value);
+    } else if (STREQ("max_inflight_messages", key, klen) == true) {
+        // Packet identifiers are 16 bit wide, no point in going beyond
+        size_t max_inflight = parse_int(value);
+        c->max_inflight_msgs = max_inflight <= 0xFFFF ? max_inflight : 0xFFFF;
+    } else if (STREQ("backpressure_threshold", key, klen) == true) {
+        c->backpressure_threshold = read_memory_with_mul(value);
+    } else if (STREQ("message_expiry", key, klen) == true) {
+        c->expiry.ttl = read_time_with_mul(value);
+    } else if (STREQ("message_expiry_topic", key, klen) == true) {
+        parse_config_expiry_topic(c, value);
+    } else if (STREQ("session_expiry", key, klen) == true) {
+        c->session_expiry = read_time_with_mul(value);
+    } else if (STREQ("client_rate_messages", key, klen) == true) {
+        c->rate_limits.client_messages = parse_int(value);
+    } else if (STREQ("client_rate_bytes", key, klen) == true) {
+        c->rate_limits.client_bytes = read_memory_with_mul(value);
+    } else if (STREQ("listener_rate_messages", key, klen) == true) {
+        c->rate_limits.listener_messages = parse_int(value);
+    } else if (STREQ("listener_rate_bytes", key, klen) == true) {
+        c->rate_limits.listener_bytes = read_memory_with_mul(value);
     } else if (STREQ("cafile", key, klen) == true) {
-        config.tls = true;
-        strcpy(config.cafile, value);
+        c->tls = true;
+        strcpy(c->cafile, value);
     } else if (STREQ("certfile", key, klen) == true) {
-        strcpy(config.certfile, value);
+        strcpy(c->certfile, value);
     } else if (STREQ("keyfile", key, klen) == true) {
-        strcpy(config.keyfile, value);
+        strcpy(c->keyfile, value);
     } else if (STREQ("allow_anonymous", key, klen) == true) {
         // TODO add strict checks
-        if (STREQ(value, "false", 5) == true) config.allow_anonymous = false;
-        else config.allow_anonymous = true;
+        if (STREQ(value, "false", 5) == true) c->allow_anonymous = false;
+        else c->allow_anonymous = true;
     } else if (STREQ("password_file", key, klen) == true) {
-        strcpy(config.password_file, value);
+        strcpy(c->password_file, value);
+    } else if (STREQ("auth_workers", key, klen) == true) {
+        int workers = parse_int(value);
+        c->auth_workers = workers > 0 ? workers : 0;
+    } else if (STREQ("auth_cache_size", key, klen) == true) {
+        c->auth_cache_size = parse_int(value);
+    } else if (STREQ("acl_file", key, klen) == true) {
+        strcpy(c->acl_file, value);
     } else if (STREQ("tls_protocols", key, klen) == true) {
         if (vlen == 0) return;
-        config.tls_protocols = 0;
+        c->tls_protocols = 0;
         char *token = strtok((char *) value, ",");
         if (!token) {
-            config.tls_protocols = parse_config_tls_protocols((char *) value);
+            c->tls_protocols = parse_config_tls_protocols((char *) value);
         } else {
             while (token) {
-                config.tls_protocols |= parse_config_tls_protocols((char *) token);
+                c->tls_protocols |= parse_config_tls_protocols((char *) token);
                 token = strtok(NULL, ",");
             }
         }
@@ -262,7 +401,7 @@ static inline void unpack_bytes(char **str, char *dest) {
     while (!isspace(**str) && **str) *dest++ = *(*str)++;
 }
 
-int config_load(const char *configpath) {
+static bool config_parse(const char *configpath, struct config *c) {
 
     assert(configpath);
 
@@ -314,12 +453,125 @@ int config_load(const char *configpath) {
 
         // At this point we have key -> value ready to be ingested on the
         // global configuration object
-        add_config_value(key, value);
+        add_config_value(c, key, value);
     }
 
+    // Nodes of a cluster are named after their address if not told otherwise
+    if (c->cluster_peers_nr > 0 && c->cluster_node_id[0] == '\0')
+        snprintf(c->cluster_node_id, sizeof(c->cluster_node_id),
+                 "%.*s:%.*s", 24, c->hostname, 8, c->port);
+
     return true;
 }
 
+int config_load(const char *configpath) {
+    // Defaults and command line options, what a reload starts from
+    base = config;
+    snprintf(config_path, sizeof(config_path), "%s", configpath);
+    return config_parse(configpath, &config);
+}
+
+struct config *config_reread(void) {
+    if (config_path[0] == '\0')
+        return NULL;
+    struct config *c = try_alloc(sizeof(*c));
+    *c = base;
+    if (!config_parse(config_path, c)) {
+        free_memory(c);
+        return NULL;
+    }
+    return c;
+}
+
+/*
+ * Settings compared by a reload, the live ones are read on the fly or applied
+ * by the server rebuilding its structures, see reload.h
+ */
+enum setting_reload { RESTART, LIVE, LIVE_TLS };
+
+struct setting {
+    const char *name;
+    size_t offset;
+    size_t size;
+    enum setting_reload reload;
+};
+
+#define SETTING(name, field, reload) \
+    { name, offsetof(struct config, field), \
+      sizeof(((struct config *) 0)->field), reload }
+
+static const struct setting settings[] = {
+    SETTING("log_level", loglevel, LIVE),
+    SETTING("keepalive", keepalive, LIVE),
+    SETTING("max_inflight_messages", max_inflight_msgs, LIVE),
+    SETTING("backpressure_threshold", backpressure_threshold, LIVE),
+    SETTING("message_expiry/message_expiry_topic", expiry, LIVE),
+    SETTING("session_expiry", session_expiry, LIVE),
+    SETTING("allow_anonymous", allow_anonymous, LIVE),
+    SETTING("password_file", password_file, LIVE),
+    SETTING("acl_file", acl_file, LIVE),
+    SETTING("tls_protocols", tls_protocols, LIVE_TLS),
+    SETTING("cafile", cafile, LIVE_TLS),
+    SETTING("certfile", certfile, LIVE_TLS),
+    SETTING("keyfile", keyfile, LIVE_TLS),
+    SETTING("log_path", logpath, RESTART),
+    SETTING("unix_socket", socket_family, RESTART),
+    SETTING("ip_address", hostname, RESTART),
+    SETTING("ip_port", port, RESTART),
+    SETTING("metrics_port", metrics_port, RESTART),
+    SETTING("trace_path", trace_path, RESTART),
+    SETTING("capture_path", capture_path, RESTART),
+    SETTING("capture_rate", capture_rate, RESTART),
+    SETTING("bridge_address", bridge_address, RESTART),
+    SETTING("bridge_client_id", bridge_client_id, RESTART),
+    SETTING("bridge_username", bridge_username, RESTART),
+    SETTING("bridge_password", bridge_password, RESTART),
+    SETTING("bridge_buffer", bridge_buffer, RESTART),
+    SETTING("bridge_keepalive", bridge_keepalive, RESTART),
+    SETTING("bridge_in/bridge_out", bridge_topics, RESTART),
+    SETTING("cluster_node_id", cluster_node_id, RESTART),
+    SETTING("cluster_peers", cluster_peers, RESTART),
+    SETTING("cluster_username", cluster_username, RESTART),
+    SETTING("cluster_password", cluster_password, RESTART),
+    SETTING("cluster_buffer", cluster_buffer, RESTART),
+    SETTING("shm_socket", shm_socket, RESTART),
+    SETTING("shm_ring_size", shm_ring_size, RESTART),
+    SETTING("client_rate_*/listener_rate_*", rate_limits, RESTART),
+    SETTING("max_memory", max_memory, RESTART),
+    SETTING("max_request_size", max_request_size, RESTART),
+    SETTING("tcp_backlog", tcp_backlog, RESTART),
+    SETTING("stats_publish_interval", stats_pub_interval, RESTART),
+    SETTING("tls", tls, RESTART),
+    SETTING("auth_workers", auth_workers, RESTART),
+    SETTING("auth_cache_size", auth_cache_size, RESTART)
+};
+
+#define SETTINGS (sizeof(settings) / sizeof(settings[0]))
+
+void config_apply(const struct config *c) {
+    int applied = 0, restart = 0;
+    // Certificates are swapped on a TLS listener, they can't turn it on or off
+    bool tls = config.tls == true && c->tls == true;
+    for (size_t i = 0; i < SETTINGS; ++i) {
+        const struct setting *s = &settings[i];
+        unsigned char *live = (unsigned char *) &config + s->offset;
+        const unsigned char *next = (const unsigned char *) c + s->offset;
+        if (memcmp(live, next, s->size) == 0)
+            continue;
+        if (s->reload == LIVE || (s->reload == LIVE_TLS && tls == true)) {
+            memcpy(live, next, s->size);
+            log_info("Reload: %s applied", s->name);
+            applied++;
+        } else {
+            log_warning("Reload: %s changed, a restart is needed", s->name);
+            restart++;
+        }
+    }
+    sol_log_level = config.loglevel;
+    log_info("Reload done, %d settings applied, %d need a restart",
+             applied, restart);
+}
+
 void config_set_default(void) {
 
     // Set the global pointer
@@ -332,6 +584,24 @@ void config_set_default(void) {
     memset(config.logpath, 0x00, 0xFFF);
     strcpy(config.hostname, DEFAULT_HOSTNAME);
     strcpy(config.port, DEFAULT_PORT);
+    memset(config.metrics_port, 0x00, 0xFF);
+    memset(config.trace_path, 0x00, 0xFFF);
+    memset(config.capture_path, 0x00, 0xFFF);
+    config.capture_rate = read_memory_with_mul(DEFAULT_CAPTURE_RATE);
+    memset(config.bridge_address, 0x00, 0xFF);
+    strcpy(config.bridge_client_id, DEFAULT_BRIDGE_CLIENT_ID);
+    memset(config.bridge_username, 0x00, 0xFF);
+    memset(config.bridge_password, 0x00, 0xFF);
+    config.bridge_buffer = read_memory_with_mul(DEFAULT_BRIDGE_BUFFER);
+    config.bridge_keepalive = read_time_with_mul(DEFAULT_BRIDGE_KEEPALIVE);
+    config.bridge_topics_nr = 0;
+    memset(config.cluster_node_id, 0x00, sizeof(config.cluster_node_id));
+    config.cluster_peers_nr = 0;
+    memset(config.cluster_username, 0x00, 0xFF);
+    memset(config.cluster_password, 0x00, 0xFF);
+    config.cluster_buffer = read_memory_with_mul(DEFAULT_CLUSTER_BUFFER);
+    memset(config.shm_socket, 0x00, 0xFF);
+    config.shm_ring_size = read_memory_with_mul(DEFAULT_SHM_RING_SIZE);
 #ifdef __linux__
     config.run = eventfd(0, EFD_NONBLOCK);
 #else
@@ -342,9 +612,17 @@ void config_set_default(void) {
     config.tcp_backlog = SOMAXCONN;
     config.stats_pub_interval = read_time_with_mul(DEFAULT_STATS_INTERVAL);
     config.keepalive = read_time_with_mul(DEFAULT_KEEPALIVE);
+    config.max_inflight_msgs = DEFAULT_MAX_INFLIGHT_MSGS;
+    config.backpressure_threshold = read_memory_with_mul(DEFAULT_BACKPRESSURE);
+    memset(&config.expiry, 0x00, sizeof(config.expiry));
+    config.session_expiry = 0;
+    memset(&config.rate_limits, 0x00, sizeof(config.rate_limits));
     config.tls = false;
     config.tls_protocols = DEFAULT_TLS_PROTOCOLS;
     config.allow_anonymous = true;
+    config.auth_workers = DEFAULT_AUTH_WORKERS;
+    config.auth_cache_size = DEFAULT_AUTH_CACHE_SIZE;
+    memset(config.acl_file, 0x00, 0xFFF);
 }
 
 void config_print_tls_versions(void) {
@@ -391,8 +669,69 @@ void config_print(void) {
             if (config.tls == true) config_print_tls_versions();
             log_info("\tFile handles soft limit: %li", get_fh_soft_limit());
         }
+        if (config.metrics_port[0])
+            log_info("\tMetrics port: %s", config.metrics_port);
+        if (config.trace_path[0])
+            log_info("\tTrace path: %s", config.trace_path);
+        if (config.capture_path[0]) {
+            const char *human_cr = memory_to_string(config.capture_rate);
+            log_info("\tCapture path: %s (%s/s)", config.capture_path,
+                     config.capture_rate > 0 ? human_cr : "unbounded");
+            free_memory((char *) human_cr);
+        }
+        if (config.bridge_address[0]) {
+            const char *human_bb = memory_to_string(config.bridge_buffer);
+            log_info("\tBridge: %s as %s, %d topics, %s buffer",
+                     config.bridge_address, config.bridge_client_id,
+                     config.bridge_topics_nr, human_bb);
+            free_memory((char *) human_bb);
+        }
+        if (config.cluster_peers_nr > 0)
+            log_info("\tCluster: node %s, %d peers", config.cluster_node_id,
+                     config.cluster_peers_nr);
+        if (config.shm_socket[0]) {
+            const char *human_rs = memory_to_string(config.shm_ring_size);
+            log_info("\tShared memory socket: %s (%s rings)",
+                     config.shm_socket, human_rs);
+            free_memory((char *) human_rs);
+        }
+        if (config.allow_anonymous == false)
+            log_info("\tAuthentication: %d workers, %lu cached logins",
+                     config.auth_workers, config.auth_cache_size);
+        if (config.acl_file[0])
+            log_info("\tACL file: %s", config.acl_file);
         const char *human_rsize = memory_to_string(config.max_request_size);
         log_info("\tMax request size: %s", human_rsize);
+        log_info("\tMax inflight messages: %lu", config.max_inflight_msgs);
+        if (config.backpressure_threshold > 0) {
+            const char *human_bp = memory_to_string(config.backpressure_threshold);
+            log_info("\tBackpressure threshold: %s", human_bp);
+            free_memory((char *) human_bp);
+        } else {
+            log_info("\tBackpressure threshold: disabled");
+        }
+        if (config.expiry.ttl > 0 || config.expiry.topics_nr > 0) {
+            const char *human_ttl = time_to_string(config.expiry.ttl);
+            log_info("\tMessage expiry: %s, %d topics",
+                     config.expiry.ttl > 0 ? human_ttl : "never",
+                     config.expiry.topics_nr);
+            free_memory((char *) human_ttl);
+        }
+        if (config.session_expiry > 0) {
+            const char *human_se = time_to_string(config.session_expiry);
+            log_info("\tSession expiry: %s", human_se);
+            free_memory((char *) human_se);
+        }
+        if (config.rate_limits.client_messages > 0
+            || config.rate_limits.client_bytes > 0)
+            log_info("\tClient rate limit: %lu messages/s, %lu bytes/s",
+                     config.rate_limits.client_messages,
+                     config.rate_limits.client_bytes);
+        if (config.rate_limits.listener_messages > 0
+            || config.rate_limits.listener_bytes > 0)
+            log_info("\tListener rate limit: %lu messages/s, %lu bytes/s",
+                     config.rate_limits.listener_messages,
+                     config.rate_limits.listener_bytes);
         log_info("Logging:");
         log_info("\tlevel: %s", llevel);
         if (config.logpath[0])
@@ -429,13 +768,17 @@ bool config_read_passwd_file(const char *path, struct authentication **auth_map)
         pline = line;
         if (*pline == '\0') continue;
 
+        // Read again on every reload, malformed lines are skipped
+        if (!strchr(pline, ':'))
+            continue;
+
         int i = 0;
         puname = line;
-        while (*puname != ':')
+        while (*puname != ':' && i < 0xFF - 1)
             username[i++] = *puname++;
-        puname++;
+        puname = strchr(puname, ':') + 1;
         i = 0;
-        while (*puname != '\n')
+        while (*puname && *puname != '\n' && i < 0xFFF - 1)
             password[i++] = *puname++;
 
         struct authentication *auth = try_alloc(sizeof(*auth));
@@ -444,5 +787,7 @@ bool config_read_passwd_file(const char *path, struct authentication **auth_map)
         HASH_ADD_STR(*auth_map, username, auth);
     }
 
+    fclose(fh);
+
     return true;
 }
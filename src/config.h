@@ -73,12 +73,74 @@
 #define DEFAULT_MAX_REQUEST_SIZE    "512KB"
 #define DEFAULT_STATS_INTERVAL      "10s"
 #define DEFAULT_KEEPALIVE           "60s"
+#define DEFAULT_MAX_INFLIGHT_MSGS   20
+#define DEFAULT_BACKPRESSURE        "256KB"
+#define DEFAULT_CAPTURE_RATE        "1MB"
+#define DEFAULT_BRIDGE_CLIENT_ID    "sol-bridge"
+#define DEFAULT_BRIDGE_BUFFER       "1MB"
+#define DEFAULT_BRIDGE_KEEPALIVE    "60s"
+
+/* Max number of bridge_in and bridge_out entries */
+#define BRIDGE_MAX_TOPICS           16
+
+/* Max number of message_expiry_topic entries */
+#define EXPIRY_MAX_TOPICS           16
+
+#define DEFAULT_CLUSTER_BUFFER      "4MB"
+#define DEFAULT_SHM_RING_SIZE       "1MB"
+#define DEFAULT_AUTH_WORKERS        2
+#define DEFAULT_AUTH_CACHE_SIZE     4096
+
+/* Max number of other nodes of a cluster */
+#define CLUSTER_MAX_PEERS           16
 #ifdef TLS1_3_VERSION
 #define DEFAULT_TLS_PROTOCOLS       (SOL_TLSv1_2 | SOL_TLSv1_3)
 #else
 #define DEFAULT_TLS_PROTOCOLS       SOL_TLSv1_2
 #endif
 
+/*
+ * A topic forwarded by the bridge, in one direction. Topics are mapped by
+ * their prefixes, a local topic local_prefix + T matching local_prefix +
+ * filter is forwarded as remote_prefix + T and vice versa for incoming ones.
+ */
+struct bridge_topic {
+    /* Direction, true for remote to local */
+    bool in;
+    /* Max QoS of the forwarded messages, 0 or 1 */
+    int qos;
+    /* Topic filter, wildcards allowed */
+    char filter[0xFF];
+    /* Prefixes of the topics on each side */
+    char local_prefix[0xFF];
+    char remote_prefix[0xFF];
+};
+
+/*
+ * TTL of the messages queued for offline sessions and of the retained ones,
+ * by topic filter, the first filter matching wins over the default ttl
+ */
+struct message_expiry {
+    /* Seconds, 0 means never */
+    size_t ttl;
+    struct {
+        char filter[0xFF];
+        size_t ttl;
+    } topics[EXPIRY_MAX_TOPICS];
+    int topics_nr;
+};
+
+/*
+ * Ingress rate limits per second, of each client and of each listener, 0
+ * means unlimited, see ratelimit.h
+ */
+struct rate_limits {
+    size_t client_messages;
+    size_t client_bytes;
+    size_t listener_messages;
+    size_t listener_bytes;
+};
+
 struct config {
     /* Sol version <MAJOR.MINOR.PATCH> */
     const char *version;
@@ -99,6 +161,44 @@ struct config {
     /* Port to open while listening, only if socket_family is INET,
      * otherwise it's ignored */
     char port[0xFF];
+    /* Port to serve metrics on over HTTP, empty means disabled */
+    char metrics_port[0xFF];
+    /* Path to dump traces to on SIGUSR1, empty means tracing disabled */
+    char trace_path[0xFFF];
+    /* Path to capture the inbound traffic to, empty means capture disabled */
+    char capture_path[0xFFF];
+    /* Bytes of packets captured per second at most, 0 means no bound */
+    size_t capture_rate;
+    /* Remote broker to bridge topics with, host:port, empty means disabled */
+    char bridge_address[0xFF];
+    /* Client ID, username and password of the bridge on the remote broker */
+    char bridge_client_id[0xFF];
+    char bridge_username[0xFF];
+    char bridge_password[0xFF];
+    /* Bytes of messages waiting to be forwarded after which new ones are dropped */
+    size_t bridge_buffer;
+    /* Keepalive of the bridge connection */
+    size_t bridge_keepalive;
+    /* Topics forwarded by the bridge, in both directions */
+    struct bridge_topic bridge_topics[BRIDGE_MAX_TOPICS];
+    int bridge_topics_nr;
+    /* Name of this node in a cluster, ip_address:ip_port if not set */
+    char cluster_node_id[0x30];
+    /* The other nodes of the cluster, host:port, none means disabled */
+    char cluster_peers[CLUSTER_MAX_PEERS][0xFF];
+    int cluster_peers_nr;
+    /* Username and password the nodes connect to each other with */
+    char cluster_username[0xFF];
+    char cluster_password[0xFF];
+    /* Max bytes of messages buffered for each node unreachable */
+    size_t cluster_buffer;
+    /*
+     * Unix socket local clients connect to for the shared memory transport,
+     * empty means disabled
+     */
+    char shm_socket[0xFF];
+    /* Size of each of the two rings of a shared memory connection */
+    size_t shm_ring_size;
     /* Max memory to be used, after which the system starts to reclaim back by
      * freeing older items stored */
     size_t max_memory;
@@ -113,6 +213,24 @@ struct config {
      * **CURRENTLY USED AS ACK TIMER AS WELL**
      */
     size_t keepalive;
+    /*
+     * Max number of QoS > 0 messages sent to a client and not acknowledged
+     * yet, exceeding messages are queued in the session till acks arrive.
+     * 0 means no limit.
+     */
+    size_t max_inflight_msgs;
+    /*
+     * Bytes waiting to be written out to a subscriber after which it's
+     * considered congested, publishers sending mostly to congested
+     * subscribers are paused till their queues drain. 0 means disabled.
+     */
+    size_t backpressure_threshold;
+    /* TTL of the queued and retained messages, see expiry.h */
+    struct message_expiry expiry;
+    /* Seconds a persistent session is kept while offline, 0 means forever */
+    size_t session_expiry;
+    /* Messages and bytes per second read from clients */
+    struct rate_limits rate_limits;
     /* TLS flag */
     bool tls;
     /* TLS protocol version */
@@ -127,6 +245,12 @@ struct config {
     bool allow_anonymous;
     /* File path on the filesystem pointing to the password_file */
     char password_file[0xFFF];
+    /* Threads checking passwords off the loops, 0 to check them inline */
+    int auth_workers;
+    /* Max number of verified logins cached, 0 means no cache */
+    size_t auth_cache_size;
+    /* File path of the topic ACLs, no ACLs if not set */
+    char acl_file[0xFFF];
 };
 
 extern struct config *conf;
@@ -155,6 +279,18 @@ struct authentication {
 void config_set_default(void);
 void config_print(void);
 int config_load(const char *);
+
+/*
+ * Read the file loaded by config_load again, on top of the defaults and the
+ * command line options, returns NULL if it can't be read
+ */
+struct config *config_reread(void);
+
+/*
+ * Apply the settings of a configuration read again that can change live,
+ * logging the ones changed that need a restart
+ */
+void config_apply(const struct config *);
 bool config_read_passwd_file(const char *, struct authentication **);
 char *time_to_string(size_t);
 char *memory_to_string(size_t);
@@ -0,0 +1,177 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "config.h"
+#include "memory.h"
+#include "logging.h"
+#include "server.h"
+#include "handlers.h"
+#include "sol_internal.h"
+#include "bridge.h"
+#include "cluster.h"
+#include "embed.h"
+#include "libsol.h"
+
+enum embed_state { EMBED_IDLE, EMBED_STARTING, EMBED_RUNNING, EMBED_STOPPED };
+
+struct sol_subscription {
+    char *filter;
+    sol_callback *callback;
+    void *arg;
+    struct sol_subscription *prev;
+    struct sol_subscription *next;
+};
+
+bool embed_enabled = false;
+
+static atomic_int state = ATOMIC_VAR_INIT(EMBED_IDLE);
+
+static pthread_t broker;
+
+/*
+ * In-process subscriptions, read on every message routed by the loops,
+ * written only on subscribe and unsubscribe
+ */
+static struct sol_subscription *subs = NULL;
+
+static pthread_rwlock_t subs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+void embed_deliver(const struct mqtt_publish *p, unsigned qos, bool retain) {
+    struct sol_message m = {
+        .topic = (const char *) p->topic,
+        .topiclen = p->topiclen,
+        .payload = p->payload,
+        .payloadlen = p->payloadlen,
+        .qos = qos,
+        .retain = retain
+    };
+    pthread_rwlock_rdlock(&subs_lock);
+    for (struct sol_subscription *s = subs; s; s = s->next)
+        if (match_filter(s->filter, m.topic, m.topiclen))
+            s->callback(&m, s->arg);
+    pthread_rwlock_unlock(&subs_lock);
+}
+
+static void *embed_run(void *arg) {
+    (void) arg;
+    start_server(conf->hostname, conf->port);
+    return NULL;
+}
+
+int sol_start(const char *confpath) {
+    int idle = EMBED_IDLE;
+    if (!atomic_compare_exchange_strong(&state, &idle, EMBED_STARTING))
+        return -1;
+    config_set_default();
+    conf->loglevel = WARNING;
+    if (confpath)
+        config_load(confpath);
+    sol_log_init(conf->logpath, conf->loglevel);
+    config_print();
+    embed_enabled = true;
+    if (pthread_create(&broker, NULL, embed_run, NULL) != 0) {
+        sol_log_close();
+        atomic_store(&state, EMBED_STOPPED);
+        return -1;
+    }
+    // The start time is set once the global instance is ready
+    while (info.start_time == 0)
+        usleep(1000);
+    atomic_store(&state, EMBED_RUNNING);
+    return 0;
+}
+
+void sol_stop(void) {
+    int running = EMBED_RUNNING;
+    if (!atomic_compare_exchange_strong(&state, &running, EMBED_STOPPED))
+        return;
+    stop_server();
+    pthread_join(broker, NULL);
+    sol_log_close();
+}
+
+int sol_publish(const char *topic, const void *payload,
+                size_t len, unsigned qos, bool retain) {
+    size_t topiclen = topic ? strlen(topic) : 0;
+    if (atomic_load(&state) != EMBED_RUNNING || topiclen == 0
+        || topiclen > UINT16_MAX || qos > EXACTLY_ONCE
+        || strpbrk(topic, "+#"))
+        return -1;
+    struct mqtt_packet *pkt =
+        mqtt_packet_alloc(PUBLISH_B | (qos << 1) | (retain ? 1 : 0));
+    pkt->publish.topiclen = topiclen;
+    pkt->publish.topic = (u8 *) try_strdup(topic);
+    pkt->publish.payloadlen = len;
+    pkt->publish.payload = try_alloc(len + 1);
+    memcpy(pkt->publish.payload, payload, len);
+    pkt->publish.payload[len] = '\0';
+    INCREF(pkt, struct mqtt_packet);
+    int n = publish_external(pkt);
+    if (bridge_enabled == true)
+        bridge_forward(&pkt->publish, qos, retain);
+    if (cluster_enabled == true)
+        cluster_forward(&pkt->publish, qos, retain);
+    DECREF(pkt, struct mqtt_packet);
+    return n;
+}
+
+struct sol_subscription *sol_subscribe(const char *filter,
+                                       sol_callback *callback, void *arg) {
+    if (!filter || filter[0] == '\0' || !callback)
+        return NULL;
+    struct sol_subscription *s = try_alloc(sizeof(*s));
+    s->filter = try_strdup(filter);
+    s->callback = callback;
+    s->arg = arg;
+    s->prev = NULL;
+    pthread_rwlock_wrlock(&subs_lock);
+    s->next = subs;
+    if (subs)
+        subs->prev = s;
+    subs = s;
+    pthread_rwlock_unlock(&subs_lock);
+    return s;
+}
+
+void sol_unsubscribe(struct sol_subscription *s) {
+    if (!s)
+        return;
+    pthread_rwlock_wrlock(&subs_lock);
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        subs = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    pthread_rwlock_unlock(&subs_lock);
+    free_memory(s->filter);
+    free_memory(s);
+}
@@ -39,6 +39,7 @@
 #include "util.h"
 #include "memory.h"
 #include "config.h"
+#include "trace.h"
 
 #if defined(EPOLL)
 
@@ -289,7 +290,8 @@ static int ev_api_fire_event(struct ev_ctx *ctx, int fd, int mask) {
     struct poll_api *p_api = ctx->api;
     for (int i = 0; i < p_api->nfds; ++i) {
         if (p_api->fds[i].fd == fd) {
-            p_api->fds[i].events = mask & EV_READ ? POLLIN : POLLOUT;
+            p_api->fds[i].events = mask & EV_READ ? POLLIN
+                : mask & EV_WRITE ? POLLOUT : 0;
             break;
         }
     }
@@ -490,7 +492,7 @@ static int ev_api_poll(struct ev_ctx *ctx, time_t timeout) {
     ts_timeout.tv_sec = timeout;
     ts_timeout.tv_nsec = 0;
     int err = kevent(k_api->fd, NULL, 0,
-                     k_api->events, ctx->maxevents, &ts_timeout);
+                     k_api->events, ctx->events_nr, &ts_timeout);
     if (err < 0)
         return -EV_ERR;
     return err;
@@ -592,14 +594,23 @@ static int ev_process_event(struct ev_ctx *ctx, int idx, int mask) {
                 ++fired;
             }
         }
+        /*
+         * Hang up or error on a descriptor without events armed (e.g. with
+         * reads temporarily suspended), the read callback must be notified
+         * or the condition will be reported over and over
+         */
+        if (mask == EV_DISCONNECT && e->rcallback) {
+            e->rcallback(ctx, e->rdata);
+            ++fired;
+        }
     }
     return fired;
 }
 
 /*
  * Auxiliary function, update FD, mask and data in monitored events array.
- * Monitored events are the same number as the maximum FD registered in the
- * context.
+ * Monitored events are indexed by FD, the array is doubled till it fits the
+ * FD registered.
  */
 static void ev_add_monitored(struct ev_ctx *ctx, int fd, int mask,
                              void (*callback)(struct ev_ctx *, void *),
@@ -609,15 +620,14 @@ static void ev_add_monitored(struct ev_ctx *ctx, int fd, int mask,
      * That is because FD_SETSIZE is fixed to 1024, fd_set is an array of 32
      * i32 and each FD is represented by a bit so 32 x 32 = 1024 as hard limit
      */
-    if (fd > ctx->maxevents) {
+    if (fd >= ctx->maxevents) {
         int i = ctx->maxevents;
-        ctx->maxevents = fd;
-        if (fd > ctx->events_nr) {
-            ctx->events_monitored = try_realloc(ctx->events_monitored,
-                                                (fd + 1) * sizeof(struct ev));
-            for (; i < ctx->maxevents; ++i)
-                ctx->events_monitored[i].mask = EV_NONE;
-        }
+        while (ctx->maxevents <= fd)
+            ctx->maxevents *= 2;
+        ctx->events_monitored = try_realloc(ctx->events_monitored,
+                                            ctx->maxevents * sizeof(struct ev));
+        for (; i < ctx->maxevents; ++i)
+            ctx->events_monitored[i].mask = EV_NONE;
     }
     ctx->events_monitored[fd].fd = fd;
     ctx->events_monitored[fd].mask |= mask;
@@ -640,10 +650,12 @@ int ev_init(struct ev_ctx *ctx, int events_nr) {
     if (err < 0)
         return err;
     ctx->stop = 0;
-    ctx->fired_events = 0;
+    ctx->wakeups = ATOMIC_VAR_INIT(0);
+    ctx->fired_events = ATOMIC_VAR_INIT(0);
     ctx->maxevents = events_nr;
     ctx->events_nr = events_nr;
     ctx->events_monitored = try_calloc(events_nr, sizeof(struct ev));
+    ctx->tasks = ctx->tasks_tail = ctx->running = NULL;
     return EV_OK;
 }
 
@@ -654,6 +666,11 @@ void ev_destroy(struct ev_ctx *ctx) {
             ev_del_fd(ctx, ctx->events_monitored[i].fd);
     }
     free_memory(ctx->events_monitored);
+    while (ctx->tasks) {
+        struct ev_task *task = ctx->tasks;
+        ctx->tasks = task->next;
+        free_memory(task);
+    }
     ev_api_destroy(ctx);
 }
 
@@ -661,8 +678,57 @@ int ev_poll(struct ev_ctx *ctx, time_t timeout) {
     return ev_api_poll(ctx, timeout);
 }
 
+/*
+ * Run the tasks deferred before the current cycle, the ones they defer in
+ * turn are left for the next one
+ */
+static int ev_run_tasks(struct ev_ctx *ctx) {
+    int fired = 0;
+    ctx->running = ctx->tasks;
+    ctx->tasks = ctx->tasks_tail = NULL;
+    while (ctx->running) {
+        struct ev_task *task = ctx->running;
+        ctx->running = task->next;
+        task->callback(ctx, task->data);
+        free_memory(task);
+        ++fired;
+    }
+    return fired;
+}
+
+int ev_step(struct ev_ctx *ctx, time_t timeout) {
+    int n = 0, events = 0, fired = 0;
+    uint64_t trace_start = TRACE_START();
+    n = ev_poll(ctx, ctx->tasks ? 0 : timeout);
+    TRACE_END("ev_poll", trace_start);
+    if (n < 0)
+        return n;
+    for (int i = 0; i < n; ++i) {
+        events = ev_get_event_type(ctx, i);
+        fired += ev_process_event(ctx, i, events);
+    }
+    if (ctx->tasks) {
+        trace_start = TRACE_START();
+        fired += ev_run_tasks(ctx);
+        TRACE_END("ev_tasks", trace_start);
+    }
+    /*
+     * Only the loop thread updates its counters, readers may be on other
+     * threads, so relaxed stores are enough
+     */
+    atomic_store_explicit(&ctx->wakeups,
+                          atomic_load_explicit(&ctx->wakeups,
+                                               memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_store_explicit(&ctx->fired_events,
+                          atomic_load_explicit(&ctx->fired_events,
+                                               memory_order_relaxed) + fired,
+                          memory_order_relaxed);
+    return fired;
+}
+
 int ev_run(struct ev_ctx *ctx) {
-    int n = 0, events = 0;
+    int n = 0;
     /*
      * Start an infinite loop, can be stopped only by scheduling an ev_stop
      * callback or if an error on the underlying backend occur
@@ -672,7 +738,7 @@ int ev_run(struct ev_ctx *ctx) {
          * blocks polling for events, -1 means forever. Returns only in case of
          * valid events ready to be processed or errors
          */
-        n = ev_poll(ctx, -1);
+        n = ev_step(ctx, -1);
         if (n < 0) {
             /* Signals to all threads. Ignore it for now */
             if (errno == EINTR)
@@ -680,11 +746,10 @@ int ev_run(struct ev_ctx *ctx) {
             /* Error occured, break the loop */
             break;
         }
-        for (int i = 0; i < n; ++i) {
-            events = ev_get_event_type(ctx, i);
-            ctx->fired_events += ev_process_event(ctx, i, events);
-        }
     }
+    // Work deferred is carried out anyway, it may hold resources
+    while (ctx->tasks)
+        ev_run_tasks(ctx);
     return n;
 }
 
@@ -692,6 +757,43 @@ void ev_stop(struct ev_ctx *ctx) {
    ctx->stop = 1;
 }
 
+void ev_defer(struct ev_ctx *ctx, void (*callback)(struct ev_ctx *, void *),
+              void *data) {
+    struct ev_task *task = try_alloc(sizeof(*task));
+    task->callback = callback;
+    task->data = data;
+    task->next = NULL;
+    if (ctx->tasks_tail)
+        ctx->tasks_tail->next = task;
+    else
+        ctx->tasks = task;
+    ctx->tasks_tail = task;
+}
+
+static void ev_tasks_remove(struct ev_task **head,
+                            void (*callback)(struct ev_ctx *, void *),
+                            const void *data, struct ev_task **tail) {
+    struct ev_task *prev = NULL;
+    while (*head) {
+        struct ev_task *task = *head;
+        if (task->callback == callback && task->data == data) {
+            *head = task->next;
+            if (tail && *tail == task)
+                *tail = prev;
+            free_memory(task);
+        } else {
+            prev = task;
+            head = &task->next;
+        }
+    }
+}
+
+void ev_cancel(struct ev_ctx *ctx, void (*callback)(struct ev_ctx *, void *),
+               const void *data) {
+    ev_tasks_remove(&ctx->running, callback, data, NULL);
+    ev_tasks_remove(&ctx->tasks, callback, data, &ctx->tasks_tail);
+}
+
 int ev_watch_fd(struct ev_ctx *ctx, int fd, int mask) {
     ev_add_monitored(ctx, fd, mask, NULL, NULL);
     return ev_api_watch_fd(ctx, fd);
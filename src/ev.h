@@ -29,6 +29,7 @@
 #define EV_H
 
 #include <time.h>
+#include <stdatomic.h>
 
 #define EV_OK  0
 #define EV_ERR 1
@@ -50,6 +51,16 @@ enum ev_type {
 
 struct ev_ctx;
 
+/*
+ * Work deferred to the next cycles of a loop, see ev_defer, tasks are run
+ * in FIFO order after the IO events of each cycle
+ */
+struct ev_task {
+    void (*callback)(struct ev_ctx *, void *);
+    void *data;
+    struct ev_task *next;
+};
+
 /*
  * Event struture used as the main carrier of clients informations, it will be
  * tracked by an array in every context created
@@ -79,9 +90,13 @@ struct ev_ctx {
     int maxfd; // the maximum FD monitored by the event context,
                // events_monitored must be at least maxfd long
     int stop;
-    int maxevents;//epoll监控的当前最大的fd
-    unsigned long long fired_events;
+    int maxevents; // length of events_monitored, grows to fit the max FD
+    atomic_ullong wakeups; // number of times the poll call returned
+    atomic_ullong fired_events; // number of callbacks executed
     struct ev *events_monitored;
+    struct ev_task *tasks; // run queue of the next cycle, see ev_defer
+    struct ev_task *tasks_tail;
+    struct ev_task *running; // tasks of the current cycle still to be run
     void *api; // opaque pointer to platform defined backends
 };
 
@@ -96,6 +111,14 @@ void ev_destroy(struct ev_ctx *);
  */
 int ev_poll(struct ev_ctx *, time_t);
 
+/*
+ * Run a single cycle of the loop, polls for events waiting at most timeout
+ * milliseconds (-1 to block, 0 to return immediately) and executes the
+ * callbacks of the ready ones. Returns the number of callbacks executed or
+ * a negative value on error. Allows the caller to drive the loop by itself.
+ */
+int ev_step(struct ev_ctx *, time_t);
+
 /*
  * Blocks forever in a loop polling for events with ev_poll calls. At every
  * cycle executes callbacks registered with each event
@@ -136,6 +159,24 @@ int ev_register_cron(struct ev_ctx *,
                      void *,
                      long long, long long);
 
+/*
+ * Defer a callback after the IO events of the current loop cycle, or of the
+ * next one if called by a deferred callback itself. Meant to split a long
+ * work in slices interleaved with the IO of other clients: each slice does a
+ * bounded amount of work and defers the next one. While tasks are queued the
+ * loop doesn't block polling. Must be called from the thread running the
+ * loop.
+ */
+void ev_defer(struct ev_ctx *, void (*callback)(struct ev_ctx *, void *),
+              void *);
+
+/*
+ * Remove the tasks deferred with the given callback and data, e.g. working on
+ * a client going away. Must be called from the thread running the loop.
+ */
+void ev_cancel(struct ev_ctx *, void (*callback)(struct ev_ctx *, void *),
+               const void *);
+
 /*
  * Register a new event for the next loop cycle to a FD. Equal to ev_watch_fd
  * but allow to carry an event object for the next cycle.
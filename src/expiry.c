@@ -0,0 +1,301 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include "ev.h"
+#include "config.h"
+#include "server.h"
+#include "memory.h"
+#include "logging.h"
+#include "trace.h"
+#include "wheel.h"
+#include "expiry.h"
+#include "handlers.h"
+#include "sol_internal.h"
+
+enum expiry_type { EXPIRY_QUEUED, EXPIRY_RETAINED, EXPIRY_SESSION };
+
+/*
+ * A message queued for a session or retained on a topic, or an offline
+ * session, the key is the topic name for a retained message, the session ID
+ * otherwise
+ */
+struct expiry_entry {
+    struct wheel_entry wheel;       /* Must be the first member */
+    enum expiry_type type;
+    struct mqtt_packet *packet;     /* Only for a queued message */
+    unsigned short mid;             /* Inflight slot, 0 if parked */
+    char *key;
+};
+
+static struct wheel wheel = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .last = 0,
+    .slots = { NULL }
+};
+
+static void entry_track(struct expiry_entry *e, time_t deadline) {
+    e->wheel.deadline = deadline;
+    wheel_add(&wheel, &e->wheel);
+}
+
+static void entry_free(struct expiry_entry *e) {
+    if (e->packet)
+        DECREF(e->packet, struct mqtt_packet);
+    free_memory(e->key);
+    free_memory(e);
+}
+
+/*
+ * Drop in a single pass all the expired messages queued or parked for an
+ * offline session, returns the number of parked ones dropped, the queued
+ * ones are counted as their inflight slots are cleared.
+ */
+static size_t compact_queued(struct client_session *s, time_t now) {
+    size_t dropped = 0;
+    struct list_node **node = &s->outgoing_msgs->head, *prev = NULL;
+    while (*node) {
+        struct mqtt_packet *pkt = (*node)->data;
+        if (!message_expired(pkt->expiry, now)) {
+            prev = *node;
+            node = &(*node)->next;
+            continue;
+        }
+        struct list_node *expired = *node;
+        *node = expired->next;
+        if (s->outgoing_msgs->tail == expired)
+            s->outgoing_msgs->tail = prev;
+        s->outgoing_msgs->len--;
+        DECREF(pkt, struct mqtt_packet);
+        free_memory(expired);
+    }
+    node = &s->pending_msgs->head;
+    prev = NULL;
+    while (*node) {
+        struct inflight_msg *pending = (*node)->data;
+        if (!message_expired(pending->packet->expiry, now)) {
+            prev = *node;
+            node = &(*node)->next;
+            continue;
+        }
+        struct list_node *expired = *node;
+        *node = expired->next;
+        if (s->pending_msgs->tail == expired)
+            s->pending_msgs->tail = prev;
+        s->pending_msgs->len--;
+        inflight_msg_clear(pending);
+        free_memory(pending);
+        free_memory(expired);
+        dropped++;
+    }
+    s->swept = now;
+    return dropped;
+}
+
+/*
+ * Drop a message queued for a session, the queues of a client online are
+ * being drained by its loop, only the inflight slot is cleared, not to be
+ * sent again. The queues of an offline session are compacted once per sweep,
+ * dropping all the messages expired, visited counts the compactions and the
+ * ones exceeding EXPIRY_SESSIONS_BATCH return false, nothing touched, to be
+ * put off to the next sweep. Must be called with the global lock held.
+ */
+static bool drop_queued(const struct expiry_entry *e, time_t now,
+                        size_t *visited, size_t *dropped) {
+    struct client_session *s = NULL;
+    struct client *c = NULL;
+    HASH_FIND_STR(server.sessions, e->key, s);
+    if (!s)
+        return true;
+    HASH_FIND_STR(server.clients_map, e->key, c);
+    bool online = c && c->online == true && c->session == s;
+    bool compact = online == false && s->swept != now;
+    if (compact == true && (*visited)++ >= EXPIRY_SESSIONS_BATCH)
+        return false;
+#if THREADSNR > 0
+    if (online == true)
+        pthread_mutex_lock(&c->mutex);
+#endif
+    if (e->mid > 0 && s->i_msgs && s->i_msgs[e->mid].packet == e->packet) {
+        inflight_msg_clear(&s->i_msgs[e->mid]);
+        s->i_msgs[e->mid].packet = NULL;
+        s->i_acks[e->mid] = -1;
+        --s->inflights;
+        (*dropped)++;
+    }
+    if (compact == true)
+        *dropped += compact_queued(s, now);
+#if THREADSNR > 0
+    if (online == true)
+        pthread_mutex_unlock(&c->mutex);
+#endif
+    return true;
+}
+
+/* Must be called with the global lock held */
+static size_t drop_retained(const struct expiry_entry *e, time_t now) {
+    struct topic *t = topic_store_get(server.store, e->key);
+    if (!t || !t->retained_msg || !message_expired(t->retained_expiry, now))
+        return 0;
+    free_memory(t->retained_msg);
+    t->retained_msg = NULL;
+    t->retained_expiry = 0;
+    return 1;
+}
+
+/*
+ * Reclaim a persistent session gone offline, unless it came back or went
+ * offline again since, then a newer entry tracks it. Must be called with the
+ * global lock held.
+ */
+static size_t drop_session(const struct expiry_entry *e, time_t now) {
+    struct client_session *s = NULL;
+    struct client *c = NULL;
+    HASH_FIND_STR(server.sessions, e->key, s);
+    if (!s || !message_expired(s->expiry, now))
+        return 0;
+    HASH_FIND_STR(server.clients_map, e->key, c);
+    if (c && c->online == true && c->session == s)
+        return 0;
+    log_debug("Session %s expired", s->session_id);
+    session_drop(s);
+    return 1;
+}
+
+time_t expiry_deadline(const char *topic) {
+    size_t len = strlen(topic);
+    size_t ttl = conf->expiry.ttl;
+    // Stored with the trailing '/', filters are matched as published
+    if (len > 0 && topic[len - 1] == '/')
+        len--;
+    for (int i = 0; i < conf->expiry.topics_nr; ++i) {
+        if (match_filter(conf->expiry.topics[i].filter, topic, len)) {
+            ttl = conf->expiry.topics[i].ttl;
+            break;
+        }
+    }
+    return ttl > 0 ? time(NULL) + (time_t) ttl : 0;
+}
+
+void expiry_track_queued(const struct client_session *s,
+                         struct mqtt_packet *pkt, unsigned short mid) {
+    struct expiry_entry *e = try_alloc(sizeof(*e));
+    e->type = EXPIRY_QUEUED;
+    e->packet = pkt;
+    e->mid = mid;
+    e->key = try_strdup(s->session_id);
+    INCREF(pkt, struct mqtt_packet);
+    entry_track(e, pkt->expiry);
+}
+
+void expiry_track_retained(const struct topic *t) {
+    struct expiry_entry *e = try_alloc(sizeof(*e));
+    e->type = EXPIRY_RETAINED;
+    e->packet = NULL;
+    e->mid = 0;
+    e->key = try_strdup(t->name);
+    entry_track(e, t->retained_expiry);
+}
+
+void expiry_track_session(const struct client_session *s) {
+    struct expiry_entry *e = try_alloc(sizeof(*e));
+    e->type = EXPIRY_SESSION;
+    e->packet = NULL;
+    e->mid = 0;
+    e->key = try_strdup(s->session_id);
+    entry_track(e, s->expiry);
+}
+
+void expiry_check(struct ev_ctx *ctx, void *data) {
+    (void) ctx;
+    (void) data;
+    time_t now = time(NULL);
+    struct wheel_entry *due = wheel_due(&wheel, now);
+    if (!due)
+        return;
+    size_t queued = 0, retained = 0, sessions = 0, visited = 0;
+    struct wheel_entry *later = NULL;
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    for (struct wheel_entry **w = &due; *w;) {
+        struct expiry_entry *e = (struct expiry_entry *) *w;
+        bool done = true;
+        switch (e->type) {
+            case EXPIRY_QUEUED:
+                done = drop_queued(e, now, &visited, &queued);
+                break;
+            case EXPIRY_RETAINED:
+                retained += drop_retained(e, now);
+                break;
+            case EXPIRY_SESSION:
+                /*
+                 * Reclaiming a session walks its subscriptions and the
+                 * wildcards, the ones exceeding the batch are put off to the
+                 * next sweep not to hold the lock for too long
+                 */
+                done = visited++ < EXPIRY_SESSIONS_BATCH;
+                if (done == true)
+                    sessions += drop_session(e, now);
+                break;
+        }
+        if (done == false) {
+            struct wheel_entry *next = (*w)->next;
+            (*w)->next = later;
+            later = *w;
+            *w = next;
+            continue;
+        }
+        w = &(*w)->next;
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    while (due) {
+        struct expiry_entry *e = (struct expiry_entry *) due;
+        due = due->next;
+        entry_free(e);
+    }
+    while (later) {
+        struct expiry_entry *e = (struct expiry_entry *) later;
+        later = later->next;
+        entry_track(e, now + 1);
+    }
+    if (queued > 0 || retained > 0 || sessions > 0)
+        log_debug("Expired %lu queued and %lu retained messages, %lu sessions",
+                  queued, retained, sessions);
+}
+
+void expiry_shutdown(void) {
+    struct wheel_entry *all = wheel_drain(&wheel);
+    while (all) {
+        struct expiry_entry *e = (struct expiry_entry *) all;
+        all = all->next;
+        entry_free(e);
+    }
+}
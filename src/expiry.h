@@ -0,0 +1,99 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef EXPIRY_H
+#define EXPIRY_H
+
+#include <time.h>
+#include <stddef.h>
+#include "config.h"
+
+struct ev_ctx;
+struct topic;
+struct mqtt_packet;
+struct client_session;
+
+/*
+ * Expiry of the messages kept by the broker on behalf of the clients: QoS > 0
+ * messages queued for offline sessions and retained messages. Their TTL is
+ * set by topic filter, see message_expiry_topic, falling back to
+ * message_expiry, no TTL at all means they're kept forever.
+ *
+ * The deadline is stamped on the packet, or on the topic for a retained
+ * message, and checked lazily as messages are about to be sent out: on
+ * session resume, as parked messages are released, on re-sends and on
+ * subscribe. Messages nobody asks for are dropped by a cron job sweeping a
+ * timing wheel of one second slots indexed by deadline, see wheel.h. The
+ * queues of an offline session are walked once per sweep, all the messages
+ * expired dropped in one pass.
+ *
+ * Persistent sessions gone offline are tracked on the same wheel, after
+ * session_expiry seconds they're reclaimed with their subscriptions, queues
+ * and inflight tables. Reclaimed sessions and walked queues are up to
+ * EXPIRY_SESSIONS_BATCH per sweep, the others are put off to the next one.
+ */
+
+#define EXPIRY_SESSIONS_BATCH   256
+
+/* A deadline passed, 0 is never */
+#define message_expired(deadline, now) ((deadline) > 0 && (deadline) <= (now))
+
+/* True if any TTL is set, nothing is tracked otherwise */
+#define expiry_enabled() \
+    (conf->expiry.ttl > 0 || conf->expiry.topics_nr > 0)
+
+/*
+ * Deadline of a message published now on a topic, as stored with the
+ * trailing '/', 0 if it never expires. Reads the configuration, the global
+ * lock must be held not to race with a reload.
+ */
+time_t expiry_deadline(const char *);
+
+/*
+ * Track a message queued for an offline session, or parked if mid is 0, to
+ * be dropped when the deadline stamped on it passes. Takes a reference on
+ * the packet.
+ */
+void expiry_track_queued(const struct client_session *,
+                         struct mqtt_packet *, unsigned short);
+
+/* Track a retained message, to be dropped once its deadline passes */
+void expiry_track_retained(const struct topic *);
+
+/*
+ * Track a persistent session gone offline, to be reclaimed when the deadline
+ * set on it passes, unless it's back online by then
+ */
+void expiry_track_session(const struct client_session *);
+
+/* Cron job dropping the messages and the sessions expired */
+void expiry_check(struct ev_ctx *, void *);
+
+/* Release everything tracked */
+void expiry_shutdown(void);
+
+#endif
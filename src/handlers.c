@@ -32,6 +32,14 @@
 #include "memory.h"
 #include "logging.h"
 #include "handlers.h"
+#include "memorypool.h"
+#include "trace.h"
+#include "bridge.h"
+#include "cluster.h"
+#include "embed.h"
+#include "auth.h"
+#include "acl.h"
+#include "expiry.h"
 #include "sol_internal.h"
 
 /* Prototype for a command handler */
@@ -51,12 +59,14 @@ static int pingreq_handler(struct io_event *);
 
 static void session_init(struct client_session *, const char *);
 
-static struct client_session *client_session_alloc(const char *);
-
 static unsigned next_free_mid(struct client_session *);
 
+static void inflight_tables_alloc(struct client_session *);
+
 static void inflight_msg_init(struct inflight_msg *, struct mqtt_packet *);
 
+static void topic_link_wildcards(struct topic *, const char *);
+
 /* Command handler mapped usign their position paired with their type */
 static handler *handlers[15] = {
     NULL,
@@ -87,14 +97,24 @@ static void session_free(const struct ref *refcount) {
         container_of(refcount, struct client_session, refcount);
     list_destroy(session->subscriptions, 0);
     list_destroy(session->outgoing_msgs, 0);
+    struct inflight_msg *pending = NULL;
+    while ((pending = list_pop(session->pending_msgs))) {
+        DECREF(pending->packet, struct mqtt_packet);
+        free_memory(pending);
+    }
+    list_destroy(session->pending_msgs, 0);
     if (has_inflight(session)) {
         for (int i = 0; i < MAX_INFLIGHT_MSGS; ++i) {
             if (session->i_msgs[i].packet)
                 DECREF(session->i_msgs[i].packet, struct mqtt_packet);
         }
     }
-    free_memory(session->i_acks);
-    free_memory(session->i_msgs);
+    if (session->i_msgs) {
+        free_memory(session->i_acks);
+        free_memory(session->i_msgs);
+        info.inflight_tables--;
+    }
+    info.sessions--;
     free_memory(session);
 }
 
@@ -103,24 +123,69 @@ static void session_init(struct client_session *session, const char *session_id)
     session->next_free_mid = 1;
     session->subscriptions = list_new(NULL);
     session->outgoing_msgs = list_new(NULL);
+    session->pending_msgs = list_new(NULL);
     snprintf(session->session_id, MQTT_CLIENT_ID_LEN, "%s", session_id);
-    session->i_acks = try_calloc(MAX_INFLIGHT_MSGS, sizeof(time_t));
-    session->i_msgs = try_calloc(MAX_INFLIGHT_MSGS, sizeof(struct inflight_msg));
+    session->i_acks = NULL;
+    session->i_msgs = NULL;
+    session->expiry = 0;
+    session->swept = 0;
     session->refcount = (struct ref) { session_free, 0 };
 }
 
-static struct client_session *client_session_alloc(const char *session_id) {
+struct client_session *client_session_alloc(const char *session_id) {
     struct client_session *session = try_alloc(sizeof(*session));
     session_init(session, session_id);
+    info.sessions++;
     return session;
 }
 
+/*
+ * Drop the session of a persistent client gone offline, like the one of a
+ * clean session client would be on disconnection. The offline client is
+ * still tracked in the clients map, with its client ID reset, it's reclaimed
+ * by the pool as well. Must be called with the global lock held.
+ */
+void session_drop(struct client_session *session) {
+    struct client *c, *tmp;
+    HASH_ITER(hh, server.clients_map, c, tmp) {
+        if (c->session == session && c->online == false) {
+            HASH_DEL(server.clients_map, c);
+            memorypool_free(server.pool, c);
+        }
+    }
+    topic_store_remove_wildcard(server.store, session->session_id);
+    list_foreach(item, session->subscriptions) {
+        struct topic *t = item->data;
+        struct subscriber *sub = NULL;
+        HASH_FIND_STR(t->subscribers, session->session_id, sub);
+        if (sub) {
+            HASH_DEL(t->subscribers, sub);
+            DECREF(sub, struct subscriber);
+        }
+    }
+    HASH_DEL(server.sessions, session);
+    DECREF(session, struct client_session);
+}
+
 static inline unsigned next_free_mid(struct client_session *session) {
     if (session->next_free_mid == MAX_INFLIGHT_MSGS)
         session->next_free_mid = 1;
     return session->next_free_mid++;
 }
 
+/*
+ * Allocate the inflight tables of a session on its first QoS > 0 message,
+ * they're about 2MB together and most of the sessions, idle or QoS 0 only,
+ * never need them. Must be called holding the lock guarding the session.
+ */
+static void inflight_tables_alloc(struct client_session *session) {
+    if (session->i_msgs)
+        return;
+    session->i_acks = try_calloc(MAX_INFLIGHT_MSGS, sizeof(time_t));
+    session->i_msgs = try_calloc(MAX_INFLIGHT_MSGS, sizeof(struct inflight_msg));
+    info.inflight_tables++;
+}
+
 static inline void inflight_msg_init(struct inflight_msg *imsg,
                                      struct mqtt_packet *p) {
     imsg->seen = time(NULL);
@@ -129,113 +194,293 @@ static inline void inflight_msg_init(struct inflight_msg *imsg,
 }
 
 /*
- * One of the two exposed functions of the module, it's also needed on server
- * module to publish periodic messages (e.g. $SOL stats). It's responsible
- * of the normal publish but also taking care of disconnected clients, enqueuing
- * packets and setting up inflight messages for QoS > 0.
- * Returns the number of publish done or an error code in case of conditions
- * that requires de-allocation of the pkt argument occurs.
+ * Drop a message that can't fit even an empty write buffer, freeing the
+ * inflight slot it holds, if any, so it's not sent again either
  */
-int publish_message(struct mqtt_packet *pkt, const struct topic *t) {
+static void message_oversize(struct client *c, struct mqtt_packet *pkt,
+                             size_t len) {
+    struct client_session *s = c->session;
+    unsigned short mid = pkt->publish.pkt_id;
+    log_warning("Dropping message to %s on %s, %lu bytes exceed the %lu "
+                "bytes of max_request_size", c->client_id, pkt->publish.topic,
+                len, (unsigned long) conf->max_request_size);
+    STATS_INC(messages_dropped);
+    if (mid > 0 && s->i_msgs && s->i_msgs[mid].packet == pkt) {
+        inflight_msg_clear(&s->i_msgs[mid]);
+        s->i_msgs[mid].packet = NULL;
+        s->i_acks[mid] = -1;
+        --s->inflights;
+    }
+}
 
-    bool all_at_most_once = true;
-    size_t len = 0;
-    unsigned short mid = 0;
-    unsigned char qos = pkt->header.bits.qos;
-#if THREADSNR > 0
-    pthread_mutex_lock(&mutex);
-#endif
-    int count = HASH_COUNT(t->subscribers);
+/*
+ * Park a QoS > 0 message in the pending queue of a session, it will be sent
+ * out as soon as the inflight window has room for it, see
+ * inflight_window_release. Takes a reference to the packet.
+ */
+static void inflight_window_park(struct client_session *session,
+                                 struct mqtt_packet *p) {
+    struct inflight_msg *pending = try_alloc(sizeof(*pending));
+    inflight_msg_init(pending, p);
+    INCREF(p, struct mqtt_packet);
+    list_push_back(session->pending_msgs, pending);
+}
 
-    if (count == 0) {
-        INCREF(pkt, struct mqtt_packet);
-        goto exit;
+/*
+ * Move as many parked messages as the inflight window allows from the pending
+ * queue of the session to the write buffer of the client, assigning them a
+ * message ID and tracking them as inflight. The shared packet is not touched,
+ * a shallow copy carrying the right QoS and ID is packed instead.
+ * Must be called with the client lock held, returns the number of messages
+ * written out, none while the session backlog is still being flushed. With
+ * the write buffer full the release is resumed once it's written out.
+ */
+static int inflight_window_release(struct client *c) {
+    int released = 0;
+    struct client_session *s = c->session;
+    // They follow the messages queued while offline, still being written out
+    if (c->backlog != BACKLOG_NONE)
+        return 0;
+    if (list_size(s->pending_msgs) > 0)
+        inflight_tables_alloc(s);
+    time_t now = time(NULL);
+    while (list_size(s->pending_msgs) > 0 && !inflight_window_full(s)) {
+        struct inflight_msg *pending = s->pending_msgs->head->data;
+        struct mqtt_packet p = *pending->packet;
+        p.header.bits.qos = pending->qos;
+        size_t len = mqtt_size(&p, NULL);
+        bool oversize = len > (size_t) conf->max_request_size;
+        // The write buffer is full, resumed once it's written out
+        if (oversize == false && !wbuf_fits(c, len)) {
+            c->backlog = BACKLOG_BLOCKED;
+            break;
+        }
+        list_pop(s->pending_msgs);
+        if (oversize == true)
+            message_oversize(c, &p, len);
+        if (oversize == true || message_expired(p.expiry, now)) {
+            inflight_msg_clear(pending);
+            free_memory(pending);
+            continue;
+        }
+        unsigned short mid = next_free_mid(s);
+        p.publish.pkt_id = mid;
+        // The reference taken on park is handed over to the inflight slot
+        s->i_msgs[mid] = (struct inflight_msg) {
+            .seen = time(NULL),
+            .packet = pending->packet,
+            .qos = pending->qos
+        };
+        s->i_acks[mid] = time(NULL);
+        ++s->inflights;
+        mqtt_pack(&p, c->wbuf + c->towrite);
+        c->towrite += len;
+        free_memory(pending);
+        STATS_INC(messages_sent);
+        c->stats.messages_out++;
+        released++;
     }
+    if (released > 0)
+        log_debug("Released %i pending messages to %s (%lu still queued)",
+                  released, c->client_id, list_size(s->pending_msgs));
+    return released;
+}
 
-    // first run check
-    struct subscriber *sub, *dummy;
-    HASH_ITER(hh, t->subscribers, sub, dummy) {
-        struct client_session *s = sub->session;
-        struct client *sc = NULL;
-        HASH_FIND_STR(server.clients_map, s->session_id, sc);
-        /*
-         * Update QoS according to subscriber's one, following MQTT
-         * rules: The min between the original QoS and the subscriber
-         * QoS
-         */
-        pkt->header.bits.qos = qos >= sub->granted_qos ? sub->granted_qos : qos;
-        len = mqtt_size(pkt, NULL); // override len, no ID set in QoS 0
+/*
+ * Deliver a message to a single subscriber, updating the QoS according to
+ * the one granted, following MQTT rules: the min between the original QoS
+ * and the subscriber QoS. Must be called with the global lock held, returns
+ * 1 if the message has been sent, queued or parked with a QoS > 0, 0
+ * otherwise.
+ */
+static int publish_deliver(struct mqtt_packet *pkt, unsigned char qos,
+                           struct client_session *s, unsigned char granted_qos,
+                           uint64_t start) {
+    int delivered = 0;
+    struct client *sc = NULL;
+    HASH_FIND_STR(server.clients_map, s->session_id, sc);
+    pkt->header.bits.qos = qos >= granted_qos ? granted_qos : qos;
+    size_t len = mqtt_size(pkt, NULL); // override len, no ID set in QoS 0
+    /*
+     * if QoS 0
+     *
+     * Set the correct size of the output packet and set the
+     * correct QoS value (0) and packet identifier to (0) as
+     * specified by MQTT specs
+     */
+    pkt->publish.pkt_id = 0;
+
+    /*
+     * if QoS > 0 we set packet identifier and track the inflight
+     * message, proceed with the publish towards online subscriber.
+     */
+    if (pkt->header.bits.qos > AT_MOST_ONCE) {
         /*
-         * if QoS 0
-         *
-         * Set the correct size of the output packet and set the
-         * correct QoS value (0) and packet identifier to (0) as
-         * specified by MQTT specs
+         * The inflight window of the session is full, the message is
+         * parked and will be released as soon as the subscriber
+         * acknowledges some of the messages already sent. This is valid
+         * for offline clients as well, they'll receive the exceeding
+         * messages as they ack the ones sent on reconnection.
          */
-        pkt->publish.pkt_id = 0;
-
+        if (inflight_window_full(s)
+            && (s->clean_session == false || (sc && sc->online == true))) {
+#if THREADSNR > 0
+            if (sc) pthread_mutex_lock(&sc->mutex);
+#endif
+            inflight_window_park(s, pkt);
+#if THREADSNR > 0
+            if (sc) pthread_mutex_unlock(&sc->mutex);
+#endif
+            if (pkt->expiry > 0 && (!sc || sc->online == false))
+                expiry_track_queued(s, pkt, 0);
+            return 1;
+        }
         /*
-         * if QoS > 0 we set packet identifier and track the inflight
-         * message, proceed with the publish towards online subscriber.
+         * The messages queued while offline are still being written out to
+         * the subscriber, or its write buffer is full, this one is parked to
+         * follow them, released once the buffer is written out
          */
-        if (pkt->header.bits.qos > AT_MOST_ONCE) {
-            mid = next_free_mid(s);
-            pkt->publish.pkt_id = mid;
-            INCREF(pkt, struct mqtt_packet);
-            /*
-             * If offline, we must enqueue messages in the inflight queue
-             * of the client, they will be sent out only in case of a
-             * clean_session == false connection
-             */
-            if (!sc || sc->online == false) {
-                if (s->clean_session == false) {
-                    list_push(s->outgoing_msgs, pkt);
-                    all_at_most_once = false;
-                    INCREF(pkt, struct mqtt_packet);
-                    inflight_msg_init(&s->i_msgs[mid], pkt);
-                    s->i_acks[mid] = time(NULL);
-                    ++s->inflights;
-                }
-                continue;
-            }
+        if (sc && sc->online == true) {
 #if THREADSNR > 0
             pthread_mutex_lock(&sc->mutex);
 #endif
-            /*
-             * The subscriber client is marked as online, so we proceed to
-             * set the inflight messages according to the QoS level required
-             * and write back the payload
-             */
-            inflight_msg_init(&sc->session->i_msgs[mid], pkt);
-            sc->session->i_acks[mid] = time(NULL);
-            ++sc->session->inflights;
+            bool behind = sc->backlog != BACKLOG_NONE;
+            if (behind == false && sc->towrite > 0 && !wbuf_fits(sc, len)) {
+                sc->backlog = BACKLOG_BLOCKED;
+                behind = true;
+            }
+            if (behind == true)
+                inflight_window_park(s, pkt);
 #if THREADSNR > 0
             pthread_mutex_unlock(&sc->mutex);
 #endif
-            all_at_most_once = false;
+            if (behind == true)
+                return 1;
+        }
+        unsigned short mid = next_free_mid(s);
+        pkt->publish.pkt_id = mid;
+        INCREF(pkt, struct mqtt_packet);
+        /*
+         * If offline, we must enqueue messages in the inflight queue
+         * of the client, they will be sent out only in case of a
+         * clean_session == false connection
+         */
+        if (!sc || sc->online == false) {
+            if (s->clean_session == false) {
+                list_push_back(s->outgoing_msgs, pkt);
+                INCREF(pkt, struct mqtt_packet);
+                inflight_tables_alloc(s);
+                inflight_msg_init(&s->i_msgs[mid], pkt);
+                s->i_acks[mid] = time(NULL);
+                ++s->inflights;
+                if (pkt->expiry > 0)
+                    expiry_track_queued(s, pkt, mid);
+                return 1;
+            }
+            return 0;
         }
 #if THREADSNR > 0
         pthread_mutex_lock(&sc->mutex);
 #endif
-        mqtt_pack(pkt, sc->wbuf + sc->towrite);
-        sc->towrite += len;
+        /*
+         * The subscriber client is marked as online, so we proceed to
+         * set the inflight messages according to the QoS level required
+         * and write back the payload
+         */
+        inflight_tables_alloc(sc->session);
+        inflight_msg_init(&sc->session->i_msgs[mid], pkt);
+        sc->session->i_acks[mid] = time(NULL);
+        ++sc->session->inflights;
 #if THREADSNR > 0
         pthread_mutex_unlock(&sc->mutex);
 #endif
+        delivered = 1;
+    } else if (!sc || sc->online == false) {
+        // QoS 0 messages are not stored for offline clients
+        return 0;
+    }
+#if THREADSNR > 0
+    pthread_mutex_lock(&sc->mutex);
+#endif
+    /*
+     * No room left in the write buffer, a QoS 0 message is dropped, a QoS > 0
+     * one is already tracked as inflight and will be sent again later, unless
+     * it can't fit at all
+     */
+    if (!wbuf_fits(sc, len)) {
+        if (len > (size_t) conf->max_request_size) {
+            message_oversize(sc, pkt, len);
+            delivered = 0;
+        } else if (pkt->header.bits.qos == AT_MOST_ONCE) {
+            STATS_INC(messages_dropped);
+        }
+#if THREADSNR > 0
+        pthread_mutex_unlock(&sc->mutex);
+#endif
+        log_debug("Write buffer of %s full, %s message on %s",
+                  sc->client_id, delivered ? "delaying" : "dropping",
+                  pkt->publish.topic);
+        return delivered;
+    }
+    mqtt_pack(pkt, sc->wbuf + sc->towrite);
+    sc->towrite += len;
+    sc->stats.messages_out++;
+    /*
+     * Schedule a write for the current subscriber on the next event
+     * cycle, under its lock so it can't race with the subscriber loop
+     * re-arming the descriptor for reading after a write
+     */
+    enqueue_event_write(sc);
+#if THREADSNR > 0
+    pthread_mutex_unlock(&sc->mutex);
+#endif
+
+    LATENCY_RECORD(LATENCY_ROUTING, start);
+
+    STATS_INC(messages_sent);
+
+    log_debug("Sending PUBLISH to %s (d%i, q%u, r%i, m%u, %s, ... (%i bytes))",
+              sc->client_id,
+              pkt->header.bits.dup,
+              pkt->header.bits.qos,
+              pkt->header.bits.retain,
+              pkt->publish.pkt_id,
+              pkt->publish.topic,
+              pkt->publish.payloadlen);
+    return delivered;
+}
+
+/*
+ * One of the two exposed functions of the module, it's also needed on server
+ * module to publish periodic messages (e.g. $SOL stats). It's responsible
+ * of the normal publish but also taking care of disconnected clients, enqueuing
+ * packets and setting up inflight messages for QoS > 0.
+ * Returns the number of publish done. Every subscriber getting a QoS > 0
+ * message takes a reference on pkt, callers owning a heap allocated packet
+ * must hold their own reference across the call, as the acks of the first
+ * subscribers may come in before the routing is done.
+ */
+int publish_message(struct mqtt_packet *pkt, const struct topic *t) {
+
+    bool all_at_most_once = true;
+    unsigned char qos = pkt->header.bits.qos;
+    // Routing latency includes the wait on the global lock
+    uint64_t start = monotonic_ns();
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    int count = HASH_COUNT(t->subscribers);
 
-        // Schedule a write for the current subscriber on the next event cycle
-        enqueue_event_write(sc);
+    if (count == 0)
+        goto exit;
 
-        info.messages_sent++;
+    if (qos > AT_MOST_ONCE && expiry_enabled())
+        pkt->expiry = expiry_deadline(t->name);
 
-        log_debug("Sending PUBLISH to %s (d%i, q%u, r%i, m%u, %s, ... (%i bytes))",
-                  sc->client_id,
-                  pkt->header.bits.dup,
-                  pkt->header.bits.qos,
-                  pkt->header.bits.retain,
-                  pkt->publish.pkt_id,
-                  pkt->publish.topic,
-                  pkt->publish.payloadlen);
+    struct subscriber *sub, *dummy;
+    HASH_ITER(hh, t->subscribers, sub, dummy) {
+        if (publish_deliver(pkt, qos, sub->session, sub->granted_qos, start) > 0)
+            all_at_most_once = false;
     }
 
     // add return code
@@ -251,49 +496,175 @@ exit:
 }
 
 /*
- * Check if a topic match a wildcard subscription. It works with + and # as
- * well
+ * A fan-out split in slices of FANOUT_SLICE recipients, the subscribers of
+ * the topic at the time of the publish, each one holding a reference to its
+ * session
  */
-static inline int match_subscription(const char *topic,
-                                     const char *wtopic, bool multilevel) {
-    size_t len = strlen(wtopic);
-    int i = 0, j = 0;
-    bool found = false;
-    char *ptopic = (char *) topic;
-    /*
-     * Cycle through the wildcard topic, char by char, seeking for '+' char and
-     * at the same time assuring that every char is equal in the topic as well,
-     * we don't want to accept different topics
-     */
-    while (i < len && wtopic[i]) {
-        j = 0;
-        for (; i < len; ++i) {
-            if (wtopic[i] == '+') {
-                found = true;
-                break;
-            } else if (!ptopic || (wtopic[i] != ptopic[j])) {
-                return -SOL_ERR;
-            }
-            j++;
-        }
-        /*
-         * Get a pointer to the next '/', called two times because we want to
-         * skip the first occurence, like foo/bar/baz, cause at this point we'
-         * re already at /bar/baz and we don't need a pointer to /bar/baz
-         * again
-         */
-        if (ptopic[0] == '/')
-            ptopic++;
-        ptopic = index(ptopic, '/');
-        if (ptopic[0] == '/')
-            ptopic = index(ptopic + 1, '/');
-        i++;
+struct fanout {
+    struct mqtt_packet *pkt;
+    struct client *publisher;   /* NULL once disconnected */
+    unsigned char qos;
+    uint64_t start;
+    size_t next;
+    size_t len;
+    struct {
+        struct client_session *session;
+        unsigned char qos;
+    } recipients[];
+};
+
+/*
+ * Route the next slice of a fan-out, deferring the one after it to the next
+ * loop cycle. Once done, the publisher is read again.
+ */
+static void fanout_run(struct ev_ctx *ctx, void *arg) {
+    struct fanout *f = arg;
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    size_t end = f->next + FANOUT_SLICE < f->len ? f->next + FANOUT_SLICE : f->len;
+    for (; f->next < end; ++f->next) {
+        struct client_session *s = f->recipients[f->next].session;
+        // Ours is the last reference, the session has been dropped meanwhile
+        if (s->refcount.count > 1)
+            publish_deliver(f->pkt, f->qos, s, f->recipients[f->next].qos,
+                            f->start);
+        DECREF(s, struct client_session);
+    }
+    bool done = f->next == f->len;
+    if (done == true && f->publisher) {
+        f->publisher->fanout = NULL;
+        server_rearm(f->publisher);
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    if (done == false) {
+        ev_defer(ctx, fanout_run, f);
+        return;
     }
-    if (!found && ptopic && multilevel == true)
-        return SOL_OK;
-    if (ptopic && (ptopic[0] == '/' || ptopic[1] != '\0') && multilevel == false)
-        return -SOL_ERR;
-    return SOL_OK;
+    DECREF(f->pkt, struct mqtt_packet);
+    free_memory(f);
+}
+
+/*
+ * Route a PUBLISH received from a client like publish_message, unless the
+ * topic has more than FANOUT_SLICE subscribers: the first slice is routed
+ * right away, the others on the next cycles of the loop of the publisher,
+ * interleaved with the IO of the other clients. The publisher isn't read
+ * till the fan-out is done, keeping its messages in order.
+ */
+static void publish_fanout(struct client *c, struct mqtt_packet *pkt,
+                           const struct topic *t) {
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    size_t count = HASH_COUNT(t->subscribers);
+    if (count <= FANOUT_SLICE) {
+#if THREADSNR > 0
+        pthread_mutex_unlock(&mutex);
+#endif
+        publish_message(pkt, t);
+        return;
+    }
+    struct fanout *f =
+        try_alloc(sizeof(*f) + count * sizeof(f->recipients[0]));
+    f->pkt = pkt;
+    f->publisher = c;
+    f->qos = pkt->header.bits.qos;
+    f->start = monotonic_ns();
+    f->next = 0;
+    f->len = 0;
+    INCREF(pkt, struct mqtt_packet);
+    if (f->qos > AT_MOST_ONCE && expiry_enabled())
+        pkt->expiry = expiry_deadline(t->name);
+    struct subscriber *sub, *dummy;
+    HASH_ITER(hh, t->subscribers, sub, dummy) {
+        f->recipients[f->len].session = sub->session;
+        f->recipients[f->len].qos = sub->granted_qos;
+        INCREF(sub->session, struct client_session);
+        f->len++;
+    }
+    c->fanout = f;
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    log_debug("Routing PUBLISH of %s to %lu subscribers in slices",
+              c->client_id, f->len);
+    fanout_run(c->ctx, f);
+}
+
+void fanout_detach(struct client *c) {
+    if (c->fanout) {
+        c->fanout->publisher = NULL;
+        c->fanout = NULL;
+    }
+}
+
+/*
+ * Store a PUBLISH as the retained message of a topic, ready to be sent out,
+ * stamping its deadline if any. Must be called with the global lock held.
+ */
+static void topic_retain(struct topic *t, const struct mqtt_packet *pkt) {
+    free_memory(t->retained_msg);
+    t->retained_msg = try_alloc(mqtt_size(pkt, NULL));
+    mqtt_pack(pkt, t->retained_msg);
+    t->retained_expiry = expiry_enabled() ? expiry_deadline(t->name) : 0;
+    if (t->retained_expiry > 0)
+        expiry_track_retained(t);
+}
+
+/*
+ * Route a message coming from outside of the clients, e.g. from a bridge,
+ * like a PUBLISH received from a client, wildcard subscriptions and retained
+ * message included. pkt must be heap allocated, a reference is taken for the
+ * time of the call.
+ */
+int publish_external(struct mqtt_packet *pkt) {
+    struct mqtt_publish *p = &pkt->publish;
+    char topic[p->topiclen + 2];
+    if (p->topic[p->topiclen - 1] != '/')
+        snprintf(topic, p->topiclen + 2, "%s/", (const char *) p->topic);
+    else
+        snprintf(topic, p->topiclen + 1, "%s", (const char *) p->topic);
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    struct topic *t = topic_store_get_or_put(server.store, topic);
+    topic_link_wildcards(t, topic);
+    if (pkt->header.bits.retain == 1)
+        topic_retain(t, pkt);
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    unsigned qos = pkt->header.bits.qos;
+    INCREF(pkt, struct mqtt_packet);
+    int n = publish_message(pkt, t);
+    if (embed_enabled == true)
+        embed_deliver(&pkt->publish, qos, pkt->header.bits.retain);
+    DECREF(pkt, struct mqtt_packet);
+    return n;
+}
+
+/*
+ * Check if the majority of the online subscribers of a topic have more than
+ * backpressure_threshold bytes still waiting to be written out on their
+ * sockets, meaning they can't keep up with the rate of incoming publishes.
+ * Must be called with the global lock held.
+ */
+bool topic_congested(const struct topic *t) {
+    size_t online = 0, congested = 0;
+    struct subscriber *sub, *dummy;
+    HASH_ITER(hh, t->subscribers, sub, dummy) {
+        struct client *sc = NULL;
+        HASH_FIND_STR(server.clients_map, sub->session->session_id, sc);
+        if (!sc || sc->online == false)
+            continue;
+        online++;
+        if (sc->towrite - sc->wrote > conf->backpressure_threshold)
+            congested++;
+    }
+    return congested * 2 > online;
 }
 
 /*
@@ -322,20 +693,67 @@ static void set_connack(struct client *c, unsigned char rc, unsigned sp) {
         log_info("Resuming session for %s", c->client_id);
         /*
          * If there's already some subscriptions and pending messages,
-         * empty the queue
+         * empty the queue, BACKLOG_SLICE messages per loop cycle; the ones
+         * parked while offline, exceeding the inflight window, follow
          */
-        // TODO check for write buffer size exceed
-        if (list_size(c->session->outgoing_msgs) > 0) {
-            size_t len = 0;
-            list_foreach(item, c->session->outgoing_msgs) {
-                len = mqtt_size(item->data, NULL);
-                mqtt_pack(item->data, c->wbuf + c->towrite);
-                c->towrite += len;
-            }
-            // We want to clean up the queue after the payload set
-            list_clear(c->session->outgoing_msgs, 0);
+        c->backlog = BACKLOG_QUEUED;
+        session_backlog_flush(c->ctx, c);
+    }
+}
+
+/*
+ * Write out the next BACKLOG_SLICE messages queued for a resumed session, as
+ * far as they fit in the write buffer, deferring the rest to the next loop
+ * cycle, or to the write of the buffer if it's full. Once the queue is empty
+ * the messages parked exceeding the inflight window are released.
+ */
+void session_backlog_flush(struct ev_ctx *ctx, void *arg) {
+    struct client *c = arg;
+    size_t flushed = 0;
+    time_t now = time(NULL);
+#if THREADSNR > 0
+    pthread_mutex_lock(&c->mutex);
+#endif
+    struct client_session *s = c->session;
+    while (list_size(s->outgoing_msgs) > 0 && flushed < BACKLOG_SLICE) {
+        struct mqtt_packet *pkt = s->outgoing_msgs->head->data;
+        size_t len = mqtt_size(pkt, NULL);
+        bool oversize = len > (size_t) conf->max_request_size;
+        if (oversize == false && !wbuf_fits(c, len))
+            break;
+        list_pop(s->outgoing_msgs);
+        /*
+         * Never fitting the buffer, e.g. max_request_size was lowered since
+         * it was queued, it would block the session forever
+         */
+        if (oversize == true)
+            message_oversize(c, pkt, len);
+        // Expired ones are left to the inflight check to clear
+        else if (!message_expired(pkt->expiry, now)) {
+            mqtt_pack(pkt, c->wbuf + c->towrite);
+            c->towrite += len;
+            flushed++;
         }
+        // The inflight slot still holds its own reference
+        DECREF(pkt, struct mqtt_packet);
+    }
+    if (list_size(s->outgoing_msgs) == 0) {
+        c->backlog = BACKLOG_NONE;
+        inflight_window_release(c);
+    } else if (flushed == BACKLOG_SLICE) {
+        c->backlog = BACKLOG_QUEUED;
+        ev_defer(ctx, session_backlog_flush, c);
+    } else {
+        // The write buffer is full, resumed once it's written out
+        c->backlog = BACKLOG_BLOCKED;
     }
+    if (c->towrite > 0)
+        enqueue_event_write(c);
+#if THREADSNR > 0
+    pthread_mutex_unlock(&c->mutex);
+#endif
+    log_debug("Flushed %lu queued messages to %s (%lu still queued)",
+              flushed, c->client_id, list_size(s->outgoing_msgs));
 }
 
 static int connect_handler(struct io_event *e) {
@@ -361,12 +779,35 @@ static int connect_handler(struct io_event *e) {
     if (conf->allow_anonymous == false) {
         if (c->bits.username == 0 || c->bits.password == 0)
             goto bad_auth;
-        else {
+        /*
+         * Checked by the auth workers, the CONNECT is handled again once
+         * they're done, with the outcome set
+         */
+        if (cc->auth == AUTH_UNCHECKED) {
+            // A copy, the table may be swapped by a reload while hashing
             struct authentication *auth = NULL;
-            HASH_FIND_STR(server.auths, (char *) c->payload.username, auth);
-            if (!auth || !check_passwd((char *) c->payload.password, auth->salt))
+            char *salt = NULL;
+#if THREADSNR > 0
+            TRACE_LOCK("mutex_wait", &mutex);
+#endif
+            struct authentication *auths = atomic_load(&server.auths);
+            HASH_FIND_STR(auths, (char *) c->payload.username, auth);
+            if (auth)
+                salt = try_strdup(auth->salt);
+#if THREADSNR > 0
+            pthread_mutex_unlock(&mutex);
+#endif
+            if (!salt)
                 goto bad_auth;
+            // Set by the worker if pending, it may be done already
+            int rc = auth_check(e, salt);
+            free_memory(salt);
+            if (rc == AUTH_PENDING)
+                return PARKED;
+            cc->auth = rc;
         }
+        if (cc->auth != AUTH_GRANTED)
+            goto bad_auth;
     }
 
     /*
@@ -376,6 +817,18 @@ static int connect_handler(struct io_event *e) {
     if (!c->payload.client_id[0] && c->bits.clean_session == false)
         goto not_authorized;
 
+    /*
+     * Client IDs with the cluster prefix are reserved to the other nodes, a
+     * node skips the ACLs and can move sessions, so it must authenticate with
+     * the cluster credentials
+     */
+    bool peer = cluster_is_peer((const char *) c->payload.client_id);
+    if (peer == true && !cluster_authenticate(c)) {
+        log_info("Refused %s, not authenticated as a cluster node",
+                 c->payload.client_id);
+        goto not_authorized;
+    }
+
     /*
      * Check for client ID, if not present generate a random ID, otherwise add
      * the client to the sessions map if not already present
@@ -388,9 +841,29 @@ static int connect_handler(struct io_event *e) {
      */
     snprintf(cc->client_id, MQTT_CLIENT_ID_LEN, "%s", c->payload.client_id);
 
+    /*
+     * With ACLs set, a will the client couldn't publish itself is dropped,
+     * the connection is accepted anyway. The username is kept in any case,
+     * ACLs may be enabled by a reload.
+     */
+    bool will = c->bits.will == 1;
+    cc->acl = acl_client_new(c->bits.username == 1
+                             ? (const char *) c->payload.username : NULL);
 #if THREADSNR > 0
-    pthread_mutex_lock(&mutex);
+    TRACE_LOCK("mutex_wait", &mutex);
 #endif
+    struct acl *acl = atomic_load(&server.acl);
+    if (acl) {
+        if (will == true
+            && !acl_can_publish(acl, cc->acl, cc->client_id,
+                                (const char *) c->payload.will_topic,
+                                strlen((const char *) c->payload.will_topic))) {
+            log_info("Will topic %s of %s refused by the ACLs",
+                     c->payload.will_topic, cc->client_id);
+            will = false;
+        }
+    }
+
     // First we check if a session is present
     HASH_FIND_STR(server.sessions, cc->client_id, cc->session);
     if (cc->session && c->bits.clean_session == true)
@@ -398,6 +871,9 @@ static int connect_handler(struct io_event *e) {
         HASH_DEL(server.sessions, cc->session);
     else if (cc->session)
         session_present = 1;
+    // Back online, it doesn't expire anymore
+    if (cc->session)
+        cc->session->expiry = 0;
 
     cc->connected = true;
 
@@ -425,7 +901,7 @@ static int connect_handler(struct io_event *e) {
 #endif
 
     // Add LWT topic and message if present
-    if (c->bits.will) {
+    if (will == true) {
         cc->has_lwt = true;
         const char *will_topic = (const char *) c->payload.will_topic;
         const char *will_message = (const char *) c->payload.will_message;
@@ -451,12 +927,15 @@ static int connect_handler(struct io_event *e) {
         cc->session->lwt_msg.header.bits.qos = c->bits.will_qos;
         // We must store the retained message in the topic
         if (c->bits.will_retain == 1) {
-            size_t publen = mqtt_size(&cc->session->lwt_msg, NULL);
-            unsigned char *payload = try_alloc(publen);
-            mqtt_pack(&cc->session->lwt_msg, payload);
             // We got a ready-to-be-sent bytestring in the retained message
             // field
-            t->retained_msg = payload;
+#if THREADSNR > 0
+            TRACE_LOCK("mutex_wait", &mutex);
+#endif
+            topic_retain(t, &cc->session->lwt_msg);
+#if THREADSNR > 0
+            pthread_mutex_unlock(&mutex);
+#endif
         }
         log_info("Will message specified (%lu bytes)",
                  cc->session->lwt_msg.publish.payloadlen);
@@ -467,6 +946,14 @@ static int connect_handler(struct io_event *e) {
 
     cc->clean_session = c->bits.clean_session;
 
+    /*
+     * Other nodes of the cluster connect with a reserved client ID, any other
+     * client connecting here is taken over from the node it was connected to
+     */
+    cc->cluster_peer = peer;
+    if (cluster_enabled == true && cc->cluster_peer == false)
+        cluster_connected(cc->client_id);
+
     set_connack(cc, MQTT_CONNECTION_ACCEPTED, session_present);
 
     log_debug("Sending CONNACK to %s (%u, %u)",
@@ -528,9 +1015,72 @@ static void recursive_sub(struct trie_node *node, void *arg) {
     list_push(s->session->subscriptions, t);
 }
 
-static int subscribe_handler(struct io_event *e) {
+/*
+ * Subscribe a session to a filter, as sent by the client. Must be called with
+ * the global lock held, returns the topic subscribed.
+ */
+struct topic *session_subscribe(struct client_session *session,
+                                const char *filter, size_t len, unsigned qos) {
 
     bool wildcard = false;
+    char topic[len + 2];
+    snprintf(topic, len + 1, "%s", filter);
+
+    /* Recursive subscribe to all children topics if the topic ends with "/#" */
+    if (len > 1 && topic[len - 1] == '#' && topic[len - 2] == '/') {
+        topic[len - 1] = '\0';
+        wildcard = true;
+    } else if (topic[len - 1] != '/') {
+        topic[len] = '/';
+        topic[len + 1] = '\0';
+    }
+
+    /*
+     * Check if the topic exists already or in case create it and store in
+     * the global map
+     */
+    struct topic *t = topic_store_get_or_put(server.store, topic);
+    /*
+     * Let's explore two possible scenarios:
+     * 1. Normal topic (no single level wildcard '+') which can end with
+     *    multilevel wildcard '#'
+     * 2. A topic contaning one or more single level wildcard '+'
+     */
+    if (!index(topic, '+')) {
+        struct subscriber *tmp;
+        HASH_FIND_STR(t->subscribers, session->session_id, tmp);
+        if (session->clean_session == true || !tmp) {
+            if (!tmp) {
+                tmp = topic_add_subscriber(t, session, qos);
+                // we increment reference for the subscriptions session
+                INCREF(tmp, struct subscriber);
+            }
+            list_push(session->subscriptions, t);
+            if (wildcard == true) {
+                add_wildcard(topic, tmp, wildcard);
+                topic_store_map(server.store, topic, recursive_sub, tmp);
+            }
+        }
+    } else {
+        /*
+         * Here we encountered at least 1 single level wildcard '+', we add
+         * the topic to the wildcards list as we can't know at this point
+         * which topic it will match, unless already subscribed
+         */
+        topic_store_wildcards_foreach(item, server.store) {
+            struct subscription *ws = item->data;
+            if (ws->subscriber->session == session
+                && ws->multilevel == wildcard && strcmp(ws->topic, topic) == 0)
+                return t;
+        }
+        struct subscriber *sub = subscriber_new(session, qos);
+        add_wildcard(topic, sub, wildcard);
+    }
+    return t;
+}
+
+static int subscribe_handler(struct io_event *e) {
+
     struct mqtt_subscribe *s = &e->data.subscribe;
 
     /*
@@ -539,95 +1089,101 @@ static int subscribe_handler(struct io_event *e) {
      */
     unsigned char rcs[s->tuples_len];
     struct client *c = e->client;
+    struct mqtt_packet pkt = {
+        .header = (union mqtt_header) { .byte = SUBACK_B },
+        .suback = (struct mqtt_suback) { .rcslen = s->tuples_len }
+    };
+    // Room is left for the SUBACK, retained messages not fitting are dropped
+    size_t suback_len = mqtt_size(&pkt, NULL);
 
     /* Subscribe packets contains a list of topics and QoS tuples */
     for (unsigned i = 0; i < s->tuples_len; i++) {
 
         log_debug("Received SUBSCRIBE from %s", c->client_id);
-
-        /*
-         * Check if the topic exists already or in case create it and store in
-         * the global map
-         */
-        char topic[s->tuples[i].topic_len + 2];
-        snprintf(topic, s->tuples[i].topic_len + 1, "%s", s->tuples[i].topic);
-
-        log_debug("\t%s (QoS %i)", topic, s->tuples[i].qos);
-        /* Recursive subscribe to all children topics if the topic ends with "/#" */
-        if (topic[s->tuples[i].topic_len - 1] == '#' &&
-            topic[s->tuples[i].topic_len - 2] == '/') {
-            topic[s->tuples[i].topic_len - 1] = '\0';
-            wildcard = true;
-        } else if (topic[s->tuples[i].topic_len - 1] != '/') {
-            topic[s->tuples[i].topic_len] = '/';
-            topic[s->tuples[i].topic_len + 1] = '\0';
+        log_debug("\t%.*s (QoS %i)", s->tuples[i].topic_len,
+                  s->tuples[i].topic, s->tuples[i].qos);
+
+        // Messages between the nodes of a cluster are for them only
+        if (cluster_enabled == true && c->cluster_peer == false
+            && cluster_is_control((const char *) s->tuples[i].topic,
+                                  s->tuples[i].topic_len)) {
+            log_debug("\t%.*s reserved to the cluster", s->tuples[i].topic_len,
+                      s->tuples[i].topic);
+            rcs[i] = 0x80;
+            continue;
         }
 
-        struct topic *t = topic_store_get_or_put(server.store, topic);
-        /*
-         * Let's explore two possible scenarios:
-         * 1. Normal topic (no single level wildcard '+') which can end with
-         *    multilevel wildcard '#'
-         * 2. A topic contaning one or more single level wildcard '+'
-         */
 #if THREADSNR > 0
-        pthread_mutex_lock(&c->mutex);
-        pthread_mutex_lock(&mutex);
-#endif
-        if (!index(topic, '+')) {
-            struct subscriber *tmp;
-            HASH_FIND_STR(t->subscribers, c->client_id, tmp);
-            if (c->clean_session == true || !tmp) {
-                if (!tmp) {
-                    tmp = topic_add_subscriber(t, e->client->session,
-                                               s->tuples[i].qos);
-                    // we increment reference for the subscriptions session
-                    INCREF(tmp, struct subscriber);
-                }
-                list_push(e->client->session->subscriptions, t);
-                if (wildcard == true) {
-                    add_wildcard(topic, tmp, wildcard);
-                    topic_store_map(server.store, topic, recursive_sub, tmp);
-                }
-            }
-        } else {
-            /*
-             * Here we encountered at least 1 single level wildcard '+', we add
-             * the topic to the wildcards list as we can't know at this point
-             * which topic it will match
-             */
-            struct subscriber *sub = subscriber_new(e->client->session,
-                                                    s->tuples[i].qos);
-            add_wildcard(topic, sub, wildcard);
+        TRACE_LOCK("mutex_wait", &mutex);
+#endif
+        // Refused by the ACLs, nodes of the cluster are trusted
+        struct acl *acl = atomic_load(&server.acl);
+        if (acl && c->cluster_peer == false
+            && !acl_can_subscribe(acl, c->acl, c->client_id,
+                                  (const char *) s->tuples[i].topic,
+                                  s->tuples[i].topic_len)) {
+#if THREADSNR > 0
+            pthread_mutex_unlock(&mutex);
+#endif
+            log_debug("\t%.*s refused by the ACLs", s->tuples[i].topic_len,
+                      s->tuples[i].topic);
+            rcs[i] = 0x80;
+            continue;
         }
+
 #if THREADSNR > 0
-        pthread_mutex_unlock(&mutex);
+        pthread_mutex_lock(&c->mutex);
 #endif
+        struct topic *t = session_subscribe(c->session,
+                                            (const char *) s->tuples[i].topic,
+                                            s->tuples[i].topic_len,
+                                            s->tuples[i].qos);
 
         // Retained message? Publish it
         // TODO move after SUBACK response
+        if (t->retained_msg
+            && message_expired(t->retained_expiry, time(NULL))) {
+            free_memory(t->retained_msg);
+            t->retained_msg = NULL;
+            t->retained_expiry = 0;
+        }
         if (t->retained_msg) {
             size_t len = alloc_size(t->retained_msg);
-            memcpy(c->wbuf + c->towrite, t->retained_msg, len);
-            c->towrite += len;
+            if (wbuf_fits(c, len + suback_len)) {
+                memcpy(c->wbuf + c->towrite, t->retained_msg, len);
+                c->towrite += len;
+            } else {
+                log_warning("Dropping retained message of %s to %s, the "
+                            "write buffer is full", t->name, c->client_id);
+                STATS_INC(messages_dropped);
+            }
         }
 #if THREADSNR > 0
+        pthread_mutex_unlock(&mutex);
         pthread_mutex_unlock(&c->mutex);
 #endif
         rcs[i] = s->tuples[i].qos;
+
+        // Let the other nodes know, messages matching will be routed here
+        if (cluster_enabled == true && c->cluster_peer == false)
+            cluster_subscribed((const char *) s->tuples[i].topic,
+                               s->tuples[i].topic_len);
     }
 
-    struct mqtt_packet pkt = {
-        .header = (union mqtt_header) { .byte = SUBACK_B }
-    };
     mqtt_suback(&pkt, s->pkt_id, rcs, s->tuples_len);
 
 #if THREADSNR > 0
     pthread_mutex_lock(&c->mutex);
 #endif
-    size_t len = mqtt_size(&pkt, NULL);
+    if (!wbuf_fits(c, suback_len)) {
+#if THREADSNR > 0
+        pthread_mutex_unlock(&c->mutex);
+#endif
+        mqtt_packet_destroy(&pkt);
+        return -ERRWBUFFULL;
+    }
     mqtt_pack(&pkt, c->wbuf + c->towrite);
-    c->towrite += len;
+    c->towrite += suback_len;
 #if THREADSNR > 0
     pthread_mutex_unlock(&c->mutex);
 #endif
@@ -646,8 +1202,8 @@ static int unsubscribe_handler(struct io_event *e) {
     log_debug("Received UNSUBSCRIBE from %s", c->client_id);
 
 #if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
     pthread_mutex_lock(&c->mutex);
-    pthread_mutex_lock(&mutex);
 #endif
     struct topic *t = NULL;
     for (int i = 0; i < e->data.unsubscribe.tuples_len; ++i) {
@@ -660,6 +1216,15 @@ static int unsubscribe_handler(struct io_event *e) {
     pthread_mutex_unlock(&mutex);
 #endif
 
+    if (cluster_enabled == true)
+        cluster_interest_changed();
+
+    if (!wbuf_fits(c, MQTT_ACK_LEN)) {
+#if THREADSNR > 0
+        pthread_mutex_unlock(&c->mutex);
+#endif
+        return -ERRWBUFFULL;
+    }
     mqtt_pack_mono(c->wbuf + c->towrite, UNSUBACK, e->data.unsubscribe.pkt_id);
     c->towrite += MQTT_ACK_LEN;
 #if THREADSNR > 0
@@ -673,6 +1238,64 @@ static int unsubscribe_handler(struct io_event *e) {
     return REPLY;
 }
 
+/*
+ * Check for # wildcards subscriptions matching the topic a message is
+ * published on, adding their subscribers to it. Must be called with the
+ * global lock held.
+ */
+static void topic_link_wildcards(struct topic *t, const char *topic) {
+    if (topic_store_wildcards_empty(server.store))
+        return;
+    topic_store_wildcards_foreach(item, server.store) {
+        struct subscription *s = item->data;
+        int matched = match_subscription(topic, s->topic, s->multilevel);
+        if (matched == SOL_OK && !is_subscribed(t, s->subscriber->session)) {
+            /*
+             * We need to make a copy of the subscriber cause UTHASH needs
+             * a proper handle to work correctly, otherwise we'll end up
+             * freeing the same refernce on disconnect and break the table
+             */
+            struct subscriber *copy = subscriber_clone(s->subscriber);
+            INCREF(copy, struct subscriber);
+            HASH_ADD_STR(t->subscribers, id, copy);
+            list_push(s->subscriber->session->subscriptions, t);
+        }
+    }
+}
+
+/*
+ * Answer to a PUBLISH according to its QoS, with a PUBACK or a PUBREC,
+ * nothing for AT_MOST_ONCE
+ */
+static int publish_ack(struct io_event *e, unsigned qos, unsigned mid) {
+    struct client *c = e->client;
+
+    // We're in the case of AT_MOST_ONCE QoS level, it's a fire-and-forget
+    if (qos == AT_MOST_ONCE)
+        return NOREPLY;
+
+    int ptype = qos == EXACTLY_ONCE ? PUBREC : PUBACK;
+
+#if THREADSNR > 0
+    pthread_mutex_lock(&c->mutex);
+#endif
+    if (!wbuf_fits(c, MQTT_ACK_LEN)) {
+#if THREADSNR > 0
+        pthread_mutex_unlock(&c->mutex);
+#endif
+        return -ERRWBUFFULL;
+    }
+    mqtt_ack(&e->data, ptype == PUBACK ? PUBACK_B : PUBREC_B);
+    mqtt_pack_mono(c->wbuf + c->towrite, ptype, mid);
+    c->towrite += MQTT_ACK_LEN;
+#if THREADSNR > 0
+    pthread_mutex_unlock(&c->mutex);
+#endif
+    log_debug("Sending %s to %s (m%u)",
+              ptype == PUBACK ? "PUBACK" : "PUBREC", c->client_id, mid);
+    return REPLY;
+}
+
 static int publish_handler(struct io_event *e) {
 
     struct client *c = e->client;
@@ -689,11 +1312,40 @@ static int publish_handler(struct io_event *e) {
               p->topic,
               p->payloadlen);
 
-    info.messages_recv++;
+    STATS_INC(messages_recv);
+    c->stats.messages_in++;
 
-    char topic[p->topiclen + 2];
     unsigned char qos = hdr->bits.qos;
 
+    // Messages between the nodes of a cluster, not to be routed
+    if (cluster_enabled == true
+        && cluster_control(p, c->cluster_peer) == true) {
+        mqtt_packet_destroy(&e->data);
+        return publish_ack(e, qos, orig_mid);
+    }
+
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    /*
+     * MQTT 3.1.1 has no way to tell a publish was refused, it's acknowledged
+     * and dropped
+     */
+    struct acl *acl = atomic_load(&server.acl);
+    if (acl && c->cluster_peer == false
+        && !acl_can_publish(acl, c->acl, c->client_id,
+                            (const char *) p->topic, p->topiclen)) {
+#if THREADSNR > 0
+        pthread_mutex_unlock(&mutex);
+#endif
+        log_debug("PUBLISH from %s to %s refused by the ACLs",
+                  c->client_id, p->topic);
+        mqtt_packet_destroy(&e->data);
+        return publish_ack(e, qos, orig_mid);
+    }
+
+    char topic[p->topiclen + 2];
+
     /*
      * For convenience we assure that all topics ends with a '/', indicating a
      * hierarchical level
@@ -705,7 +1357,6 @@ static int publish_handler(struct io_event *e) {
 
 #if THREADSNR > 0
     pthread_mutex_lock(&c->mutex);
-    pthread_mutex_lock(&mutex);
 #endif
     /*
      * Retrieve the topic from the global map, if it wasn't created before,
@@ -713,24 +1364,16 @@ static int publish_handler(struct io_event *e) {
      */
     struct topic *t = topic_store_get_or_put(server.store, topic);
 
-    /* Check for # wildcards subscriptions */
-    if (topic_store_wildcards_empty(server.store)) {
-        topic_store_wildcards_foreach(item, server.store) {
-            struct subscription *s = item->data;
-            int matched = match_subscription(topic, s->topic, s->multilevel);
-            if (matched == SOL_OK && !is_subscribed(t, s->subscriber->session)) {
-                /*
-                 * We need to make a copy of the subscriber cause UTHASH needs
-                 * a proper handle to work correctly, otherwise we'll end up
-                 * freeing the same refernce on disconnect and break the table
-                 */
-                struct subscriber *copy = subscriber_clone(s->subscriber);
-                INCREF(copy, struct subscriber);
-                HASH_ADD_STR(t->subscribers, id, copy);
-                list_push(s->subscriber->session->subscriptions, t);
-            }
-        }
-    }
+    /* Account the publish to find the heaviest topics and publishers */
+    heavy_hitters_add(&server.top[TOP_TOPICS_MESSAGES], topic, 1);
+    heavy_hitters_add(&server.top[TOP_TOPICS_BYTES], topic, p->payloadlen);
+    heavy_hitters_add(&server.top[TOP_CLIENTS_MESSAGES], c->client_id, 1);
+    heavy_hitters_add(&server.top[TOP_CLIENTS_BYTES], c->client_id, p->payloadlen);
+
+    topic_link_wildcards(t, topic);
+
+    if (hdr->bits.retain == 1)
+        topic_retain(t, &e->data);
 #if THREADSNR > 0
     pthread_mutex_unlock(&mutex);
 #endif
@@ -738,44 +1381,55 @@ static int publish_handler(struct io_event *e) {
     struct mqtt_packet *pkt = mqtt_packet_alloc(e->data.header.byte);
     // TODO must perform a deep copy here
     pkt->publish = e->data.publish;
-
-    if (hdr->bits.retain == 1) {
-        t->retained_msg = try_alloc(mqtt_size(&e->data, NULL));
-        mqtt_pack(&e->data, t->retained_msg);
-    }
 #if THREADSNR > 0
     pthread_mutex_unlock(&c->mutex);
 #endif
 
-    if (publish_message(pkt, t) == 0)
-        DECREF(pkt, struct mqtt_packet);
-
-    // We have to answer to the publisher
-    if (qos == AT_MOST_ONCE)
-        goto exit;
+    /*
+     * Acknowledged before routing, the room for it is checked as the packet
+     * is read, copies routed back to the publisher itself can't take it
+     */
+    int rc = publish_ack(e, qos, orig_mid);
 
-    int ptype = qos == EXACTLY_ONCE ? PUBREC : PUBACK;
+    INCREF(pkt, struct mqtt_packet);
+    publish_fanout(c, pkt, t);
+    // In-process subscribers of the host process, if embedded
+    if (embed_enabled == true)
+        embed_deliver(&pkt->publish, qos, hdr->bits.retain);
+    /*
+     * Messages forwarded by other nodes have been already routed to the
+     * bridge and the rest of the cluster by the node receiving them
+     */
+    if (c->cluster_peer == false) {
+        if (bridge_enabled == true)
+            bridge_forward(&pkt->publish, qos, hdr->bits.retain);
+        if (cluster_enabled == true)
+            cluster_forward(&pkt->publish, qos, hdr->bits.retain);
+    }
+    DECREF(pkt, struct mqtt_packet);
 
+    /*
+     * Credit based backpressure, if most of the subscribers of the topic
+     * can't keep up, mark the publisher as paused, the server will stop
+     * reading from it till their queues drain, letting TCP flow control push
+     * back on the producer
+     */
+    if (conf->backpressure_threshold > 0 && c->paused == false) {
 #if THREADSNR > 0
-    pthread_mutex_lock(&c->mutex);
+        TRACE_LOCK("mutex_wait", &mutex);
 #endif
-    mqtt_ack(&e->data, ptype == PUBACK ? PUBACK_B : PUBREC_B);
-    mqtt_pack_mono(c->wbuf + c->towrite, ptype, orig_mid);
-    c->towrite += MQTT_ACK_LEN;
+        if (topic_congested(t)) {
+            log_debug("Pausing %s, subscribers of %s are congested",
+                      c->client_id, t->name);
+            c->blocked_on = t;
+            c->paused = true;
+        }
 #if THREADSNR > 0
-    pthread_mutex_unlock(&c->mutex);
+        pthread_mutex_unlock(&mutex);
 #endif
-    log_debug("Sending %s to %s (m%u)",
-              ptype == PUBACK ? "PUBACK" : "PUBREC", c->client_id, orig_mid);
-    return REPLY;
-
-exit:
+    }
 
-    /*
-     * We're in the case of AT_MOST_ONCE QoS level, we don't need to send out
-     * any byte, it's a fire-and-forget.
-     */
-    return NOREPLY;
+    return rc;
 }
 
 static int puback_handler(struct io_event *e) {
@@ -785,14 +1439,23 @@ static int puback_handler(struct io_event *e) {
 #if THREADSNR > 0
     pthread_mutex_lock(&c->mutex);
 #endif
+    // Unknown or already acknowledged message, nothing to release
+    if (!c->session->i_msgs || !c->session->i_msgs[pkt_id].packet) {
+#if THREADSNR > 0
+        pthread_mutex_unlock(&c->mutex);
+#endif
+        return NOREPLY;
+    }
     inflight_msg_clear(&c->session->i_msgs[pkt_id]);
     c->session->i_msgs[pkt_id].packet = NULL;
     c->session->i_acks[pkt_id] = -1;
     --c->session->inflights;
+    // A slot in the inflight window is free, release parked messages if any
+    int released = inflight_window_release(c);
 #if THREADSNR > 0
     pthread_mutex_unlock(&c->mutex);
 #endif
-    return NOREPLY;
+    return released > 0 ? REPLY : NOREPLY;
 }
 
 static int pubrec_handler(struct io_event *e) {
@@ -802,13 +1465,20 @@ static int pubrec_handler(struct io_event *e) {
 #if THREADSNR > 0
     pthread_mutex_lock(&c->mutex);
 #endif
+    if (!wbuf_fits(c, MQTT_ACK_LEN)) {
+#if THREADSNR > 0
+        pthread_mutex_unlock(&c->mutex);
+#endif
+        return -ERRWBUFFULL;
+    }
     mqtt_pack_mono(c->wbuf + c->towrite, PUBREL, pkt_id);
     c->towrite += MQTT_ACK_LEN;
 #if THREADSNR > 0
     pthread_mutex_unlock(&c->mutex);
 #endif
     // Update inflight acks table
-    c->session->i_acks[pkt_id] = time(NULL);
+    if (c->session->i_acks)
+        c->session->i_acks[pkt_id] = time(NULL);
     log_debug("Sending PUBREL to %s (m%u)", c->client_id, pkt_id);
     return REPLY;
 }
@@ -820,6 +1490,12 @@ static int pubrel_handler(struct io_event *e) {
 #if THREADSNR > 0
     pthread_mutex_lock(&c->mutex);
 #endif
+    if (!wbuf_fits(c, MQTT_ACK_LEN)) {
+#if THREADSNR > 0
+        pthread_mutex_unlock(&c->mutex);
+#endif
+        return -ERRWBUFFULL;
+    }
     mqtt_pack_mono(c->wbuf + c->towrite, PUBCOMP, pkt_id);
     c->towrite += MQTT_ACK_LEN;
 #if THREADSNR > 0
@@ -836,28 +1512,44 @@ static int pubcomp_handler(struct io_event *e) {
 #if THREADSNR > 0
     pthread_mutex_lock(&c->mutex);
 #endif
+    // Unknown or already acknowledged message, nothing to release
+    if (!c->session->i_msgs || !c->session->i_msgs[pkt_id].packet) {
+#if THREADSNR > 0
+        pthread_mutex_unlock(&c->mutex);
+#endif
+        return NOREPLY;
+    }
     c->session->i_acks[pkt_id] = -1;
     inflight_msg_clear(&c->session->i_msgs[pkt_id]);
     c->session->i_msgs[pkt_id].packet = NULL;
     --c->session->inflights;
+    // A slot in the inflight window is free, release parked messages if any
+    int released = inflight_window_release(c);
 #if THREADSNR > 0
     pthread_mutex_unlock(&c->mutex);
 #endif
-    return NOREPLY;
+    return released > 0 ? REPLY : NOREPLY;
 }
 
 static int pingreq_handler(struct io_event *e) {
-    log_debug("Received PINGREQ from %s", e->client->client_id);
+    struct client *c = e->client;
+    log_debug("Received PINGREQ from %s", c->client_id);
     e->data.header.byte = PINGRESP_B;
 #if THREADSNR > 0
-    pthread_mutex_lock(&e->client->mutex);
+    pthread_mutex_lock(&c->mutex);
 #endif
-    mqtt_pack(&e->data, e->client->wbuf + e->client->towrite);
-    e->client->towrite += MQTT_HEADER_LEN;
+    if (!wbuf_fits(c, MQTT_HEADER_LEN)) {
 #if THREADSNR > 0
-    pthread_mutex_unlock(&e->client->mutex);
+        pthread_mutex_unlock(&c->mutex);
+#endif
+        return -ERRWBUFFULL;
+    }
+    mqtt_pack(&e->data, c->wbuf + c->towrite);
+    c->towrite += MQTT_HEADER_LEN;
+#if THREADSNR > 0
+    pthread_mutex_unlock(&c->mutex);
 #endif
-    log_debug("Sending PINGRESP to %s", e->client->client_id);
+    log_debug("Sending PINGRESP to %s", c->client_id);
     return REPLY;
 }
 
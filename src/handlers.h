@@ -28,12 +28,41 @@
 #ifndef HANDLERS_H
 #define HANDLERS_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 struct topic;
 struct mqtt_packet;
 struct io_event;
+struct client_session;
+struct client;
+struct ev_ctx;
+
+/*
+ * Per loop cycle budgets: subscribers a single PUBLISH is routed to and
+ * messages of a resumed session written out, the rest is deferred to the
+ * next cycles, interleaved with the IO of the other clients
+ */
+#define FANOUT_SLICE  1024
+#define BACKLOG_SLICE 256
 
 int publish_message(struct mqtt_packet *, const struct topic *);
 
+int publish_external(struct mqtt_packet *);
+
+struct client_session *client_session_alloc(const char *);
+
+void session_drop(struct client_session *);
+
+void session_backlog_flush(struct ev_ctx *, void *);
+
+void fanout_detach(struct client *);
+
+struct topic *session_subscribe(struct client_session *, const char *,
+                                size_t, unsigned);
+
+bool topic_congested(const struct topic *);
+
 int handle_command(unsigned, struct io_event *);
 
 #endif
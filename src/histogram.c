@@ -0,0 +1,104 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "histogram.h"
+
+#define LOAD(v) atomic_load_explicit(&(v), memory_order_relaxed)
+
+#define STORE(v, x) atomic_store_explicit(&(v), (x), memory_order_relaxed)
+
+/*
+ * Map a value to its bucket, values below HISTOGRAM_SUB_BUCKETS have their
+ * own bucket, for greater ones, the position of the most significant bit
+ * selects the range and the next HISTOGRAM_SUB_BITS bits the bucket inside it
+ */
+static inline unsigned bucket_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return value;
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned range = msb - HISTOGRAM_SUB_BITS + 1;
+    unsigned sub = (value >> (range - 1)) - HISTOGRAM_SUB_BUCKETS;
+    return range * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+/* Highest value that maps to a bucket */
+static inline uint64_t bucket_value(unsigned idx) {
+    unsigned range = idx / HISTOGRAM_SUB_BUCKETS;
+    uint64_t sub = idx % HISTOGRAM_SUB_BUCKETS;
+    if (range == 0)
+        return sub;
+    return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << (range - 1)) - 1;
+}
+
+void histogram_init(struct histogram *h) {
+    memset(h, 0x00, sizeof(*h));
+}
+
+void histogram_record(struct histogram *h, uint64_t value) {
+    unsigned idx = bucket_index(value);
+    STORE(h->counts[idx], LOAD(h->counts[idx]) + 1);
+    STORE(h->total, LOAD(h->total) + 1);
+    STORE(h->sum, LOAD(h->sum) + value);
+}
+
+void histogram_merge(struct histogram *dst, const struct histogram *src) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        STORE(dst->counts[i], LOAD(dst->counts[i]) + LOAD(src->counts[i]));
+    STORE(dst->total, LOAD(dst->total) + LOAD(src->total));
+    STORE(dst->sum, LOAD(dst->sum) + LOAD(src->sum));
+}
+
+void histogram_sub(struct histogram *dst, const struct histogram *src) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        STORE(dst->counts[i], LOAD(dst->counts[i]) - LOAD(src->counts[i]));
+    STORE(dst->total, LOAD(dst->total) - LOAD(src->total));
+    STORE(dst->sum, LOAD(dst->sum) - LOAD(src->sum));
+}
+
+uint64_t histogram_percentile(const struct histogram *h, double percentile) {
+    unsigned long long total = 0, seen = 0, rank = 0;
+    /*
+     * Sum up the counts instead of trusting the total, as they could be
+     * updated while we're reading
+     */
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        total += LOAD(h->counts[i]);
+    if (total == 0)
+        return 0;
+    rank = (unsigned long long) (percentile / 100.0 * total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    if (rank > total)
+        rank = total;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += LOAD(h->counts[i]);
+        if (seen >= rank)
+            return bucket_value(i);
+    }
+    return 0;
+}
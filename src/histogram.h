@@ -0,0 +1,77 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Log-linear histogram, HDR style: every power of two range is split into
+ * HISTOGRAM_SUB_BUCKETS linear buckets, values lower than that are recorded
+ * exactly. This gives a relative error of ~6% over the entire range of 64 bit
+ * values with a fixed and small footprint, and constant time recording.
+ *
+ * Histograms are meant to be written by a single thread, with relaxed loads
+ * and stores, and read, merged and subtracted by any other thread, making it
+ * cheap to keep one for each event loop and combine them on read.
+ */
+#define HISTOGRAM_SUB_BITS      4
+#define HISTOGRAM_SUB_BUCKETS   (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS       ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+    atomic_ullong total;
+    atomic_ullong sum;
+    atomic_ullong counts[HISTOGRAM_BUCKETS];
+};
+
+/* Reset all the counters of the histogram */
+void histogram_init(struct histogram *);
+
+/* Record a value, must be called only by the thread owning the histogram */
+void histogram_record(struct histogram *, uint64_t);
+
+/* Add all the counts of the second histogram to the first one */
+void histogram_merge(struct histogram *, const struct histogram *);
+
+/*
+ * Subtract the counts of the second histogram from the first one, useful to
+ * obtain the values recorded in an interval from two snapshots of the same
+ * histogram
+ */
+void histogram_sub(struct histogram *, const struct histogram *);
+
+/*
+ * Return the value at the given percentile (0.0 - 100.0), rounded up to the
+ * highest value equivalent to the bucket it falls in, 0 if no values were
+ * recorded. A percentile of 100.0 gives the max value recorded.
+ */
+uint64_t histogram_percentile(const struct histogram *, double);
+
+#endif
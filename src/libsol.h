@@ -0,0 +1,98 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBSOL_H
+#define LIBSOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * libsol, the broker core as a library, to run Sol inside a host process.
+ * The broker started by sol_start listens and serves network clients as the
+ * sol executable does, on its own threads, while the host process publishes
+ * and subscribes in-process, without a socket in between:
+ *
+ * - sol_publish routes a message straight into the broker, to the network
+ *   subscribers, the bridge and the other nodes of the cluster, exactly like
+ *   a message published by a client
+ * - sol_subscribe registers a callback run for every message matching a
+ *   filter, published either by a network client or in-process
+ *
+ * Callbacks run on the event loop thread that routed the message, right
+ * after it reached the network subscribers, with a view on the packet as
+ * received: topic and payload are only valid for the time of the call and
+ * must be copied to be kept. Callbacks are expected to return quickly, they
+ * hold back the publisher, they may call sol_publish but not subscribe or
+ * unsubscribe. Retained messages are not replayed to in-process
+ * subscriptions, $SOL statistics are not delivered to them.
+ *
+ * The broker can be started once in the life of the process.
+ */
+
+/* A message as seen by an in-process subscriber */
+struct sol_message {
+    const char *topic;      /* NUL terminated */
+    size_t topiclen;
+    const void *payload;
+    size_t payloadlen;
+    unsigned qos;           /* As published */
+    bool retain;
+};
+
+typedef void sol_callback(const struct sol_message *, void *);
+
+struct sol_subscription;
+
+/*
+ * Load the configuration file at the given path, if not NULL, and start the
+ * broker on background threads, returns once it's ready to route messages.
+ * Returns 0 on success, -1 if the broker was already started.
+ */
+int sol_start(const char *);
+
+/* Stop the broker and wait for its threads to exit */
+void sol_stop(void);
+
+/*
+ * Publish a message on a topic, wildcards not allowed, with the given QoS
+ * (0 to 2) and retain flag. Payload and topic are copied. Returns the number
+ * of network subscribers reached, -1 if the broker is not running or the
+ * arguments are not valid.
+ */
+int sol_publish(const char *, const void *, size_t, unsigned, bool);
+
+/*
+ * Subscribe a callback to a topic filter, wildcards allowed, the last
+ * argument is passed to every call. Returns NULL if the filter is not valid.
+ */
+struct sol_subscription *sol_subscribe(const char *, sol_callback *, void *);
+
+/* Remove a subscription, the callback is not called anymore once returned */
+void sol_unsubscribe(struct sol_subscription *);
+
+#endif
@@ -0,0 +1,579 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <netdb.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "ev.h"
+#include "pack.h"
+#include "config.h"
+#include "memory.h"
+#include "logging.h"
+#include "link.h"
+
+/* Bytes of messages batched in the write buffer before trying to send them */
+#define LINK_BATCH_SIZE         (64 * 1024)
+
+/* Initial size of the read buffer, grown up to max_request_size if needed */
+#define LINK_READ_SIZE          4096
+
+/* Seconds allowed to connect and receive the CONNACK */
+#define LINK_CONNECT_TIMEOUT    10
+
+/* Bounds of the delay between reconnection attempts, doubled on each one */
+#define LINK_MIN_BACKOFF        1
+#define LINK_MAX_BACKOFF        30
+
+#define DUP_FLAG                0x08
+
+/*
+ * A message to be sent, packed once when enqueued; QoS 1 messages get their
+ * packet identifier written at id_off when they're sent, id_off is 0 for
+ * QoS 0 messages
+ */
+struct link_msg {
+    struct link_msg *next;
+    size_t len;
+    size_t id_off;
+    u16 id;
+    unsigned char data[];
+};
+
+static void link_callback(struct ev_ctx *, void *);
+
+static void link_queue_push(struct link_queue *q, struct link_msg *m) {
+    m->next = NULL;
+    if (q->tail)
+        q->tail->next = m;
+    else
+        q->head = m;
+    q->tail = m;
+}
+
+static struct link_msg *link_queue_pop(struct link_queue *q) {
+    struct link_msg *m = q->head;
+    if (!m)
+        return NULL;
+    q->head = m->next;
+    if (!q->head)
+        q->tail = NULL;
+    return m;
+}
+
+static void link_queue_free(struct link_queue *q) {
+    struct link_msg *m;
+    while ((m = link_queue_pop(q)))
+        free_memory(m);
+}
+
+/* Make room for len more bytes in the write buffer */
+static unsigned char *link_reserve(struct link *l, size_t len) {
+    if (l->wlen + len > l->wsize) {
+        while (l->wlen + len > l->wsize)
+            l->wsize = l->wsize ? l->wsize * 2 : LINK_BATCH_SIZE;
+        l->wbuf = try_realloc(l->wbuf, l->wsize);
+    }
+    unsigned char *ptr = l->wbuf + l->wlen;
+    l->wlen += len;
+    return ptr;
+}
+
+static void link_send_packet(struct link *l, const struct mqtt_packet *pkt) {
+    size_t len = mqtt_size(pkt, NULL);
+    unsigned char *ptr = link_reserve(l, len);
+    l->wlen -= len;
+    l->wlen += mqtt_pack(pkt, ptr);
+}
+
+static void link_send_ack(struct link *l, u8 type, u16 id) {
+    mqtt_pack_mono(link_reserve(l, MQTT_ACK_LEN), type, id);
+}
+
+static u16 link_next_id(struct link *l) {
+    if (++l->next_id == 0)
+        l->next_id = 1;
+    return l->next_id;
+}
+
+/*
+ * Close the connection and schedule the next attempt, messages still waiting
+ * for a PUBACK go back in front of the pending ones, marked as duplicates.
+ * Must be called with the lock held.
+ */
+static void link_drop(struct link *l, const char *reason) {
+    log_warning("%s to %s down: %s, retrying in %lds",
+                l->name, l->address, reason, (long) l->backoff);
+    if (l->fd >= 0) {
+        ev_del_fd(l->ctx, l->fd);
+        close(l->fd);
+    }
+    l->fd = -1;
+    l->state = LINK_DOWN;
+    l->armed = false;
+    l->rlen = l->wlen = l->wsent = 0;
+    if (l->inflight.head) {
+        for (struct link_msg *m = l->inflight.head; m; m = m->next)
+            m->data[0] |= DUP_FLAG;
+        l->inflight.tail->next = l->pending.head;
+        if (!l->pending.head)
+            l->pending.tail = l->inflight.tail;
+        l->pending.head = l->inflight.head;
+        l->inflight.head = l->inflight.tail = NULL;
+    }
+    l->inflight_nr = 0;
+    l->next_attempt = time(NULL) + l->backoff;
+    l->backoff *= 2;
+    if (l->backoff > LINK_MAX_BACKOFF)
+        l->backoff = LINK_MAX_BACKOFF;
+}
+
+/*
+ * Write out as much as possible, batching pending messages in the write
+ * buffer as long as the inflight window allows it, and watch the descriptor
+ * for writing only while there are bytes left. Must be called with the lock
+ * held.
+ */
+static void link_flush(struct link *l) {
+    size_t window = conf->max_inflight_msgs > 0 ? conf->max_inflight_msgs : 0xFFFF;
+    for (;;) {
+        if (l->wsent > 0) {
+            memmove(l->wbuf, l->wbuf + l->wsent, l->wlen - l->wsent);
+            l->wlen -= l->wsent;
+            l->wsent = 0;
+        }
+        while (l->state == LINK_UP && l->pending.head
+               && l->wlen < LINK_BATCH_SIZE) {
+            struct link_msg *m = l->pending.head;
+            if (m->id_off > 0 && l->inflight_nr >= window)
+                break;
+            link_queue_pop(&l->pending);
+            if (m->id_off > 0) {
+                m->id = link_next_id(l);
+                packi16(m->data + m->id_off, m->id);
+            }
+            memcpy(link_reserve(l, m->len), m->data, m->len);
+            l->stats.forwarded++;
+            if (m->id_off > 0) {
+                link_queue_push(&l->inflight, m);
+                l->inflight_nr++;
+            } else {
+                l->queued_bytes -= m->len;
+                free_memory(m);
+            }
+        }
+        if (l->wlen == 0)
+            break;
+        ssize_t n = send(l->fd, l->wbuf, l->wlen, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            link_drop(l, strerror(errno));
+            return;
+        }
+        l->wsent = n;
+        l->last_sent = time(NULL);
+        if (l->wsent < l->wlen)
+            break;
+    }
+    bool more = l->wsent < l->wlen;
+    if (more != l->armed) {
+        l->armed = more;
+        ev_fire_event(l->ctx, l->fd, more ? EV_READ|EV_WRITE : EV_READ,
+                      link_callback, l);
+    }
+}
+
+static void link_send_connect(struct link *l) {
+    struct mqtt_packet pkt = { .header = { .byte = CONNECT_B } };
+    pkt.connect.payload.keepalive = l->keepalive;
+    snprintf((char *) pkt.connect.payload.client_id, MQTT_CLIENT_ID_LEN,
+             "%s", l->client_id);
+    if (l->username && l->username[0]) {
+        pkt.connect.bits.username = 1;
+        pkt.connect.payload.username = (u8 *) l->username;
+    }
+    if (l->password && l->password[0]) {
+        pkt.connect.bits.password = 1;
+        pkt.connect.payload.password = (u8 *) l->password;
+    }
+    link_send_packet(l, &pkt);
+}
+
+/*
+ * A message published on the remote broker, handed to the on_publish
+ * callback without the lock, only this loop touches the buffers
+ */
+static int link_receive(struct link *l, u8 byte, unsigned char *buf, size_t len) {
+    struct mqtt_packet *pkt = mqtt_packet_alloc(byte);
+    INCREF(pkt, struct mqtt_packet);
+    if (mqtt_unpack(buf, pkt, byte, len) != MQTT_OK
+        || pkt->publish.topiclen == 0) {
+        DECREF(pkt, struct mqtt_packet);
+        link_drop(l, "malformed PUBLISH");
+        return -1;
+    }
+    unsigned qos = pkt->header.bits.qos;
+    u16 id = pkt->publish.pkt_id;
+    l->stats.received++;
+    pthread_mutex_unlock(&l->lock);
+    l->on_publish(l, pkt);
+    pthread_mutex_lock(&l->lock);
+    DECREF(pkt, struct mqtt_packet);
+    if (qos == AT_LEAST_ONCE)
+        link_send_ack(l, PUBACK, id);
+    else if (qos == EXACTLY_ONCE)
+        link_send_ack(l, PUBREC, id);
+    return 0;
+}
+
+/* A PUBACK for a message sent, acknowledged in order in most cases */
+static void link_release(struct link *l, u16 id) {
+    struct link_msg *prev = NULL, *m = l->inflight.head;
+    while (m && m->id != id) {
+        prev = m;
+        m = m->next;
+    }
+    if (!m)
+        return;
+    if (prev)
+        prev->next = m->next;
+    else
+        l->inflight.head = m->next;
+    if (l->inflight.tail == m)
+        l->inflight.tail = prev;
+    l->inflight_nr--;
+    l->queued_bytes -= m->len;
+    free_memory(m);
+}
+
+/* Handle a complete packet from the remote broker, -1 if the link dropped */
+static int link_handle(struct link *l, u8 byte, unsigned char *buf, size_t len) {
+    switch (byte >> 4) {
+        case CONNACK:
+            if (l->state != LINK_HANDSHAKE || len < 2) {
+                link_drop(l, "unexpected CONNACK");
+                return -1;
+            }
+            if (buf[1] != MQTT_CONNECTION_ACCEPTED) {
+                link_drop(l, "connection refused");
+                return -1;
+            }
+            log_info("%s connected to %s", l->name, l->address);
+            l->state = LINK_UP;
+            l->backoff = LINK_MIN_BACKOFF;
+            if (l->on_connect) {
+                pthread_mutex_unlock(&l->lock);
+                l->on_connect(l);
+                pthread_mutex_lock(&l->lock);
+            }
+            break;
+        case PUBLISH:
+            return link_receive(l, byte, buf, len);
+        case PUBACK:
+            if (len >= sizeof(u16))
+                link_release(l, unpacku16(buf));
+            break;
+        case PUBREL:
+            if (len >= sizeof(u16))
+                link_send_ack(l, PUBCOMP, unpacku16(buf));
+            break;
+        case SUBACK:
+            for (size_t i = sizeof(u16); i < len; ++i)
+                if (buf[i] > EXACTLY_ONCE)
+                    log_warning("%s subscription refused by %s",
+                                l->name, l->address);
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+/* Handle all the complete packets in the read buffer */
+static int link_process(struct link *l) {
+    size_t off = 0;
+    while (l->rlen - off >= MQTT_HEADER_LEN) {
+        unsigned char *ptr = l->rbuf + off;
+        size_t avail = l->rlen - off - 1, i = 0;
+        // The remaining length is complete at the first byte without the
+        // continuation bit, at most 4 bytes
+        while (i < avail && i < 4 && (ptr[1 + i] & 0x80))
+            ++i;
+        if (i == 4) {
+            link_drop(l, "malformed packet");
+            return -1;
+        }
+        if (i == avail)
+            break;
+        unsigned pos = 0;
+        size_t len = mqtt_decode_length(ptr + 1, &pos);
+        if (1 + pos + len > l->rlen - off)
+            break;
+        if (link_handle(l, ptr[0], ptr + 1 + pos, len) < 0)
+            return -1;
+        off += 1 + pos + len;
+    }
+    memmove(l->rbuf, l->rbuf + off, l->rlen - off);
+    l->rlen -= off;
+    return 0;
+}
+
+/* Read and handle everything available, -1 if the link dropped */
+static int link_read(struct link *l) {
+    for (;;) {
+        if (l->rlen == l->rsize) {
+            if (l->rsize >= conf->max_request_size) {
+                link_drop(l, "packet too large");
+                return -1;
+            }
+            l->rsize *= 2;
+            if (l->rsize > conf->max_request_size)
+                l->rsize = conf->max_request_size;
+            l->rbuf = try_realloc(l->rbuf, l->rsize);
+        }
+        ssize_t n = recv(l->fd, l->rbuf + l->rlen, l->rsize - l->rlen, 0);
+        if (n == 0) {
+            link_drop(l, "connection closed");
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            link_drop(l, strerror(errno));
+            return -1;
+        }
+        l->rlen += n;
+        l->last_recv = time(NULL);
+        if (link_process(l) < 0)
+            return -1;
+    }
+}
+
+/*
+ * Single callback for both directions, called when the descriptor is
+ * readable, writable while armed, or once the connection completes
+ */
+static void link_callback(struct ev_ctx *ctx, void *arg) {
+    (void) ctx;
+    struct link *l = arg;
+    pthread_mutex_lock(&l->lock);
+    if (l->state == LINK_DOWN)
+        goto unlock;
+    if (l->state == LINK_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(l->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+            err = errno;
+        if (err == EINPROGRESS)
+            goto unlock;
+        if (err != 0) {
+            link_drop(l, strerror(err));
+            goto unlock;
+        }
+        l->state = LINK_HANDSHAKE;
+        l->last_recv = time(NULL);
+        link_send_connect(l);
+    }
+    if (link_read(l) < 0)
+        goto unlock;
+    link_flush(l);
+unlock:
+    pthread_mutex_unlock(&l->lock);
+}
+
+/* Start a non blocking connection to the remote broker */
+static void link_connect(struct link *l) {
+    char host[0xFF];
+    snprintf(host, sizeof(host), "%s", l->address);
+    char *port = strrchr(host, ':');
+    if (!port) {
+        link_drop(l, "missing port in the address");
+        return;
+    }
+    *port++ = '\0';
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM
+    }, *res = NULL;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0) {
+        link_drop(l, gai_strerror(err));
+        return;
+    }
+    l->attempt_start = time(NULL);
+    l->fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (l->fd < 0) {
+        freeaddrinfo(res);
+        link_drop(l, strerror(errno));
+        return;
+    }
+    (void) fcntl(l->fd, F_SETFL, fcntl(l->fd, F_GETFL, 0) | O_NONBLOCK);
+    (void) setsockopt(l->fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    err = connect(l->fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (err < 0 && errno != EINPROGRESS) {
+        err = errno;
+        close(l->fd);
+        l->fd = -1;
+        link_drop(l, strerror(err));
+        return;
+    }
+    l->state = LINK_CONNECTING;
+    l->armed = true;
+    ev_register_event(l->ctx, l->fd, EV_READ|EV_WRITE, link_callback, l);
+}
+
+/*
+ * Periodic routine, connect when due, bound the time to get connected and
+ * keep the link alive, pinging when idle and dropping it when the remote
+ * broker stops answering
+ */
+static void link_cron(struct ev_ctx *ctx, void *arg) {
+    (void) ctx;
+    struct link *l = arg;
+    time_t now = time(NULL);
+    pthread_mutex_lock(&l->lock);
+    switch (l->state) {
+        case LINK_DOWN:
+            if (now >= l->next_attempt)
+                link_connect(l);
+            break;
+        case LINK_CONNECTING:
+        case LINK_HANDSHAKE:
+            if (now - l->attempt_start > LINK_CONNECT_TIMEOUT)
+                link_drop(l, "connection timed out");
+            break;
+        case LINK_UP:
+            if (now - l->last_recv > (time_t) l->keepalive * 3 / 2) {
+                link_drop(l, "keepalive timed out");
+                break;
+            }
+            if (now - l->last_sent >= (time_t) l->keepalive / 2) {
+                struct mqtt_packet ping = { .header = { .byte = PINGREQ_B } };
+                link_send_packet(l, &ping);
+            }
+            link_flush(l);
+            break;
+    }
+    pthread_mutex_unlock(&l->lock);
+}
+
+void link_init(struct link *l) {
+    pthread_mutex_init(&l->lock, NULL);
+    l->ctx = NULL;
+    l->fd = -1;
+    l->state = LINK_DOWN;
+    l->pending.head = l->pending.tail = NULL;
+    l->inflight.head = l->inflight.tail = NULL;
+    l->inflight_nr = l->queued_bytes = 0;
+    l->next_id = 0;
+    l->rsize = LINK_READ_SIZE;
+    l->rbuf = try_alloc(l->rsize);
+    l->rlen = 0;
+    l->wbuf = NULL;
+    l->wsize = l->wlen = l->wsent = 0;
+    l->armed = false;
+    l->last_recv = l->last_sent = l->attempt_start = l->next_attempt = 0;
+    l->backoff = LINK_MIN_BACKOFF;
+    memset(&l->stats, 0x00, sizeof(l->stats));
+}
+
+void link_start(struct link *l, struct ev_ctx *ctx) {
+    pthread_mutex_lock(&l->lock);
+    l->ctx = ctx;
+    link_connect(l);
+    pthread_mutex_unlock(&l->lock);
+    ev_register_cron(ctx, link_cron, l, 1, 0);
+}
+
+int link_publish(struct link *l, const struct mqtt_packet *pkt) {
+    struct mqtt_packet out = *pkt;
+    if (out.header.bits.qos > AT_LEAST_ONCE)
+        out.header.bits.qos = AT_LEAST_ONCE;
+    out.header.bits.dup = 0;
+    size_t len = mqtt_size(&out, NULL);
+    pthread_mutex_lock(&l->lock);
+    if (l->buffer > 0 && l->queued_bytes + len > l->buffer) {
+        l->stats.dropped++;
+        pthread_mutex_unlock(&l->lock);
+        return -1;
+    }
+    struct link_msg *m = try_alloc(sizeof(*m) + len);
+    m->len = mqtt_pack(&out, m->data);
+    // The packet identifier sits right before the payload
+    m->id_off = out.header.bits.qos > AT_MOST_ONCE ?
+        m->len - out.publish.payloadlen - sizeof(u16) : 0;
+    m->id = 0;
+    link_queue_push(&l->pending, m);
+    l->queued_bytes += m->len;
+    if (l->state == LINK_UP && l->armed == false) {
+        l->armed = true;
+        ev_fire_event(l->ctx, l->fd, EV_READ|EV_WRITE, link_callback, l);
+    }
+    pthread_mutex_unlock(&l->lock);
+    return 0;
+}
+
+void link_subscribe(struct link *l, const char *filter, unsigned qos) {
+    struct mqtt_subscribe_tuple tuple = { qos, strlen(filter), (u8 *) filter };
+    struct mqtt_packet pkt = { .header = { .byte = SUBSCRIBE_B } };
+    pthread_mutex_lock(&l->lock);
+    pkt.subscribe.pkt_id = link_next_id(l);
+    pkt.subscribe.tuples_len = 1;
+    pkt.subscribe.tuples = &tuple;
+    link_send_packet(l, &pkt);
+    pthread_mutex_unlock(&l->lock);
+}
+
+void link_get_stats(struct link *l, struct link_stats *stats) {
+    pthread_mutex_lock(&l->lock);
+    *stats = l->stats;
+    stats->connected = l->state == LINK_UP;
+    stats->queued_bytes = l->queued_bytes;
+    pthread_mutex_unlock(&l->lock);
+}
+
+void link_shutdown(struct link *l) {
+    pthread_mutex_lock(&l->lock);
+    if (l->fd >= 0)
+        close(l->fd);
+    l->fd = -1;
+    l->state = LINK_DOWN;
+    link_queue_free(&l->pending);
+    link_queue_free(&l->inflight);
+    free_memory(l->rbuf);
+    free_memory(l->wbuf);
+    l->rbuf = l->wbuf = NULL;
+    pthread_mutex_unlock(&l->lock);
+    pthread_mutex_destroy(&l->lock);
+}
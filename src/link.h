@@ -0,0 +1,136 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LINK_H
+#define LINK_H
+
+#include <time.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "mqtt.h"
+
+struct ev_ctx;
+
+/*
+ * Outbound MQTT connection to another broker, used by the bridge and by the
+ * cluster links between nodes. The connection is driven by the loop running
+ * the cron jobs; any loop can publish on it, messages are packed once,
+ * enqueued and the descriptor armed for writing, so that all the messages
+ * enqueued meanwhile are pipelined in as few writes as possible. QoS 1
+ * messages are kept till acknowledged, up to max_inflight_messages in flight,
+ * and sent again with the DUP flag after a reconnection, which backs off
+ * exponentially. While the remote broker is unreachable, messages are
+ * buffered up to a bound, the exceeding ones are dropped.
+ */
+
+enum link_state { LINK_DOWN, LINK_CONNECTING, LINK_HANDSHAKE, LINK_UP };
+
+struct link_msg;
+
+struct link_queue {
+    struct link_msg *head;
+    struct link_msg *tail;
+};
+
+struct link_stats {
+    bool connected;
+    size_t forwarded;
+    size_t received;
+    size_t dropped;
+    size_t queued_bytes;
+};
+
+struct link {
+    /*
+     * To be set before link_init: what the link is for, used in the logs,
+     * the remote host:port, the credentials (username and password can be
+     * empty), the keepalive in seconds and the bound on the bytes of messages
+     * buffered, 0 means no bound
+     */
+    const char *name;
+    char address[0xFF];
+    char client_id[MQTT_CLIENT_ID_LEN];
+    const char *username;
+    const char *password;
+    size_t keepalive;
+    size_t buffer;
+    /*
+     * Called once the remote broker accepted the connection, to subscribe
+     * with link_subscribe, and for each PUBLISH received, the packet is heap
+     * allocated and a reference is held for the time of the call. Both are
+     * called from the loop running the cron jobs, without the lock held.
+     */
+    void (*on_connect)(struct link *);
+    void (*on_publish)(struct link *, struct mqtt_packet *);
+    void *data;
+    /* Private state, guarded by the lock */
+    pthread_mutex_t lock;
+    struct ev_ctx *ctx;
+    int fd;
+    enum link_state state;
+    struct link_queue pending;
+    struct link_queue inflight;
+    size_t inflight_nr;
+    size_t queued_bytes;
+    u16 next_id;
+    unsigned char *rbuf;
+    size_t rsize;
+    size_t rlen;
+    unsigned char *wbuf;
+    size_t wsize;
+    size_t wlen;
+    size_t wsent;
+    bool armed;
+    time_t last_recv;
+    time_t last_sent;
+    time_t attempt_start;
+    time_t next_attempt;
+    time_t backoff;
+    struct link_stats stats;
+};
+
+void link_init(struct link *);
+
+/* Start connecting, from the loop running the cron jobs */
+void link_start(struct link *, struct ev_ctx *);
+
+/*
+ * Enqueue a PUBLISH, QoS 2 is downgraded to 1. Can be called from any loop.
+ * Returns -1 if the message has been dropped, the buffer being full.
+ */
+int link_publish(struct link *, const struct mqtt_packet *);
+
+/* Subscribe to a filter on the remote broker, from the on_connect callback */
+void link_subscribe(struct link *, const char *, unsigned);
+
+void link_get_stats(struct link *, struct link_stats *);
+
+/* Close the connection and free all the pending messages */
+void link_shutdown(struct link *);
+
+#endif
@@ -157,44 +157,54 @@ List *list_push_back(List *l, void *val) {
     return l;
 }
 
-static struct list_node *list_remove_single_node(struct list_node *head,
-                                                 void *data,
-                                                 struct list_node **ret,
-                                                 compare_func cmp) {
+/*
+ * Remove the value at the front of the list, the node is de-allocated while
+ * the data it carried is returned to the caller
+ * Complexity: O(1)
+ */
+void *list_pop(List *l) {
 
-    if (!head)
+    if (!l || l->len == 0)
         return NULL;
 
-    // We want the first match
-    if (cmp(head, data) == 0 && !*ret) {
+    struct list_node *head = l->head;
+    void *data = head->data;
 
-        struct list_node *tmp_next = head->next;
+    l->head = head->next;
+    if (--l->len == 0)
+        l->tail = NULL;
 
-        *ret = head;
+    free_memory(head);
 
-        return tmp_next;
-
-    }
+    return data;
+}
 
-    head->next = list_remove_single_node(head->next, data, ret, cmp);
+struct list_node *list_remove_node(List *list, void *data, compare_func cmp) {
 
-    return head;
+    if (!list || list->len == 0)
+        return NULL;
 
-}
+    struct list_node *prev = NULL, *node = list->head;
 
-struct list_node *list_remove_node(List *list, void *data, compare_func cmp) {
+    // We want the first match
+    while (node && cmp(node, data) != 0) {
+        prev = node;
+        node = node->next;
+    }
 
-    if (list->len == 0 || !list)
+    if (!node)
         return NULL;
 
-    struct list_node *node = NULL;
+    if (prev)
+        prev->next = node->next;
+    else
+        list->head = node->next;
 
-    list_remove_single_node(list->head, data, &node, cmp);
+    if (list->tail == node)
+        list->tail = prev;
 
-    if (node) {
-        list->len--;
-        node->next = NULL;
-    }
+    list->len--;
+    node->next = NULL;
 
     return node;
 }
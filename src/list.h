@@ -72,6 +72,12 @@ List *list_push(List *, void *);
 /* Insert data into a node and push it to the back of the list */
 List *list_push_back(List *, void *);
 
+/*
+ * Remove the head node of the list and return the data it was carrying,
+ * returns NULL if the list is empty
+ */
+void *list_pop(List *);
+
 /*
  * Remove a single node from the list, the first one satisfy compare_func
  * criteria, without de-allocating it
@@ -96,11 +102,13 @@ void list_iter_next(struct iterator *);
             tmp = curr;                                     \
             if (prev == NULL) (list)->head = curr->next;    \
             else prev->next = curr->next;                   \
+            if ((list)->tail == curr) (list)->tail = prev;  \
             curr = curr->next;                              \
             if ((list)->destructor)                         \
                 (list)->destructor(tmp);                    \
             (list)->len--;                                  \
         } else {                                            \
+            prev = curr;                                    \
             curr = curr->next;                              \
         }                                                   \
     }                                                       \
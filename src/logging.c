@@ -30,55 +30,213 @@
 #include <stdarg.h>
 #include <string.h>
 #include <assert.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "memory.h"
 #include "logging.h"
 
 #define MAX_LOG_SIZE 120
 
+/* Number of records of each per-thread ring, must be a power of 2 */
+#define LOG_RING_SIZE 1024
+
+/* Sleep time of the writer thread when there's nothing to write out */
+#define LOG_WRITER_IDLE_NS 5000000
+
+/* A single formatted log message waiting to be written out */
+struct log_record {
+    time_t ts;
+    char msg[MAX_LOG_SIZE + 4];
+};
+
+/*
+ * Single producer single consumer ring, every thread logging owns one and
+ * it's the only one writing records into it, the writer thread is the only
+ * consumer. Positions grow indefinitely and are masked to index the records,
+ * they live on different cache lines to avoid false sharing between the
+ * producer and the consumer. When the ring is full new messages are dropped
+ * and counted.
+ */
+struct log_ring {
+    atomic_size_t head; /* Next record to read, consumer owned */
+    /*
+     * Keep head and tail on different cache lines, plain padding as the
+     * allocator gives no alignment guarantee beyond max_align_t
+     */
+    char pad[64 - sizeof(atomic_size_t)];
+    atomic_size_t tail; /* Next record to write, producer owned */
+    atomic_size_t dropped; /* Messages dropped for a full ring, producer owned */
+    size_t dropped_reported; /* Drops already reported, consumer owned */
+    struct log_ring *next;
+    struct log_record records[LOG_RING_SIZE];
+};
+
 static FILE *fh = NULL;
-static int logging_level = DEBUG;
+
+int sol_log_level = DEBUG;
+
+/* Ring of the calling thread, lazily allocated on the first log call */
+static _Thread_local struct log_ring *ring = NULL;
+
+/* All the rings allocated, new ones are pushed on the head */
+static _Atomic(struct log_ring *) rings = NULL;
+
+/* Set while the writer thread is running, log calls go through the rings */
+static atomic_bool running = ATOMIC_VAR_INIT(false);
+
+static pthread_t writer;
+
+/* Serialize consumers, the writer thread and synchronous flushes */
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void log_write(time_t ts, const char *msg) {
+    fprintf(stdout, "%lu %s\n", (unsigned long) ts, msg);
+    if (fh)
+        fprintf(fh, "%lu %s\n", (unsigned long) ts, msg);
+}
+
+/*
+ * Write out all the pending records of every ring, reporting the number of
+ * messages dropped since the last run, if any. Returns the number of records
+ * written.
+ */
+static size_t log_drain(void) {
+    size_t drained = 0;
+    char warn[64];
+    pthread_mutex_lock(&drain_mutex);
+    for (struct log_ring *r = atomic_load(&rings); r; r = r->next) {
+        size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        for (; head != tail; ++head, ++drained) {
+            struct log_record *rec = &r->records[head & (LOG_RING_SIZE - 1)];
+            log_write(rec->ts, rec->msg);
+        }
+        atomic_store_explicit(&r->head, head, memory_order_release);
+        size_t dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+        if (dropped != r->dropped_reported) {
+            snprintf(warn, sizeof(warn), "WARNING: %lu log messages dropped",
+                     dropped - r->dropped_reported);
+            log_write(time(NULL), warn);
+            r->dropped_reported = dropped;
+        }
+    }
+    if (drained > 0) {
+        fflush(stdout);
+        if (fh)
+            fflush(fh);
+    }
+    pthread_mutex_unlock(&drain_mutex);
+    return drained;
+}
+
+static void *log_writer(void *arg) {
+    (void) arg;
+    struct timespec idle = { 0, LOG_WRITER_IDLE_NS };
+    while (atomic_load(&running) == true) {
+        if (log_drain() == 0)
+            nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+static struct log_ring *log_ring_new(void) {
+    struct log_ring *r = try_calloc(1, sizeof(*r));
+    r->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+        ;
+    return r;
+}
 
 void sol_log_init(const char *file, int level) {
-    if (!file) return;
-    fh = fopen(file, "a+");
-    logging_level = level;
-    if (!fh)
-        printf("%lu * WARNING: Unable to open file %s\n",
-               (unsigned long) time(NULL), file);
+    sol_log_level = level;
+    if (file && file[0] != '\0') {
+        fh = fopen(file, "a+");
+        if (!fh)
+            printf("%lu * WARNING: Unable to open file %s\n",
+                   (unsigned long) time(NULL), file);
+    }
+    atomic_store(&running, true);
+    if (pthread_create(&writer, NULL, log_writer, NULL) != 0) {
+        atomic_store(&running, false);
+        printf("%lu * WARNING: Unable to start the log writer, logging "
+               "synchronously\n", (unsigned long) time(NULL));
+    }
 }
 
 void sol_log_close(void) {
+    if (atomic_exchange(&running, false) == true)
+        pthread_join(writer, NULL);
+    log_drain();
+    struct log_ring *r = atomic_exchange(&rings, NULL);
+    while (r) {
+        struct log_ring *next = r->next;
+        free_memory(r);
+        r = next;
+    }
+    ring = NULL;
     if (fh) {
         fflush(fh);
         fclose(fh);
+        fh = NULL;
     }
 }
 
+static void log_format(char *msg, const char *fmt, va_list ap) {
+    vsnprintf(msg, MAX_LOG_SIZE + 4, fmt, ap);
+    /* Truncate message too long and copy 3 bytes to make space for 3 dots */
+    memcpy(msg + MAX_LOG_SIZE, "...", 3);
+    msg[MAX_LOG_SIZE + 3] = '\0';
+}
+
 void sol_log(int level, const char *fmt, ...) {
 
-    if (level < logging_level)
+    if (level < sol_log_level)
         return;
 
     assert(fmt);
 
     va_list ap;
-    char msg[MAX_LOG_SIZE + 4];
 
-    va_start(ap, fmt);
-    vsnprintf(msg, sizeof(msg), fmt, ap);
-    va_end(ap);
-
-    /* Truncate message too long and copy 3 bytes to make space for 3 dots */
-    memcpy(msg + MAX_LOG_SIZE, "...", 3);
-    msg[MAX_LOG_SIZE + 3] = '\0';
+    /*
+     * Before the writer thread is started, or after it's been stopped, and
+     * for fatal errors, as the process is going to exit right after, messages
+     * are written synchronously, preserving the order with pending ones
+     */
+    if (atomic_load_explicit(&running, memory_order_relaxed) == false
+        || level == FATAL) {
+        char msg[MAX_LOG_SIZE + 4];
+        va_start(ap, fmt);
+        log_format(msg, fmt, ap);
+        va_end(ap);
+        log_drain();
+        pthread_mutex_lock(&drain_mutex);
+        log_write(time(NULL), msg);
+        fflush(stdout);
+        if (fh)
+            fflush(fh);
+        pthread_mutex_unlock(&drain_mutex);
+        return;
+    }
 
-    // Open two handler, one for standard output and a second for the
-    // persistent log file
-    FILE *fp = stdout;
+    if (!ring)
+        ring = log_ring_new();
 
-    if (!fp)
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == LOG_RING_SIZE) {
+        atomic_store_explicit(&ring->dropped,
+                              atomic_load_explicit(&ring->dropped,
+                                                   memory_order_relaxed) + 1,
+                              memory_order_relaxed);
         return;
+    }
 
-    fprintf(fp, "%lu %s\n", (unsigned long) time(NULL), msg);
-    if (fh)
-        fprintf(fh, "%lu %s\n", (unsigned long) time(NULL), msg);
+    // Format straight into the ring slot, then publish it to the writer
+    struct log_record *rec = &ring->records[tail & (LOG_RING_SIZE - 1)];
+    rec->ts = time(NULL);
+    va_start(ap, fmt);
+    log_format(rec->msg, fmt, ap);
+    va_end(ap);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
 }
@@ -30,11 +30,38 @@
 
 enum log_level { DEBUG, INFORMATION, WARNING, ERROR, FATAL };
 
+/*
+ * Minimum level of log calls to be compiled in, calls below it are removed
+ * entirely, arguments evaluation included. Set at build time, defaults to
+ * DEBUG, e.g. -DLOG_MIN_LEVEL=INFORMATION
+ */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL DEBUG
+#endif
+
+/* Runtime logging level, checked before any formatting happens */
+extern int sol_log_level;
+
+/*
+ * Open the log file, if any, set the logging level and start the background
+ * writer thread, from now on log calls will be formatted into per-thread
+ * ring buffers and written out asynchronously. Before this call logs are
+ * written synchronously.
+ */
 void sol_log_init(const char *, int);
+
+/*
+ * Stop the background writer thread, flushing all the pending messages, and
+ * close the log file
+ */
 void sol_log_close(void);
+
 void sol_log(int, const char *, ...);
 
-#define log(...) sol_log( __VA_ARGS__ )
+#define log(level, ...) do {                                    \
+    if ((level) >= LOG_MIN_LEVEL && (level) >= sol_log_level)   \
+        sol_log((level), __VA_ARGS__);                          \
+} while (0)
 #define log_debug(...) log(DEBUG, __VA_ARGS__)
 #define log_warning(...) log(WARNING, __VA_ARGS__)
 #define log_error(...) log(ERROR, __VA_ARGS__)
@@ -56,16 +56,24 @@ void *try_alloc(size_t size) {
 }
 
 /*
- * Same as xmalloc, but with calloc, creating chunk o zero'ed memory.
- * TODO: still a suboptimal solution
+ * Same as xmalloc, but with calloc, creating chunk o zero'ed memory. Large
+ * chunks come straight from mmap already zero'ed, calloc doesn't touch them
+ * so their pages are not resident till they're first written, this is what
+ * keeps the buffers of an idle client cheap.
  *
  * This function can fail if not memory is available, interrupting the
  * execution of the program and exiting, hence the prefix "try".
  */
 void *try_calloc(size_t len, size_t size) {
-    void *ptr = try_alloc(len * size);
-    memset(ptr, 0x00, len * size);
-    return ptr;
+    void *ptr = calloc(1, len * size + sizeof(size_t));
+    if (!ptr) {
+        fprintf(stderr, "[%s:%ul] Out of memory (%lu bytes)\n",
+                __FILE__, __LINE__, len * size);
+        exit(EXIT_FAILURE);
+    }
+    memory += len * size + sizeof(size_t);
+    *((size_t *) ptr) = len * size;
+    return (char *) ptr + sizeof(size_t);
 }
 
 /*
@@ -33,97 +33,96 @@ static void memorypool_resize(struct memorypool *);
 
 struct memorypool *memorypool_new(size_t blocks_nr, size_t blocksize) {
     struct memorypool *pool = try_alloc(sizeof(*pool));
-    blocksize = blocksize >= sizeof(intptr_t) ? blocksize : sizeof(intptr_t);
+    blocksize = blocksize >= sizeof(void *) ? blocksize : sizeof(void *);
     pool->memory = try_calloc(blocks_nr, blocksize);
-    pool->free = pool->memory;
     pool->blocks_nr = blocks_nr;
     pool->blocksize = blocksize;
-    if (!pool->free) {
+    if (!pool->memory) {
         free_memory(pool);
         return NULL;
     }
+    pool->chunks = try_alloc(sizeof(void *));
+    pool->chunks[0] = pool->memory;
+    pool->chunks_nr = 1;
     /*
-     * We pre-assign the position of each free block in the free pointer, this
-     * way we know every block position before allocating new memory, we'll
-     * call it the header of each block, where we store the offset in memory
-     * to reach the next free slot:
+     * Free blocks are linked in a list, we store in the header of each one
+     * the address of the next free block:
      *
      *       ____________
-     *     _| 0x1ad45f02 | (0+blocksize)
+     *     _| 0x1ad45f02 |
      *    | |------------|
      *    | |     .      |
      *    | |     .      |
      *    |_|------------|
-     *     _| 0x2ff43da1 | (1+blocksize)
+     *     _| 0x2ff43da1 |
      *    | |------------|
      *    | |     .      |
      *    | |     .      |
      *    |_|------------|
-     *      | 0x98fff34a | (n+blocksize)
+     *      |    NULL    |
      *      |------------|
      *      |     .      |
      *
      * Just before assigning a free block of memory, we update the free pointer,
      * pointing it to the memory address previously stored as r-value in it.
-     * This way everytime we allocate a new block we can refresh the next free
-     * block in the list.
+     * The list starts empty, blocks enter it only once released, the ones
+     * never used are taken from the fresh part of the last chunk.
      */
-    intptr_t *ptr = pool->free;
-    for (size_t i = 1; i != blocks_nr; ++i) {
-        *ptr = (intptr_t) i;
-        ptr = (intptr_t *)((char *) ptr + blocksize);
-    }
+    pool->free = NULL;
+    pool->fresh = pool->memory;
+    pool->end = pool->fresh + blocks_nr * blocksize;
     pool->block_used = 0;
     return pool;
 }
 
 void memorypool_destroy(struct memorypool *pool) {
-    free_memory(pool->memory);
+    for (size_t i = 0; i < pool->chunks_nr; ++i)
+        free_memory(pool->chunks[i]);
+    free_memory(pool->chunks);
     free_memory(pool);
 }
 
 void *memorypool_alloc(struct memorypool *pool) {
-    if (pool->block_used == pool->blocks_nr - 2)
-        memorypool_resize(pool);
     void *ptr = pool->free;
-    /*
-     * After pointing the return pointer to the next free block, we need to
-     * update the next free block address on the free pointer. The address is
-     * already stored in the "header" of the block.
-     */
-    pool->free = (intptr_t *)((char *) pool->memory +
-                              (*((intptr_t *) pool->free)) * pool->blocksize);
+    if (ptr) {
+        /*
+         * After pointing the return pointer to the next free block, we need
+         * to update the next free block address on the free pointer. The
+         * address is already stored in the "header" of the block.
+         */
+        pool->free = *((void **) ptr);
+    } else {
+        if (pool->fresh == pool->end)
+            memorypool_resize(pool);
+        ptr = pool->fresh;
+        pool->fresh += pool->blocksize;
+    }
     pool->block_used++;
     return ptr;
 }
 
 void memorypool_free(struct memorypool *pool, void *ptr) {
     /*
-     * Here we just need to point the header of the pointer to the next free
-     * location and udpate the current free location by pointing it to the
+     * Here we just need to point the header of the pointer to the current
+     * free location and update the free location by pointing it to the
      * free'd pointer
      */
-    *((intptr_t *) ptr) = *((intptr_t *) pool->free);
-    if (pool->block_used == pool->blocks_nr - 2)
-        memorypool_resize(pool);
+    *((void **) ptr) = pool->free;
     pool->free = ptr;
     pool->block_used--;
 }
 
+/*
+ * Double the capacity of the pool with a new chunk, the memory already
+ * handed out is left where it is
+ */
 static void memorypool_resize(struct memorypool *pool) {
-    pool->blocks_nr *= 2;
-    size_t newsize = pool->blocks_nr * pool->blocksize;
-    /* We extract next memory block offset position */
-    intptr_t offset = *((intptr_t *) pool->free);
-    pool->memory = try_realloc(pool->memory, newsize);
-    pool->free = (void *)((char *) pool->memory + ((offset-1) * pool->blocksize));
-    /*
-     * Apply the same logic of the init, but starting from the updated offset,
-     * the ald size of the pool
-     */
-    intptr_t *ptr = (intptr_t *) pool->free;
-    for (size_t i = offset; i <= pool->blocks_nr; ++i) {
-        *ptr = (intptr_t) i;
-        ptr = (intptr_t *)((char *) ptr + pool->blocksize);
-    }
+    size_t blocks_nr = pool->blocks_nr;
+    void *chunk = try_calloc(blocks_nr, pool->blocksize);
+    pool->chunks = try_realloc(pool->chunks,
+                               (pool->chunks_nr + 1) * sizeof(void *));
+    pool->chunks[pool->chunks_nr++] = chunk;
+    pool->fresh = chunk;
+    pool->end = pool->fresh + blocks_nr * pool->blocksize;
+    pool->blocks_nr += blocks_nr;
 }
@@ -33,11 +33,21 @@
  * be pre-allocated and re-use of memory blocks, so no size have to be
  * specified like in a normal malloc but only alloc and free of a pointer is
  * possible.
+ *
+ * The pool grows by chunks, a full pool allocates a new chunk as large as the
+ * current capacity, blocks already handed out never move so pointers to them
+ * stay valid for the entire life of the pool. Blocks never used are handed
+ * out in order from the last chunk, so its pages are touched only when they're
+ * needed.
  */
 struct memorypool {
     void *memory;
     void *free;
-    int block_used;
+    char *fresh;
+    char *end;
+    void **chunks;
+    size_t chunks_nr;
+    size_t block_used;
     size_t blocks_nr;
     size_t blocksize;
 };
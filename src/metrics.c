@@ -0,0 +1,347 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include "ev.h"
+#include "config.h"
+#include "memory.h"
+#include "server.h"
+#include "logging.h"
+#include "network.h"
+#include "metrics.h"
+#include "bridge.h"
+#include "cluster.h"
+#include "ratelimit.h"
+
+/*
+ * Max size of an HTTP request we're willing to read, scrapers send just a
+ * request line and a bunch of headers
+ */
+#define METRICS_REQUEST_SIZE    2048
+
+/* Response body buffer size, large enough for all the loops metrics */
+#define METRICS_RESPONSE_SIZE   16384
+
+/*
+ * A single HTTP connection to the metrics listener, tracks the bytes read so
+ * far, the request is served as soon as all the headers are received
+ */
+struct metrics_conn {
+    struct connection conn;
+    size_t read;
+    unsigned char buf[METRICS_REQUEST_SIZE];
+};
+
+/* The listening socket for metrics, kept to be passed to the accept callback */
+static int metrics_fd = -1;
+
+/*
+ * Append formatted text to the output buffer, tracking the position and
+ * taking care of not exceeding its size
+ */
+static void metrics_printf(char *buf, size_t len, size_t *pos,
+                           const char *fmt, ...) {
+    if (*pos >= len)
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + *pos, len - *pos, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        *pos = *pos + n < len ? *pos + n : len;
+}
+
+/*
+ * Write the HELP and TYPE lines of a metric, followed by a sample for each
+ * event loop
+ */
+#define METRIC_PER_LOOP(name, type, help, field) do {                       \
+    metrics_printf(buf, len, &pos, "# HELP " name " " help "\n"             \
+                   "# TYPE " name " " type "\n");                           \
+    for (int i = 0; i <= THREADSNR; ++i)                                    \
+        metrics_printf(buf, len, &pos, name "{loop=\"%d\"} %llu\n", i,      \
+                       (unsigned long long) atomic_load_explicit(           \
+                           &server.stats[i].field, memory_order_relaxed));  \
+} while (0)
+
+size_t metrics_render(char *buf, size_t len) {
+    size_t pos = 0;
+    METRIC_PER_LOOP("sol_connections_active", "gauge",
+                    "Clients currently connected.", active_connections);
+    METRIC_PER_LOOP("sol_connections_total", "counter",
+                    "Clients connected since the start.", total_connections);
+    METRIC_PER_LOOP("sol_messages_received_total", "counter",
+                    "PUBLISH packets received.", messages_recv);
+    METRIC_PER_LOOP("sol_messages_sent_total", "counter",
+                    "PUBLISH packets sent.", messages_sent);
+    METRIC_PER_LOOP("sol_messages_dropped_total", "counter",
+                    "PUBLISH packets dropped, not fitting the write buffer.",
+                    messages_dropped);
+    METRIC_PER_LOOP("sol_bytes_received_total", "counter",
+                    "Bytes received.", bytes_recv);
+    METRIC_PER_LOOP("sol_bytes_sent_total", "counter",
+                    "Bytes sent.", bytes_sent);
+    // Event loop counters are kept by the ev_ctx of each loop
+    unsigned long long wakeups[THREADSNR + 1], callbacks[THREADSNR + 1];
+    for (int i = 0; i <= THREADSNR; ++i) {
+        wakeups[i] = atomic_load_explicit(&server.loops[i].wakeups,
+                                          memory_order_relaxed);
+        callbacks[i] = atomic_load_explicit(&server.loops[i].fired_events,
+                                            memory_order_relaxed);
+    }
+    metrics_printf(buf, len, &pos,
+                   "# HELP sol_loop_wakeups_total Event loop poll returns.\n"
+                   "# TYPE sol_loop_wakeups_total counter\n");
+    for (int i = 0; i <= THREADSNR; ++i)
+        metrics_printf(buf, len, &pos,
+                       "sol_loop_wakeups_total{loop=\"%d\"} %llu\n",
+                       i, wakeups[i]);
+    metrics_printf(buf, len, &pos,
+                   "# HELP sol_loop_callbacks_total Event loop callbacks run.\n"
+                   "# TYPE sol_loop_callbacks_total counter\n");
+    for (int i = 0; i <= THREADSNR; ++i)
+        metrics_printf(buf, len, &pos,
+                       "sol_loop_callbacks_total{loop=\"%d\"} %llu\n",
+                       i, callbacks[i]);
+    metrics_printf(buf, len, &pos,
+                   "# HELP sol_loop_callbacks_per_wakeup Average callbacks "
+                   "run for each event loop wakeup.\n"
+                   "# TYPE sol_loop_callbacks_per_wakeup gauge\n");
+    for (int i = 0; i <= THREADSNR; ++i)
+        metrics_printf(buf, len, &pos,
+                       "sol_loop_callbacks_per_wakeup{loop=\"%d\"} %.3f\n", i,
+                       wakeups[i] ? (double) callbacks[i] / wakeups[i] : 0.0);
+    // Latencies of each stage, cumulative since the start
+    static struct histogram latency;
+    static const double quantiles[] = { 0.5, 0.99, 0.999, 1.0 };
+    metrics_printf(buf, len, &pos,
+                   "# HELP sol_latency_seconds Time spent by messages in "
+                   "each stage inside the broker.\n"
+                   "# TYPE sol_latency_seconds summary\n");
+    for (int i = 0; i < LATENCY_STAGES; ++i) {
+        const char *stage = latency_stage_name(i);
+        latency_aggregate(&latency, i);
+        for (int j = 0; j < 4; ++j)
+            metrics_printf(buf, len, &pos,
+                           "sol_latency_seconds{stage=\"%s\",quantile=\"%g\"} "
+                           "%.9f\n", stage, quantiles[j],
+                           histogram_percentile(&latency, quantiles[j] * 100) / 1e9);
+        metrics_printf(buf, len, &pos,
+                       "sol_latency_seconds_sum{stage=\"%s\"} %.9f\n"
+                       "sol_latency_seconds_count{stage=\"%s\"} %llu\n",
+                       stage, latency.sum / 1e9, stage,
+                       (unsigned long long) latency.total);
+    }
+    // Memory footprint of the connections, by component
+    struct footprint fp;
+    server_footprint(&fp);
+    metrics_printf(buf, len, &pos,
+                   "# HELP sol_memory_rss_bytes Resident set size of the "
+                   "process.\n"
+                   "# TYPE sol_memory_rss_bytes gauge\n"
+                   "sol_memory_rss_bytes %zu\n"
+                   "# HELP sol_connections_memory_bytes Memory used by the "
+                   "connections, by component.\n"
+                   "# TYPE sol_connections_memory_bytes gauge\n"
+                   "sol_connections_memory_bytes{component=\"client\"} %zu\n"
+                   "sol_connections_memory_bytes{component=\"buffers\"} %zu\n"
+                   "sol_connections_memory_bytes{component=\"session\"} %zu\n"
+                   "sol_connections_memory_bytes{component=\"inflight\"} %zu\n"
+                   "sol_connections_memory_bytes{component=\"epoll\"} %zu\n",
+                   fp.rss, fp.clients, fp.buffers, fp.sessions, fp.inflight,
+                   fp.epoll);
+    // Bridge to the remote broker, if configured
+    // Ingress rate limits, by listener and bucket out of tokens
+    if (ratelimit_enabled == true) {
+        static const char *const listeners[RATE_LISTENERS] = { "socket", "shm" };
+        struct rate_limit_stats rs;
+        ratelimit_get_stats(&rs);
+        metrics_printf(buf, len, &pos,
+                       "# HELP sol_clients_throttled Clients with reads "
+                       "suspended by the rate limits.\n"
+                       "# TYPE sol_clients_throttled gauge\n"
+                       "sol_clients_throttled %lu\n"
+                       "# HELP sol_throttled_total Frames exceeding the rate "
+                       "limits, by listener and limit.\n"
+                       "# TYPE sol_throttled_total counter\n",
+                       info.throttled_clients);
+        for (int i = 0; i < RATE_LISTENERS; ++i)
+            metrics_printf(buf, len, &pos,
+                           "sol_throttled_total{listener=\"%s\","
+                           "limit=\"client\"} %zu\n"
+                           "sol_throttled_total{listener=\"%s\","
+                           "limit=\"listener\"} %zu\n",
+                           listeners[i], rs.client[i],
+                           listeners[i], rs.listener[i]);
+    }
+    if (bridge_enabled == true) {
+        struct link_stats bs;
+        bridge_get_stats(&bs);
+        metrics_printf(buf, len, &pos,
+                       "# HELP sol_bridge_connected Whether the bridge is "
+                       "connected to the remote broker.\n"
+                       "# TYPE sol_bridge_connected gauge\n"
+                       "sol_bridge_connected %d\n"
+                       "# HELP sol_bridge_messages_total Messages through the "
+                       "bridge, by direction.\n"
+                       "# TYPE sol_bridge_messages_total counter\n"
+                       "sol_bridge_messages_total{direction=\"out\"} %zu\n"
+                       "sol_bridge_messages_total{direction=\"in\"} %zu\n"
+                       "# HELP sol_bridge_dropped_total Messages dropped with "
+                       "the bridge buffer full.\n"
+                       "# TYPE sol_bridge_dropped_total counter\n"
+                       "sol_bridge_dropped_total %zu\n"
+                       "# HELP sol_bridge_queued_bytes Bytes of messages "
+                       "waiting to be sent or acknowledged.\n"
+                       "# TYPE sol_bridge_queued_bytes gauge\n"
+                       "sol_bridge_queued_bytes %zu\n",
+                       bs.connected ? 1 : 0, bs.forwarded, bs.received,
+                       bs.dropped, bs.queued_bytes);
+    }
+    // Links to the other nodes of the cluster, one series per node
+    if (cluster_enabled == true) {
+        struct link_stats cs[CLUSTER_MAX_PEERS];
+        int peers = cluster_get_stats(cs);
+        metrics_printf(buf, len, &pos,
+                       "# HELP sol_cluster_peer_connected Whether the link to "
+                       "another node is up.\n"
+                       "# TYPE sol_cluster_peer_connected gauge\n");
+        for (int i = 0; i < peers; ++i)
+            metrics_printf(buf, len, &pos,
+                           "sol_cluster_peer_connected{peer=\"%s\"} %d\n",
+                           conf->cluster_peers[i], cs[i].connected ? 1 : 0);
+        metrics_printf(buf, len, &pos,
+                       "# HELP sol_cluster_forwarded_total Messages forwarded "
+                       "to another node.\n"
+                       "# TYPE sol_cluster_forwarded_total counter\n");
+        for (int i = 0; i < peers; ++i)
+            metrics_printf(buf, len, &pos,
+                           "sol_cluster_forwarded_total{peer=\"%s\"} %zu\n",
+                           conf->cluster_peers[i], cs[i].forwarded);
+        metrics_printf(buf, len, &pos,
+                       "# HELP sol_cluster_dropped_total Messages dropped with "
+                       "the buffer of the link full.\n"
+                       "# TYPE sol_cluster_dropped_total counter\n");
+        for (int i = 0; i < peers; ++i)
+            metrics_printf(buf, len, &pos,
+                           "sol_cluster_dropped_total{peer=\"%s\"} %zu\n",
+                           conf->cluster_peers[i], cs[i].dropped);
+    }
+    // Broker wide values
+    metrics_printf(buf, len, &pos,
+                   "# HELP sol_publishers_paused Publishers paused by "
+                   "backpressure.\n"
+                   "# TYPE sol_publishers_paused gauge\n"
+                   "sol_publishers_paused %lu\n"
+                   "# HELP sol_memory_used_bytes Memory allocated by the "
+                   "broker.\n"
+                   "# TYPE sol_memory_used_bytes gauge\n"
+                   "sol_memory_used_bytes %lu\n"
+                   "# HELP sol_uptime_seconds Seconds since the start.\n"
+                   "# TYPE sol_uptime_seconds gauge\n"
+                   "sol_uptime_seconds %lu\n",
+                   info.paused_publishers, memory_used(),
+                   time(NULL) - info.start_time);
+    return pos;
+}
+
+static void metrics_close(struct ev_ctx *ctx, struct metrics_conn *mc) {
+    ev_del_fd(ctx, mc->conn.fd);
+    close_connection(&mc->conn);
+    free_memory(mc);
+}
+
+/*
+ * Reply to a complete request, only GET /metrics is served, the response is
+ * small enough to be written in a single call on a fresh socket, then the
+ * connection is closed.
+ */
+static void metrics_reply(struct metrics_conn *mc) {
+    char header[128];
+    char *body = try_alloc(METRICS_RESPONSE_SIZE);
+    size_t len = 0;
+    int status = strncmp((const char *) mc->buf, "GET /metrics", 12) == 0
+        ? 200 : 404;
+    if (status == 200)
+        len = metrics_render(body, METRICS_RESPONSE_SIZE);
+    int hlen = snprintf(header, sizeof(header),
+                        "HTTP/1.0 %s\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %lu\r\n"
+                        "Connection: close\r\n\r\n",
+                        status == 200 ? "200 OK" : "404 Not Found", len);
+    if (send_data(&mc->conn, (unsigned char *) header, hlen) == hlen && len > 0)
+        send_data(&mc->conn, (unsigned char *) body, len);
+    free_memory(body);
+}
+
+static void metrics_read_callback(struct ev_ctx *ctx, void *data) {
+    struct metrics_conn *mc = data;
+    ssize_t n = recv_data(&mc->conn, mc->buf + mc->read,
+                          METRICS_REQUEST_SIZE - 1 - mc->read);
+    if (n <= 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        metrics_close(ctx, mc);
+        return;
+    }
+    mc->read += n > 0 ? n : 0;
+    mc->buf[mc->read] = '\0';
+    // Wait for the end of the headers, unless the buffer is already full
+    if (!strstr((const char *) mc->buf, "\r\n\r\n")
+        && mc->read < METRICS_REQUEST_SIZE - 1)
+        return;
+    metrics_reply(mc);
+    metrics_close(ctx, mc);
+}
+
+static void metrics_accept_callback(struct ev_ctx *ctx, void *data) {
+    (void) data;
+    while (1) {
+        struct connection conn;
+        connection_init(&conn, NULL);
+        int fd = accept_connection(&conn, metrics_fd);
+        if (fd == 0)
+            continue;
+        if (fd < 0) {
+            close_connection(&conn);
+            break;
+        }
+        struct metrics_conn *mc = try_alloc(sizeof(*mc));
+        mc->conn = conn;
+        mc->read = 0;
+        ev_register_event(ctx, fd, EV_READ, metrics_read_callback, mc);
+    }
+}
+
+void metrics_start(struct ev_ctx *ctx, const char *host, const char *port) {
+    metrics_fd = make_listen(host, port, INET);
+    ev_register_event(ctx, metrics_fd, EV_READ, metrics_accept_callback, NULL);
+    log_info("Serving metrics on http://%s:%s/metrics", host, port);
+}
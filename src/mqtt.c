@@ -45,6 +45,10 @@ static int unpack_mqtt_unsubscribe(u8 *, struct mqtt_packet *, usize);
 
 static int unpack_mqtt_ack(u8 *, struct mqtt_packet *, usize);
 
+static int unpack_mqtt_connack(u8 *, struct mqtt_packet *, usize);
+
+static int unpack_mqtt_suback(u8 *, struct mqtt_packet *, usize);
+
 static usize pack_mqtt_header(const union mqtt_header *, u8 *);
 
 static usize pack_mqtt_ack(const struct mqtt_packet *, u8 *);
@@ -55,6 +59,10 @@ static usize pack_mqtt_suback(const struct mqtt_packet *, u8 *);
 
 static usize pack_mqtt_publish(const struct mqtt_packet *, u8 *);
 
+static usize pack_mqtt_connect(const struct mqtt_packet *, u8 *);
+
+static usize pack_mqtt_subscribe(const struct mqtt_packet *, u8 *);
+
 /* MQTT v3.1.1 standard */
 static const int MAX_LEN_BYTES = 4;
 
@@ -65,6 +73,12 @@ static const int MAX_LEN_BYTES = 4;
  */
 static const int SKIP_PROTOCOL_NAME = 7;
 
+/* Length of the CONNECT variable header, protocol name, level, flags and
+   keepalive */
+static const int CONNECT_HEADER_LEN = 10;
+
+static const u8 PROTOCOL_LEVEL = 4;
+
 /*
  * Unpack functions mapping unpacking_handlers positioned in the array based
  * on message type
@@ -72,27 +86,27 @@ static const int SKIP_PROTOCOL_NAME = 7;
 static mqtt_unpack_handler *unpack_handlers[11] = {
     NULL,
     unpack_mqtt_connect,
-    NULL,
+    unpack_mqtt_connack,
     unpack_mqtt_publish,
     unpack_mqtt_ack,
     unpack_mqtt_ack,
     unpack_mqtt_ack,
     unpack_mqtt_ack,
     unpack_mqtt_subscribe,
-    NULL,
+    unpack_mqtt_suback,
     unpack_mqtt_unsubscribe
 };
 
 static mqtt_pack_handler *pack_handlers[13] = {
     NULL,
-    NULL,
+    pack_mqtt_connect,
     pack_mqtt_connack,
     pack_mqtt_publish,
     pack_mqtt_ack,
     pack_mqtt_ack,
     pack_mqtt_ack,
     pack_mqtt_ack,
-    NULL,
+    pack_mqtt_subscribe,
     pack_mqtt_suback,
     NULL,
     pack_mqtt_ack,
@@ -412,6 +426,19 @@ static int unpack_mqtt_ack(u8 *buf, struct mqtt_packet *pkt, usize len) {
     return MQTT_OK;
 }
 
+static int unpack_mqtt_connack(u8 *buf, struct mqtt_packet *pkt, usize len) {
+    pkt->connack = (struct mqtt_connack) { .byte = buf[0], .rc = buf[1] };
+    return MQTT_OK;
+}
+
+static int unpack_mqtt_suback(u8 *buf, struct mqtt_packet *pkt, usize len) {
+    pkt->suback.pkt_id = unpack_integer(&buf, 'H');
+    len -= sizeof(u16);
+    pkt->suback.rcslen = len;
+    pkt->suback.rcs = unpack_bytes(&buf, len);
+    return pkt->suback.rcs ? MQTT_OK : -MQTT_ERR;
+}
+
 /*
  * Main unpacking function entry point. Call the correct unpacking function
  * through a dispatch table
@@ -513,13 +540,70 @@ static usize pack_mqtt_publish(const struct mqtt_packet *pkt, u8 *buf) {
     return pktlen;
 }
 
+/* Pack a string prepended by its length as a 16 bit integer */
+static usize pack_string16(u8 *buf, const u8 *str, u16 len) {
+    pack(buf, "H", len);
+    memcpy(buf + sizeof(u16), str, len);
+    return sizeof(u16) + len;
+}
+
+static usize pack_mqtt_connect(const struct mqtt_packet *pkt, u8 *buf) {
+
+    usize len = 0;
+    usize pktlen = mqtt_size(pkt, &len);
+    const struct mqtt_connect *c = &pkt->connect;
+
+    pack(buf++, "B", pkt->header.byte);
+    buf += mqtt_encode_length(buf, len);
+
+    // Variable header, protocol name and level, flags and keepalive
+    buf += pack_string16(buf, (const u8 *) "MQTT", 4);
+    buf += pack(buf, "BBH", PROTOCOL_LEVEL, c->byte, c->payload.keepalive);
+
+    // Payload, every field is a string prepended by its length
+    buf += pack_string16(buf, c->payload.client_id,
+                         strlen((const char *) c->payload.client_id));
+    if (c->bits.will == 1) {
+        buf += pack_string16(buf, c->payload.will_topic,
+                             strlen((const char *) c->payload.will_topic));
+        buf += pack_string16(buf, c->payload.will_message,
+                             strlen((const char *) c->payload.will_message));
+    }
+    if (c->bits.username == 1)
+        buf += pack_string16(buf, c->payload.username,
+                             strlen((const char *) c->payload.username));
+    if (c->bits.password == 1)
+        pack_string16(buf, c->payload.password,
+                      strlen((const char *) c->payload.password));
+
+    return pktlen;
+}
+
+static usize pack_mqtt_subscribe(const struct mqtt_packet *pkt, u8 *buf) {
+
+    usize len = 0;
+    usize pktlen = mqtt_size(pkt, &len);
+
+    pack(buf++, "B", pkt->header.byte);
+    buf += mqtt_encode_length(buf, len);
+
+    buf += pack(buf, "H", pkt->subscribe.pkt_id);
+    for (int i = 0; i < pkt->subscribe.tuples_len; i++) {
+        buf += pack_string16(buf, pkt->subscribe.tuples[i].topic,
+                             pkt->subscribe.tuples[i].topic_len);
+        pack(buf++, "B", pkt->subscribe.tuples[i].qos);
+    }
+
+    return pktlen;
+}
+
 /*
  * Main packing function entry point. Call the correct packing function through
  * a dispatch table
  */
 usize mqtt_pack(const struct mqtt_packet *pkt, u8 *buf) {
     u8 type = pkt->header.bits.type;
-    if (type == PINGREQ || type == PINGRESP)
+    if (type == PINGREQ || type == PINGRESP || type == DISCONNECT)
         return pack_mqtt_header(&pkt->header, buf);
     return pack_handlers[type](pkt, buf);
 }
@@ -643,6 +727,31 @@ usize mqtt_size(const struct mqtt_packet *pkt, usize *len) {
         case SUBACK:
             size = MQTT_HEADER_LEN + sizeof(uint16_t) + pkt->suback.rcslen;
             break;
+        case CONNECT:
+            size = MQTT_HEADER_LEN + CONNECT_HEADER_LEN + sizeof(uint16_t) +
+                strlen((const char *) pkt->connect.payload.client_id);
+            if (pkt->connect.bits.will == 1)
+                size += 2 * sizeof(uint16_t) +
+                    strlen((const char *) pkt->connect.payload.will_topic) +
+                    strlen((const char *) pkt->connect.payload.will_message);
+            if (pkt->connect.bits.username == 1)
+                size += sizeof(uint16_t) +
+                    strlen((const char *) pkt->connect.payload.username);
+            if (pkt->connect.bits.password == 1)
+                size += sizeof(uint16_t) +
+                    strlen((const char *) pkt->connect.payload.password);
+            break;
+        case SUBSCRIBE:
+            size = MQTT_HEADER_LEN + sizeof(uint16_t);
+            for (int i = 0; i < pkt->subscribe.tuples_len; i++)
+                size += sizeof(uint16_t) + pkt->subscribe.tuples[i].topic_len +
+                    sizeof(uint8_t);
+            break;
+        case PINGREQ:
+        case PINGRESP:
+        case DISCONNECT:
+            size = MQTT_HEADER_LEN;
+            break;
         default:
             size = MQTT_ACK_LEN;
             break;
@@ -676,6 +785,7 @@ static void mqtt_packet_free(const struct ref *refcount) {
 struct mqtt_packet *mqtt_packet_alloc(u8 byte) {
     struct mqtt_packet *packet = try_alloc(sizeof(*packet));
     packet->header = (union mqtt_header) { .byte = byte };
+    packet->expiry = 0;
     packet->refcount = (struct ref) { mqtt_packet_free, 0 };
     packet->refcount.count = ATOMIC_VAR_INIT(0);
     return packet;
@@ -28,6 +28,7 @@
 #ifndef MQTT_H
 #define MQTT_H
 
+#include <time.h>
 #include "ref.h"
 #include "types.h"
 
@@ -51,15 +52,19 @@
  * Stub bytes, useful for generic replies, these represent the first byte in
  * the fixed header
  */
+#define CONNECT_B  0x10
 #define CONNACK_B  0x20
 #define PUBLISH_B  0x30
 #define PUBACK_B   0x40
 #define PUBREC_B   0x50
 #define PUBREL_B   0x62
 #define PUBCOMP_B  0x70
+#define SUBSCRIBE_B 0x82
 #define SUBACK_B   0x90
 #define UNSUBACK_B 0xB0
+#define PINGREQ_B  0xC0
 #define PINGRESP_B 0xD0
+#define DISCONNECT_B 0xE0
 
 /* Message types */
 enum packet_type {
@@ -197,14 +202,16 @@ struct mqtt_connack {
     u8 rc;
 };
 
+struct mqtt_subscribe_tuple {
+    u8 qos;
+    u16 topic_len;
+    u8 *topic;
+};
+
 struct mqtt_subscribe {
     u16 pkt_id;
     u16 tuples_len;
-    struct {
-        u8 qos;
-        u16 topic_len;
-        u8 *topic;
-    } *tuples;
+    struct mqtt_subscribe_tuple *tuples;
 };
 
 struct mqtt_unsubscribe {
@@ -257,6 +264,8 @@ struct mqtt_packet {
         struct mqtt_subscribe subscribe;
         struct mqtt_unsubscribe unsubscribe;
     };
+    /* Deadline of a message queued for offline sessions, 0 means never */
+    time_t expiry;
     struct ref refcount;
 };
 
@@ -287,6 +296,8 @@ int mqtt_unpack(u8 *, struct mqtt_packet *, u8, usize);
  * Unpack from binary to an mqtt_packet structure. Internally it uses a
  * dispatch table to call the right unpack function based on the opcode
  * expected to read.
+ * Besides the packets sent by the broker, CONNECT and SUBSCRIBE can be packed
+ * and CONNACK and SUBACK unpacked as well, to be used by client side tools.
  */
 usize mqtt_pack(const struct mqtt_packet *, u8 *);
 
@@ -302,7 +313,7 @@ void mqtt_connack(struct mqtt_packet *, u8 , u8);
 
 void mqtt_suback(struct mqtt_packet *, u16, u8 *, u16);
 
-void mqtt_publish(struct mqtt_packet *, u16, usize, u8 *, usize, u8 *);
+void mqtt_packet_publish(struct mqtt_packet *, u16, usize, u8 *, usize, u8 *);
 
 /*
  * Release the memory allocated through helpers function calls based on the
@@ -266,8 +266,14 @@ ssize_t recv_bytes(int fd, unsigned char *buf, size_t bufsize) {
                 goto err;
         }
 
-        if (n == 0)
+        /*
+         * Peer closed, callers tell it apart from an EAGAIN with nothing read
+         * through errno, which may still hold an EAGAIN from any earlier call
+         */
+        if (n == 0) {
+            errno = 0;
             return 0;
+        }
 
         buf += n;
         total += n;
@@ -292,7 +298,7 @@ void openssl_cleanup() {
     EVP_cleanup();
 }
 
-SSL_CTX *create_ssl_context() {
+SSL_CTX *create_ssl_context(int protocols) {
 
     SSL_CTX *ctx;
 
@@ -307,22 +313,22 @@ SSL_CTX *create_ssl_context() {
     if (!ctx) {
         perror("Unable to create SSL context");
         ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
+        return NULL;
     }
 
     SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2|SSL_OP_NO_SSLv3);
     SSL_CTX_set_options(ctx, SSL_OP_SINGLE_DH_USE);
 
-    if (!(conf->tls_protocols & SOL_TLSv1))
+    if (!(protocols & SOL_TLSv1))
         SSL_CTX_set_options(ctx, SSL_OP_NO_TLSv1);
-    if (!(conf->tls_protocols & SOL_TLSv1_1))
+    if (!(protocols & SOL_TLSv1_1))
         SSL_CTX_set_options(ctx, SSL_OP_NO_TLSv1_1);
 #ifdef SSL_OP_NO_TLSv1_2
-    if (!(conf->tls_protocols & SOL_TLSv1_2))
+    if (!(protocols & SOL_TLSv1_2))
         SSL_CTX_set_options(ctx, SSL_OP_NO_TLSv1_2);
 #endif
 #ifdef SSL_OP_NO_TLSv1_3
-    if (!(conf->tls_protocols & SOL_TLSv1_3))
+    if (!(protocols & SOL_TLSv1_3))
         SSL_CTX_set_options(ctx, SSL_OP_NO_TLSv1_3);
 #endif
 
@@ -347,12 +353,12 @@ static int client_certificate_verify(int preverify_ok, X509_STORE_CTX *ctx) {
     return preverify_ok;
 }
 
-void load_certificates(SSL_CTX *ctx, const char *ca,
+bool load_certificates(SSL_CTX *ctx, const char *ca,
                        const char *cert, const char *key) {
 
     if (SSL_CTX_load_verify_locations(ctx, ca, NULL) <= 0) {
         ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
+        return false;
     }
 
     SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE|SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
@@ -361,19 +367,21 @@ void load_certificates(SSL_CTX *ctx, const char *ca,
 
     if (SSL_CTX_use_certificate_chain_file(ctx, cert) <= 0) {
         ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
+        return false;
     }
 
     if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) <= 0 ) {
         ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
+        return false;
     }
 
     /* verify private key */
     if (!SSL_CTX_check_private_key(ctx) ) {
         fprintf(stderr, "Private key does not match the public certificate\n");
-        exit(EXIT_FAILURE);
+        return false;
     }
+
+    return true;
 }
 
 SSL *ssl_accept(SSL_CTX *ctx, int fd) {
@@ -511,6 +519,7 @@ static void conn_tls_close(struct connection *c) {
 void connection_init(struct connection *conn, const SSL_CTX *ssl_ctx) {
     conn->fd = -1;
     conn->ssl = NULL; // Will be filled in case of TLS connection on accept
+    conn->shm = NULL; // Will be filled in case of shared memory connection
     conn->ctx = (SSL_CTX *) ssl_ctx;
     if (ssl_ctx) {
         // We need a TLS connection
@@ -28,6 +28,7 @@
 
 #ifndef NETWORK_H
 #define NETWORK_H
+#include <stdbool.h>
 
 #include <openssl/ssl.h>
 #include <arpa/inet.h>
@@ -53,10 +54,13 @@
  * be set with the right function needed. Maintain even the address:port of the
  * connecting client.
  */
+struct shm_conn;
+
 struct connection {
     int fd;
     SSL *ssl;
     SSL_CTX *ctx;
+    struct shm_conn *shm; /* Rings of a shared memory connection, see shm.h */
     char ip[INET_ADDRSTRLEN + 6];
     int (*accept) (struct connection *, int);
     ssize_t (*send) (struct connection *, const unsigned char *, size_t);
@@ -96,8 +100,8 @@ ssize_t send_bytes(int, const unsigned char *, size_t);
  */
 ssize_t recv_bytes(int, unsigned char *, size_t);
 
-// Init SSL context
-SSL_CTX *create_ssl_context(void);
+// Init SSL context allowing the SOL_TLS* protocols set, NULL on failure
+SSL_CTX *create_ssl_context(int);
 
 /* Init openssl library */
 void openssl_init(void);
@@ -105,8 +109,11 @@ void openssl_init(void);
 /* Release resources allocated by openssl library */
 void openssl_cleanup(void);
 
-/* Load cert.pem and key.pem certfiles from filesystem */
-void load_certificates(SSL_CTX *, const char *, const char *, const char *);
+/*
+ * Load cert.pem and key.pem certfiles from filesystem, returns false if any
+ * of them can't be used
+ */
+bool load_certificates(SSL_CTX *, const char *, const char *, const char *);
 
 /* Send data like sendall but adding encryption SSL */
 ssize_t ssl_send_bytes(SSL *, const unsigned char *, size_t);
@@ -0,0 +1,151 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "util.h"
+#include "config.h"
+#include "ratelimit.h"
+
+bool ratelimit_enabled = false;
+
+static struct {
+    pthread_mutex_t lock;
+    struct rate_limit buckets[RATE_LISTENERS];
+    atomic_size_t client_throttles[RATE_LISTENERS];
+    atomic_size_t listener_throttles[RATE_LISTENERS];
+} listeners = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+#define listener_limited() \
+    (conf->rate_limits.listener_messages > 0 \
+     || conf->rate_limits.listener_bytes > 0)
+
+/* Add the tokens accrued in elapsed ns, up to a second worth */
+static double bucket_refill(double tokens, size_t rate, uint64_t elapsed) {
+    if (rate == 0)
+        return tokens;
+    tokens += (double) rate * elapsed / 1e9;
+    return tokens > rate ? rate : tokens;
+}
+
+static void limit_fill(struct rate_limit *l, size_t messages, size_t bytes,
+                       uint64_t now) {
+    l->messages = messages;
+    l->bytes = bytes;
+    l->last = now;
+}
+
+static void limit_refill(struct rate_limit *l, size_t messages, size_t bytes,
+                         uint64_t now) {
+    // Another loop may have refilled the listener buckets a bit later
+    if (now <= l->last)
+        return;
+    l->messages = bucket_refill(l->messages, messages, now - l->last);
+    l->bytes = bucket_refill(l->bytes, bytes, now - l->last);
+    l->last = now;
+}
+
+static bool limit_take(struct rate_limit *l, size_t messages, size_t bytes,
+                       size_t size, uint64_t now) {
+    limit_refill(l, messages, bytes, now);
+    if (messages > 0)
+        l->messages -= 1;
+    if (bytes > 0)
+        l->bytes -= size;
+    return l->messages < 0 || l->bytes < 0;
+}
+
+static bool limit_refilled(struct rate_limit *l, size_t messages,
+                           size_t bytes, uint64_t now) {
+    limit_refill(l, messages, bytes, now);
+    return l->messages >= 0 && l->bytes >= 0;
+}
+
+void ratelimit_init(void) {
+    const struct rate_limits *rl = &conf->rate_limits;
+    if (rl->client_messages == 0 && rl->client_bytes == 0
+        && !listener_limited())
+        return;
+    uint64_t now = monotonic_ns();
+    for (int i = 0; i < RATE_LISTENERS; ++i) {
+        limit_fill(&listeners.buckets[i], rl->listener_messages,
+                   rl->listener_bytes, now);
+        listeners.client_throttles[i] = ATOMIC_VAR_INIT(0);
+        listeners.listener_throttles[i] = ATOMIC_VAR_INIT(0);
+    }
+    ratelimit_enabled = true;
+}
+
+void ratelimit_client_init(struct rate_limit *l) {
+    limit_fill(l, conf->rate_limits.client_messages,
+               conf->rate_limits.client_bytes, monotonic_ns());
+}
+
+bool ratelimit_take(struct rate_limit *l, enum rate_listener listener,
+                    size_t size) {
+    const struct rate_limits *rl = &conf->rate_limits;
+    uint64_t now = monotonic_ns();
+    bool client = limit_take(l, rl->client_messages, rl->client_bytes,
+                             size, now);
+    bool shared = false;
+    if (listener_limited()) {
+        pthread_mutex_lock(&listeners.lock);
+        shared = limit_take(&listeners.buckets[listener],
+                            rl->listener_messages, rl->listener_bytes,
+                            size, now);
+        pthread_mutex_unlock(&listeners.lock);
+    }
+    if (client == true)
+        listeners.client_throttles[listener]++;
+    else if (shared == true)
+        listeners.listener_throttles[listener]++;
+    return client || shared;
+}
+
+bool ratelimit_refilled(struct rate_limit *l, enum rate_listener listener) {
+    const struct rate_limits *rl = &conf->rate_limits;
+    uint64_t now = monotonic_ns();
+    if (!limit_refilled(l, rl->client_messages, rl->client_bytes, now))
+        return false;
+    if (!listener_limited())
+        return true;
+    pthread_mutex_lock(&listeners.lock);
+    bool refilled = limit_refilled(&listeners.buckets[listener],
+                                   rl->listener_messages,
+                                   rl->listener_bytes, now);
+    pthread_mutex_unlock(&listeners.lock);
+    return refilled;
+}
+
+void ratelimit_get_stats(struct rate_limit_stats *stats) {
+    for (int i = 0; i < RATE_LISTENERS; ++i) {
+        stats->client[i] = listeners.client_throttles[i];
+        stats->listener[i] = listeners.listener_throttles[i];
+    }
+}
@@ -0,0 +1,88 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Ingress rate limits, token buckets of messages and bytes per second for
+ * each client and for each listener, all the clients accepted there
+ * together. Every frame read takes a token and its size in bytes from the
+ * buckets of the client and of its listener, as it's decoded; buckets can go
+ * below zero, the frame is handled anyway, then the server stops reading from
+ * the client till they're back to zero. Buckets hold up to a second worth of
+ * tokens, short bursts go through untouched.
+ */
+
+enum rate_listener {
+    RATE_LISTENER_SOCKET,   /* TCP or UNIX socket, plain or TLS */
+    RATE_LISTENER_SHM,      /* Shared memory, see shm.h */
+    RATE_LISTENERS
+};
+
+/* Tokens of the messages and bytes buckets, always refilled together */
+struct rate_limit {
+    double messages;
+    double bytes;
+    uint64_t last;          /* Monotonic ns of the last refill */
+};
+
+/* Times a client was throttled, by listener and bucket out of tokens */
+struct rate_limit_stats {
+    size_t client[RATE_LISTENERS];
+    size_t listener[RATE_LISTENERS];
+};
+
+/* Set once on startup, never changed while the loops are running */
+extern bool ratelimit_enabled;
+
+/*
+ * Enable the rate limits if any is configured, must be called before starting
+ * the event loops
+ */
+void ratelimit_init(void);
+
+/* Fill the buckets of a client just accepted */
+void ratelimit_client_init(struct rate_limit *);
+
+/*
+ * Take a frame of the given size from the buckets of a client and of its
+ * listener, returns true if any of them is out of tokens. Must be called
+ * by the loop serving the client.
+ */
+bool ratelimit_take(struct rate_limit *, enum rate_listener, size_t);
+
+/* True if the buckets of a client and of its listener are refilled */
+bool ratelimit_refilled(struct rate_limit *, enum rate_listener);
+
+void ratelimit_get_stats(struct rate_limit_stats *);
+
+#endif
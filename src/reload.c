@@ -0,0 +1,163 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "ev.h"
+#include "acl.h"
+#include "config.h"
+#include "server.h"
+#include "memory.h"
+#include "logging.h"
+#include "network.h"
+#include "trace.h"
+#include "reload.h"
+#include "sol_internal.h"
+
+static struct {
+    atomic_bool requested;
+    atomic_bool running;
+    bool started;           /* A thread is to be joined */
+    pthread_t thread;
+} reload = {
+    .requested = ATOMIC_VAR_INIT(false),
+    .running = ATOMIC_VAR_INIT(false),
+    .started = false
+};
+
+/*
+ * Build everything off the loops, what can't be loaded keeps its current
+ * version and settings, the rest is swapped in at once
+ */
+static void *reload_run(void *arg) {
+    (void) arg;
+    log_info("Reloading configuration");
+    struct config *c = config_reread();
+    if (!c) {
+        log_error("Reload: unable to read the configuration");
+        atomic_store(&reload.running, false);
+        return NULL;
+    }
+
+    // Contents may have changed even if the paths did not, always read again
+    struct authentication *auths = NULL;
+    bool swap_auths = true;
+    if (c->allow_anonymous == false
+        && !config_read_passwd_file(c->password_file, &auths)) {
+        log_error("Reload: failed to read password file, keeping the current one");
+        AUTH_DESTROY(auths);
+        c->allow_anonymous = conf->allow_anonymous;
+        memcpy(c->password_file, conf->password_file, sizeof(c->password_file));
+        swap_auths = false;
+    }
+
+    struct acl *acl = NULL;
+    bool swap_acl = true;
+    if (c->acl_file[0]) {
+        acl = acl_load(c->acl_file);
+        if (!acl) {
+            log_error("Reload: failed to load ACL file, keeping the current one");
+            memcpy(c->acl_file, conf->acl_file, sizeof(c->acl_file));
+            swap_acl = false;
+        }
+    }
+
+    SSL_CTX *ssl_ctx = NULL;
+    if (conf->tls == true && c->tls == true) {
+        ssl_ctx = create_ssl_context(c->tls_protocols);
+        if (!ssl_ctx
+            || !load_certificates(ssl_ctx, c->cafile, c->certfile, c->keyfile)) {
+            log_error("Reload: failed to load certificates, keeping the current ones");
+            if (ssl_ctx)
+                SSL_CTX_free(ssl_ctx);
+            ssl_ctx = NULL;
+            c->tls_protocols = conf->tls_protocols;
+            memcpy(c->cafile, conf->cafile, sizeof(c->cafile));
+            memcpy(c->certfile, conf->certfile, sizeof(c->certfile));
+            memcpy(c->keyfile, conf->keyfile, sizeof(c->keyfile));
+        }
+    }
+
+    /*
+     * The structures swapped out are used only with the global lock held, or
+     * through a reference of their own for the TLS context, once it's
+     * released nothing points to them anymore
+     */
+    struct authentication *old_auths = NULL;
+    struct acl *old_acl = NULL;
+    SSL_CTX *old_ssl_ctx = NULL;
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    if (swap_auths == true)
+        old_auths = atomic_exchange(&server.auths, auths);
+    if (swap_acl == true)
+        old_acl = atomic_exchange(&server.acl, acl);
+    if (ssl_ctx)
+        old_ssl_ctx = atomic_exchange(&server.ssl_ctx, ssl_ctx);
+    config_apply(c);
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    free_memory(c);
+
+    AUTH_DESTROY(old_auths);
+    acl_free(old_acl);
+    if (old_ssl_ctx)
+        SSL_CTX_free(old_ssl_ctx);
+
+    atomic_store(&reload.running, false);
+    return NULL;
+}
+
+void reload_request(void) {
+    atomic_store(&reload.requested, true);
+}
+
+void reload_check(struct ev_ctx *ctx, void *data) {
+    (void) ctx;
+    (void) data;
+    if (atomic_load(&reload.running) == false) {
+        if (reload.started == true) {
+            pthread_join(reload.thread, NULL);
+            reload.started = false;
+        }
+        if (atomic_exchange(&reload.requested, false) == true) {
+            atomic_store(&reload.running, true);
+            reload.started = true;
+            pthread_create(&reload.thread, NULL, reload_run, NULL);
+        }
+    }
+}
+
+void reload_shutdown(void) {
+    if (reload.started == true) {
+        pthread_join(reload.thread, NULL);
+        reload.started = false;
+    }
+}
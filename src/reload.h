@@ -0,0 +1,56 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RELOAD_H
+#define RELOAD_H
+
+struct ev_ctx;
+
+/*
+ * Live reload of the configuration, asked with SIGHUP. The cron loop hands
+ * the work to a thread of its own: sol.conf is read again, the password file,
+ * the ACLs and the TLS context are built anew off the loops, then swapped in
+ * under the global lock together with the settings that can change live (see
+ * config_apply). Connections and sessions are untouched, new checks just use
+ * the new structures; a password file, ACL file or certificate that can't be
+ * loaded keeps the current one in place.
+ *
+ * Handlers use the password table and the ACLs only with the global lock
+ * held, accepts take a reference to the TLS context under it, so the ones
+ * replaced are freed by the reload right after the swap.
+ */
+
+/* Ask for a reload, safe to call from a signal handler */
+void reload_request(void);
+
+/* Cron job starting the reloads asked */
+void reload_check(struct ev_ctx *, void *);
+
+/* Wait for a reload in progress */
+void reload_shutdown(void);
+
+#endif
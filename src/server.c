@@ -30,6 +30,9 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <pthread.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #include "ev.h"
 #include "network.h"
 #include "config.h"
@@ -37,6 +40,18 @@
 #include "memory.h"
 #include "logging.h"
 #include "handlers.h"
+#include "metrics.h"
+#include "trace.h"
+#include "capture.h"
+#include "bridge.h"
+#include "cluster.h"
+#include "shm.h"
+#include "auth.h"
+#include "acl.h"
+#include "reload.h"
+#include "upgrade.h"
+#include "expiry.h"
+#include "ratelimit.h"
 #include "memorypool.h"
 #include "sol_internal.h"
 
@@ -53,6 +68,18 @@ struct listen_payload {
     atomic_bool cronjobs;
 };
 
+/* Trace span names of the handlers, indexed by packet type */
+static const char *const trace_command_names[16] = {
+    "handle_command:RESERVED", "handle_command:CONNECT",
+    "handle_command:CONNACK", "handle_command:PUBLISH",
+    "handle_command:PUBACK", "handle_command:PUBREC",
+    "handle_command:PUBREL", "handle_command:PUBCOMP",
+    "handle_command:SUBSCRIBE", "handle_command:SUBACK",
+    "handle_command:UNSUBSCRIBE", "handle_command:UNSUBACK",
+    "handle_command:PINGREQ", "handle_command:PINGRESP",
+    "handle_command:DISCONNECT", "handle_command:RESERVED"
+};
+
 /* Seconds in a Sol, easter egg */
 static const double SOL_SECONDS = 88775.24;
 
@@ -65,6 +92,21 @@ struct sol_info info;
 /* Broker global instance, contains the topic trie and the clients hashtable */
 struct server server;
 
+/*
+ * Statistics shard of the calling thread, every event loop points it to its
+ * own on start
+ */
+_Thread_local struct loop_stats *loop_stats = &server.stats[THREADSNR];
+
+/* Latency histograms of the calling thread, set by every event loop on start */
+_Thread_local struct histogram *loop_latency = server.latency[THREADSNR];
+
+/* Number of event loops started, used to assign each one its slot */
+static atomic_int loops_nr = ATOMIC_VAR_INIT(0);
+
+/* Listening socket of the shared memory transport, -1 if disabled */
+static int shm_sfd = -1;
+
 /*
  * TCP server, based on I/O multiplexing abstraction called ev_ctx. Each thread
  * (if any) should have his own ev_ctx and thus being responsible of a subset
@@ -118,6 +160,20 @@ static void client_init(struct client *);
 
 static void client_deactivate(struct client *);
 
+/*
+ * Close the connection of a client on an error or a disconnection not
+ * announced by a DISCONNECT, publishing its LWT message if any
+ */
+static void client_abort(struct ev_ctx *, struct client *, int);
+
+/*
+ * Backpressure handling, stop reading from a publisher whose subscribers
+ * are congested and resume it once they have drained their queues
+ */
+static bool client_suspend(struct ev_ctx *, struct client *);
+
+static void resume_publishers(void);
+
 // CALLBACKS for the eventloop
 static void accept_callback(struct ev_ctx *, void *);
 
@@ -129,7 +185,7 @@ static void write_callback(struct ev_ctx *, void *);
  * Processing message function, will be applied on fully formed mqtt packet
  * received on read_callback callback
  */
-static void process_message(struct ev_ctx *, struct client *);
+static int process_message(struct ev_ctx *, struct client *);
 
 /* Periodic routine to publish general stats about the broker on $SOL topics */
 static void publish_stats(struct ev_ctx *, void *);
@@ -140,11 +196,20 @@ static void publish_stats(struct ev_ctx *, void *);
  */
 static void inflight_msg_check(struct ev_ctx *, void *);
 
+/* Periodic routine to dump the traces, if requested */
+static void trace_check(struct ev_ctx *, void *);
+
+/* Periodic routine re-arming the clients throttled, once their tokens refill */
+static void throttle_check(struct ev_ctx *, void *);
+
+/* Interval of throttle_check, the delay of a throttled client at most */
+#define THROTTLE_CHECK_NS 10000000
+
 /*
  * Statistics topics, published every N seconds defined by configuration
  * interval
  */
-#define SYS_TOPICS 11
+#define SYS_TOPICS 16
 
 /*
  * Utility struct for information topics. Just the name of the topic and his
@@ -167,7 +232,25 @@ static const struct sys_topic sys_topics[SYS_TOPICS] = {
     { "$SOL/broker/bytes/received/", 27 },
     { "$SOL/broker/messages/sent/", 26 },
     { "$SOL/broker/messages/received/", 30 },
-    { "$SOL/broker/memory/used", 23 }
+    { "$SOL/broker/memory/used", 23 },
+    { "$SOL/broker/clients/paused/", 27 },
+    { "$SOL/broker/top/topics/messages/", 32 },
+    { "$SOL/broker/top/topics/bytes/", 29 },
+    { "$SOL/broker/top/clients/messages/", 33 },
+    { "$SOL/broker/top/clients/bytes/", 30 }
+};
+
+/* Quantiles of the latency histograms published on $SOL topics */
+#define LATENCY_QUANTILES 4
+
+static const struct {
+    const char *name;
+    double percentile;
+} latency_quantiles[LATENCY_QUANTILES] = {
+    { "p50", 50.0 },
+    { "p99", 99.0 },
+    { "p999", 99.9 },
+    { "max", 100.0 }
 };
 
 /* Simple error_code to string function, to be refined */
@@ -185,6 +268,8 @@ static const char *solerr(int rc) {
             return "Socket FD EAGAIN";
         case -ERRNOMEM:
             return "Out of memory";
+        case -ERRWBUFFULL:
+            return "Write buffer full, the client is not reading";
         case MQTT_UNACCEPTABLE_PROTOCOL_VERSION:
             return "[MQTT] Unknown protocol version";
         case MQTT_IDENTIFIER_REJECTED:
@@ -206,24 +291,205 @@ static const char *solerr(int rc) {
  * ====================================================
  */
 
+/*
+ * Publish a single statistic on a $SOL topic, the topic is created if it
+ * doesn't exist yet
+ */
+static void publish_stat(const char *topic, const char *value) {
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    struct topic *t = topic_store_get_or_put(server.store, topic);
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    struct mqtt_packet p = {
+        .header = (union mqtt_header) { .byte = PUBLISH_B },
+        .publish = (struct mqtt_publish) {
+            .pkt_id = 0,
+            .topiclen = strlen(topic),
+            .topic = (unsigned char *) topic,
+            .payloadlen = strlen(value),
+            .payload = (unsigned char *) value
+        }
+    };
+    publish_message(&p, t);
+}
+
+/*
+ * Publish p50, p99, p999 and max of each latency stage, in microseconds, on
+ * $SOL/broker/latency/<stage>/<quantile>/ topics. Values refer to the last
+ * stats interval only, a snapshot of the cumulative histograms is kept to
+ * subtract it at the next run.
+ */
+static void publish_latencies(void) {
+    static struct histogram snapshot[LATENCY_STAGES];
+    static struct histogram current;
+    char topic[64], value[32];
+    for (int i = 0; i < LATENCY_STAGES; ++i) {
+        latency_aggregate(&current, i);
+        histogram_sub(&current, &snapshot[i]);
+        histogram_merge(&snapshot[i], &current);
+        for (int j = 0; j < LATENCY_QUANTILES; ++j) {
+            snprintf(topic, sizeof(topic), "$SOL/broker/latency/%s/%s/",
+                     latency_stage_name(i), latency_quantiles[j].name);
+            uint64_t ns = histogram_percentile(&current,
+                                               latency_quantiles[j].percentile);
+            snprintf(value, sizeof(value), "%.3f", ns / 1e3);
+            publish_stat(topic, value);
+        }
+    }
+}
+
+/* Dimensions of the per client report, see publish_client_stats */
+enum client_dimension {
+    CLIENT_MESSAGES_IN,
+    CLIENT_MESSAGES_OUT,
+    CLIENT_BYTES_IN,
+    CLIENT_BYTES_OUT,
+    CLIENT_CPU_CYCLES,
+    CLIENT_INFLIGHT,
+    CLIENT_PENDING,
+    CLIENT_WRITE_QUEUE,
+    CLIENT_THROTTLED,
+    CLIENT_DIMENSIONS
+};
+
+static const char *const client_dimension_names[CLIENT_DIMENSIONS] = {
+    "messages_in", "messages_out", "bytes_in", "bytes_out", "cpu_cycles",
+    "inflight", "pending", "write_queue", "throttled"
+};
+
+static struct topic *client_top_topics[CLIENT_DIMENSIONS];
+
+/*
+ * Publish the top HEAVY_HITTERS_K clients by each dimension on
+ * $SOL/broker/clients/top/<dimension>/ topics, one entry per line in the
+ * form "<client_id> <value>". Counters (messages, bytes and cycles) refer to
+ * the time since the previous report, while inflight messages, messages
+ * pending for a full inflight window and bytes waiting to be written out are
+ * the current depths. Walking all the clients is not free, so the report is
+ * built only if someone is subscribed to at least one of the topics.
+ */
+static void publish_client_stats(void) {
+    char payload[4096];
+    struct topk tops[CLIENT_DIMENSIONS];
+    struct topk_entry entries[HEAVY_HITTERS_K];
+    struct client *c, *tmp;
+    bool wanted = false;
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    for (int i = 0; i < CLIENT_DIMENSIONS; ++i)
+        wanted |= HASH_COUNT(client_top_topics[i]->subscribers) > 0;
+    if (wanted == false)
+        goto unlock;
+    for (int i = 0; i < CLIENT_DIMENSIONS; ++i)
+        topk_init(&tops[i], HEAVY_HITTERS_K);
+    HASH_ITER(hh, server.clients_map, c, tmp) {
+        if (!c->online)
+            continue;
+        struct client_stats now = c->stats;
+        uint64_t values[CLIENT_DIMENSIONS] = {
+            [CLIENT_MESSAGES_IN] = now.messages_in - c->reported.messages_in,
+            [CLIENT_MESSAGES_OUT] = now.messages_out - c->reported.messages_out,
+            [CLIENT_BYTES_IN] = now.bytes_in - c->reported.bytes_in,
+            [CLIENT_BYTES_OUT] = now.bytes_out - c->reported.bytes_out,
+            [CLIENT_CPU_CYCLES] = now.cycles - c->reported.cycles,
+            [CLIENT_INFLIGHT] = c->session ? c->session->inflights : 0,
+            [CLIENT_PENDING] = c->session ? list_size(c->session->pending_msgs) : 0,
+            [CLIENT_WRITE_QUEUE] = c->towrite - c->wrote,
+            [CLIENT_THROTTLED] = now.throttled - c->reported.throttled
+        };
+        c->reported = now;
+        for (int i = 0; i < CLIENT_DIMENSIONS; ++i)
+            if (values[i] > 0)
+                topk_offer(&tops[i], c->client_id, values[i]);
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    for (int i = 0; i < CLIENT_DIMENSIONS; ++i) {
+        size_t n = topk_sorted(&tops[i], entries), pos = 0;
+        payload[0] = '\0';
+        for (size_t j = 0; j < n; ++j) {
+            int len = snprintf(payload + pos, sizeof(payload) - pos,
+                               "%s %lu\n", entries[j].key, entries[j].count);
+            if (len < 0 || pos + len >= sizeof(payload)) {
+                payload[pos] = '\0';
+                break;
+            }
+            pos += len;
+        }
+        publish_stat(client_top_topics[i]->name, payload);
+        topk_destroy(&tops[i]);
+    }
+    return;
+
+unlock:
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+}
+
+/*
+ * Publish the heavy hitters of the last stats interval on
+ * $SOL/broker/top/{topics,clients}/{messages,bytes}/ topics, one entry per
+ * line in the form "<key> <count>" sorted by count, then start a new
+ * interval. Counts are count-min sketch estimates, they may be slightly
+ * overestimated.
+ */
+static void publish_heavy_hitters(void) {
+    char payloads[TOP_DIMENSIONS][4096];
+    struct topk_entry entries[HEAVY_HITTERS_K];
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    for (int i = 0; i < TOP_DIMENSIONS; ++i) {
+        size_t n = topk_sorted(&server.top[i].top, entries), pos = 0;
+        payloads[i][0] = '\0';
+        for (size_t j = 0; j < n; ++j) {
+            int len = snprintf(payloads[i] + pos, sizeof(payloads[i]) - pos,
+                               "%s %lu\n", entries[j].key, entries[j].count);
+            // Skip truncated entries, too long keys
+            if (len < 0 || pos + len >= sizeof(payloads[i])) {
+                payloads[i][pos] = '\0';
+                break;
+            }
+            pos += len;
+        }
+        heavy_hitters_reset(&server.top[i]);
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    for (int i = 0; i < TOP_DIMENSIONS; ++i)
+        publish_stat(sys_topics[SYS_TOPICS - TOP_DIMENSIONS + i].name,
+                     payloads[i]);
+}
+
 /*
  * Publish statistics periodic task, it will be called once every N config
  * defined seconds, it publishes some informations on predefined topics
  */
 static void publish_stats(struct ev_ctx *ctx, void *data) {
     (void)data;
+    uint64_t trace_start = TRACE_START();
+
+    struct loop_stats stats;
+    stats_aggregate(&stats);
 
     char cclients[21];
-    snprintf(cclients, 21, "%lu", info.active_connections);
+    snprintf(cclients, 21, "%lu", stats.active_connections);
 
     char bsent[21];
-    snprintf(bsent, 21, "%lu", info.bytes_sent);
+    snprintf(bsent, 21, "%lu", stats.bytes_sent);
 
     char msent[21];
-    snprintf(msent, 21, "%lu", info.messages_sent);
+    snprintf(msent, 21, "%lu", stats.messages_sent);
 
     char mrecv[21];
-    snprintf(mrecv, 21, "%lu", info.messages_recv);
+    snprintf(mrecv, 21, "%lu", stats.messages_recv);
 
     long long uptime = time(NULL) - info.start_time;
     char utime[21];
@@ -237,6 +503,9 @@ static void publish_stats(struct ev_ctx *ctx, void *data) {
     char mem[21];
     snprintf(mem, 21, "%lld", memory);
 
+    char paused[21];
+    snprintf(paused, 21, "%lu", info.paused_publishers);
+
     // $SOL/uptime
     struct mqtt_packet p = {
         .header = (union mqtt_header) { .byte = PUBLISH_B },
@@ -298,6 +567,25 @@ static void publish_stats(struct ev_ctx *ctx, void *data) {
     p.publish.payload = (unsigned char *) &mem;
 
     publish_message(&p, topic_store_get(server.store, sys_topics[10].name));
+
+    // $SOL/broker/clients/paused
+    p.publish.topiclen = sys_topics[11].len;
+    p.publish.topic = (unsigned char *) sys_topics[11].name;
+    p.publish.payloadlen = strlen(paused);
+    p.publish.payload = (unsigned char *) &paused;
+
+    publish_message(&p, topic_store_get(server.store, sys_topics[11].name));
+
+    // $SOL/broker/latency/<stage>/<quantile>
+    publish_latencies();
+
+    // $SOL/broker/top/<topics|clients>/<messages|bytes>
+    publish_heavy_hitters();
+
+    // $SOL/broker/clients/top/<dimension>
+    publish_client_stats();
+
+    TRACE_END("cron:publish_stats", trace_start);
 }
 
 /*
@@ -315,8 +603,9 @@ static void inflight_msg_check(struct ev_ctx *ctx, void *data) {
     time_t now = time(NULL);
     struct mqtt_packet *p = NULL;
     struct client *c, *tmp;
+    uint64_t trace_start = TRACE_START();
 #if THREADSNR > 0
-    pthread_mutex_lock(&mutex);
+    TRACE_LOCK("mutex_wait", &mutex);
 #endif
     HASH_ITER(hh, server.clients_map, c, tmp) {
         if (!c || !c->connected || !c->session || !has_inflight(c->session))
@@ -325,6 +614,15 @@ static void inflight_msg_check(struct ev_ctx *ctx, void *data) {
         pthread_mutex_lock(&c->mutex);
 #endif
         for (int i = 1; i < MAX_INFLIGHT_MSGS; ++i) {
+            // Expired messages are dropped instead of being sent again
+            if (c->session->i_msgs[i].packet
+                && message_expired(c->session->i_msgs[i].packet->expiry, now)) {
+                inflight_msg_clear(&c->session->i_msgs[i]);
+                c->session->i_msgs[i].packet = NULL;
+                c->session->i_acks[i] = -1;
+                --c->session->inflights;
+                continue;
+            }
             // TODO remove 20 hardcoded value
             // Messages
             if (c->session->i_msgs[i].packet
@@ -335,37 +633,61 @@ static void inflight_msg_check(struct ev_ctx *ctx, void *data) {
                 // Set DUP flag to 1
                 mqtt_set_dup(p);
                 size = mqtt_size(c->session->i_msgs[i].packet, NULL);
+                // No room left, tried again on the next run
+                if (c->towrite + size > (size_t) conf->max_request_size)
+                    continue;
                 // Serialize the packet and send it out again
                 mqtt_pack(p, c->wbuf + c->towrite);
                 c->towrite += size;
                 enqueue_event_write(c);
                 // Update information stats
-                info.messages_sent++;
+                STATS_INC(messages_sent);
+                c->stats.messages_out++;
             }
-            // ACKs
+            /*
+             * ACKs, the PUBREL of a QoS 2 message, no DUP flag as its fixed
+             * header flags are reserved
+             */
             if (c->session->i_acks[i] > 0
+                && c->session->i_msgs[i].packet
+                && c->session->i_msgs[i].qos == EXACTLY_ONCE
                 && (now - c->session->i_acks[i]) > 20) {
                 log_debug("Re-sending ack to %s", c->client_id);
-                struct mqtt_packet ack;
+                struct mqtt_packet ack = { .header = { .byte = PUBREL_B } };
                 mqtt_ack(&ack, i);
-                // Set DUP flag to 1
-                mqtt_set_dup(&ack);
                 size = mqtt_size(&ack, NULL);
+                // No room left, tried again on the next run
+                if (c->towrite + size > (size_t) conf->max_request_size)
+                    continue;
                 // Serialize the packet and send it out again
-                mqtt_pack(p, c->wbuf + c->towrite);
+                mqtt_pack(&ack, c->wbuf + c->towrite);
                 c->towrite += size;
                 enqueue_event_write(c);
                 // Update information stats
-                info.messages_sent++;
+                STATS_INC(messages_sent);
             }
         }
 #if THREADSNR > 0
         pthread_mutex_unlock(&c->mutex);
 #endif
     }
+    /*
+     * Subscribers may have gone away without draining their queues, give
+     * paused publishers a chance to be resumed anyway
+     */
+    if (info.paused_publishers > 0)
+        resume_publishers();
 #if THREADSNR > 0
     pthread_mutex_unlock(&mutex);
 #endif
+    TRACE_END("cron:inflight_msg_check", trace_start);
+}
+
+/* Periodic routine to serve trace dumps requested through SIGUSR1 */
+static void trace_check(struct ev_ctx *ctx, void *data) {
+    (void) ctx;
+    (void) data;
+    trace_dump_pending();
 }
 
 /*
@@ -374,6 +696,11 @@ static void inflight_msg_check(struct ev_ctx *ctx, void *data) {
  * ======================================================
  */
 
+/* Compare function to match a client pointer in a list of clients */
+static int client_cmp(const void *arg1, const void *arg2) {
+    return ((struct list_node *) arg1)->data == arg2 ? 0 : -1;
+}
+
 /*
  * All clients are pre-allocated at the start of the server, but their buffers
  * (read and write) are not, they're lazily allocated with this function, meant
@@ -383,20 +710,40 @@ static void client_init(struct client *client) {
     client->online = true;
     client->connected = false;
     client->clean_session = true;
+    client->cluster_peer = false;
+    client->auth = AUTH_UNCHECKED;
+    client->acl = NULL;
     client->client_id[0] = '\0';
     client->status = WAITING_HEADER;
     client->rc = 0;
     client->rpos = ATOMIC_VAR_INIT(0);
     client->read = ATOMIC_VAR_INIT(0);
     client->toread = ATOMIC_VAR_INIT(0);
-    if (!client->rbuf)
+    if (!client->rbuf) {
         client->rbuf = try_calloc(conf->max_request_size, sizeof(unsigned char));
+        info.client_buffers += conf->max_request_size;
+    }
     client->wrote = ATOMIC_VAR_INIT(0);
     client->towrite = ATOMIC_VAR_INIT(0);
-    if (!client->wbuf)
+    if (!client->wbuf) {
         client->wbuf = try_calloc(conf->max_request_size, sizeof(unsigned char));
+        info.client_buffers += conf->max_request_size;
+    }
     client->last_seen = time(NULL);
     client->has_lwt = false;
+    client->read_ts = 0;
+    client->wbuf_ts = ATOMIC_VAR_INIT(0);
+    client->paused = ATOMIC_VAR_INIT(false);
+    client->disarmed = false;
+    client->blocked_on = NULL;
+    if (ratelimit_enabled == true)
+        ratelimit_client_init(&client->limit);
+    client->throttled = client->throttle_disarmed = false;
+    client->fanout = NULL;
+    client->backlog = BACKLOG_NONE;
+    client->held = false;
+    memset(&client->stats, 0x00, sizeof(client->stats));
+    memset(&client->reported, 0x00, sizeof(client->reported));
     client->session = NULL;
     pthread_mutex_init(&client->mutex, NULL);
 }
@@ -409,21 +756,56 @@ static void client_init(struct client *client) {
  */
 static void client_deactivate(struct client *client) {
 
+    /*
+     * The global lock always comes first, routing takes it before the lock
+     * of each subscriber it writes to
+     */
 #if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
     pthread_mutex_lock(&client->mutex);
 #endif
-    if (client->online == false) return;
+    if (client->online == false) {
+#if THREADSNR > 0
+        pthread_mutex_unlock(&client->mutex);
+        pthread_mutex_unlock(&mutex);
+#endif
+        return;
+    }
 
     client->rpos = client->toread = client->read = 0;
     client->wrote = client->towrite = 0;
+    if (capture_enabled == true)
+        capture_close(client->conn.fd);
     close_connection(&client->conn);
 
     client->online = false;
+    client->held = false;
+    if (client->backlog != BACKLOG_NONE) {
+        ev_cancel(client->ctx, session_backlog_flush, client);
+        client->backlog = BACKLOG_NONE;
+    }
+    acl_client_free(client->acl);
+    client->acl = NULL;
 
-#if THREADSNR > 0
-    pthread_mutex_lock(&mutex);
-#endif
-    if (client->clean_session == true) {
+    bool release = false;
+    if (client->disarmed == true) {
+        free_memory(list_remove_node(server.paused, client, client_cmp));
+        info.paused_publishers--;
+    }
+    client->paused = client->disarmed = false;
+    if (client->throttle_disarmed == true) {
+        free_memory(list_remove_node(server.throttled, client, client_cmp));
+        info.throttled_clients--;
+    }
+    client->throttled = client->throttle_disarmed = false;
+    // A PUBLISH still being routed in slices goes on without its publisher
+    fanout_detach(client);
+    /*
+     * A session taken over by another node of the cluster is marked clean,
+     * it has been moved there and it's dropped like a clean one
+     */
+    if (client->clean_session == true
+        || (client->session && client->session->clean_session == true)) {
         if (client->session) {
             topic_store_remove_wildcard(server.store, client->client_id);
             list_foreach(item, client->session->subscriptions) {
@@ -434,16 +816,187 @@ static void client_deactivate(struct client *client) {
         }
         if (client->connected == true)
             HASH_DEL(server.clients_map, client);
-        memorypool_free(server.pool, client);
+        release = true;
+    } else if (client->session && conf->session_expiry > 0) {
+        client->session->expiry = time(NULL) + conf->session_expiry;
+        expiry_track_session(client->session);
     }
-#if THREADSNR > 0
-    pthread_mutex_unlock(&mutex);
-#endif
     client->connected = false;
     client->client_id[0] = '\0';
 #if THREADSNR > 0
     pthread_mutex_unlock(&client->mutex);
     pthread_mutex_destroy(&client->mutex);
+#endif
+    /*
+     * Back to the pool as the very last thing, still under the global lock,
+     * the next memorypool_alloc of any loop hands this same block out right
+     * away, the client must not be touched anymore after it
+     */
+    if (release == true)
+        memorypool_free(server.pool, client);
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    // Subscriptions gone, the other nodes will be told
+    if (cluster_enabled == true)
+        cluster_interest_changed();
+}
+
+static void client_abort(struct ev_ctx *ctx, struct client *c, int rc) {
+    /*
+     * We got an unexpected error or a disconnection from the client side,
+     * remove client from the global map and free resources allocated such as
+     * io_event structure and paired payload
+     */
+    log_error("Closing connection with %s (%s): %s",
+              c->client_id, c->conn.ip, solerr(rc));
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    // Publish, if present, LWT message
+    if (c->has_lwt == true) {
+        char *tname = (char *) c->session->lwt_msg.publish.topic;
+        struct topic *t = topic_store_get(server.store, tname);
+        if (t)
+            publish_message(&c->session->lwt_msg, t);
+    }
+    // Clean resources
+    ev_del_fd(ctx, c->conn.fd);
+    // Remove from subscriptions for now
+    if (c->session && list_size(c->session->subscriptions) > 0) {
+        list_foreach(item, c->session->subscriptions) {
+            log_debug("Deleting %s from topic %s",
+                      c->client_id, ((struct topic *) item->data)->name);
+            topic_del_subscriber(item->data, c);
+        }
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    client_deactivate(c);
+    STATS_DEC(active_connections);
+}
+
+/*
+ * Stop reading from a client paused by backpressure, its descriptor is left
+ * in the loop without any event armed and it's tracked in the paused list of
+ * the server, waiting for resume_publishers to re-arm it. Returns true if the
+ * client has been suspended, false if it doesn't need to be anymore.
+ */
+static bool client_suspend(struct ev_ctx *ctx, struct client *c) {
+    bool suspended = false;
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    if (c->paused == true && !topic_congested(c->blocked_on))
+        c->paused = false;
+    if (c->paused == true) {
+        if (c->disarmed == false) {
+            list_push_back(server.paused, c);
+            info.paused_publishers++;
+            c->disarmed = true;
+        }
+        ev_fire_event(ctx, c->conn.fd, EV_NONE, NULL, NULL);
+        suspended = true;
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    return suspended;
+}
+
+/*
+ * Re-arm a client whose reads have been suspended, unless it's still paused
+ * by backpressure, out of tokens or routing a PUBLISH in slices, whatever
+ * comes last re-arms it. If it has pending bytes to write out a write event is
+ * scheduled, the write callback will take care of re-arming it for reading.
+ * Must be called with the global lock held.
+ */
+void server_rearm(struct client *c) {
+    if (c->disarmed == true || c->throttle_disarmed == true || c->fanout)
+        return;
+    if (c->towrite > 0)
+        enqueue_event_write(c);
+    else
+        ev_fire_event(c->ctx, c->conn.fd, EV_READ, read_callback, c);
+}
+
+/*
+ * Re-arm all the paused publishers whose blocking topic is not congested
+ * anymore, if a publisher has pending bytes to write out (e.g. it's a
+ * subscriber as well) a write event is scheduled, the write callback will
+ * take care of re-arming it for reading.
+ * Must be called with the global lock held.
+ */
+static void resume_publishers(void) {
+    struct list_node *cur = server.paused->head, *next = NULL;
+    for (; cur; cur = next) {
+        next = cur->next;
+        struct client *c = cur->data;
+        if (topic_congested(c->blocked_on))
+            continue;
+        free_memory(list_remove_node(server.paused, c, client_cmp));
+        info.paused_publishers--;
+        c->paused = c->disarmed = false;
+        c->blocked_on = NULL;
+        log_debug("Resuming %s", c->client_id);
+        server_rearm(c);
+    }
+}
+
+/*
+ * Stop reading from a client out of tokens, like client_suspend for the
+ * backpressure, it's tracked in the throttled list of the server till
+ * throttle_check finds its buckets refilled. Returns true if the client has
+ * been throttled, false if its buckets are refilled already.
+ */
+static bool client_throttle(struct ev_ctx *ctx, struct client *c) {
+    enum rate_listener l = c->conn.shm ? RATE_LISTENER_SHM : RATE_LISTENER_SOCKET;
+    bool throttled = false;
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    if (c->throttle_disarmed == false && ratelimit_refilled(&c->limit, l))
+        c->throttled = false;
+    if (c->throttled == true) {
+        if (c->throttle_disarmed == false) {
+            list_push_back(server.throttled, c);
+            info.throttled_clients++;
+            c->stats.throttled++;
+            c->throttle_disarmed = true;
+        }
+        ev_fire_event(ctx, c->conn.fd, EV_NONE, NULL, NULL);
+        throttled = true;
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    return throttled;
+}
+
+static void throttle_check(struct ev_ctx *ctx, void *data) {
+    (void) ctx;
+    (void) data;
+    if (info.throttled_clients == 0)
+        return;
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    struct list_node *cur = server.throttled->head, *next = NULL;
+    for (; cur; cur = next) {
+        next = cur->next;
+        struct client *c = cur->data;
+        enum rate_listener l =
+            c->conn.shm ? RATE_LISTENER_SHM : RATE_LISTENER_SOCKET;
+        if (!ratelimit_refilled(&c->limit, l))
+            continue;
+        free_memory(list_remove_node(server.throttled, c, client_cmp));
+        info.throttled_clients--;
+        c->throttled = c->throttle_disarmed = false;
+        server_rearm(c);
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
 #endif
 }
 
@@ -610,7 +1163,8 @@ static inline int read_data(struct client *c) {
     if (c->read < c->toread)
         return -ERREAGAIN;
 
-    info.bytes_recv += c->read;
+    STATS_ADD(bytes_recv, c->read);
+    c->stats.bytes_in += c->read;
 
     return SOL_OK;
 
@@ -638,9 +1192,13 @@ static inline int write_data(struct client *c) {
     if (c->wrote < c->towrite && errno == EAGAIN)
         goto eagain;
     // Update information stats
-    info.bytes_sent += c->towrite;
+    STATS_ADD(bytes_sent, c->towrite);
+    c->stats.bytes_out += c->towrite;
     // Reset client written bytes track fields
     c->towrite = c->wrote = 0;
+    unsigned long long enqueued = atomic_exchange(&c->wbuf_ts, 0);
+    if (enqueued > 0)
+        LATENCY_RECORD(LATENCY_IO, enqueued);
 #if THREADSNR > 0
     pthread_mutex_unlock(&c->mutex);
 #endif
@@ -672,25 +1230,98 @@ eagain:
  */
 static void write_callback(struct ev_ctx *ctx, void *arg) {
     struct client *client = arg;
+    uint64_t trace_start = TRACE_START();
+    uint64_t cycles = cycle_count();
     int err = write_data(client);
+    /*
+     * A refused CONNACK is the last packet, the connection is closed once
+     * it's out, nothing else sent by the client must be handled
+     */
+    if (err == SOL_OK && (client->rc == MQTT_BAD_USERNAME_OR_PASSWORD
+                          || client->rc == MQTT_NOT_AUTHORIZED))
+        err = -ERRCLIENTDC;
     switch (err) {
         case SOL_OK:
+            /*
+             * A packet held for lack of room for its reply, other loops may
+             * have filled the buffer again meanwhile
+             */
+            if (client->held == true) {
+                if (wbuf_fits(client, client->read)) {
+                    client->held = false;
+                    int rc = process_message(ctx, client);
+                    if (rc == -ERRCLIENTDC || rc == -ERRWBUFFULL)
+                        err = rc;
+                } else {
+                    enqueue_event_write(client);
+                }
+                break;
+            }
             /*
              * Rearm descriptor making it ready to receive input,
              * read_callback will be the callback to be used; also reset the
-             * read buffer status for the client.
+             * read buffer status for the client, unless these were bytes
+             * enqueued by other loops while a packet was partially read.
+             */
+            if (client->status == SENDING_DATA)
+                client->status = WAITING_HEADER;
+            /*
+             * Some bytes have been drained, check if any publisher paused
+             * by backpressure can be resumed
+             */
+            if (info.paused_publishers > 0) {
+#if THREADSNR > 0
+                TRACE_LOCK("mutex_wait", &mutex);
+#endif
+                resume_publishers();
+#if THREADSNR > 0
+                pthread_mutex_unlock(&mutex);
+#endif
+            }
+            if (client->paused == true && client_suspend(ctx, client))
+                break;
+            if (client->throttled == true && client_throttle(ctx, client))
+                break;
+            // Not read till its PUBLISH is routed, fanout_run re-arms it
+            if (client->fanout) {
+                ev_fire_event(ctx, client->conn.fd, EV_NONE, NULL, NULL);
+                break;
+            }
+            /*
+             * Other loops may have enqueued bytes meanwhile, their write
+             * event must not be overridden by re-arming for reading
              */
-            client->status = WAITING_HEADER;
-            ev_fire_event(ctx, client->conn.fd, EV_READ, read_callback, client);
+#if THREADSNR > 0
+            pthread_mutex_lock(&client->mutex);
+#endif
+            // Room in the buffer for the next slice of the session backlog
+            if (client->backlog == BACKLOG_BLOCKED) {
+                client->backlog = BACKLOG_QUEUED;
+                ev_defer(ctx, session_backlog_flush, client);
+            }
+            if (client->towrite > 0)
+                enqueue_event_write(client);
+            else
+                ev_fire_event(ctx, client->conn.fd, EV_READ,
+                              read_callback, client);
+#if THREADSNR > 0
+            pthread_mutex_unlock(&client->mutex);
+#endif
             break;
         case -ERREAGAIN:
             /*
              * We have an EAGAIN error, which is really just signaling that
              * for some reasons the kernel is not ready to write more bytes at
              * the moment and it would block, so we just want to re-try some
-             * time later, re-enqueuing a new write event
+             * time later, re-enqueuing a new write event. Shared memory
+             * connections are woken up through their eventfd becoming
+             * readable, once the client consumed part of the ring.
              */
-            enqueue_event_write(client);
+            if (client->conn.shm)
+                ev_fire_event(ctx, client->conn.fd, EV_READ,
+                              write_callback, client);
+            else
+                enqueue_event_write(client);
             break;
         default:
             log_info("Closing connection with %s (%s): %s %i",
@@ -699,10 +1330,40 @@ static void write_callback(struct ev_ctx *ctx, void *arg) {
             ev_del_fd(ctx, client->conn.fd);
             client_deactivate(client);
             // Update stats
-            info.active_connections--;
-            info.total_connections--;
+            STATS_DEC(active_connections);
             break;
     }
+    // Deactivated clients may be back to the pool already, not to be touched
+    if (err == SOL_OK || err == -ERREAGAIN)
+        client->stats.cycles += cycle_count() - cycles;
+    TRACE_END("write_callback", trace_start);
+}
+
+/*
+ * Create a client structure to handle a new connection and add it to the
+ * loop, the descriptor must be already in non-blocking mode
+ */
+static void client_attach(struct ev_ctx *ctx, const struct connection *conn) {
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    struct client *c = memorypool_alloc(server.pool);
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
+    c->conn = *conn;
+    client_init(c);
+    c->ctx = ctx;
+
+    if (capture_enabled == true)
+        capture_open(conn->fd);
+
+    /* Add it to the epoll loop */
+    ev_register_event(ctx, conn->fd, EV_READ, read_callback, c);
+
+    /* Record the new client connected */
+    STATS_INC(active_connections);
+    STATS_INC(total_connections);
 }
 
 /*
@@ -712,6 +1373,21 @@ static void write_callback(struct ev_ctx *ctx, void *arg) {
  */
 static void accept_callback(struct ev_ctx *ctx, void *data) {
     int serverfd = *((int *) data);
+    /*
+     * A reload may swap the TLS context meanwhile, the connections accepted
+     * hold a reference of their own, this one is dropped once done
+     */
+    SSL_CTX *ssl_ctx = NULL;
+    if (conf->tls == true && serverfd != shm_sfd) {
+#if THREADSNR > 0
+        TRACE_LOCK("mutex_wait", &mutex);
+#endif
+        ssl_ctx = atomic_load(&server.ssl_ctx);
+        SSL_CTX_up_ref(ssl_ctx);
+#if THREADSNR > 0
+        pthread_mutex_unlock(&mutex);
+#endif
+    }
     while (1) {
 
         /*
@@ -720,7 +1396,10 @@ static void accept_callback(struct ev_ctx *ctx, void *data) {
          * pointer passed as argument
          */
         struct connection conn;
-        connection_init(&conn, conf->tls ? server.ssl_ctx : NULL);
+        if (serverfd == shm_sfd)
+            shm_connection_init(&conn);
+        else
+            connection_init(&conn, ssl_ctx);
         int fd = accept_connection(&conn, serverfd);
         if (fd == 0)
             continue;
@@ -729,30 +1408,12 @@ static void accept_callback(struct ev_ctx *ctx, void *data) {
             break;
         }
 
-        /*
-         * Create a client structure to handle his context
-         * connection
-         */
-#if THREADSNR > 0
-        pthread_mutex_lock(&mutex);
-#endif
-        struct client *c = memorypool_alloc(server.pool);
-#if THREADSNR > 0
-        pthread_mutex_unlock(&mutex);
-#endif
-        c->conn = conn;
-        client_init(c);
-        c->ctx = ctx;
-
-        /* Add it to the epoll loop */
-        ev_register_event(ctx, fd, EV_READ, read_callback, c);
-
-        /* Record the new client connected */
-        info.active_connections++;
-        info.total_connections++;
+        client_attach(ctx, &conn);
 
         log_info("[%p] Connection from %s", (void *) pthread_self(), conn.ip);
     }
+    if (ssl_ctx)
+        SSL_CTX_free(ssl_ctx);
 }
 
 /*
@@ -764,6 +1425,9 @@ static void read_callback(struct ev_ctx *ctx, void *data) {
     struct client *c = data;
     if (c->status == SENDING_DATA)
         return;
+    uint64_t trace_start = TRACE_START();
+    uint64_t cycles = cycle_count();
+    bool deactivated = false;
     /*
      * Received a bunch of data from a client, after the creation
      * of an IO event we need to read the bytes and encoding the
@@ -779,48 +1443,36 @@ static void read_callback(struct ev_ctx *ctx, void *data) {
              */
             /* Record last action as of now */
             c->last_seen = time(NULL);
+            c->read_ts = monotonic_ns();
             c->status = SENDING_DATA;
-            process_message(ctx, c);
+            if (capture_enabled == true)
+                capture_frame(c->conn.fd, c->rbuf, c->read);
+            // Charged as decoded, reads are suspended once it's handled
+            if (ratelimit_enabled == true
+                && ratelimit_take(&c->limit, c->conn.shm ? RATE_LISTENER_SHM
+                                  : RATE_LISTENER_SOCKET, c->read))
+                c->throttled = true;
+            /*
+             * No reply is larger than its request, but the ones to SUBSCRIBE
+             * followed by retained messages, bounded on their own. Without
+             * room for it the packet is held, nothing else is read and it's
+             * handled once the write buffer is written out
+             */
+            if (!wbuf_fits(c, c->read)) {
+                c->held = true;
+                enqueue_event_write(c);
+                break;
+            }
+            rc = process_message(ctx, c);
+            deactivated = rc == -ERRCLIENTDC || rc == -ERRWBUFFULL;
             break;
         case -ERRCLIENTDC:
         case -ERRSOCKETERR:
         case -ERRPACKETERR:
         case -ERRMAXREQSIZE:
             // TODO move to default branch
-            /*
-             * We got an unexpected error or a disconnection from the
-             * client side, remove client from the global map and
-             * free resources allocated such as io_event structure and
-             * paired payload
-             */
-            log_error("Closing connection with %s (%s): %s",
-                      c->client_id, c->conn.ip, solerr(rc));
-#if THREADSNR > 0
-            pthread_mutex_lock(&mutex);
-#endif
-            // Publish, if present, LWT message
-            if (c->has_lwt == true) {
-                char *tname = (char *) c->session->lwt_msg.publish.topic;
-                struct topic *t = topic_store_get(server.store, tname);
-                if (t)
-                    publish_message(&c->session->lwt_msg, t);
-            }
-            // Clean resources
-            ev_del_fd(ctx, c->conn.fd);
-            // Remove from subscriptions for now
-            if (c->session && list_size(c->session->subscriptions) > 0) {
-                list_foreach(item, c->session->subscriptions) {
-                    log_debug("Deleting %s from topic %s",
-                              c->client_id, ((struct topic *) item->data)->name);
-                    topic_del_subscriber(item->data, c);
-                }
-            }
-#if THREADSNR > 0
-            pthread_mutex_unlock(&mutex);
-#endif
-            client_deactivate(c);
-            info.active_connections--;
-            info.total_connections--;
+            client_abort(ctx, c, rc);
+            deactivated = true;
             break;
         case -ERREAGAIN:
             /*
@@ -832,6 +1484,10 @@ static void read_callback(struct ev_ctx *ctx, void *data) {
             ev_fire_event(ctx, c->conn.fd, EV_READ, read_callback, c);
             break;
     }
+    // Deactivated clients may be back to the pool already, not to be touched
+    if (deactivated == false)
+        c->stats.cycles += cycle_count() - cycles;
+    TRACE_END("read_callback", trace_start);
 }
 
 /*
@@ -842,8 +1498,9 @@ static void read_callback(struct ev_ctx *ctx, void *data) {
  * validating it before proceed to call handlers. Depending on the handler
  * called and its outcome, it'll enqueue an event to write a reply or just
  * reset the client state to allow reading some more packets.
+ * Returns the outcome of the handler, see server_resume.
  */
-static void process_message(struct ev_ctx *ctx, struct client *c) {
+static int process_message(struct ev_ctx *ctx, struct client *c) {
     struct io_event io = { .client = c };
     /*
      * Unpack received bytes into a mqtt_packet structure and execute the
@@ -851,8 +1508,18 @@ static void process_message(struct ev_ctx *ctx, struct client *c) {
      */
     mqtt_unpack(c->rbuf + c->rpos, &io.data, *c->rbuf, c->read - c->rpos);
     c->toread = c->read = c->rpos = 0;
-    c->rc = handle_command(io.data.header.bits.type, &io);
-    switch (c->rc) {
+    return server_resume(ctx, &io);
+}
+
+int server_resume(struct ev_ctx *ctx, struct io_event *e) {
+    struct io_event io = *e;
+    struct client *c = io.client;
+    uint64_t trace_start = TRACE_START();
+    int rc = handle_command(io.data.header.bits.type, &io);
+    c->rc = rc;
+    TRACE_END(trace_command_names[io.data.header.bits.type], trace_start);
+    LATENCY_RECORD(LATENCY_HANDLER, c->read_ts);
+    switch (rc) {
         case REPLY:
         case MQTT_NOT_AUTHORIZED:
         case MQTT_BAD_USERNAME_OR_PASSWORD:
@@ -870,18 +1537,61 @@ static void process_message(struct ev_ctx *ctx, struct client *c) {
             ev_del_fd(ctx, c->conn.fd);
             client_deactivate(io.client);
             // Update stats
-            info.active_connections--;
-            info.total_connections--;
+            STATS_DEC(active_connections);
+            break;
+        case -ERRWBUFFULL:
+            if (io.data.header.bits.type != PUBLISH)
+                mqtt_packet_destroy(&io.data);
+            client_abort(ctx, c, rc);
             break;
         case -ERRNOMEM:
             log_error(solerr(c->rc));
             break;
+        case PARKED:
+            // The packet is owned by the handler now, nothing armed
+            break;
         default:
             c->status = WAITING_HEADER;
             if (io.data.header.bits.type != PUBLISH)
                 mqtt_packet_destroy(&io.data);
+            /*
+             * The descriptor is still armed for reading, unless the publisher
+             * has just been paused by backpressure or run out of tokens
+             */
+            if (c->paused == true && client_suspend(ctx, c))
+                break;
+            if (c->throttled == true && client_throttle(ctx, c))
+                break;
+            // Not read till its PUBLISH is routed, fanout_run re-arms it
+            if (c->fanout)
+                ev_fire_event(ctx, c->conn.fd, EV_NONE, NULL, NULL);
             break;
     }
+    return rc;
+}
+
+/*
+ * Arm the clients handed over by an upgrade assigned to the loop, before it
+ * starts accepting new ones, as if they were just accepted
+ */
+static void adopt_clients(struct ev_ctx *ctx) {
+    struct client *c, *tmp;
+#if THREADSNR > 0
+    TRACE_LOCK("mutex_wait", &mutex);
+#endif
+    HASH_ITER(hh, server.clients_map, c, tmp) {
+        if (c->ctx != ctx || c->online == false)
+            continue;
+        if (capture_enabled == true)
+            capture_open(c->conn.fd);
+        ev_register_event(ctx, c->conn.fd, EV_READ, read_callback, c);
+        if (c->towrite > 0)
+            enqueue_event_write(c);
+        STATS_INC(active_connections);
+    }
+#if THREADSNR > 0
+    pthread_mutex_unlock(&mutex);
+#endif
 }
 
 /*
@@ -890,6 +1600,8 @@ static void process_message(struct ev_ctx *ctx, struct client *c) {
  */
 static void stop_handler(struct ev_ctx *ctx, void *arg) {
     (void) arg;
+    // No more clients to be resumed, the loops are about to be destroyed
+    auth_stop();
     ev_stop(ctx);
 }
 
@@ -902,26 +1614,56 @@ static void stop_handler(struct ev_ctx *ctx, void *arg) {
  */
 static void eventloop_start(void *args) {
     struct listen_payload *loop_data = args;
-    struct ev_ctx ctx;
+    /*
+     * The loop running cron jobs is started last, on the main thread, and it
+     * takes the last slot
+     */
+    int id = loop_data->cronjobs == true ? THREADSNR : atomic_fetch_add(&loops_nr, 1);
+    struct ev_ctx *ctx = &server.loops[id];
+    loop_stats = &server.stats[id];
+    loop_latency = server.latency[id];
     int sfd = loop_data->fd;
-    ev_init(&ctx, EVENTLOOP_MAX_EVENTS);
+    ev_init(ctx, EVENTLOOP_MAX_EVENTS);
     // Register stop event
 #ifdef __linux__
-    ev_register_event(&ctx, conf->run, EV_CLOSEFD|EV_READ, stop_handler, NULL);
+    ev_register_event(ctx, conf->run, EV_CLOSEFD|EV_READ, stop_handler, NULL);
 #else
-    ev_register_event(&ctx, conf->run[1], EV_CLOSEFD|EV_READ, stop_handler, NULL);
+    ev_register_event(ctx, conf->run[1], EV_CLOSEFD|EV_READ, stop_handler, NULL);
 #endif
+    adopt_clients(ctx);
     // Register listening FD with accept callback
-    ev_register_event(&ctx, sfd, EV_READ, accept_callback, &sfd);
+    ev_register_event(ctx, sfd, EV_READ, accept_callback, &sfd);
+    // Same for the shared memory transport, if enabled
+    if (shm_sfd >= 0)
+        ev_register_event(ctx, shm_sfd, EV_READ, accept_callback, &shm_sfd);
     // Register periodic tasks
     if (loop_data->cronjobs == true) {
         printf("Enabling cronjobs\n");
-        ev_register_cron(&ctx, publish_stats, NULL, conf->stats_pub_interval, 0);
-        ev_register_cron(&ctx, inflight_msg_check, NULL, 1, 0);
+        ev_register_cron(ctx, publish_stats, NULL, conf->stats_pub_interval, 0);
+        ev_register_cron(ctx, inflight_msg_check, NULL, 1, 0);
+        ev_register_cron(ctx, reload_check, NULL, 1, 0);
+        ev_register_cron(ctx, upgrade_check, NULL, 1, 0);
+        ev_register_cron(ctx, expiry_check, NULL, 1, 0);
+        if (ratelimit_enabled == true)
+            ev_register_cron(ctx, throttle_check, NULL, 0, THROTTLE_CHECK_NS);
+        if (trace_enabled == true)
+            ev_register_cron(ctx, trace_check, NULL, 1, 0);
+        if (shm_sfd >= 0)
+            ev_register_cron(ctx, shm_check, NULL, 1, 0);
+        // Expose metrics over HTTP, if enabled
+        if (conf->metrics_port[0] != '\0')
+            metrics_start(ctx, conf->socket_family == INET ?
+                          conf->hostname : DEFAULT_HOSTNAME, conf->metrics_port);
+        // Connect to the remote broker, if bridged
+        if (bridge_enabled == true)
+            bridge_start(ctx);
+        // Connect to the other nodes, if clustered
+        if (cluster_enabled == true)
+            cluster_start(ctx);
     }
     // Start the loop, blocking call
-    ev_run(&ctx);
-    ev_destroy(&ctx);
+    ev_run(ctx);
+    ev_destroy(ctx);
 }
 
 /*
@@ -935,8 +1677,83 @@ static void eventloop_start(void *args) {
  * schedules an EV_WRITE event with a client pointer set to write carried
  * contents out on the socket descriptor.
  */
-void enqueue_event_write(const struct client *c) {
-    ev_fire_event(c->ctx, c->conn.fd, EV_WRITE, write_callback, (void *) c);
+void enqueue_event_write(struct client *c) {
+    // Track the time the oldest pending bytes have been enqueued
+    unsigned long long none = 0;
+    atomic_compare_exchange_strong(&c->wbuf_ts, &none, monotonic_ns());
+    ev_fire_event(c->ctx, c->conn.fd, EV_WRITE, write_callback, c);
+}
+
+/*
+ * Sum up all the statistics shards of the event loops into the passed in
+ * struct, values are read with relaxed ordering so the result is not an
+ * atomic snapshot
+ */
+void stats_aggregate(struct loop_stats *stats) {
+    memset(stats, 0x00, sizeof(*stats));
+    for (int i = 0; i <= THREADSNR; ++i) {
+        const struct loop_stats *s = &server.stats[i];
+#define STATS_SUM(field) \
+        stats->field += atomic_load_explicit(&s->field, memory_order_relaxed)
+        STATS_SUM(active_connections);
+        STATS_SUM(total_connections);
+        STATS_SUM(messages_sent);
+        STATS_SUM(messages_recv);
+        STATS_SUM(messages_dropped);
+        STATS_SUM(bytes_sent);
+        STATS_SUM(bytes_recv);
+#undef STATS_SUM
+    }
+}
+
+/*
+ * Resident set size of the process, read from /proc/self/statm, 0 if not
+ * available
+ */
+static size_t process_rss(void) {
+    unsigned long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (!fp)
+        return 0;
+    if (fscanf(fp, "%lu %lu", &pages, &resident) != 2)
+        resident = 0;
+    fclose(fp);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+void server_footprint(struct footprint *fp) {
+    struct loop_stats stats;
+    stats_aggregate(&stats);
+    fp->connections = stats.active_connections;
+    fp->rss = process_rss();
+    fp->clients = fp->connections * sizeof(struct client);
+    fp->buffers = info.client_buffers;
+    fp->sessions = info.sessions * (sizeof(struct client_session) + 3 * sizeof(List));
+    fp->inflight = info.inflight_tables * MAX_INFLIGHT_MSGS
+        * (sizeof(time_t) + sizeof(struct inflight_msg));
+    // Every loop indexes its monitored events by descriptor
+    fp->epoll = fp->connections * EPOLL_ITEM_SIZE;
+    for (int i = 0; i <= THREADSNR; ++i)
+        fp->epoll += server.loops[i].maxevents * sizeof(struct ev);
+}
+
+void latency_aggregate(struct histogram *h, enum latency_stage stage) {
+    histogram_init(h);
+    for (int i = 0; i <= THREADSNR; ++i)
+        histogram_merge(h, &server.latency[i][stage]);
+}
+
+const char *latency_stage_name(enum latency_stage stage) {
+    switch (stage) {
+        case LATENCY_HANDLER:
+            return "handler";
+        case LATENCY_ROUTING:
+            return "routing";
+        case LATENCY_IO:
+            return "io";
+        default:
+            return "unknown";
+    }
 }
 
 /*
@@ -947,42 +1764,45 @@ void enqueue_event_write(const struct client *c) {
  */
 int start_server(const char *addr, const char *port) {
 
-    INIT_INFO;
-
-    /* Initialize global Sol instance */
-    server.store = topic_store_new();
-    server.auths = NULL;
-    server.pool = memorypool_new(BASE_CLIENTS_NUM, sizeof(struct client));
-    if (!server.pool)
-        log_fatal("Failed to allocate %d sized memory pool for clients",
-                  BASE_CLIENTS_NUM);
-    server.clients_map = NULL;
-    server.sessions = NULL;
-    pthread_mutex_init(&mutex, NULL);
+    server_init();
 
-    if (conf->allow_anonymous == false)
-        if (!config_read_passwd_file(conf->password_file, &server.auths))
-            log_error("Failed to read password file");
-
-    /* Generate stats topics */
-    for (int i = 0; i < SYS_TOPICS; i++) {
-        struct topic *t = topic_new(try_strdup(sys_topics[i].name));
-        if (!t)
-            log_fatal("start_server failed: Out of memory");
-        topic_store_put(server.store, t);
-    }
+    /* Listening sockets and clients may be handed over by an upgrade */
+    int sfd = -1;
+    upgrade_resume(&sfd, &shm_sfd);
 
     /* Start listening for new connections */
-    int sfd = make_listen(addr, port, conf->socket_family);
+    if (sfd < 0)
+        sfd = make_listen(addr, port, conf->socket_family);
+
+    /* Local clients may connect through shared memory as well */
+    if (conf->shm_socket[0] != '\0' && shm_sfd < 0)
+        shm_sfd = make_listen(conf->shm_socket, NULL, UNIX);
 
     /* Setup SSL in case of flag true */
     if (conf->tls == true) {
         openssl_init();
-        server.ssl_ctx = create_ssl_context();
-        load_certificates(server.ssl_ctx, conf->cafile,
-                          conf->certfile, conf->keyfile);
+        SSL_CTX *ssl_ctx = create_ssl_context(conf->tls_protocols);
+        if (!ssl_ctx
+            || !load_certificates(ssl_ctx, conf->cafile,
+                                  conf->certfile, conf->keyfile))
+            exit(EXIT_FAILURE);
+        atomic_store(&server.ssl_ctx, ssl_ctx);
     }
 
+    if (conf->trace_path[0] != '\0')
+        trace_init(conf->trace_path);
+
+    if (conf->capture_path[0] != '\0')
+        capture_init(conf->capture_path, conf->capture_rate);
+
+    if (conf->bridge_address[0] != '\0')
+        bridge_init();
+
+    ratelimit_init();
+
+    if (conf->cluster_peers_nr > 0)
+        cluster_init();
+
     log_info("Server start");
     info.start_time = time(NULL);
 
@@ -995,31 +1815,161 @@ int start_server(const char *addr, const char *port) {
         pthread_create(&thrs[i], NULL, (void * (*) (void *)) &eventloop_start, &loop_start);
     }
 #endif
-    loop_start.cronjobs = true;
+    /*
+     * The cron loop gets its own payload, the threads just started may still
+     * have to read theirs
+     */
+    struct listen_payload cron_start = { sfd, ATOMIC_VAR_INIT(true) };
     // start eventloop, could be spread on multiple threads
-    eventloop_start(&loop_start);
+    eventloop_start(&cron_start);
 
 #if THREADSNR > 0
     for (int i = 0; i < THREADSNR; ++i)
         pthread_join(thrs[i], NULL);
 #endif
 
+    /* The new process, if upgrading, keeps using the shared memory socket */
+    bool upgraded = upgrade_handoff(sfd, shm_sfd);
+
     close(sfd);
-    AUTH_DESTROY(server.auths);
-    topic_store_destroy(server.store);
+    if (shm_sfd >= 0) {
+        close(shm_sfd);
+        if (upgraded == false)
+            unlink(conf->shm_socket);
+    }
 
     /* Destroy SSL context, if any present */
     if (conf->tls == true) {
-        SSL_CTX_free(server.ssl_ctx);
+        SSL_CTX_free(atomic_load(&server.ssl_ctx));
         openssl_cleanup();
     }
-    pthread_mutex_destroy(&mutex);
+    trace_close();
+    capture_shutdown();
+    bridge_shutdown();
+    cluster_shutdown();
+
+    server_cleanup();
 
     log_info("Sol v%s exiting", VERSION);
 
     return SOL_OK;
 }
 
+// Stops epoll_wait loops by sending an event
+void stop_server(void) {
+    for (int i = 0; i < THREADSNR + 1; ++i) {
+#ifdef __linux__
+        eventfd_write(conf->run, 1);
+#else
+        (void) write(conf->run[0], &(unsigned long) {1}, sizeof(unsigned long));
+#endif
+        usleep(1500);
+    }
+}
+
+void server_init(void) {
+
+    INIT_INFO;
+
+    /* Initialize global Sol instance */
+    server.store = topic_store_new();
+    server.pool = memorypool_new(BASE_CLIENTS_NUM, sizeof(struct client));
+    if (!server.pool)
+        log_fatal("Failed to allocate %d sized memory pool for clients",
+                  BASE_CLIENTS_NUM);
+    server.clients_map = NULL;
+    server.sessions = NULL;
+    server.paused = list_new(NULL);
+    server.throttled = list_new(NULL);
+    for (int i = 0; i < TOP_DIMENSIONS; ++i)
+        heavy_hitters_init(&server.top[i], HEAVY_HITTERS_K);
+    pthread_mutex_init(&mutex, NULL);
+
+    struct authentication *auths = NULL;
+    if (conf->allow_anonymous == false)
+        if (!config_read_passwd_file(conf->password_file, &auths))
+            log_error("Failed to read password file");
+    atomic_store(&server.auths, auths);
+    auth_init();
+    /*
+     * Broken ACLs refuse everything rather than letting every client
+     * publish and subscribe anywhere
+     */
+    struct acl *acl = NULL;
+    if (conf->acl_file[0]) {
+        acl = acl_load(conf->acl_file);
+        if (!acl) {
+            log_error("Failed to load ACL file, refusing every topic");
+            acl = acl_new();
+        } else {
+            log_info("Loaded %lu ACL rules", acl_size(acl));
+        }
+    }
+    atomic_store(&server.acl, acl);
+
+    /* Generate stats topics */
+    for (int i = 0; i < SYS_TOPICS; i++) {
+        struct topic *t = topic_new(try_strdup(sys_topics[i].name));
+        if (!t)
+            log_fatal("start_server failed: Out of memory");
+        topic_store_put(server.store, t);
+    }
+
+    /*
+     * Generate latency and client report topics as well, so they can be
+     * subscribed with wildcards before their first publish
+     */
+    char tname[64];
+    for (int i = 0; i < LATENCY_STAGES; i++) {
+        for (int j = 0; j < LATENCY_QUANTILES; j++) {
+            snprintf(tname, sizeof(tname),
+                     "$SOL/broker/latency/%s/%s/",
+                     latency_stage_name(i), latency_quantiles[j].name);
+            topic_store_get_or_put(server.store, tname);
+        }
+    }
+    for (int i = 0; i < CLIENT_DIMENSIONS; i++) {
+        snprintf(tname, sizeof(tname),
+                 "$SOL/broker/clients/top/%s/", client_dimension_names[i]);
+        client_top_topics[i] =
+            topic_store_get_or_put(server.store, tname);
+    }
+}
+
+void server_attach(struct ev_ctx *ctx, int fd) {
+    struct connection conn;
+    connection_init(&conn, NULL);
+    conn.fd = fd;
+    snprintf(conn.ip, sizeof(conn.ip), "fd:%d", fd);
+    client_attach(ctx, &conn);
+}
+
+struct client *server_adopt(int fd, const char *ip) {
+    static unsigned next = 0;
+    struct client *c = memorypool_alloc(server.pool);
+    connection_init(&c->conn, NULL);
+    c->conn.fd = fd;
+    snprintf(c->conn.ip, sizeof(c->conn.ip), "%s", ip);
+    client_init(c);
+    c->ctx = &server.loops[next++ % (THREADSNR + 1)];
+    return c;
+}
+
+void server_cleanup(void) {
+    reload_shutdown();
+    auth_shutdown();
+    expiry_shutdown();
+    struct authentication *auths = atomic_load(&server.auths);
+    AUTH_DESTROY(auths);
+    acl_free(atomic_load(&server.acl));
+    topic_store_destroy(server.store);
+    list_destroy(server.paused, 0);
+    list_destroy(server.throttled, 0);
+    for (int i = 0; i < TOP_DIMENSIONS; ++i)
+        heavy_hitters_destroy(&server.top[i]);
+    pthread_mutex_destroy(&mutex);
+}
+
 /*
  * Make the entire process a daemon running in background
  */
@@ -28,10 +28,15 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <stdatomic.h>
 #include "mqtt.h"
 #include "pack.h"
+#include "list.h"
+#include "ev.h"
 #include "trie.h"
 #include "network.h"
+#include "sketch.h"
+#include "histogram.h"
 
 /*
  * Number of worker threads to be created. Each one will host his own ev_ctx
@@ -64,35 +69,104 @@ struct io_event {
     struct mqtt_packet data;
 };
 
-/* Global informations statistics structure */
-struct sol_info {
+/*
+ * Per event loop statistics, each loop owns a shard and it's the only thread
+ * writing into it, so counters can be updated with relaxed loads and stores
+ * instead of locked read-modify-write instructions. Shards are aligned to a
+ * cache line to avoid false sharing between loops, readers have to aggregate
+ * them, see stats_aggregate.
+ */
+struct loop_stats {
     /* Number of clients currently connected */
-    atomic_size_t active_connections;
+    _Alignas(64) atomic_size_t active_connections;
     /* Total number of clients connected since the start */
     atomic_size_t total_connections;
     /* Total number of sent messages */
     atomic_size_t messages_sent;
     /* Total number of received messages */
     atomic_size_t messages_recv;
+    /* Total number of messages dropped, not fitting the write buffer */
+    atomic_size_t messages_dropped;
+    /* Total number of bytes sent out */
+    atomic_size_t bytes_sent;
+    /* Total number of bytes received */
+    atomic_size_t bytes_recv;
+};
+
+/* Shard of the event loop running on the calling thread */
+extern _Thread_local struct loop_stats *loop_stats;
+
+#define STATS_ADD(field, n)                                                 \
+    atomic_store_explicit(&loop_stats->field,                               \
+        atomic_load_explicit(&loop_stats->field, memory_order_relaxed) + (n),\
+        memory_order_relaxed)
+
+#define STATS_INC(field) STATS_ADD(field, 1)
+
+#define STATS_DEC(field) STATS_ADD(field, -1)
+
+/*
+ * Stages of the life of a message inside the broker, latencies of each one
+ * are tracked by per event loop histograms:
+ * - LATENCY_HANDLER packet fully read -> handler done
+ * - LATENCY_ROUTING handler received a publish -> packet enqueued on a
+ *                   subscriber write buffer
+ * - LATENCY_IO      bytes enqueued on a client -> written out on the socket
+ */
+enum latency_stage {
+    LATENCY_HANDLER,
+    LATENCY_ROUTING,
+    LATENCY_IO,
+    LATENCY_STAGES
+};
+
+/* Latency histograms of the event loop running on the calling thread */
+extern _Thread_local struct histogram *loop_latency;
+
+#define LATENCY_RECORD(stage, start) \
+    histogram_record(&loop_latency[(stage)], monotonic_ns() - (start))
+
+/*
+ * Heavy hitters tracked on the publish path, by topic and by publishing
+ * client, both for number of messages and payload bytes. They're reset at
+ * every stats interval, after the top HEAVY_HITTERS_K are published.
+ */
+#define HEAVY_HITTERS_K 10
+
+enum top_dimension {
+    TOP_TOPICS_MESSAGES,
+    TOP_TOPICS_BYTES,
+    TOP_CLIENTS_MESSAGES,
+    TOP_CLIENTS_BYTES,
+    TOP_DIMENSIONS
+};
+
+/* Global informations statistics structure */
+struct sol_info {
     /* Timestamp of the start time */
     atomic_size_t start_time;
     /* Seconds passed since the start */
     atomic_size_t uptime;
-    /* Total number of bytes received */
-    atomic_size_t bytes_sent;
-    /* Total number of bytes sent out */
-    atomic_size_t bytes_recv;
+    /* Number of publishers currently paused by backpressure */
+    atomic_size_t paused_publishers;
+    /* Number of clients currently throttled by the rate limits */
+    atomic_size_t throttled_clients;
+    /* Bytes allocated for the read and write buffers of the clients */
+    atomic_size_t client_buffers;
+    /* Number of sessions currently alive */
+    atomic_size_t sessions;
+    /* Number of sessions with their inflight tables allocated */
+    atomic_size_t inflight_tables;
 };
 
 #define INIT_INFO do { \
-    info.active_connections = ATOMIC_VAR_INIT(0);   \
-    info.total_connections = ATOMIC_VAR_INIT(0);    \
-    info.messages_sent = ATOMIC_VAR_INIT(0);        \
-    info.messages_recv = ATOMIC_VAR_INIT(0);        \
     info.start_time = ATOMIC_VAR_INIT(0);           \
     info.uptime = ATOMIC_VAR_INIT(0);               \
-    info.bytes_sent = ATOMIC_VAR_INIT(0);           \
-    info.bytes_recv = ATOMIC_VAR_INIT(0);           \
+    info.paused_publishers = ATOMIC_VAR_INIT(0);    \
+    info.throttled_clients = ATOMIC_VAR_INIT(0);    \
+    info.client_buffers = ATOMIC_VAR_INIT(0);       \
+    info.sessions = ATOMIC_VAR_INIT(0);             \
+    info.inflight_tables = ATOMIC_VAR_INIT(0);      \
 } while (0)
 
 /*
@@ -119,10 +193,31 @@ struct server {
     // The global session map, another UTHASH handle pointer, must be set to
     // NULL
     struct client_session *sessions;
-    // UTHASH handle pointer for authentications
-    struct authentication *auths;
-    // Application TLS context
-    SSL_CTX *ssl_ctx;
+    // UTHASH handle pointer for authentications, swapped by a reload, used
+    // only with the global mutex held
+    struct authentication *_Atomic auths;
+    // Compiled topic ACLs, NULL if not set, swapped by a reload, used only
+    // with the global mutex held
+    struct acl *_Atomic acl;
+    // Application TLS context, swapped by a reload, accepts take a reference
+    // to it with the global mutex held
+    SSL_CTX *_Atomic ssl_ctx;
+    // Publishers with reads suspended by backpressure, guarded by the global
+    // mutex
+    List *paused;
+    // Clients with reads suspended by the rate limits, guarded by the global
+    // mutex
+    List *throttled;
+    // Event loops, the last one is run by the main thread and it's the one
+    // serving cron jobs
+    struct ev_ctx loops[THREADSNR + 1];
+    // Statistics shards, one for each event loop
+    struct loop_stats stats[THREADSNR + 1];
+    // Latency histograms for each stage, one set for each event loop
+    struct histogram latency[THREADSNR + 1][LATENCY_STAGES];
+    // Heavy hitters of the current stats interval, guarded by the global
+    // mutex
+    struct heavy_hitters top[TOP_DIMENSIONS];
 };
 
 extern struct server server;
@@ -135,12 +230,100 @@ extern struct server server;
  */
 int start_server(const char *, const char *);
 
+/*
+ * Stop the event loops started by start_server, making it return. It's
+ * async-signal-safe, meant to be called by signal handlers as well.
+ */
+void stop_server(void);
+
+/*
+ * Lower level APIs to embed the broker core without listening on a socket,
+ * start_server is built on top of them:
+ * - server_init sets up the global instance (topic store, sessions, clients
+ *   pool), the configuration must be already set
+ * - server_attach adds an already connected, non-blocking descriptor as a
+ *   new client served by the given loop, as if it was just accepted
+ * - server_cleanup releases what server_init allocated
+ * Loops are owned and run by the caller.
+ */
+void server_init(void);
+
+void server_attach(struct ev_ctx *, int);
+
+/*
+ * Create a client for a connection handed over by an upgrade, see upgrade.h,
+ * assigning it to one of the loops started by start_server. The caller sets
+ * its state, the loop arms its events as it starts.
+ */
+struct client *server_adopt(int, const char *);
+
+/*
+ * Run the handler of a packet of a client, then reply or re-arm it for
+ * reading according to the outcome. Called on every packet read and to resume
+ * a packet parked by its handler, from the loop serving the client.
+ * Returns the outcome of the handler, on -ERRCLIENTDC and -ERRWBUFFULL the
+ * client has been deactivated and must not be touched anymore.
+ */
+int server_resume(struct ev_ctx *, struct io_event *);
+
+void server_cleanup(void);
+
 /*
  * Fire a write callback to reply after a client request, under the hood it
  * schedules an EV_WRITE event with a client pointer set to write carried
  * contents out on the socket descriptor.
  */
-void enqueue_event_write(const struct client *);
+void enqueue_event_write(struct client *);
+
+/*
+ * Arm again a client whose reads have been suspended (backpressure, rate
+ * limits, sliced routing of a PUBLISH) once nothing holds it anymore. Must be
+ * called with the global lock held.
+ */
+void server_rearm(struct client *);
+
+/*
+ * Sum up all the statistics shards of the event loops into the passed in
+ * struct, values are read with relaxed ordering so the result is not an
+ * atomic snapshot
+ */
+void stats_aggregate(struct loop_stats *);
+
+/*
+ * Approximate kernel memory of a descriptor registered on epoll, a struct
+ * epitem and a struct eppoll_entry from their slab caches
+ */
+#define EPOLL_ITEM_SIZE 192
+
+/*
+ * Memory footprint of the connected clients, broken down by component, all
+ * sizes in bytes. Buffers are the allocated size, with large buffers most of
+ * the pages of an idle client are never touched and don't count in the RSS.
+ */
+struct footprint {
+    size_t connections; /* Clients currently connected */
+    size_t rss;         /* Resident set size of the whole process */
+    size_t clients;     /* The struct client of each connection */
+    size_t buffers;     /* Read and write buffers */
+    size_t sessions;    /* Sessions and their lists, without the contents */
+    size_t inflight;    /* Inflight tables, allocated on the first QoS > 0 */
+    size_t epoll;       /* Event loops monitored arrays and kernel epitems */
+};
+
+/*
+ * Fill the footprint passed in with the current values, counters are read
+ * with relaxed ordering so the result is not an atomic snapshot
+ */
+void server_footprint(struct footprint *);
+
+/*
+ * Merge the latency histograms of a stage of all the event loops into the
+ * passed in histogram
+ */
+void latency_aggregate(struct histogram *, enum latency_stage);
+
+/* Name of a latency stage, as used in topics and metrics labels */
+const char *latency_stage_name(enum latency_stage);
 
 /*
  * Make the entire process a daemon running in background
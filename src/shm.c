@@ -0,0 +1,310 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "config.h"
+#include "memory.h"
+#include "logging.h"
+#include "network.h"
+#include "shm.h"
+
+/* Smallest ring, whatever set by shm_ring_size */
+#define SHM_MIN_RING    4096
+
+#define SHM_ALIGN(n)    (((n) + 63) & ~((size_t) 63))
+
+struct shm_conn {
+    int sock;           /* The handshake socket, closed when the client is gone */
+    int wakeup;         /* Eventfd waking up the broker, the connection fd */
+    int client;         /* Eventfd waking up the client */
+    void *map;
+    size_t size;
+    size_t ring_size;   /* Never read back from the mapping */
+    struct shm_ring *in;
+    struct shm_ring *out;
+    bool drained;       /* The eventfd was drained waiting for room to write */
+    struct shm_conn *prev;
+    struct shm_conn *next;
+};
+
+/* All the shared memory connections open, checked by shm_check */
+static struct shm_conn *conns = NULL;
+
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Broker side, the connection functions
+ */
+
+static void shm_conn_free(struct shm_conn *s) {
+    if (s->map)
+        munmap(s->map, s->size);
+    if (s->sock >= 0)
+        close(s->sock);
+    if (s->client >= 0)
+        close(s->client);
+    if (s->wakeup >= 0)
+        close(s->wakeup);
+    free_memory(s);
+}
+
+/*
+ * Set up the mapping and the eventfds of a new connection and send them to
+ * the client, the rings are zeroed by ftruncate
+ */
+static struct shm_conn *shm_handshake(int sock) {
+    struct shm_conn *s = try_calloc(1, sizeof(*s));
+    s->sock = sock;
+    s->wakeup = s->client = -1;
+    size_t ring_size = SHM_MIN_RING;
+    while (ring_size < conf->shm_ring_size)
+        ring_size <<= 1;
+    size_t ring_bytes = SHM_ALIGN(sizeof(struct shm_ring) + ring_size);
+    size_t inbound = SHM_ALIGN(sizeof(struct shm_header));
+    s->size = inbound + 2 * ring_bytes;
+    int mfd = memfd_create("sol-shm", MFD_CLOEXEC);
+    if (mfd < 0 || ftruncate(mfd, s->size) < 0)
+        goto err;
+    s->map = mmap(NULL, s->size, PROT_READ|PROT_WRITE, MAP_SHARED, mfd, 0);
+    if (s->map == MAP_FAILED) {
+        s->map = NULL;
+        goto err;
+    }
+    struct shm_header *hdr = s->map;
+    hdr->magic = SHM_MAGIC;
+    hdr->version = SHM_VERSION;
+    hdr->inbound = inbound;
+    hdr->outbound = inbound + ring_bytes;
+    hdr->size = s->size;
+    s->in = (struct shm_ring *) ((unsigned char *) s->map + hdr->inbound);
+    s->out = (struct shm_ring *) ((unsigned char *) s->map + hdr->outbound);
+    s->in->size = s->out->size = s->ring_size = ring_size;
+    // Nothing to read yet, the broker starts asleep on its eventfd
+    s->in->waiting = 1;
+    s->client = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    s->wakeup = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (s->client < 0 || s->wakeup < 0)
+        goto err;
+    int fds[3] = { mfd, s->client, s->wakeup };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } cbuf;
+    memset(&cbuf, 0x00, sizeof(cbuf));
+    struct iovec iov = { .iov_base = "S", .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cbuf.buf,
+        .msg_controllen = sizeof(cbuf.buf)
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != 1)
+        goto err;
+    close(mfd);
+    return s;
+
+err:
+
+    log_error("Shared memory handshake failed: %s", strerror(errno));
+    if (mfd >= 0)
+        close(mfd);
+    shm_conn_free(s);
+    return NULL;
+}
+
+int shm_accept(struct connection *c, int sfd) {
+    int sock = accept(sfd, NULL, NULL);
+    if (sock < 0) {
+        if (errno != EWOULDBLOCK && errno != EAGAIN) perror("accept");
+        return -1;
+    }
+    (void) fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    (void) fcntl(sock, F_SETFD, FD_CLOEXEC);
+    struct shm_conn *s = shm_handshake(sock);
+    if (!s)
+        return -1;
+    pthread_mutex_lock(&conns_lock);
+    s->next = conns;
+    if (conns)
+        conns->prev = s;
+    conns = s;
+    pthread_mutex_unlock(&conns_lock);
+    c->shm = s;
+    c->fd = s->wakeup;
+    snprintf(c->ip, sizeof(c->ip), "shm");
+    return c->fd;
+}
+
+/*
+ * Same semantic of recv_bytes: errno is EAGAIN if less than len bytes were
+ * available, a return of 0 with errno 0 means the client closed and a corrupt
+ * ring is an error, closing the connection as well. The eventfd
+ * is drained only once the ring is found empty, before setting the waiting
+ * flag and checking it again, so it's still readable as long as there are
+ * bytes left in the ring, the loop is level triggered.
+ */
+static ssize_t shm_recv(struct connection *c, unsigned char *buf, size_t len) {
+    struct shm_conn *s = c->shm;
+    struct shm_ring *r = s->in;
+    if (atomic_load_explicit(&r->waiting, memory_order_relaxed))
+        atomic_store_explicit(&r->waiting, 0, memory_order_relaxed);
+    ssize_t n = shm_ring_read(r, s->ring_size, buf, len);
+    if (n < 0)
+        goto corrupt;
+    if ((size_t) n < len) {
+        eventfd_read(s->wakeup, &(eventfd_t) {0});
+        atomic_store_explicit(&r->waiting, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        ssize_t more = shm_ring_read(r, s->ring_size, buf + n, len - n);
+        if (more < 0)
+            goto corrupt;
+        if (more > 0) {
+            // Raced with the client, stay readable for what's left
+            atomic_store_explicit(&r->waiting, 0, memory_order_relaxed);
+            eventfd_write(s->wakeup, 1);
+            n += more;
+        }
+    }
+    if (n > 0)
+        shm_ring_consumed(r, s->client);
+    if ((size_t) n < len) {
+        if (n == 0 && atomic_load(&r->closed) && shm_ring_empty(r)) {
+            errno = 0;
+            return 0;
+        }
+        errno = EAGAIN;
+    }
+    return n;
+
+corrupt:
+
+    log_warning("Shared memory client ring corrupt, closing the connection");
+    errno = EPROTO;
+    return -1;
+}
+
+/*
+ * Same semantic of send_bytes, with the ring full errno is EAGAIN, a corrupt
+ * ring is an error as in shm_recv. The eventfd of the connection is always
+ * writable, so with the ring full it's drained before setting the full flag
+ * and the loop waits for it to be readable, written by the client once it
+ * freed some room. A wakeup for reading may be swallowed by that, it's given
+ * back once everything is sent.
+ */
+static ssize_t shm_send(struct connection *c, const unsigned char *buf,
+                        size_t len) {
+    struct shm_conn *s = c->shm;
+    struct shm_ring *r = s->out;
+    if (atomic_load(&s->in->closed)) {
+        errno = EPIPE;
+        return -1;
+    }
+    ssize_t n = shm_ring_write(r, s->ring_size, buf, len);
+    if (n >= 0 && (size_t) n < len) {
+        eventfd_read(s->wakeup, &(eventfd_t) {0});
+        s->drained = true;
+        atomic_store_explicit(&r->full, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        ssize_t more = shm_ring_write(r, s->ring_size, buf + n, len - n);
+        n = more < 0 ? more : n + more;
+    }
+    if (n < 0) {
+        log_warning("Shared memory client ring corrupt, closing the connection");
+        errno = EPROTO;
+        return -1;
+    }
+    if (n > 0)
+        shm_ring_produced(r, s->client);
+    if ((size_t) n < len) {
+        errno = EAGAIN;
+    } else if (s->drained == true) {
+        s->drained = false;
+        eventfd_write(s->wakeup, 1);
+    }
+    return n;
+}
+
+static void shm_close(struct connection *c) {
+    struct shm_conn *s = c->shm;
+    if (!s) {
+        if (c->fd >= 0)
+            close(c->fd);
+        return;
+    }
+    pthread_mutex_lock(&conns_lock);
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        conns = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    pthread_mutex_unlock(&conns_lock);
+    atomic_store(&s->out->closed, 1);
+    eventfd_write(s->client, 1);
+    shm_conn_free(s);
+    c->shm = NULL;
+    c->fd = -1;
+}
+
+void shm_connection_init(struct connection *c) {
+    connection_init(c, NULL);
+    c->accept = shm_accept;
+    c->send = shm_send;
+    c->recv = shm_recv;
+    c->close = shm_close;
+}
+
+void shm_check(struct ev_ctx *ctx, void *arg) {
+    (void) ctx;
+    (void) arg;
+    char b;
+    pthread_mutex_lock(&conns_lock);
+    for (struct shm_conn *s = conns; s; s = s->next) {
+        if (atomic_load(&s->in->closed))
+            continue;
+        ssize_t n = recv(s->sock, &b, 1, MSG_PEEK|MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            atomic_store(&s->in->closed, 1);
+            eventfd_write(s->wakeup, 1);
+        }
+    }
+    pthread_mutex_unlock(&conns_lock);
+}
@@ -0,0 +1,209 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+
+struct ev_ctx;
+struct connection;
+
+/*
+ * Shared memory transport for clients running on the same host, MQTT packets
+ * flow through two single producer single consumer byte rings, one per
+ * direction, in a memfd mapping shared with the broker, without a syscall or
+ * a copy through the kernel per packet.
+ *
+ * The handshake runs on the unix socket set by shm_socket: the broker accepts
+ * the connection, sets up the mapping and sends back, with SCM_RIGHTS, the
+ * memfd and two eventfds, the first one waking up the client, the second one
+ * waking up the broker. The mapping starts with a struct shm_header, the
+ * rings follow at the offsets it states. From then on the socket is only kept
+ * open to tell when the client is gone.
+ *
+ * Each side only sleeps after setting the waiting flag of the ring it reads
+ * from and checking the ring again, a producer writes the eventfd of the other
+ * side only if it finds the flag set, so a busy consumer is never woken up
+ * through the kernel. A producer finding the ring full sets the full flag and
+ * the consumer wakes it up once it freed some room: the broker then waits for
+ * its eventfd to be readable rather than for the connection to be writable,
+ * an eventfd always is.
+ */
+
+#define SHM_MAGIC       0x534f4c53  /* "SOLS" */
+#define SHM_VERSION     1
+
+struct shm_ring {
+    /* Written by the producer only */
+    _Alignas(64) volatile atomic_ullong head;
+    /* Written by the consumer only */
+    _Alignas(64) volatile atomic_ullong tail;
+    /* The consumer is going to sleep on its eventfd */
+    _Alignas(64) volatile atomic_uint waiting;
+    /* The producer found the ring full */
+    volatile atomic_uint full;
+    /* The producer closed its side of the connection */
+    volatile atomic_uint closed;
+    /* Size of data, a power of 2, only read by the client on connect */
+    uint64_t size;
+    _Alignas(64) unsigned char data[];
+};
+
+/*
+ * Ring primitives, shared by the broker and the clients, head and tail grow
+ * indefinitely, their difference is the number of bytes in the ring. The
+ * size is the one each side set or validated on its own, never the one in the
+ * mapping, which the other side can write: a difference of head and tail
+ * greater than it means a corrupt ring and -1 is returned.
+ */
+
+static inline ssize_t shm_ring_write(struct shm_ring *r, size_t size,
+                                     const unsigned char *buf, size_t len) {
+    unsigned long long head =
+        atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned long long tail =
+        atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head - tail > size)
+        return -1;
+    size_t room = size - (head - tail);
+    size_t n = len < room ? len : room;
+    size_t off = head & (size - 1);
+    size_t first = n < size - off ? n : size - off;
+    memcpy(r->data + off, buf, first);
+    memcpy(r->data, buf + first, n - first);
+    atomic_store_explicit(&r->head, head + n, memory_order_release);
+    return n;
+}
+
+static inline ssize_t shm_ring_read(struct shm_ring *r, size_t size,
+                                    unsigned char *buf, size_t len) {
+    unsigned long long tail =
+        atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned long long head =
+        atomic_load_explicit(&r->head, memory_order_acquire);
+    if (head - tail > size)
+        return -1;
+    size_t used = head - tail;
+    size_t n = len < used ? len : used;
+    size_t off = tail & (size - 1);
+    size_t first = n < size - off ? n : size - off;
+    memcpy(buf, r->data + off, first);
+    memcpy(buf + first, r->data, n - first);
+    atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+    return n;
+}
+
+static inline bool shm_ring_empty(struct shm_ring *r) {
+    return atomic_load_explicit(&r->head, memory_order_acquire)
+        == atomic_load_explicit(&r->tail, memory_order_relaxed);
+}
+
+/* After producing, wake up the consumer if it's going to sleep */
+static inline void shm_ring_produced(struct shm_ring *r, int efd) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&r->waiting, memory_order_relaxed))
+        eventfd_write(efd, 1);
+}
+
+/* After consuming, wake up the producer if it found the ring full */
+static inline void shm_ring_consumed(struct shm_ring *r, int efd) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&r->full, memory_order_relaxed)) {
+        atomic_store_explicit(&r->full, 0, memory_order_relaxed);
+        eventfd_write(efd, 1);
+    }
+}
+
+struct shm_header {
+    uint32_t magic;
+    uint32_t version;
+    /* Offsets in the mapping of the client to broker and broker to client rings */
+    uint64_t inbound;
+    uint64_t outbound;
+    /* Size of the whole mapping */
+    uint64_t size;
+};
+
+/* Broker side of a shared memory connection */
+struct shm_conn;
+
+/*
+ * Accept a connection on the shared memory listening socket and set it up as
+ * a shared memory one, the descriptor of the connection becomes the eventfd
+ * waking up the broker. Returns the descriptor or -1.
+ */
+int shm_accept(struct connection *, int);
+
+/* Set the connection to use the shared memory functions */
+void shm_connection_init(struct connection *);
+
+/*
+ * Check the clients of the shared memory connections, waking up the broker
+ * for the ones gone so that their connections are closed. To be run
+ * periodically from the loop running the cron jobs.
+ */
+void shm_check(struct ev_ctx *, void *);
+
+/* Client side of a shared memory connection */
+struct shm_client {
+    int sock;
+    int wakeup;         /* Eventfd waking up the client */
+    int broker;         /* Eventfd waking up the broker */
+    void *map;
+    size_t size;
+    size_t ring_size;
+    struct shm_ring *rx;
+    struct shm_ring *tx;
+};
+
+/* Connect to the broker through the unix socket path, returns 0 or -1 */
+int shm_client_connect(struct shm_client *, const char *);
+
+/*
+ * Send len bytes to the broker, blocking while the ring is full, returns the
+ * number of bytes sent or -1 if the broker closed the connection or the ring
+ * is corrupt
+ */
+ssize_t shm_client_send(struct shm_client *, const unsigned char *, size_t);
+
+/*
+ * Receive up to len bytes from the broker, spinning for a while and then
+ * sleeping on the eventfd till some arrive or timeout_ms expires (-1 waits
+ * forever). Returns the number of bytes received, 0 on timeout or -1 if the
+ * broker closed the connection or the ring is corrupt.
+ */
+ssize_t shm_client_recv(struct shm_client *, unsigned char *, size_t, int);
+
+void shm_client_close(struct shm_client *);
+
+#endif
@@ -0,0 +1,212 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <sched.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "shm.h"
+
+/*
+ * Client side of the shared memory transport, kept apart from the broker side
+ * so that clients can link it alone
+ */
+
+/*
+ * Times a client polls the ring before going to sleep on the eventfd, waking
+ * up from the kernel costs more than a few microseconds of polling. Every
+ * SHM_YIELD polls the CPU is yielded, the broker may be waiting for it.
+ */
+#define SHM_SPIN        4096
+#define SHM_YIELD       64
+
+int shm_client_connect(struct shm_client *c, const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fds[3] = { -1, -1, -1 };
+    memset(c, 0x00, sizeof(*c));
+    c->sock = c->wakeup = c->broker = -1;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if ((c->sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0
+        || connect(c->sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        goto err;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } cbuf;
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cbuf.buf,
+        .msg_controllen = sizeof(cbuf.buf)
+    };
+    if (recvmsg(c->sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+        goto err;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+        goto err;
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    c->wakeup = fds[1];
+    c->broker = fds[2];
+    struct stat st;
+    if (fstat(fds[0], &st) < 0)
+        goto err;
+    c->size = st.st_size;
+    c->map = mmap(NULL, c->size, PROT_READ|PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (c->map == MAP_FAILED) {
+        c->map = NULL;
+        goto err;
+    }
+    const struct shm_header *hdr = c->map;
+    if (hdr->magic != SHM_MAGIC || hdr->version != SHM_VERSION
+        || hdr->size != c->size) {
+        errno = EPROTO;
+        goto err;
+    }
+    if (hdr->inbound >= hdr->outbound
+        || hdr->outbound > c->size - sizeof(struct shm_ring)) {
+        errno = EPROTO;
+        goto err;
+    }
+    c->tx = (struct shm_ring *) ((unsigned char *) c->map + hdr->inbound);
+    c->rx = (struct shm_ring *) ((unsigned char *) c->map + hdr->outbound);
+    // Both rings share the size, a power of 2 fitting the mapping
+    c->ring_size = c->tx->size;
+    if (c->ring_size == 0 || (c->ring_size & (c->ring_size - 1))
+        || c->rx->size != c->ring_size
+        || hdr->outbound - hdr->inbound < sizeof(struct shm_ring) + c->ring_size
+        || c->size - hdr->outbound < sizeof(struct shm_ring) + c->ring_size) {
+        errno = EPROTO;
+        goto err;
+    }
+    return 0;
+
+err:
+
+    shm_client_close(c);
+    return -1;
+}
+
+/*
+ * Sleep till woken up by the broker, returns 1 once woken up, 0 on timeout and
+ * -1 if the broker is gone
+ */
+static int shm_client_wait(struct shm_client *c, int timeout_ms) {
+    struct pollfd pfds[2] = {
+        { .fd = c->wakeup, .events = POLLIN },
+        // The broker never writes on the socket, readable means closed
+        { .fd = c->sock, .events = POLLIN }
+    };
+    int n = poll(pfds, 2, timeout_ms);
+    if (n < 0)
+        return errno == EINTR ? 1 : -1;
+    if (pfds[1].revents)
+        return -1;
+    if (pfds[0].revents)
+        eventfd_read(c->wakeup, &(eventfd_t) {0});
+    return n > 0;
+}
+
+ssize_t shm_client_send(struct shm_client *c,
+                        const unsigned char *buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        if (atomic_load(&c->rx->closed))
+            return -1;
+        ssize_t n = shm_ring_write(c->tx, c->ring_size,
+                                   buf + total, len - total);
+        if (n == 0) {
+            // Full, check again once the broker knows it has to wake us up
+            atomic_store_explicit(&c->tx->full, 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            n = shm_ring_write(c->tx, c->ring_size, buf + total, len - total);
+            if (n == 0 && shm_client_wait(c, -1) < 0)
+                return -1;
+        }
+        if (n < 0)
+            return -1;
+        if (n > 0)
+            shm_ring_produced(c->tx, c->broker);
+        total += n;
+    }
+    return total;
+}
+
+ssize_t shm_client_recv(struct shm_client *c, unsigned char *buf,
+                        size_t len, int timeout_ms) {
+    for (;;) {
+        for (int i = 0; i < SHM_SPIN; ++i) {
+            ssize_t n = shm_ring_read(c->rx, c->ring_size, buf, len);
+            if (n < 0)
+                return -1;
+            if (n > 0) {
+                shm_ring_consumed(c->rx, c->broker);
+                return n;
+            }
+            if (atomic_load(&c->rx->closed))
+                return -1;
+            if (i % SHM_YIELD == SHM_YIELD - 1)
+                sched_yield();
+        }
+        atomic_store_explicit(&c->rx->waiting, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        int woken = 1;
+        if (shm_ring_empty(c->rx))
+            woken = shm_client_wait(c, timeout_ms);
+        atomic_store_explicit(&c->rx->waiting, 0, memory_order_relaxed);
+        if (woken < 0)
+            return -1;
+        if (woken == 0 && shm_ring_empty(c->rx))
+            return 0;
+    }
+}
+
+void shm_client_close(struct shm_client *c) {
+    if (c->tx) {
+        atomic_store(&c->tx->closed, 1);
+        eventfd_write(c->broker, 1);
+    }
+    if (c->map)
+        munmap(c->map, c->size);
+    if (c->sock >= 0)
+        close(c->sock);
+    if (c->wakeup >= 0)
+        close(c->wakeup);
+    if (c->broker >= 0)
+        close(c->broker);
+    memset(c, 0x00, sizeof(*c));
+    c->sock = c->wakeup = c->broker = -1;
+}
@@ -0,0 +1,184 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include "memory.h"
+#include "sketch.h"
+
+/*
+ * 64 bit FNV-1a followed by a finalizer mix, the two halves of the result
+ * are combined to derive the index of each row (Kirsch-Mitzenmacher), so the
+ * key has to be hashed only once
+ */
+static uint64_t hash_key(const char *key, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char) key[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline size_t row_index(uint64_t hash, int row) {
+    uint32_t h1 = hash, h2 = hash >> 32;
+    return (h1 + (uint64_t) row * (h2 | 1)) % CMS_WIDTH;
+}
+
+void cms_reset(struct cms *cms) {
+    memset(cms, 0x00, sizeof(*cms));
+}
+
+uint64_t cms_add(struct cms *cms, const char *key, size_t len, uint64_t weight) {
+    uint64_t hash = hash_key(key, len), estimate = UINT64_MAX;
+    for (int i = 0; i < CMS_DEPTH; ++i) {
+        uint64_t *counter = &cms->counts[i][row_index(hash, i)];
+        *counter += weight;
+        if (*counter < estimate)
+            estimate = *counter;
+    }
+    cms->total += weight;
+    return estimate;
+}
+
+uint64_t cms_estimate(const struct cms *cms, const char *key, size_t len) {
+    uint64_t hash = hash_key(key, len), estimate = UINT64_MAX;
+    for (int i = 0; i < CMS_DEPTH; ++i) {
+        uint64_t counter = cms->counts[i][row_index(hash, i)];
+        if (counter < estimate)
+            estimate = counter;
+    }
+    return estimate;
+}
+
+void topk_init(struct topk *top, size_t k) {
+    top->k = k;
+    top->len = 0;
+    top->heap = try_calloc(k, sizeof(struct topk_entry));
+}
+
+void topk_clear(struct topk *top) {
+    for (size_t i = 0; i < top->len; ++i)
+        free_memory(top->heap[i].key);
+    top->len = 0;
+}
+
+void topk_destroy(struct topk *top) {
+    topk_clear(top);
+    free_memory(top->heap);
+}
+
+static inline void entry_swap(struct topk_entry *a, struct topk_entry *b) {
+    struct topk_entry tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void heap_sift_up(struct topk *top, size_t i) {
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (top->heap[parent].count <= top->heap[i].count)
+            break;
+        entry_swap(&top->heap[parent], &top->heap[i]);
+        i = parent;
+    }
+}
+
+static void heap_sift_down(struct topk *top, size_t i) {
+    for (;;) {
+        size_t min = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < top->len && top->heap[left].count < top->heap[min].count)
+            min = left;
+        if (right < top->len && top->heap[right].count < top->heap[min].count)
+            min = right;
+        if (min == i)
+            break;
+        entry_swap(&top->heap[min], &top->heap[i]);
+        i = min;
+    }
+}
+
+void topk_offer(struct topk *top, const char *key, uint64_t count) {
+    if (top->k == 0)
+        return;
+    // Already tracked, counts only grow so the heap property can only be
+    // violated downwards
+    for (size_t i = 0; i < top->len; ++i) {
+        if (strcmp(top->heap[i].key, key) == 0) {
+            top->heap[i].count = count;
+            heap_sift_down(top, i);
+            return;
+        }
+    }
+    if (top->len < top->k) {
+        top->heap[top->len].key = try_strdup(key);
+        top->heap[top->len].count = count;
+        heap_sift_up(top, top->len++);
+        return;
+    }
+    // Evict the smallest tracked key if the new one is bigger
+    if (count <= top->heap[0].count)
+        return;
+    free_memory(top->heap[0].key);
+    top->heap[0].key = try_strdup(key);
+    top->heap[0].count = count;
+    heap_sift_down(top, 0);
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    uint64_t ca = ((const struct topk_entry *) a)->count;
+    uint64_t cb = ((const struct topk_entry *) b)->count;
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+size_t topk_sorted(const struct topk *top, struct topk_entry *entries) {
+    memcpy(entries, top->heap, top->len * sizeof(struct topk_entry));
+    qsort(entries, top->len, sizeof(struct topk_entry), entry_cmp);
+    return top->len;
+}
+
+void heavy_hitters_init(struct heavy_hitters *hh, size_t k) {
+    cms_reset(&hh->sketch);
+    topk_init(&hh->top, k);
+}
+
+void heavy_hitters_add(struct heavy_hitters *hh, const char *key, uint64_t weight) {
+    uint64_t estimate = cms_add(&hh->sketch, key, strlen(key), weight);
+    topk_offer(&hh->top, key, estimate);
+}
+
+void heavy_hitters_reset(struct heavy_hitters *hh) {
+    cms_reset(&hh->sketch);
+    topk_clear(&hh->top);
+}
+
+void heavy_hitters_destroy(struct heavy_hitters *hh) {
+    topk_destroy(&hh->top);
+}
@@ -0,0 +1,119 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Count-min sketch, approximate counters for an unbounded set of keys with
+ * fixed memory: every key increments a counter for each row, selected by a
+ * different hash, the estimate of a key is the minimum among its counters.
+ * Estimates can only be greater than the real counts, with an error of
+ * ~2/CMS_WIDTH of the total added, with probability 1 - (1/2)^CMS_DEPTH.
+ */
+#define CMS_DEPTH   4
+#define CMS_WIDTH   2048
+
+struct cms {
+    uint64_t total;
+    uint64_t counts[CMS_DEPTH][CMS_WIDTH];
+};
+
+/* A tracked key of a topk, with its estimated count */
+struct topk_entry {
+    char *key;
+    uint64_t count;
+};
+
+/*
+ * Top-K keys by count, stored as a min-heap on the count so the smallest of
+ * the tracked keys can be evicted in constant time when a bigger one shows
+ * up. Meant to be fed with estimates of a count-min sketch, K is expected to
+ * be small so lookups by key are linear.
+ */
+struct topk {
+    size_t k;
+    size_t len;
+    struct topk_entry *heap;
+};
+
+/*
+ * Heavy hitters tracker, pairs a count-min sketch with a topk to find the
+ * keys with the highest counts with bounded memory
+ */
+struct heavy_hitters {
+    struct cms sketch;
+    struct topk top;
+};
+
+/* Reset all the counters of the sketch */
+void cms_reset(struct cms *);
+
+/* Add weight to the counters of a key, returning its updated estimate */
+uint64_t cms_add(struct cms *, const char *, size_t, uint64_t);
+
+/* Return the estimated count of a key */
+uint64_t cms_estimate(const struct cms *, const char *, size_t);
+
+/* Init a topk to track at most k keys */
+void topk_init(struct topk *, size_t);
+
+/* Release all the tracked keys, making the topk empty */
+void topk_clear(struct topk *);
+
+/* Release all the memory of the topk */
+void topk_destroy(struct topk *);
+
+/*
+ * Offer a key with its updated count, the key is tracked if already present
+ * or if there's still room, or if its count is greater than the smallest
+ * tracked one, which gets evicted
+ */
+void topk_offer(struct topk *, const char *, uint64_t);
+
+/*
+ * Copy the tracked entries into the passed in array, sorted by count in
+ * descending order. The array must be at least k long, keys are still owned
+ * by the topk. Returns the number of entries copied.
+ */
+size_t topk_sorted(const struct topk *, struct topk_entry *);
+
+/* Init a heavy hitters tracker for the top k keys */
+void heavy_hitters_init(struct heavy_hitters *, size_t);
+
+/* Account weight to a key, updating its estimate and the top k */
+void heavy_hitters_add(struct heavy_hitters *, const char *, uint64_t);
+
+/* Start a new interval, resetting both the sketch and the top k */
+void heavy_hitters_reset(struct heavy_hitters *);
+
+void heavy_hitters_destroy(struct heavy_hitters *);
+
+#endif
@@ -26,26 +26,37 @@
  */
 
 #include <signal.h>
-#ifdef __linux__
-#include <sys/eventfd.h>
-#endif
 #include <unistd.h>
 #include "util.h"
 #include "config.h"
 #include "server.h"
 #include "logging.h"
+#include "trace.h"
+#include "reload.h"
+#include "upgrade.h"
 
 // Stops epoll_wait loops by sending an event
 static void sigint_handler(int signum) {
     (void) signum;
-    for (int i = 0; i < THREADSNR + 1; ++i) {
-#ifdef __linux__
-        eventfd_write(conf->run, 1);//写入事件ID
-#else
-        (void) write(conf->run[0], &(unsigned long) {1}, sizeof(unsigned long));
-#endif
-        usleep(1500);
-    }
+    stop_server();
+}
+
+// Ask for a dump of the traces, served by the cron loop
+static void sigusr1_handler(int signum) {
+    (void) signum;
+    trace_request_dump();
+}
+
+// Read the configuration again, served by the cron loop
+static void sighup_handler(int signum) {
+    (void) signum;
+    reload_request();
+}
+
+// Hand everything over to a new process, served by the cron loop
+static void sigusr2_handler(int signum) {
+    (void) signum;
+    upgrade_request();
 }
 
 static const char *flag_description[] = {
@@ -68,8 +79,13 @@ void print_help(char *me) {
 
 int main (int argc, char **argv) {
 
+    upgrade_init(argv);
+
     signal(SIGINT, sigint_handler);
     signal(SIGTERM, sigint_handler);
+    signal(SIGUSR1, sigusr1_handler);
+    signal(SIGHUP, sighup_handler);
+    signal(SIGUSR2, sigusr2_handler);
 
     char *addr = DEFAULT_HOSTNAME;
     char *port = DEFAULT_PORT;
@@ -116,11 +132,13 @@ int main (int argc, char **argv) {
     // Try to load a configuration, if found
     config_load(confpath);
 
-    sol_log_init(conf->logpath, conf->loglevel);
-
+    // Daemonize before starting the log writer thread, it wouldn't survive
+    // the fork
     if (daemon == 1)
         daemonize();
 
+    sol_log_init(conf->logpath, conf->loglevel);
+
     // Print configuration
     config_print();
 
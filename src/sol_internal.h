@@ -35,6 +35,8 @@
 #include "trie.h"
 #include "uthash.h"
 #include "network.h"
+#include "ratelimit.h"
+#include "config.h"
 
 /* Generic return codes without a defined purpose */
 #define SOL_OK              0
@@ -49,6 +51,8 @@
  * - error EAGAIN from a non-blocking read/write function
  * - error sending/receiving data on a connected socket
  * - error OUT OF MEMORY
+ * - error no room left in the write buffer for a reply, the client is not
+ *   reading its socket
  */
 #define ERRCLIENTDC         1
 #define ERRPACKETERR        2
@@ -56,6 +60,7 @@
 #define ERREAGAIN           4
 #define ERRSOCKETERR        5
 #define ERRNOMEM            6
+#define ERRWBUFFULL         7
 
 /*
  * Return code of handler functions, signaling if there's data payload to be
@@ -65,6 +70,12 @@
 #define REPLY               0
 #define NOREPLY             1
 
+/*
+ * Return code of a handler that handed the packet off, the client is out of
+ * the loop till the handling is resumed by server_resume
+ */
+#define PARKED              6
+
 /* The maximum number of pending/not acknowledged packets for each client */
 #define MAX_INFLIGHT_MSGS 65536
 
@@ -79,6 +90,7 @@
 struct topic {
     const char *name;
     unsigned char *retained_msg;
+    time_t retained_expiry;         /* 0 means never, see expiry.h */
     struct subscriber *subscribers; /* UTHASH handle pointer, must be NULL */
 };
 
@@ -127,7 +139,8 @@ struct subscription {
  * generic ACKs, fields required are the descriptor of destination, the type
  * of the message, the timestamp of the last send try, the size of the packet
  * and the packet himself.
- * It's meant to be used in a fixed length array.
+ * It's meant to be used in a fixed length array, the same structure is also
+ * employed to park messages exceeding the inflight window of a session.
  */
 struct inflight_msg {
     time_t seen; /* Timestamp of the last time we have seen this msg */
@@ -159,6 +172,38 @@ enum client_status {
     SENDING_DATA
 };
 
+/*
+ * Progress of the messages queued for a resumed session, written out
+ * BACKLOG_SLICE per loop cycle:
+ * - BACKLOG_NONE     nothing left, messages are written out as they're routed
+ * - BACKLOG_QUEUED   the next slice is deferred to the next loop cycle
+ * - BACKLOG_BLOCKED  the write buffer is full, the next slice follows its
+ *                    write; set as well when the parked QoS > 0 messages
+ *                    don't fit, they're released after the write
+ */
+enum backlog_state {
+    BACKLOG_NONE,
+    BACKLOG_QUEUED,
+    BACKLOG_BLOCKED
+};
+
+struct fanout;
+
+/*
+ * Per client counters, plain integers updated by the loop owning the client
+ * or under the client lock when delivering from another loop, so they cost
+ * no atomic operations. They're read without locks to build the reports,
+ * values may be slightly stale.
+ */
+struct client_stats {
+    uint64_t messages_in; /* PUBLISH received */
+    uint64_t messages_out; /* PUBLISH sent, re-sends included */
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t cycles; /* CPU cycles spent in the read and write callbacks */
+    uint64_t throttled; /* Times reads were suspended by the rate limits */
+};
+
 /*
  * Wrapper structure around a connected client, each client can be a publisher
  * or a subscriber, it can be used to track sessions too.
@@ -194,21 +239,46 @@ struct client {
                              */
     struct client_session *session; /* The session associated to the client */
     time_t last_seen; /* The timestamp of the last action performed */
+    uint64_t read_ts; /* Monotonic timestamp of the last complete packet read */
+    volatile atomic_ullong wbuf_ts; /* Monotonic timestamp of the oldest bytes pending in wbuf, 0 if none */
     bool online;  /* Just an online flag */
     bool connected; /* States if the client has already processed a connection packet */
     bool has_lwt; /* States if the connection packet carried a LWT message */
     bool clean_session; /* States if the connection packet was set to clean session */
+    volatile atomic_bool paused; /* Reads suspended, subscribers can't keep up with the client */
+    bool disarmed; /* The descriptor has no events armed while paused */
+    bool held; /* A packet read is held till the write buffer has room for its reply */
+    struct rate_limit limit; /* Ingress token buckets, see ratelimit.h */
+    bool throttled; /* Out of tokens, reads suspended till they refill */
+    bool throttle_disarmed; /* Tracked in the throttled list, no events armed */
+    bool cluster_peer; /* Connected as another node of the cluster */
+    unsigned char auth; /* Outcome of the password check, see auth.h */
+    enum backlog_state backlog; /* Messages queued while offline still to write out */
+    struct fanout *fanout; /* The PUBLISH being routed in slices, not read till done */
+    struct acl_client *acl; /* Username and memoized checks for the ACLs */
+    const struct topic *blocked_on; /* The congested topic that caused the pause */
+    struct client_stats stats; /* Counters since the connection */
+    struct client_stats reported; /* Counters at the time of the last report */
     pthread_mutex_t mutex; /* Inner lock for the client, this avoid race-conditions on shared parts */
     UT_hash_handle hh; /* UTHASH handle, needed to use UTHASH macros */
 };
 
+/*
+ * Check if len more bytes fit in the write buffer of the client, its size is
+ * max_request_size. Must be called with the client lock held, or from the
+ * loop serving the client to tell if a reply fits, see read_callback.
+ */
+static inline bool wbuf_fits(const struct client *c, size_t len) {
+    return c->towrite + len <= (size_t) conf->max_request_size;
+}
+
 /*
  * Every client has a session which track his subscriptions, possible missed
  * messages during disconnection time (that iff clean_session is set to false),
  * inflight messages and the message ID for each one.
  * A maximum of 65535 mid can be used at the same time according to MQTT specs,
- * so i_acks, i_msgs, thus being allocated on the heap during the init, will be
- * of 65535 length each.
+ * so i_acks, i_msgs, allocated on the heap on the first QoS > 0 message
+ * and NULL until then, will be of 65535 length each.
  *
  * It's a hashable struct that will be tracked during the entire lifetime of
  * the application, governed by the clean_session flag on connection from
@@ -218,8 +288,11 @@ struct client_session {
     unsigned next_free_mid; /* The next 'free' message ID */
     List *subscriptions; /* All the clients subscriptions, stored as topic structs */
     List *outgoing_msgs; /* Outgoing messages during disconnection time, stored as mqtt_packet pointers */
+    List *pending_msgs; /* QoS > 0 messages exceeding the inflight window, stored as inflight_msg pointers */
     volatile atomic_ushort inflights; /* Just a counter stating the presence of inflight messages */
     bool clean_session; /* Clean session flag */
+    time_t expiry; /* Deadline of the session while offline, 0 means never */
+    time_t swept; /* Last expiry sweep dropping the expired messages queued */
     char session_id[MQTT_CLIENT_ID_LEN]; /* The client_id the session refers to */
     struct mqtt_packet lwt_msg; /* A possibly NULL LWT message, will be set on connection */
     time_t *i_acks; /* Inflight ACKs that must be cleared */
@@ -299,6 +372,19 @@ struct subscriber *topic_add_subscriber(struct topic *,
  */
 void topic_del_subscriber(struct topic *, struct client *);
 
+/*
+ * Check if a topic matches a wildcard subscription, both single level '+'
+ * and multilevel '#' (multilevel set) wildcards are supported.
+ * Returns SOL_OK on match, -SOL_ERR otherwise.
+ */
+int match_subscription(const char *, const char *, bool);
+
+/*
+ * Check if a topic as published, not normalized, matches a filter as
+ * subscribed, e.g. foo/+/bar/#. Used to route messages to other brokers.
+ */
+bool match_filter(const char *, const char *, size_t);
+
 /*
  * Allocate a new store structure on the heap and return it after its
  * initialization, also allocating a new list on the heap to keep track of
@@ -371,4 +457,11 @@ bool topic_store_wildcards_empty(const struct topic_store *);
 
 #define has_inflight(session) ((session)->inflights > 0)
 
+/*
+ * Check if the inflight window of a session, as set by configuration
+ * max_inflight_messages, is full. A limit of 0 means no limit at all.
+ */
+#define inflight_window_full(session) \
+    (conf->max_inflight_msgs > 0 && (session)->inflights >= conf->max_inflight_msgs)
+
 #define inflight_msg_clear(msg) DECREF((msg)->packet, struct mqtt_packet)
@@ -25,6 +25,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <string.h>
 #include "memory.h"
 #include "sol_internal.h"
 
@@ -40,6 +41,7 @@ void topic_init(struct topic *t, const char *name) {
     t->name = name;
     t->subscribers = NULL;
     t->retained_msg = NULL;
+    t->retained_expiry = 0;
 }
 
 /*
@@ -107,3 +109,56 @@ void topic_del_subscriber(struct topic *t, struct client *c) {
         DECREF(sub, struct subscriber);
     }
 }
+
+/*
+ * Check if a topic match a wildcard subscription. It works with + and # as
+ * well, both are expected as normalized by the subscribe handler, so ending
+ * with a '/', with the '#' already stripped and multilevel set. Topics
+ * starting with $ are matched by wildcards only past the first level.
+ */
+int match_subscription(const char *topic, const char *wtopic, bool multilevel) {
+    if (*topic == '$' && *wtopic == '+')
+        return -SOL_ERR;
+    while (*wtopic) {
+        if (*wtopic == '+') {
+            // Single level wildcard, skip a whole level of the topic
+            while (*topic && *topic != '/')
+                topic++;
+            wtopic++;
+        } else if (*wtopic++ != *topic++) {
+            return -SOL_ERR;
+        }
+    }
+    /*
+     * The entire wildcard topic matched, any level left in the topic is
+     * accepted only by a multilevel wildcard
+     */
+    return *topic == '\0' || multilevel == true ? SOL_OK : -SOL_ERR;
+}
+
+/*
+ * Check if a topic, as published and len bytes long, matches a filter as
+ * subscribed, with + matching a single level and # all the remaining ones,
+ * foo/# matches foo as well. Topics starting with $ are matched by wildcards
+ * only past the first level.
+ */
+bool match_filter(const char *filter, const char *topic, size_t len) {
+    const char *end = topic + len;
+    if (len > 0 && topic[0] == '$' && (filter[0] == '+' || filter[0] == '#'))
+        return false;
+    while (*filter) {
+        if (*filter == '#')
+            return true;
+        if (*filter == '+') {
+            while (topic < end && *topic != '/')
+                ++topic;
+            ++filter;
+        } else if (topic < end && *filter == *topic) {
+            ++filter;
+            ++topic;
+        } else {
+            return topic == end && strcmp(filter, "/#") == 0;
+        }
+    }
+    return topic == end;
+}
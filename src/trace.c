@@ -0,0 +1,176 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include "trace.h"
+#include "memory.h"
+#include "logging.h"
+
+/* A complete span, times are in nanoseconds on the monotonic clock */
+struct trace_span {
+    const char *name;
+    uint64_t start;
+    uint64_t duration;
+};
+
+/*
+ * Single producer ring, only the owning thread records spans in it. The
+ * position grows indefinitely and is masked to index the spans, once full
+ * the oldest spans are overwritten.
+ */
+struct trace_ring {
+    atomic_size_t pos;
+    atomic_ullong lock_wait; /* Total ns spent waiting on traced locks */
+    atomic_ullong locks; /* Number of traced lock acquisitions */
+    int tid;
+    struct trace_ring *next;
+    struct trace_span spans[TRACE_RING_SIZE];
+};
+
+bool trace_enabled = false;
+
+/* Where to write the dumps */
+static const char *trace_path = NULL;
+
+/* Reference time of the dumps, spans are exported relative to it */
+static uint64_t trace_epoch = 0;
+
+/* Ring of the calling thread, lazily allocated on the first span */
+static _Thread_local struct trace_ring *ring = NULL;
+
+/* All the rings allocated, new ones are pushed on the head */
+static _Atomic(struct trace_ring *) rings = NULL;
+
+/* Progressive id of the threads, in order of first span recorded */
+static atomic_int next_tid = ATOMIC_VAR_INIT(0);
+
+static atomic_bool dump_requested = ATOMIC_VAR_INIT(false);
+
+static struct trace_ring *trace_ring_new(void) {
+    struct trace_ring *r = try_calloc(1, sizeof(*r));
+    r->tid = atomic_fetch_add(&next_tid, 1) + 1;
+    r->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+        ;
+    return r;
+}
+
+void trace_init(const char *path) {
+    trace_path = path;
+    trace_epoch = monotonic_ns();
+    trace_enabled = true;
+}
+
+void trace_record(const char *name, uint64_t start) {
+    uint64_t now = monotonic_ns();
+    if (!ring)
+        ring = trace_ring_new();
+    size_t pos = atomic_load_explicit(&ring->pos, memory_order_relaxed);
+    struct trace_span *s = &ring->spans[pos & (TRACE_RING_SIZE - 1)];
+    s->name = name;
+    s->start = start;
+    s->duration = now - start;
+    atomic_store_explicit(&ring->pos, pos + 1, memory_order_release);
+}
+
+void trace_record_lock(const char *name, uint64_t start) {
+    trace_record(name, start);
+    size_t pos = atomic_load_explicit(&ring->pos, memory_order_relaxed);
+    uint64_t wait = ring->spans[(pos - 1) & (TRACE_RING_SIZE - 1)].duration;
+    atomic_store_explicit(&ring->lock_wait,
+                          atomic_load_explicit(&ring->lock_wait,
+                                               memory_order_relaxed) + wait,
+                          memory_order_relaxed);
+    atomic_store_explicit(&ring->locks,
+                          atomic_load_explicit(&ring->locks,
+                                               memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+}
+
+void trace_lock_stats(uint64_t *wait, uint64_t *locks) {
+    *wait = *locks = 0;
+    for (struct trace_ring *r = atomic_load(&rings); r; r = r->next) {
+        *wait += atomic_load_explicit(&r->lock_wait, memory_order_relaxed);
+        *locks += atomic_load_explicit(&r->locks, memory_order_relaxed);
+    }
+}
+
+void trace_request_dump(void) {
+    atomic_store(&dump_requested, true);
+}
+
+void trace_dump_pending(void) {
+    if (atomic_exchange(&dump_requested, false) == true)
+        trace_dump();
+}
+
+int trace_dump(void) {
+    if (trace_enabled == false || !trace_path)
+        return -1;
+    FILE *fp = fopen(trace_path, "w");
+    if (!fp) {
+        log_error("Unable to open trace file %s", trace_path);
+        return -1;
+    }
+    int written = 0;
+    const char *sep = "";
+    pid_t pid = getpid();
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (struct trace_ring *r = atomic_load(&rings); r; r = r->next) {
+        fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%d,\"args\":{\"name\":\"sol-%d\"}}",
+                sep, pid, r->tid, r->tid);
+        sep = ",";
+        size_t pos = atomic_load_explicit(&r->pos, memory_order_acquire);
+        size_t i = pos > TRACE_RING_SIZE ? pos - TRACE_RING_SIZE : 0;
+        for (; i < pos; ++i) {
+            const struct trace_span *s = &r->spans[i & (TRACE_RING_SIZE - 1)];
+            uint64_t start = s->start > trace_epoch ? s->start - trace_epoch : 0;
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"sol\",\"ph\":\"X\","
+                    "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                    s->name, start / 1e3, s->duration / 1e3, pid, r->tid);
+            written++;
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    log_info("Trace dumped to %s", trace_path);
+    return written;
+}
+
+void trace_close(void) {
+    trace_enabled = false;
+    struct trace_ring *r = atomic_exchange(&rings, NULL);
+    while (r) {
+        struct trace_ring *next = r->next;
+        free_memory(r);
+        r = next;
+    }
+    ring = NULL;
+}
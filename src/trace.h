@@ -0,0 +1,110 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "util.h"
+
+/*
+ * Opt-in tracing of what each event loop is doing, meant to be turned on to
+ * investigate latency spikes. Every thread records complete spans (a name, a
+ * start and a duration) into its own fixed size ring, overwriting the oldest
+ * ones, and the rings can be dumped at any time as Chrome trace JSON, to be
+ * opened with chrome://tracing or https://ui.perfetto.dev.
+ *
+ * When tracing is disabled every probe costs a single, well predicted,
+ * branch on a global flag that never changes after startup.
+ */
+
+/* Number of spans kept by each thread, must be a power of 2 */
+#define TRACE_RING_SIZE 8192
+
+/* Set once on startup, never changed while the loops are running */
+extern bool trace_enabled;
+
+/*
+ * Enable tracing, rings will be dumped to the given path on request, if not
+ * NULL. Must be called before starting the event loops.
+ */
+void trace_init(const char *);
+
+/* Record a span named name, started at start and ending now */
+void trace_record(const char *, uint64_t);
+
+/* Like trace_record, also accounting the span as time waited on a lock */
+void trace_record_lock(const char *, uint64_t);
+
+/*
+ * Sum up the time waited on traced locks and the number of acquisitions of
+ * all the threads, values are read with relaxed ordering
+ */
+void trace_lock_stats(uint64_t *, uint64_t *);
+
+/*
+ * Ask for a dump of all the rings, only sets a flag so it's safe to call
+ * from a signal handler
+ */
+void trace_request_dump(void);
+
+/* Dump the rings if a dump was requested, meant to be run by a cron job */
+void trace_dump_pending(void);
+
+/*
+ * Write the spans currently in the rings to the trace path, returns the
+ * number of spans written or -1 on error. Spans being recorded during the
+ * dump may be missing or partially overwritten.
+ */
+int trace_dump(void);
+
+/* Release all the rings */
+void trace_close(void);
+
+/*
+ * Probes, a span is opened by saving TRACE_START() in a local variable and
+ * closed with TRACE_END, names must be string literals or otherwise outlive
+ * the rings
+ */
+#define TRACE_START() (__builtin_expect(trace_enabled, 0) ? monotonic_ns() : 0)
+
+#define TRACE_END(name, start) do {                     \
+    if (__builtin_expect((start) != 0, 0))              \
+        trace_record((name), (start));                  \
+} while (0)
+
+/* Lock a mutex tracing the time spent waiting for it */
+#define TRACE_LOCK(name, m) do {                        \
+    uint64_t trace_lock_start = TRACE_START();          \
+    pthread_mutex_lock((m));                            \
+    if (__builtin_expect(trace_lock_start != 0, 0))     \
+        trace_record_lock((name), trace_lock_start);    \
+} while (0)
+
+#endif
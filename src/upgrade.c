@@ -0,0 +1,711 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "ev.h"
+#include "acl.h"
+#include "pack.h"
+#include "config.h"
+#include "server.h"
+#include "memory.h"
+#include "logging.h"
+#include "handlers.h"
+#include "upgrade.h"
+#include "expiry.h"
+#include "sol_internal.h"
+
+/* Descriptor of the upgrade socket in the new process */
+#define UPGRADE_FD      3
+
+/*
+ * Records written on the upgrade socket, each payload is preceded by a type
+ * byte and its length on 4 bytes. Strings and buffers are written as a 4
+ * bytes length followed by their contents.
+ */
+#define RECORD_HEADER   5
+
+enum record_type {
+    RECORD_LISTENER,        /* Socket attached, 1 if shared memory, 0 if TCP */
+    RECORD_RETAINED,        /* Topic, retained message, deadline */
+    RECORD_SESSION,         /* Client ID, clean session flag, deadline */
+    RECORD_WILDCARD,        /* Client ID, QoS, filter */
+    RECORD_SUBSCRIPTIONS,   /* Client ID, then QoS and topic of each one */
+    RECORD_CLIENT,          /* Connection attached, state of the client */
+    RECORD_END
+};
+
+/* Flags of a client record */
+#define CLIENT_CLEAN    (1 << 0)
+#define CLIENT_PEER     (1 << 1)
+#define CLIENT_USER     (1 << 2)
+#define CLIENT_WILL     (1 << 3)
+
+static struct {
+    atomic_bool requested;
+    char **argv;
+    int sock;           /* Upgrade socket, of the process started or inherited */
+    pid_t pid;          /* The new process, waited to be ready */
+    time_t since;
+    bool ready;         /* Hand over as soon as the loops are stopped */
+} upgrade = {
+    .requested = ATOMIC_VAR_INIT(false),
+    .argv = NULL,
+    .sock = -1,
+    .pid = -1,
+    .since = 0,
+    .ready = false
+};
+
+/*
+ * Records writing
+ */
+
+struct handoff {
+    int sock;
+    bool ok;    /* Nothing is written after the first failure */
+    u8 *data;   /* Payload of the record being built */
+    size_t len;
+    size_t size;
+};
+
+static void put(struct handoff *h, const void *data, size_t len) {
+    if (len == 0)
+        return;
+    if (h->len + len > h->size) {
+        h->size = (h->len + len) * 2;
+        h->data = try_realloc(h->data, h->size);
+    }
+    memcpy(h->data + h->len, data, len);
+    h->len += len;
+}
+
+static void put_u8(struct handoff *h, u8 val) {
+    put(h, &val, sizeof(val));
+}
+
+static void put_u32(struct handoff *h, u32 val) {
+    u8 buf[4];
+    packi32(buf, val);
+    put(h, buf, sizeof(buf));
+}
+
+static void put_bytes(struct handoff *h, const void *data, size_t len) {
+    put_u32(h, len);
+    put(h, data, len);
+}
+
+static void put_str(struct handoff *h, const char *str) {
+    put_bytes(h, str, strlen(str));
+}
+
+/*
+ * Write out the record built, with a descriptor attached if fd >= 0. It goes
+ * with the first byte sent, whatever is left is written plainly.
+ */
+static void send_record(struct handoff *h, u8 type, int fd) {
+    u8 header[RECORD_HEADER] = { type };
+    packi32(header + 1, h->len);
+    size_t total = RECORD_HEADER + h->len, sent = 0;
+    h->len = 0;
+    if (h->ok == false)
+        return;
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = RECORD_HEADER },
+        { .iov_base = h->data, .iov_len = total - RECORD_HEADER }
+    };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } cbuf;
+    memset(&cbuf, 0x00, sizeof(cbuf));
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = total > RECORD_HEADER ? 2 : 1
+    };
+    if (fd >= 0) {
+        msg.msg_control = cbuf.buf;
+        msg.msg_controllen = sizeof(cbuf.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    ssize_t n = sendmsg(h->sock, &msg, MSG_NOSIGNAL);
+    while (n > 0 && (sent += n) < total) {
+        if (sent < RECORD_HEADER)
+            n = send(h->sock, header + sent, RECORD_HEADER - sent, MSG_NOSIGNAL);
+        else
+            n = send(h->sock, h->data + sent - RECORD_HEADER,
+                     total - sent, MSG_NOSIGNAL);
+    }
+    if (n <= 0) {
+        log_error("Upgrade: failed to hand over: %s", strerror(errno));
+        h->ok = false;
+    }
+}
+
+/*
+ * Records reading
+ */
+
+struct cursor {
+    const u8 *p;
+    const u8 *end;
+    bool ok;    /* Set to false reading past the end */
+};
+
+static const u8 *get(struct cursor *c, size_t len) {
+    if (c->ok == false || (size_t) (c->end - c->p) < len) {
+        c->ok = false;
+        return NULL;
+    }
+    const u8 *p = c->p;
+    c->p += len;
+    return p;
+}
+
+static u8 get_u8(struct cursor *c) {
+    const u8 *p = get(c, 1);
+    return p ? *p : 0;
+}
+
+static u32 get_u32(struct cursor *c) {
+    const u8 *p = get(c, 4);
+    return p ? unpacku32((u8 *) p) : 0;
+}
+
+static const u8 *get_bytes(struct cursor *c, size_t *len) {
+    *len = get_u32(c);
+    return get(c, *len);
+}
+
+/* Strings not fitting are an error, dst is set to empty */
+static void get_str(struct cursor *c, char *dst, size_t size) {
+    size_t len = 0;
+    const u8 *p = get_bytes(c, &len);
+    if (p && len >= size)
+        c->ok = false;
+    if (c->ok == false)
+        len = 0;
+    if (len > 0)
+        memcpy(dst, p, len);
+    dst[len] = '\0';
+}
+
+static bool read_all(int sock, u8 *buf, size_t len) {
+    for (size_t n = 0; n < len; ) {
+        ssize_t r = recv(sock, buf + n, len - n, 0);
+        if (r <= 0)
+            return false;
+        n += r;
+    }
+    return true;
+}
+
+/*
+ * Read the next record, the payload returned must be freed, fd is set to the
+ * descriptor attached or -1
+ */
+static bool recv_record(int sock, u8 *type, u8 **data, size_t *len, int *fd) {
+    u8 header[RECORD_HEADER];
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } cbuf;
+    struct iovec iov = { .iov_base = header, .iov_len = RECORD_HEADER };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = cbuf.buf,
+        .msg_controllen = sizeof(cbuf.buf)
+    };
+    *fd = -1;
+    *data = NULL;
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0)
+        return false;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    if (!read_all(sock, header + n, RECORD_HEADER - n))
+        goto err;
+    *type = header[0];
+    *len = unpacku32(header + 1);
+    *data = try_alloc(*len + 1);
+    if (!read_all(sock, *data, *len))
+        goto err;
+    return true;
+
+err:
+
+    if (*fd >= 0)
+        close(*fd);
+    free_memory(*data);
+    *data = NULL;
+    return false;
+}
+
+/*
+ * Old process side
+ */
+
+static void handoff_retained(struct trie_node *node, void *arg) {
+    struct handoff *h = arg;
+    if (!node || !node->data)
+        return;
+    const struct topic *t = node->data;
+    if (!t->retained_msg)
+        return;
+    put_str(h, t->name);
+    put_bytes(h, t->retained_msg, alloc_size(t->retained_msg));
+    put_u32(h, (u32) t->retained_expiry);
+    send_record(h, RECORD_RETAINED, -1);
+}
+
+static void handoff_sessions(struct handoff *h) {
+    struct client_session *s, *tmp;
+    HASH_ITER(hh, server.sessions, s, tmp) {
+        put_str(h, s->session_id);
+        put_u8(h, s->clean_session);
+        put_u32(h, (u32) s->expiry);
+        send_record(h, RECORD_SESSION, -1);
+    }
+    /*
+     * Wildcards are restored before the plain subscriptions, a multilevel
+     * one subscribes all the topics below as well
+     */
+    topic_store_wildcards_foreach(item, server.store) {
+        const struct subscription *ws = item->data;
+        size_t len = strlen(ws->topic);
+        put_str(h, ws->subscriber->session->session_id);
+        put_u8(h, ws->subscriber->granted_qos);
+        // Stored with the trailing '/', multilevel ones without the '#'
+        if (ws->multilevel == true) {
+            put_u32(h, len + 1);
+            put(h, ws->topic, len);
+            put(h, "#", 1);
+        } else {
+            put_bytes(h, ws->topic, len - 1);
+        }
+        send_record(h, RECORD_WILDCARD, -1);
+    }
+    HASH_ITER(hh, server.sessions, s, tmp) {
+        put_str(h, s->session_id);
+        list_foreach(item, s->subscriptions) {
+            const struct topic *t = item->data;
+            size_t len = strlen(t->name) - 1;
+            struct subscriber *sub = NULL;
+            HASH_FIND_STR(t->subscribers, s->session_id, sub);
+            if (!sub || len == 0)
+                continue;
+            put_u8(h, sub->granted_qos);
+            put_bytes(h, t->name, len);
+        }
+        send_record(h, RECORD_SUBSCRIPTIONS, -1);
+    }
+}
+
+/*
+ * Connections in the middle of a handler, parked included, are left behind
+ * as encrypted and shared memory ones, their state lives in this process
+ */
+static size_t handoff_clients(struct handoff *h) {
+    size_t clients = 0;
+    struct client *c, *tmp;
+    HASH_ITER(hh, server.clients_map, c, tmp) {
+        if (c->online == false || c->connected == false
+            || c->status == SENDING_DATA || c->conn.ssl || c->conn.shm)
+            continue;
+        const struct mqtt_publish *will = &c->session->lwt_msg.publish;
+        const char *username = c->acl ? c->acl->username : NULL;
+        u8 flags = (c->clean_session == true ? CLIENT_CLEAN : 0)
+            | (c->cluster_peer == true ? CLIENT_PEER : 0)
+            | (username ? CLIENT_USER : 0)
+            | (c->has_lwt == true ? CLIENT_WILL : 0);
+        put_str(h, c->client_id);
+        put_str(h, c->conn.ip);
+        put_u8(h, flags);
+        if (username)
+            put_str(h, username);
+        if (c->has_lwt == true) {
+            put_bytes(h, will->topic, will->topiclen);
+            put_bytes(h, will->payload, will->payloadlen);
+            put_u8(h, c->session->lwt_msg.header.bits.qos);
+        }
+        put_u8(h, c->status);
+        put_u32(h, c->rpos);
+        put_u32(h, c->toread);
+        put_bytes(h, c->rbuf, c->read);
+        put_bytes(h, c->wbuf + c->wrote, c->towrite - c->wrote);
+        send_record(h, RECORD_CLIENT, c->conn.fd);
+        clients++;
+    }
+    return clients;
+}
+
+/*
+ * Start the executable again with the upgrade socket, only async-signal-safe
+ * calls are made in the child, everything it needs is prepared before
+ */
+static void upgrade_spawn(void) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, fds) < 0) {
+        log_error("Upgrade: socketpair failed: %s", strerror(errno));
+        return;
+    }
+    size_t n = 0;
+    while (environ[n])
+        n++;
+    char **envp = try_calloc(n + 2, sizeof(char *));
+    memcpy(envp, environ, n * sizeof(char *));
+    envp[n] = UPGRADE_ENV "=3";
+    long maxfd = sysconf(_SC_OPEN_MAX);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Nothing else than the standard descriptors and the upgrade socket
+        if (fds[1] == UPGRADE_FD)
+            fcntl(UPGRADE_FD, F_SETFD, 0);
+        else
+            dup2(fds[1], UPGRADE_FD);
+#ifdef SYS_close_range
+        if (syscall(SYS_close_range, UPGRADE_FD + 1, ~0U, 0) < 0)
+#endif
+            for (long fd = UPGRADE_FD + 1; fd < maxfd; ++fd)
+                close(fd);
+        environ = envp;
+        execvp(upgrade.argv[0], upgrade.argv);
+        _exit(EXIT_FAILURE);
+    }
+    free_memory(envp);
+    close(fds[1]);
+    if (pid < 0) {
+        log_error("Upgrade: fork failed: %s", strerror(errno));
+        close(fds[0]);
+        return;
+    }
+    log_info("Upgrade: started %s as process %d", upgrade.argv[0], pid);
+    upgrade.sock = fds[0];
+    upgrade.pid = pid;
+    upgrade.since = time(NULL);
+}
+
+/*
+ * The new process writes a byte once it's ready to resume, the server is
+ * stopped then and what's left is done by upgrade_handoff
+ */
+static void upgrade_wait(void) {
+    u8 byte;
+    ssize_t n = recv(upgrade.sock, &byte, 1, MSG_DONTWAIT);
+    if (n == 1) {
+        log_info("Upgrade: process %d ready, handing over", upgrade.pid);
+        upgrade.ready = true;
+        stop_server();
+        return;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)
+        && time(NULL) - upgrade.since < UPGRADE_TIMEOUT)
+        return;
+    log_error("Upgrade: process %d failed to start, keep running", upgrade.pid);
+    kill(upgrade.pid, SIGKILL);
+    waitpid(upgrade.pid, NULL, 0);
+    close(upgrade.sock);
+    upgrade.sock = -1;
+    upgrade.pid = -1;
+}
+
+void upgrade_init(char **argv) {
+    upgrade.argv = argv;
+    const char *fd = getenv(UPGRADE_ENV);
+    if (!fd)
+        return;
+    upgrade.sock = atoi(fd);
+    // Not to be inherited by the next upgrade
+    unsetenv(UPGRADE_ENV);
+}
+
+void upgrade_request(void) {
+    atomic_store(&upgrade.requested, true);
+}
+
+void upgrade_check(struct ev_ctx *ctx, void *data) {
+    (void) ctx;
+    (void) data;
+    if (upgrade.ready == true)
+        return;
+    if (upgrade.pid > 0)
+        upgrade_wait();
+    else if (atomic_exchange(&upgrade.requested, false) == true)
+        upgrade_spawn();
+}
+
+bool upgrade_handoff(int sfd, int shm_sfd) {
+    if (upgrade.ready == false)
+        return false;
+    struct handoff h = { upgrade.sock, true, NULL, 0, 0 };
+    put_u8(&h, 0);
+    send_record(&h, RECORD_LISTENER, sfd);
+    if (shm_sfd >= 0) {
+        put_u8(&h, 1);
+        send_record(&h, RECORD_LISTENER, shm_sfd);
+    }
+    topic_store_map(server.store, NULL, handoff_retained, &h);
+    handoff_sessions(&h);
+    size_t clients = handoff_clients(&h);
+    send_record(&h, RECORD_END, -1);
+    free_memory(h.data);
+    if (h.ok == true)
+        log_info("Upgrade: %lu clients handed over to process %d",
+                 clients, upgrade.pid);
+    /*
+     * The socket is closed on exit, the new process waits for that to be sure
+     * everything held here is released, ports and files
+     */
+    return true;
+}
+
+/*
+ * New process side
+ */
+
+static struct client_session *find_session(const char *id) {
+    struct client_session *s = NULL;
+    HASH_FIND_STR(server.sessions, id, s);
+    return s;
+}
+
+static void resume_listener(struct cursor *c, int fd, int *sfd, int *shm_sfd) {
+    u8 shm = get_u8(c);
+    if (c->ok == true && shm == 0 && *sfd < 0)
+        *sfd = fd;
+    else if (c->ok == true && shm == 1 && *shm_sfd < 0
+             && conf->shm_socket[0] != '\0')
+        *shm_sfd = fd;
+    else
+        close(fd);
+}
+
+static void resume_retained(struct cursor *c) {
+    char topic[0xFFFF + 2];
+    get_str(c, topic, sizeof(topic));
+    size_t len = 0;
+    const u8 *msg = get_bytes(c, &len);
+    time_t deadline = get_u32(c);
+    if (c->ok == false || len == 0)
+        return;
+    struct topic *t = topic_store_get_or_put(server.store, topic);
+    free_memory(t->retained_msg);
+    t->retained_msg = try_alloc(len);
+    memcpy(t->retained_msg, msg, len);
+    t->retained_expiry = deadline;
+    if (deadline > 0)
+        expiry_track_retained(t);
+}
+
+static void resume_session(struct cursor *c) {
+    char id[MQTT_CLIENT_ID_LEN];
+    get_str(c, id, sizeof(id));
+    bool clean = get_u8(c);
+    time_t deadline = get_u32(c);
+    if (c->ok == false || find_session(id))
+        return;
+    struct client_session *s = client_session_alloc(id);
+    INCREF(s, struct client_session);
+    s->clean_session = clean;
+    s->expiry = deadline;
+    HASH_ADD_STR(server.sessions, session_id, s);
+    if (deadline > 0)
+        expiry_track_session(s);
+}
+
+static void resume_wildcard(struct cursor *c) {
+    char id[MQTT_CLIENT_ID_LEN], filter[0xFFFF + 1];
+    get_str(c, id, sizeof(id));
+    unsigned qos = get_u8(c);
+    get_str(c, filter, sizeof(filter));
+    struct client_session *s = find_session(id);
+    if (c->ok == true && s && filter[0])
+        session_subscribe(s, filter, strlen(filter), qos);
+}
+
+/* Topics already subscribed through a multilevel wildcard are skipped */
+static void resume_subscriptions(struct cursor *c) {
+    char id[MQTT_CLIENT_ID_LEN], topic[0xFFFF + 2];
+    get_str(c, id, sizeof(id));
+    struct client_session *s = find_session(id);
+    while (s && c->ok == true && c->p < c->end) {
+        unsigned qos = get_u8(c);
+        get_str(c, topic, sizeof(topic) - 1);
+        size_t len = strlen(topic);
+        if (c->ok == false || len == 0)
+            break;
+        snprintf(topic + len, 2, "/");
+        const struct topic *t = topic_store_get(server.store, topic);
+        if (t && is_subscribed(t, s))
+            continue;
+        topic[len] = '\0';
+        session_subscribe(s, topic, len, qos);
+    }
+}
+
+static bool resume_client(struct cursor *c, int fd) {
+    char id[MQTT_CLIENT_ID_LEN], ip[INET_ADDRSTRLEN + 6];
+    char username[0xFFFF + 1] = { 0 }, will_topic[0xFFFF + 1] = { 0 };
+    const u8 *will = NULL, *rbuf, *wbuf;
+    size_t will_len = 0, rlen, wlen;
+    unsigned will_qos = 0;
+    get_str(c, id, sizeof(id));
+    get_str(c, ip, sizeof(ip));
+    u8 flags = get_u8(c);
+    if (flags & CLIENT_USER)
+        get_str(c, username, sizeof(username));
+    if (flags & CLIENT_WILL) {
+        get_str(c, will_topic, sizeof(will_topic));
+        will = get_bytes(c, &will_len);
+        will_qos = get_u8(c);
+    }
+    int status = get_u8(c);
+    size_t rpos = get_u32(c);
+    size_t toread = get_u32(c);
+    rbuf = get_bytes(c, &rlen);
+    wbuf = get_bytes(c, &wlen);
+    struct client_session *s = find_session(id);
+    if (c->ok == false || fd < 0 || !s
+        || rlen > conf->max_request_size || toread > conf->max_request_size
+        || wlen > conf->max_request_size) {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    struct client *cc = server_adopt(fd, ip);
+    snprintf(cc->client_id, MQTT_CLIENT_ID_LEN, "%s", id);
+    cc->session = s;
+    cc->connected = true;
+    cc->clean_session = (flags & CLIENT_CLEAN) != 0;
+    cc->cluster_peer = (flags & CLIENT_PEER) != 0;
+    cc->acl = acl_client_new(flags & CLIENT_USER ? username : NULL);
+    if (flags & CLIENT_WILL) {
+        u8 *payload = try_alloc(will_len + 1);
+        if (will_len > 0)
+            memcpy(payload, will, will_len);
+        payload[will_len] = '\0';
+        cc->has_lwt = true;
+        s->lwt_msg = (struct mqtt_packet) {
+            .header = (union mqtt_header) { .byte = PUBLISH_B },
+            .publish = (struct mqtt_publish) {
+                .pkt_id = 0,
+                .topiclen = strlen(will_topic),
+                .topic = (unsigned char *) try_strdup(will_topic),
+                .payloadlen = will_len,
+                .payload = payload
+            }
+        };
+        s->lwt_msg.header.bits.qos = will_qos;
+    }
+    if (rlen > 0)
+        memcpy(cc->rbuf, rbuf, rlen);
+    cc->status = status;
+    cc->rpos = rpos;
+    cc->read = rlen;
+    cc->toread = toread;
+    if (wlen > 0)
+        memcpy(cc->wbuf, wbuf, wlen);
+    cc->towrite = wlen;
+    HASH_ADD_STR(server.clients_map, client_id, cc);
+    return true;
+}
+
+void upgrade_resume(int *sfd, int *shm_sfd) {
+    if (upgrade.sock < 0)
+        return;
+    int sock = upgrade.sock;
+    upgrade.sock = -1;
+    if (send(sock, "R", 1, MSG_NOSIGNAL) != 1) {
+        log_error("Upgrade: unable to reach the old process: %s",
+                  strerror(errno));
+        close(sock);
+        return;
+    }
+    size_t len = 0, clients = 0;
+    int fd = -1;
+    u8 type = RECORD_END, *data = NULL;
+    bool done = false;
+    while (done == false && recv_record(sock, &type, &data, &len, &fd)) {
+        struct cursor c = { data, data + len, true };
+        switch (type) {
+            case RECORD_LISTENER:
+                resume_listener(&c, fd, sfd, shm_sfd);
+                break;
+            case RECORD_RETAINED:
+                resume_retained(&c);
+                break;
+            case RECORD_SESSION:
+                resume_session(&c);
+                break;
+            case RECORD_WILDCARD:
+                resume_wildcard(&c);
+                break;
+            case RECORD_SUBSCRIPTIONS:
+                resume_subscriptions(&c);
+                break;
+            case RECORD_CLIENT:
+                if (resume_client(&c, fd) == true)
+                    clients++;
+                break;
+            case RECORD_END:
+                done = true;
+                break;
+            default:
+                if (fd >= 0)
+                    close(fd);
+                break;
+        }
+        free_memory(data);
+    }
+    if (done == false)
+        log_error("Upgrade: hand over interrupted");
+    log_info("Upgrade: resumed %lu sessions and %lu clients",
+             (unsigned long) HASH_COUNT(server.sessions), clients);
+    // Start as the old process is gone, anything it held is free
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    if (poll(&pfd, 1, UPGRADE_TIMEOUT * 1000) <= 0)
+        log_warning("Upgrade: the old process is still running");
+    close(sock);
+}
@@ -0,0 +1,89 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <stdbool.h>
+
+struct ev_ctx;
+
+/*
+ * Hot upgrade, asked with SIGUSR2. The running broker starts its executable
+ * again, the same path and arguments, passing it one end of a unix socket in
+ * the UPGRADE_ENV variable. As soon as the new process is up and reading,
+ * the loops of the old one are stopped and everything needed to carry on is
+ * written on the socket, descriptors travel attached with SCM_RIGHTS:
+ * - the listening sockets, TCP and shared memory ones, so no connection
+ *   attempt is refused during the switch, they queue in the backlog
+ * - the sessions, with their subscriptions, and the retained messages
+ * - the plain TCP connections of the clients, with the bytes pending in their
+ *   buffers, their will and their username
+ * The new process resumes all of them before starting its loops, then the
+ * old one exits. TLS and shared memory connections can't be carried, their
+ * state lives in the old process, they're closed and clients reconnect.
+ * QoS 1 and 2 messages in flight or queued are not carried either, a
+ * persistent session is restored with its subscriptions only.
+ *
+ * Should the new process fail to start, it's given UPGRADE_TIMEOUT seconds,
+ * the old one just keeps running.
+ */
+
+#define UPGRADE_ENV         "SOL_UPGRADE_FD"
+#define UPGRADE_TIMEOUT     5
+
+/*
+ * Remember the command line to start again, and check if this process has
+ * been started by an upgrade. To be called first thing in main.
+ */
+void upgrade_init(char **);
+
+/* Ask for an upgrade, safe to call from a signal handler */
+void upgrade_request(void);
+
+/*
+ * Cron job starting the upgrades asked and waiting for the new process to be
+ * ready, stopping the server once it is
+ */
+void upgrade_check(struct ev_ctx *, void *);
+
+/*
+ * Old process side, after the loops are stopped: hand the listening sockets,
+ * sessions and clients over to the new process. Returns true if they have
+ * been handed over, false if no upgrade is in progress.
+ */
+bool upgrade_handoff(int, int);
+
+/*
+ * New process side, before starting the loops: resume everything handed over
+ * by the old process, setting the listening sockets received, TCP and shared
+ * memory ones. Those not received are left untouched, to be made as usual.
+ * Does nothing if the process has not been started by an upgrade.
+ */
+void upgrade_resume(int *, int *);
+
+#endif
@@ -130,8 +130,16 @@ void generate_random_id(char *dest) {
     snprintf(dest, MQTT_CLIENT_ID_LEN - 1, "%s-%lu", SOL_PREFIX, utime_ns);
 }
 
+/*
+ * crypt_r instead of crypt, passwords are checked by the auth workers in
+ * parallel, its state is too large for the stack
+ */
 bool check_passwd(const char *passwd, const char *salt) {
-    return STREQ(crypt(passwd, salt), salt, strlen(salt));
+    struct crypt_data *data = try_calloc(1, sizeof(*data));
+    const char *hash = crypt_r(passwd, salt, data);
+    bool match = hash && STREQ(hash, salt, strlen(salt));
+    free_memory(data);
+    return match;
 }
 
 long get_fh_soft_limit(void) {
@@ -142,3 +150,9 @@ long get_fh_soft_limit(void) {
     }
     return limit.rlim_cur;
 }
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
@@ -32,6 +32,9 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 bool is_integer(const char *);
 int parse_int(const char *);
@@ -43,6 +46,25 @@ bool check_passwd(const char *, const char *);
 
 long get_fh_soft_limit(void);
 
+/*
+ * Nanoseconds from a monotonic clock, cheap enough to be called on the hot
+ * path as it doesn't enter the kernel on most platforms (vDSO)
+ */
+uint64_t monotonic_ns(void);
+
+/*
+ * Cheap cycle counter to attribute CPU time on the hot path, reads the TSC
+ * on x86, elsewhere falls back to monotonic nanoseconds. Values are only
+ * meaningful as differences taken on the same thread.
+ */
+static inline uint64_t cycle_count(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return monotonic_ns();
+#endif
+}
+
 #define STREQ(s1, s2, len) strncasecmp(s1, s2, len) == 0 ? true : false
 
 #define container_of(ptr, type, field) \
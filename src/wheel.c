@@ -0,0 +1,84 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "wheel.h"
+
+/* Unsigned, the first sweep starts a round before the first second */
+#define wheel_slot(w, t) (&(w)->slots[(unsigned long long) (t) % WHEEL_SLOTS])
+
+void wheel_init(struct wheel *w) {
+    pthread_mutex_init(&w->lock, NULL);
+    w->last = 0;
+    memset(w->slots, 0x00, sizeof(w->slots));
+}
+
+void wheel_add(struct wheel *w, struct wheel_entry *e) {
+    pthread_mutex_lock(&w->lock);
+    struct wheel_entry **slot = wheel_slot(w, e->deadline);
+    e->next = *slot;
+    *slot = e;
+    pthread_mutex_unlock(&w->lock);
+}
+
+struct wheel_entry *wheel_due(struct wheel *w, time_t now) {
+    struct wheel_entry *due = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->last == 0 || now - w->last > WHEEL_SLOTS)
+        w->last = now - WHEEL_SLOTS;
+    for (time_t t = w->last + 1; t <= now; ++t) {
+        struct wheel_entry **e = wheel_slot(w, t);
+        while (*e) {
+            if ((*e)->deadline <= now) {
+                struct wheel_entry *expired = *e;
+                *e = expired->next;
+                expired->next = due;
+                due = expired;
+            } else {
+                e = &(*e)->next;
+            }
+        }
+    }
+    w->last = now;
+    pthread_mutex_unlock(&w->lock);
+    return due;
+}
+
+struct wheel_entry *wheel_drain(struct wheel *w) {
+    struct wheel_entry *all = NULL;
+    pthread_mutex_lock(&w->lock);
+    for (int i = 0; i < WHEEL_SLOTS; ++i) {
+        while (w->slots[i]) {
+            struct wheel_entry *e = w->slots[i];
+            w->slots[i] = e->next;
+            e->next = all;
+            all = e;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return all;
+}
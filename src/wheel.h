@@ -0,0 +1,68 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2023, Andrea Giacomo Baldan All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Timing wheel of WHEEL_SLOTS one second slots, entries are indexed by their
+ * deadline, in seconds, and collected once it passes. An entry further than a
+ * round away just stays in its slot till its deadline comes. Entries are
+ * intrusive, struct wheel_entry must be the first member of the structures
+ * tracked, and owned by the caller once collected. Thread safe.
+ */
+
+#define WHEEL_SLOTS 512
+
+struct wheel_entry {
+    time_t deadline;
+    struct wheel_entry *next;
+};
+
+struct wheel {
+    pthread_mutex_t lock;
+    time_t last;                    /* Last second collected */
+    struct wheel_entry *slots[WHEEL_SLOTS];
+};
+
+void wheel_init(struct wheel *);
+
+void wheel_add(struct wheel *, struct wheel_entry *);
+
+/*
+ * Detach the entries due from the slots of the seconds passed since the last
+ * call, a whole round at most, returns them as a list linked by next
+ */
+struct wheel_entry *wheel_due(struct wheel *, time_t);
+
+/* Detach all the entries, due or not, returns them as wheel_due does */
+struct wheel_entry *wheel_drain(struct wheel *);
+
+#endif
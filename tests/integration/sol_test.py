@@ -141,3 +141,55 @@ def read_suback(packet):
     pack_format = "!" + "B" * len(packet)
     granted_qos = struct.unpack(pack_format, packet)
     return header, mid, granted_qos[0]
+
+
+def create_publish(topic, payload, qos=0, mid=0):
+    topic = topic.encode("utf-8")
+    remaining_length = 2 + len(topic) + len(payload)
+    if qos > 0:
+        remaining_length += 2
+    packet = struct.pack("!B", 0x30 | (qos << 1))
+    packet += mqtt_encode_len(remaining_length)
+    packet += struct.pack("!H" + str(len(topic)) + "s", len(topic), topic)
+    if qos > 0:
+        packet += struct.pack("!H", mid)
+    return packet + payload
+
+
+def create_puback(mid):
+    return struct.pack("!BBH", 0x40, 2, mid)
+
+
+def recv_exactly(sock, size):
+    data = b""
+    while len(data) < size:
+        chunk = sock.recv(size - len(data))
+        if not chunk:
+            raise ConnectionError("connection closed by the broker")
+        data += chunk
+    return data
+
+
+def read_packet(sock):
+    header = recv_exactly(sock, 1)[0]
+    remaining_length, mult = 0, 1
+    while True:
+        byte = recv_exactly(sock, 1)[0]
+        remaining_length += (byte & 127) * mult
+        mult *= 128
+        if byte & 128 == 0:
+            break
+    return header, recv_exactly(sock, remaining_length)
+
+
+def read_publish(packet):
+    header, body = packet
+    qos = (header >> 1) & 0x03
+    topiclen = struct.unpack("!H", body[:2])[0]
+    topic = body[2:2 + topiclen].decode("utf-8")
+    body = body[2 + topiclen:]
+    mid = 0
+    if qos > 0:
+        mid = struct.unpack("!H", body[:2])[0]
+        body = body[2:]
+    return topic, qos, mid, body
@@ -0,0 +1,167 @@
+import os
+import time
+import socket
+import signal
+import tempfile
+import subprocess
+import sol_test
+import base_testcase
+
+
+class TestCluster(base_testcase.BaseTestcase):
+
+    """
+    Runs a cluster of three brokers on the loopback, each one listing the
+    other two as peers
+    """
+
+    PORTS = (18861, 18862, 18863)
+    CONFIG = (
+        'ip_address 127.0.0.1\n'
+        'ip_port {}\n'
+        'cluster_peers {}\n'
+        'cluster_username cluster\n'
+        'cluster_password secret\n'
+    )
+    # Time for the links and the subscriptions to spread over the nodes
+    TIMEOUT = 15
+
+    @classmethod
+    def setUpClass(cls):
+        cls.confs, cls.nodes = [], []
+        for port in cls.PORTS:
+            peers = ','.join('127.0.0.1:{}'.format(p)
+                             for p in cls.PORTS if p != port)
+            conf = tempfile.NamedTemporaryFile('w', suffix='.conf')
+            conf.write(cls.CONFIG.format(port, peers))
+            conf.flush()
+            cls.confs.append(conf)
+            cls.nodes.append(subprocess.Popen(
+                ['./sol', '-c', conf.name],
+                stdout=subprocess.DEVNULL,
+                preexec_fn=os.setsid
+            ))
+        time.sleep(.5)
+
+    @classmethod
+    def tearDownClass(cls):
+        for node in cls.nodes:
+            os.kill(node.pid, signal.SIGTERM)
+            node.wait()
+        for conf in cls.confs:
+            conf.close()
+
+    def client(self, node, client_id, clean_session=True, subscribe=None,
+               **kwargs):
+        conn = self.get_connection(('127.0.0.1', self.PORTS[node]))
+        conn.settimeout(5)
+        conn.send(sol_test.create_connect(client_id,
+                                          clean_session=clean_session,
+                                          **kwargs))
+        header, body = sol_test.read_packet(conn)
+        self.assertEqual(header, 0x20)
+        self.assertEqual(body[1], 0)
+        if subscribe is not None:
+            conn.send(sol_test.create_subscribe(1, {subscribe: 1}))
+            header, _ = sol_test.read_packet(conn)
+            self.assertEqual(header, 0x90)
+        return conn
+
+    def receive_routed(self, pub, topic, subs):
+        """
+        Publish on topic till every subscriber gets a message, the nodes
+        forward it only once they know about the remote subscriptions
+        """
+        pending = list(subs)
+        deadline = time.time() + self.TIMEOUT
+        mid = 1
+        while pending and time.time() < deadline:
+            pub.send(sol_test.create_publish(topic, b'routed', 1, mid))
+            header, _ = sol_test.read_packet(pub)
+            self.assertEqual(header, 0x40)
+            mid += 1
+            for sub in list(pending):
+                sub.settimeout(.5)
+                try:
+                    packet = sol_test.read_packet(sub)
+                except socket.timeout:
+                    continue
+                rtopic, qos, rmid, payload = sol_test.read_publish(packet)
+                self.assertEqual(rtopic, topic)
+                self.assertEqual(payload, b'routed')
+                if qos > 0:
+                    sub.send(sol_test.create_puback(rmid))
+                pending.remove(sub)
+        self.assertEqual(pending, [])
+
+    def test_routing(self):
+        """
+        A message published on a node reaches the subscribers connected to
+        the other ones
+        """
+        subs = [
+            self.client(1, 'cluster-sub-1', subscribe='cluster/routing'),
+            self.client(2, 'cluster-sub-2', subscribe='cluster/routing')
+        ]
+        pub = self.client(0, 'cluster-pub')
+        try:
+            self.receive_routed(pub, 'cluster/routing', subs)
+        finally:
+            for conn in subs + [pub]:
+                conn.close()
+
+    def test_takeover(self):
+        """
+        A client connecting to another node is disconnected from the first
+        one, its persistent session subscriptions follow it
+        """
+        first = self.client(0, 'cluster-roamer', clean_session=False,
+                            subscribe='cluster/takeover')
+        second = self.client(1, 'cluster-roamer', clean_session=False)
+        first.settimeout(self.TIMEOUT)
+        try:
+            self.assertEqual(first.recv(100), b'')
+        except ConnectionResetError:
+            pass
+        first.close()
+        pub = self.client(2, 'cluster-takeover-pub')
+        try:
+            self.receive_routed(pub, 'cluster/takeover', [second])
+        finally:
+            second.close()
+            pub.close()
+
+    def test_node_prefix_refused(self):
+        """
+        The client ID prefix of the nodes is refused without the cluster
+        credentials, the nodes themselves connect with them
+        """
+        for credentials in ({}, {'username': 'cluster', 'password': 'wrong'}):
+            with self.connection(('127.0.0.1', self.PORTS[0])) as conn:
+                conn.settimeout(5)
+                conn.send(sol_test.create_connect('$cluster:fake',
+                                                  **credentials))
+                header, body = sol_test.read_packet(conn)
+                self.assertEqual(header, 0x20)
+                self.assertEqual(body[1], 5)
+
+    def test_control_topics_reserved(self):
+        """
+        Clients can't subscribe to the topics the nodes talk to each other
+        on, nor get their messages through a wildcard
+        """
+        with self.connection(('127.0.0.1', self.PORTS[0])) as conn:
+            conn.settimeout(5)
+            conn.send(sol_test.create_connect('cluster-eavesdropper'))
+            header, _ = sol_test.read_packet(conn)
+            self.assertEqual(header, 0x20)
+            for mid, (topic, rc) in enumerate((('$CLUSTER/takeover', 0x80),
+                                               ('+/takeover', 1)), 1):
+                conn.send(sol_test.create_subscribe(mid, {topic: 1}))
+                header, body = sol_test.read_packet(conn)
+                self.assertEqual(header, 0x90)
+                self.assertEqual(body[2], rc)
+            # Published on $CLUSTER/takeover for the other nodes
+            self.client(0, 'cluster-newcomer').close()
+            conn.settimeout(1)
+            self.assertRaises(socket.timeout, sol_test.read_packet, conn)
@@ -0,0 +1,212 @@
+import os
+import time
+import socket
+import struct
+import signal
+import tempfile
+import subprocess
+import sol_test
+import base_testcase
+
+
+class TestFanout(base_testcase.BaseTestcase):
+
+    """
+    Runs its own broker, with a small write buffer and a large inflight
+    window, so that sliced routing and the session backlog fill the buffers
+    """
+
+    PORT = 18830
+    SUBSCRIBERS = 1100     # More than FANOUT_SLICE
+    MESSAGES = 1200        # More than BACKLOG_SLICE and the inflight window
+    PAYLOAD = 1000
+    CONFIG = (
+        'ip_address 127.0.0.1\n'
+        'ip_port {}\n'
+        'max_request_size 16KB\n'
+        'max_inflight_messages 1000\n'
+        'backpressure_threshold 0\n'
+    )
+
+    @classmethod
+    def setUpClass(cls):
+        cls.conf = tempfile.NamedTemporaryFile('w', suffix='.conf')
+        cls.conf.write(cls.CONFIG.format(cls.PORT))
+        cls.conf.flush()
+        cls.broker = subprocess.Popen(
+            ['./sol', '-c', cls.conf.name],
+            stdout=subprocess.DEVNULL,
+            preexec_fn=os.setsid
+        )
+        time.sleep(.5)
+
+    @classmethod
+    def tearDownClass(cls):
+        os.kill(cls.broker.pid, signal.SIGTERM)
+        cls.broker.wait()
+        cls.conf.close()
+
+    def client(self, client_id, clean_session=True, subscribe=None, qos=0):
+        conn = self.get_connection(('127.0.0.1', self.PORT))
+        conn.settimeout(10)
+        conn.send(sol_test.create_connect(client_id,
+                                          clean_session=clean_session))
+        header, body = sol_test.read_packet(conn)
+        self.assertEqual(header, 0x20)
+        self.assertEqual(body[1], 0)
+        if subscribe is not None:
+            conn.send(sol_test.create_subscribe(1, {subscribe: qos}))
+            header, _ = sol_test.read_packet(conn)
+            self.assertEqual(header, 0x90)
+        return conn
+
+    def receive(self, conn):
+        topic, qos, mid, payload = sol_test.read_publish(
+            sol_test.read_packet(conn)
+        )
+        if qos > 0:
+            conn.send(sol_test.create_puback(mid))
+        return topic, payload
+
+    def test_sliced_fanout(self):
+        """
+        A PUBLISH to more than FANOUT_SLICE subscribers, routed across loop
+        cycles, reaches all of them and in order with the next ones
+        """
+        subs = [
+            self.client('fanout-{}'.format(i), subscribe='fanout/test',
+                        qos=i % 2)
+            for i in range(self.SUBSCRIBERS)
+        ]
+        try:
+            pub = self.client('fanout-pub')
+            for i in range(3):
+                pub.send(sol_test.create_publish('fanout/test',
+                                                 str(i).encode(), 1, i + 1))
+            for i in range(3):
+                header, body = sol_test.read_packet(pub)
+                self.assertEqual(header, 0x40)
+                self.assertEqual(struct.unpack('!H', body)[0], i + 1)
+            for sub in subs:
+                payloads = [self.receive(sub)[1] for _ in range(3)]
+                self.assertEqual(payloads, [b'0', b'1', b'2'])
+            pub.close()
+        finally:
+            for sub in subs:
+                sub.close()
+
+    def test_session_backlog(self):
+        """
+        Messages queued for an offline session, more than the inflight window
+        and far more than the write buffer holds, are all written out in
+        order on reconnection, a message published meanwhile follows them
+        """
+        sub = self.client('backlog-sub', clean_session=False,
+                          subscribe='backlog/test', qos=1)
+        self.send_disconnect(sub)
+        sub.close()
+        pub = self.client('backlog-pub')
+        filler = b'x' * (self.PAYLOAD - 4)
+        for i in range(self.MESSAGES):
+            pub.send(sol_test.create_publish('backlog/test',
+                                             struct.pack('!I', i) + filler,
+                                             1, i % 0xFFFF + 1))
+        for i in range(self.MESSAGES):
+            header, _ = sol_test.read_packet(pub)
+            self.assertEqual(header, 0x40)
+        sub = self.get_connection(('127.0.0.1', self.PORT))
+        sub.settimeout(10)
+        sub.send(sol_test.create_connect('backlog-sub', clean_session=False))
+        pub.send(sol_test.create_publish('backlog/test',
+                                         struct.pack('!I', self.MESSAGES),
+                                         1, 1))
+        header, body = sol_test.read_packet(sub)
+        self.assertEqual(header, 0x20)
+        self.assertEqual(body[0], 1)
+        for i in range(self.MESSAGES + 1):
+            topic, payload = self.receive(sub)
+            self.assertEqual(topic, 'backlog/test')
+            self.assertEqual(struct.unpack('!I', payload[:4])[0], i)
+        self.send_disconnect(sub)
+        sub.close()
+        pub.close()
+
+    def test_slow_subscriber(self):
+        """
+        QoS 0 messages to a subscriber not reading are dropped once its
+        write buffer is full, the ones it gets are whole
+        """
+        sub = socket.socket()
+        sub.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        sub.connect(('127.0.0.1', self.PORT))
+        sub.settimeout(10)
+        sub.send(sol_test.create_connect('slow-sub'))
+        sol_test.read_packet(sub)
+        sub.send(sol_test.create_subscribe(1, {'slow/test': 0}))
+        sol_test.read_packet(sub)
+        pub = self.client('slow-pub')
+        payload = b'y' * (8 * self.PAYLOAD)
+        for i in range(2000):
+            pub.send(sol_test.create_publish('slow/test', payload))
+        # Still serving everyone else
+        self.client('slow-check', subscribe='slow/test').close()
+        sub.settimeout(1)
+        received = 0
+        try:
+            while True:
+                topic, payload = self.receive(sub)
+                self.assertEqual(topic, 'slow/test')
+                self.assertEqual(len(payload), 8 * self.PAYLOAD)
+                received += 1
+        except socket.timeout:
+            pass
+        self.assertGreater(received, 0)
+        self.assertLess(received, 2000)
+        sub.close()
+        pub.close()
+
+    def test_slow_subscriber_publishing(self):
+        """
+        A subscriber not reading also publishes QoS 1 on the topic it
+        subscribes to, each copy routed back to it fills the write buffer to
+        the last byte: the PUBACKs still come, in order, once it reads again
+        """
+        sub = socket.socket()
+        sub.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        sub.connect(('127.0.0.1', self.PORT))
+        sub.settimeout(10)
+        sub.send(sol_test.create_connect('slow-pubsub'))
+        sol_test.read_packet(sub)
+        sub.send(sol_test.create_subscribe(1, {'slowpub/test': 1}))
+        sol_test.read_packet(sub)
+        pub = self.client('slowpub-pub')
+        flood = b'z' * (8 * self.PAYLOAD)
+        for i in range(500):
+            pub.send(sol_test.create_publish('slowpub/test', flood))
+        # 16KB as max_request_size, 3 bytes of fixed header, 16 of topic and
+        # message ID
+        own = b'o' * (16384 - 19)
+        for i in range(20):
+            sub.send(sol_test.create_publish('slowpub/test', own, 1, i + 1))
+        # Still serving everyone else
+        self.client('slowpub-check', subscribe='slowpub/test').close()
+        acks = []
+        sub.settimeout(2)
+        try:
+            while len(acks) < 20:
+                header, body = sol_test.read_packet(sub)
+                if header == 0x40:
+                    acks.append(struct.unpack('!H', body)[0])
+                    continue
+                topic, qos, mid, payload = sol_test.read_publish(
+                    (header, body)
+                )
+                self.assertEqual(topic, 'slowpub/test')
+                self.assertIn(payload, (flood, own))
+                if qos > 0:
+                    sub.send(sol_test.create_puback(mid))
+        except socket.timeout:
+            pass
+        self.assertEqual(acks, list(range(1, 21)))
+        sub.close()
+        pub.close()
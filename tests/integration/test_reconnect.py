@@ -0,0 +1,77 @@
+import os
+import socket
+import threading
+import subprocess
+import unittest
+import sol_test
+import base_testcase
+
+
+class TestReconnect(base_testcase.BaseTestcase):
+
+    WORKERS = 8
+    ROUNDS = 250
+    BENCH_ROUNDS = 12
+
+    def storm(self, worker, errors):
+        try:
+            for i in range(self.ROUNDS):
+                with self.connection() as conn:
+                    conn.settimeout(5)
+                    client_id = 'storm-{}-{}'.format(worker, i)
+                    conn.send(sol_test.create_connect(client_id))
+                    connack, rc = sol_test.read_connack(conn.recv(100))
+                    if rc != 0:
+                        errors.append('{} refused: {}'.format(client_id, rc))
+                        return
+                    conn.send(sol_test.create_subscribe(1, {'storm/test': 1}))
+                    conn.recv(100)
+                    # Half of the clients just drop the connection
+                    if i % 2 == 0:
+                        self.send_disconnect(conn)
+        except (socket.timeout, OSError) as e:
+            errors.append('storm-{}: {}'.format(worker, e))
+
+    def assert_alive(self):
+        with self.connection() as conn:
+            conn.settimeout(5)
+            conn.send(sol_test.create_connect('after-storm'))
+            connack, rc = sol_test.read_connack(conn.recv(100))
+            self.assertEqual(rc, 0)
+            conn.send(sol_test.create_subscribe(1, {'storm/test': 0}))
+            code, mid, granted_qos = sol_test.read_suback(conn.recv(100))
+            self.assertEqual(code, 0x90)
+            self.assertEqual(mid, 1)
+            self.send_disconnect(conn)
+
+    def test_reconnect_storm(self):
+        """
+        Clients connecting and disconnecting from all the loops at once,
+        their memory is reused right away, the broker must still answer
+        """
+        errors = []
+        workers = [
+            threading.Thread(target=self.storm, args=(i, errors))
+            for i in range(self.WORKERS)
+        ]
+        for w in workers:
+            w.start()
+        for w in workers:
+            w.join()
+        self.assertEqual(errors, [])
+        self.assert_alive()
+
+    @unittest.skipUnless(os.path.exists('./sol_bench'), 'sol_bench not built')
+    def test_bench_rounds(self):
+        """
+        Rounds of QoS 1 traffic, the clients of a round disconnect while the
+        ones of the next are connecting on other loops
+        """
+        for _ in range(self.BENCH_ROUNDS):
+            bench = subprocess.run(
+                './sol_bench -P 4 -S 4 -q 1 -n 20000 -t fixed'.split(),
+                stdout=subprocess.DEVNULL,
+                timeout=60
+            )
+            self.assertEqual(bench.returncode, 0)
+        self.assert_alive()
@@ -34,6 +34,16 @@
 #include "../src/list.h"
 #include "../src/memory.h"
 #include "../src/iterator.h"
+#include "../src/histogram.h"
+#include "../src/sketch.h"
+#include "../src/memorypool.h"
+#include "../src/acl.h"
+#include "../src/config.h"
+#include "../src/ratelimit.h"
+#include "../src/wheel.h"
+#include "../src/shm.h"
+#include "../src/authcache.h"
+#include "../src/sol_internal.h"
 
 /*
  * Tests the init feature of the list
@@ -83,6 +93,24 @@ static char *test_list_push_back(void) {
     return 0;
 }
 
+/*
+ * Tests the pop feature of the list
+ */
+static char *test_list_pop(void) {
+    List *l = list_new(NULL);
+    char *x = "abc", *y = "def";
+    ASSERT("list::list_pop...FAIL", list_pop(l) == NULL);
+    list_push_back(l, x);
+    list_push_back(l, y);
+    ASSERT("list::list_pop...FAIL", list_pop(l) == x);
+    ASSERT("list::list_pop...FAIL", l->len == 1);
+    ASSERT("list::list_pop...FAIL", list_pop(l) == y);
+    ASSERT("list::list_pop...FAIL", l->len == 0 && !l->head && !l->tail);
+    list_destroy(l, 0);
+    printf("list::list_pop...OK\n");
+    return 0;
+}
+
 
 static int compare_str(const void *arg1, const void *arg2) {
 
@@ -102,6 +130,7 @@ static char *test_list_remove_node(void) {
     l = list_push(l, x);
     struct list_node *node = list_remove_node(l, x, compare_str);
     ASSERT("list::list_remove_node...FAIL", strcmp(node->data, x) == 0);
+    ASSERT("list::list_remove_node...FAIL", l->len == 0 && !l->head && !l->tail);
     free_memory(node);
     list_destroy(l, 0);
     printf("list::list_remove_node...OK\n");
@@ -272,6 +301,415 @@ static char *test_trie_prefix_count(void) {
     return 0;
 }
 
+/*
+ * Tests the record and percentile features of the histogram
+ */
+static char *test_histogram_percentile(void) {
+    static struct histogram h;
+    histogram_init(&h);
+    ASSERT("histogram::histogram_percentile...FAIL",
+           histogram_percentile(&h, 50.0) == 0);
+    for (uint64_t i = 1; i <= 1000; ++i)
+        histogram_record(&h, i * 1000);
+    ASSERT("histogram::histogram_percentile...FAIL", h.total == 1000);
+    // Values are bucketed with a relative error lower than 1/16
+    uint64_t p50 = histogram_percentile(&h, 50.0);
+    ASSERT("histogram::histogram_percentile...FAIL",
+           p50 >= 500000 && p50 <= 500000 + 500000 / 16);
+    uint64_t p99 = histogram_percentile(&h, 99.0);
+    ASSERT("histogram::histogram_percentile...FAIL",
+           p99 >= 990000 && p99 <= 990000 + 990000 / 16);
+    uint64_t max = histogram_percentile(&h, 100.0);
+    ASSERT("histogram::histogram_percentile...FAIL",
+           max >= 1000000 && max <= 1000000 + 1000000 / 16);
+    // Small values are recorded exactly
+    histogram_init(&h);
+    histogram_record(&h, 7);
+    ASSERT("histogram::histogram_percentile...FAIL",
+           histogram_percentile(&h, 100.0) == 7);
+    printf("histogram::histogram_percentile...OK\n");
+    return 0;
+}
+
+/*
+ * Tests the merge and sub features of the histogram
+ */
+static char *test_histogram_merge_sub(void) {
+    static struct histogram a, b;
+    histogram_init(&a);
+    histogram_init(&b);
+    for (uint64_t i = 0; i < 100; ++i) {
+        histogram_record(&a, 10);
+        histogram_record(&b, 1 << 20);
+    }
+    histogram_merge(&a, &b);
+    ASSERT("histogram::histogram_merge...FAIL", a.total == 200);
+    ASSERT("histogram::histogram_merge...FAIL",
+           histogram_percentile(&a, 100.0) >= 1 << 20);
+    histogram_sub(&a, &b);
+    ASSERT("histogram::histogram_sub...FAIL", a.total == 100);
+    ASSERT("histogram::histogram_sub...FAIL",
+           histogram_percentile(&a, 100.0) == 10);
+    printf("histogram::histogram_merge_sub...OK\n");
+    return 0;
+}
+
+/*
+ * Tests the add and estimate features of the count-min sketch
+ */
+static char *test_cms_add(void) {
+    static struct cms cms;
+    cms_reset(&cms);
+    ASSERT("sketch::cms_add...FAIL", cms_estimate(&cms, "foo", 3) == 0);
+    for (int i = 0; i < 100; ++i)
+        cms_add(&cms, "foo", 3, 1);
+    uint64_t estimate = cms_add(&cms, "bar", 3, 42);
+    ASSERT("sketch::cms_add...FAIL", estimate >= 42);
+    // Estimates are never lower than the real counts
+    ASSERT("sketch::cms_add...FAIL", cms_estimate(&cms, "foo", 3) >= 100);
+    ASSERT("sketch::cms_add...FAIL", cms.total == 142);
+    printf("sketch::cms_add...OK\n");
+    return 0;
+}
+
+/*
+ * Tests the heavy hitters detection, a flooding key must show up on top of
+ * a multitude of low rate ones
+ */
+static char *test_heavy_hitters(void) {
+    static struct heavy_hitters hh;
+    char key[32];
+    struct topk_entry entries[3];
+    heavy_hitters_init(&hh, 3);
+    for (int i = 0; i < 5000; ++i) {
+        snprintf(key, sizeof(key), "device-%d", i);
+        heavy_hitters_add(&hh, key, 1);
+        heavy_hitters_add(&hh, "flooder", 10);
+        if (i % 2 == 0)
+            heavy_hitters_add(&hh, "noisy", 5);
+    }
+    size_t n = topk_sorted(&hh.top, entries);
+    ASSERT("sketch::heavy_hitters...FAIL", n == 3);
+    ASSERT("sketch::heavy_hitters...FAIL", strcmp(entries[0].key, "flooder") == 0);
+    ASSERT("sketch::heavy_hitters...FAIL", entries[0].count >= 50000);
+    ASSERT("sketch::heavy_hitters...FAIL", strcmp(entries[1].key, "noisy") == 0);
+    heavy_hitters_reset(&hh);
+    ASSERT("sketch::heavy_hitters...FAIL", hh.top.len == 0);
+    heavy_hitters_destroy(&hh);
+    printf("sketch::heavy_hitters...OK\n");
+    return 0;
+}
+
+/*
+ * Tests the growth of the memory pool, blocks already handed out must keep
+ * their address and contents across resizes
+ */
+static char *test_memorypool_grow(void) {
+    long *blocks[100];
+    struct memorypool *pool = memorypool_new(4, sizeof(long));
+    for (long i = 0; i < 100; ++i) {
+        blocks[i] = memorypool_alloc(pool);
+        *blocks[i] = i;
+    }
+    ASSERT("memorypool::memorypool_grow...FAIL", pool->block_used == 100);
+    ASSERT("memorypool::memorypool_grow...FAIL", pool->blocks_nr >= 100);
+    for (long i = 0; i < 100; ++i)
+        ASSERT("memorypool::memorypool_grow...FAIL", *blocks[i] == i);
+    // Released blocks are reused before growing again
+    size_t blocks_nr = pool->blocks_nr;
+    for (long i = 0; i < 100; i += 2)
+        memorypool_free(pool, blocks[i]);
+    for (long i = 0; i < 100; i += 2)
+        blocks[i] = memorypool_alloc(pool);
+    ASSERT("memorypool::memorypool_grow...FAIL", pool->blocks_nr == blocks_nr);
+    for (long i = 1; i < 100; i += 2)
+        ASSERT("memorypool::memorypool_grow...FAIL", *blocks[i] == i);
+    memorypool_destroy(pool);
+    printf("memorypool::memorypool_grow...OK\n");
+    return 0;
+}
+
+/*
+ * Tests the publish checks of the ACLs, user and pattern rules, wildcards and
+ * denies winning over grants
+ */
+static char *test_acl_check(void) {
+    struct acl *acl = acl_new();
+    ASSERT("acl::acl_check...FAIL", !acl_check(acl, NULL, "c1", "a/b", 3,
+                                               ACL_WRITE));
+    ASSERT("acl::acl_check...FAIL", acl_add(acl, NULL, "public/#",
+                                            ACL_READ | ACL_WRITE));
+    ASSERT("acl::acl_check...FAIL", acl_add(acl, "alice", "home/+/temp",
+                                            ACL_WRITE));
+    ASSERT("acl::acl_check...FAIL", acl_add(acl, NULL, "users/%u/#",
+                                            ACL_READ | ACL_WRITE));
+    ASSERT("acl::acl_check...FAIL", acl_add(acl, NULL, "clients/%c",
+                                            ACL_WRITE));
+    ASSERT("acl::acl_check...FAIL", acl_add(acl, NULL, "public/secret",
+                                            ACL_DENY));
+    ASSERT("acl::acl_check...FAIL", !acl_add(acl, NULL, "a/#/b", ACL_READ));
+    ASSERT("acl::acl_check...FAIL", !acl_add(acl, NULL, "a/b+", ACL_READ));
+    ASSERT("acl::acl_check...FAIL", acl_size(acl) == 5);
+#define CHECK(u, t, a) acl_check(acl, (u), "c1", (t), strlen(t), (a))
+    ASSERT("acl::acl_check...FAIL", CHECK(NULL, "public", ACL_WRITE));
+    ASSERT("acl::acl_check...FAIL", CHECK(NULL, "public/x/y", ACL_READ));
+    ASSERT("acl::acl_check...FAIL", !CHECK(NULL, "public/secret", ACL_WRITE));
+    ASSERT("acl::acl_check...FAIL", CHECK("alice", "home/k/temp", ACL_WRITE));
+    ASSERT("acl::acl_check...FAIL", !CHECK("alice", "home/k/temp", ACL_READ));
+    ASSERT("acl::acl_check...FAIL", !CHECK("bob", "home/k/temp", ACL_WRITE));
+    ASSERT("acl::acl_check...FAIL", !CHECK("alice", "home/k/hum", ACL_WRITE));
+    ASSERT("acl::acl_check...FAIL", CHECK("bob", "users/bob/inbox", ACL_WRITE));
+    ASSERT("acl::acl_check...FAIL", !CHECK("bob", "users/eve/inbox", ACL_WRITE));
+    ASSERT("acl::acl_check...FAIL", !CHECK(NULL, "users//inbox", ACL_WRITE));
+    ASSERT("acl::acl_check...FAIL", CHECK(NULL, "clients/c1", ACL_WRITE));
+    ASSERT("acl::acl_check...FAIL", !CHECK(NULL, "clients/c2", ACL_WRITE));
+    // Wildcards at the first level don't match $ topics
+    ASSERT("acl::acl_check...FAIL", acl_add(acl, NULL, "#", ACL_READ));
+    ASSERT("acl::acl_check...FAIL", CHECK(NULL, "x/y", ACL_READ));
+    ASSERT("acl::acl_check...FAIL", !CHECK(NULL, "$SOL/uptime", ACL_READ));
+#undef CHECK
+    // Memoized checks are dropped with a new set of rules
+    struct acl_client *ac = acl_client_new("bob");
+    ASSERT("acl::acl_check...FAIL",
+           acl_can_publish(acl, ac, "c1", "users/bob/x", 11));
+    ASSERT("acl::acl_check...FAIL",
+           acl_can_publish(acl, ac, "c1", "users/bob/x", 11));
+    struct acl *empty = acl_new();
+    ASSERT("acl::acl_check...FAIL",
+           !acl_can_publish(empty, ac, "c1", "users/bob/x", 11));
+    acl_client_free(ac);
+    acl_free(empty);
+    acl_free(acl);
+    printf("acl::acl_check...OK\n");
+    return 0;
+}
+
+/*
+ * Tests the subscription checks of the ACLs, a filter must be covered by a
+ * read rule and overlap no deny rule
+ */
+static char *test_acl_subscribe(void) {
+    struct acl *acl = acl_new();
+    acl_add(acl, NULL, "sensors/#", ACL_READ);
+    acl_add(acl, NULL, "sensors/private/#", ACL_DENY);
+    acl_add(acl, NULL, "rooms/+/temp", ACL_READ);
+    acl_add(acl, "admin", "#", ACL_READ);
+    acl_add(acl, "admin", "$SOL/#", ACL_READ);
+    struct acl_client *anon = acl_client_new(NULL);
+    struct acl_client *admin = acl_client_new("admin");
+#define SUB(c, f) acl_can_subscribe(acl, (c), "c1", (f), strlen(f))
+    ASSERT("acl::acl_subscribe...FAIL", SUB(anon, "sensors/a/b"));
+    ASSERT("acl::acl_subscribe...FAIL", SUB(anon, "sensors/a/+"));
+    ASSERT("acl::acl_subscribe...FAIL", !SUB(anon, "sensors/+/b"));
+    ASSERT("acl::acl_subscribe...FAIL", !SUB(anon, "sensors/private/x"));
+    ASSERT("acl::acl_subscribe...FAIL", !SUB(anon, "sensors/#"));
+    ASSERT("acl::acl_subscribe...FAIL", !SUB(anon, "sensors/+/x"));
+    ASSERT("acl::acl_subscribe...FAIL", SUB(anon, "rooms/+/temp"));
+    ASSERT("acl::acl_subscribe...FAIL", SUB(anon, "rooms/kitchen/temp"));
+    ASSERT("acl::acl_subscribe...FAIL", !SUB(anon, "rooms/#"));
+    ASSERT("acl::acl_subscribe...FAIL", !SUB(anon, "+/kitchen/temp"));
+    ASSERT("acl::acl_subscribe...FAIL", SUB(admin, "+/kitchen/temp"));
+    ASSERT("acl::acl_subscribe...FAIL", !SUB(admin, "#"));
+    ASSERT("acl::acl_subscribe...FAIL", SUB(admin, "rooms/#"));
+    ASSERT("acl::acl_subscribe...FAIL", SUB(admin, "$SOL/uptime"));
+    ASSERT("acl::acl_subscribe...FAIL", !SUB(anon, "$SOL/uptime"));
+#undef SUB
+    acl_client_free(anon);
+    acl_client_free(admin);
+    acl_free(acl);
+    printf("acl::acl_subscribe...OK\n");
+    return 0;
+}
+
+/*
+ * Tests the token buckets of the rate limits, frames past a second worth of
+ * tokens throttle the client, tokens come back at the configured rate and
+ * never exceed a second worth. Time is moved by rewinding the last refill.
+ */
+static char *test_ratelimit_buckets(void) {
+    config_set_default();
+    conf->rate_limits.client_messages = 10;
+    conf->rate_limits.client_bytes = 1000;
+    ratelimit_init();
+    ASSERT("ratelimit::ratelimit_take...FAIL", ratelimit_enabled == true);
+    struct rate_limit rl;
+    ratelimit_client_init(&rl);
+    for (int i = 0; i < 10; ++i)
+        ASSERT("ratelimit::ratelimit_take...FAIL",
+               !ratelimit_take(&rl, RATE_LISTENER_SOCKET, 10));
+    ASSERT("ratelimit::ratelimit_take...FAIL",
+           ratelimit_take(&rl, RATE_LISTENER_SOCKET, 10));
+    ASSERT("ratelimit::ratelimit_take...FAIL",
+           !ratelimit_refilled(&rl, RATE_LISTENER_SOCKET));
+    // 10 messages per second, a token back every 100ms
+    rl.last -= 250000000ULL;
+    ASSERT("ratelimit::ratelimit_refill...FAIL",
+           ratelimit_refilled(&rl, RATE_LISTENER_SOCKET));
+    ASSERT("ratelimit::ratelimit_refill...FAIL",
+           rl.messages > 1.4 && rl.messages < 1.6);
+    // Way more than a second, the buckets are full and no more
+    rl.last -= 5000000000ULL;
+    ASSERT("ratelimit::ratelimit_refill...FAIL",
+           ratelimit_refilled(&rl, RATE_LISTENER_SOCKET));
+    ASSERT("ratelimit::ratelimit_refill...FAIL",
+           rl.messages <= 10 && rl.bytes <= 1000);
+    for (int i = 0; i < 9; ++i)
+        ASSERT("ratelimit::ratelimit_take...FAIL",
+               !ratelimit_take(&rl, RATE_LISTENER_SOCKET, 10));
+    // A frame larger than the bytes bucket is taken anyway, going below zero
+    ASSERT("ratelimit::ratelimit_take...FAIL",
+           ratelimit_take(&rl, RATE_LISTENER_SOCKET, 2000));
+    ASSERT("ratelimit::ratelimit_take...FAIL", rl.bytes < 0);
+    struct rate_limit_stats stats;
+    ratelimit_get_stats(&stats);
+    ASSERT("ratelimit::ratelimit_get_stats...FAIL",
+           stats.client[RATE_LISTENER_SOCKET] == 2
+           && stats.listener[RATE_LISTENER_SOCKET] == 0);
+    memset(&conf->rate_limits, 0x00, sizeof(conf->rate_limits));
+    ratelimit_enabled = false;
+    printf("ratelimit::ratelimit_buckets...OK\n");
+    return 0;
+}
+
+/*
+ * Tests the collection of the entries of the timing wheel by deadline
+ */
+static char *test_wheel_due(void) {
+    struct wheel w;
+    wheel_init(&w);
+    struct wheel_entry a = { .deadline = 100 }, b = { .deadline = 101 };
+    // Same slot as a deadline a round and more away
+    struct wheel_entry c = { .deadline = 105 + WHEEL_SLOTS };
+    wheel_add(&w, &a);
+    wheel_add(&w, &b);
+    wheel_add(&w, &c);
+    ASSERT("wheel::wheel_due...FAIL", wheel_due(&w, 99) == NULL);
+    struct wheel_entry *due = wheel_due(&w, 100);
+    ASSERT("wheel::wheel_due...FAIL", due == &a && due->next == NULL);
+    due = wheel_due(&w, 105);
+    ASSERT("wheel::wheel_due...FAIL", due == &b && due->next == NULL);
+    // Swept past its slot over and over, still there till its deadline
+    for (time_t t = 106; t < c.deadline; t += 100)
+        ASSERT("wheel::wheel_due...FAIL", wheel_due(&w, t) == NULL);
+    due = wheel_due(&w, c.deadline);
+    ASSERT("wheel::wheel_due...FAIL", due == &c && due->next == NULL);
+    // A gap longer than a round sweeps every slot once
+    struct wheel_entry d = { .deadline = c.deadline + 10 };
+    wheel_add(&w, &d);
+    due = wheel_due(&w, d.deadline + 10 * WHEEL_SLOTS);
+    ASSERT("wheel::wheel_due...FAIL", due == &d && due->next == NULL);
+    printf("wheel::wheel_due...OK\n");
+    return 0;
+}
+
+/*
+ * Tests the detach of all the entries of the timing wheel, due or not
+ */
+static char *test_wheel_drain(void) {
+    struct wheel w;
+    wheel_init(&w);
+    struct wheel_entry a = { .deadline = 10 }, b = { .deadline = 10 };
+    struct wheel_entry c = { .deadline = 10 + 3 * WHEEL_SLOTS };
+    wheel_add(&w, &a);
+    wheel_add(&w, &b);
+    wheel_add(&w, &c);
+    int n = 0;
+    for (struct wheel_entry *e = wheel_drain(&w); e; e = e->next)
+        n++;
+    ASSERT("wheel::wheel_drain...FAIL", n == 3);
+    ASSERT("wheel::wheel_drain...FAIL", wheel_drain(&w) == NULL);
+    ASSERT("wheel::wheel_drain...FAIL", wheel_due(&w, c.deadline) == NULL);
+    printf("wheel::wheel_drain...OK\n");
+    return 0;
+}
+
+/*
+ * Tests the shared memory ring across the end of data and the overflow of the
+ * head and tail counters, a ring full and a corrupt one
+ */
+static char *test_shm_ring_wraparound(void) {
+    const size_t size = 64;
+    struct shm_ring *r = aligned_alloc(64, sizeof(*r) + size);
+    memset(r, 0x00, sizeof(*r) + size);
+    r->size = size;
+    // 10 bytes to the end of data and to the overflow of the counters
+    atomic_store(&r->head, 0ULL - 10);
+    atomic_store(&r->tail, 0ULL - 10);
+    unsigned char in[100], out[100];
+    for (int i = 0; i < 100; ++i)
+        in[i] = i;
+    ASSERT("shm::shm_ring_write...FAIL", shm_ring_write(r, size, in, 40) == 40);
+    ASSERT("shm::shm_ring_write...FAIL", atomic_load(&r->head) == 30);
+    ASSERT("shm::shm_ring_read...FAIL", shm_ring_read(r, size, out, 100) == 40);
+    ASSERT("shm::shm_ring_read...FAIL", memcmp(in, out, 40) == 0);
+    ASSERT("shm::shm_ring_empty...FAIL", shm_ring_empty(r));
+    // Full, the write is short and the next one writes nothing
+    ASSERT("shm::shm_ring_write...FAIL",
+           shm_ring_write(r, size, in, 100) == (ssize_t) size);
+    ASSERT("shm::shm_ring_write...FAIL", shm_ring_write(r, size, in, 1) == 0);
+    ASSERT("shm::shm_ring_read...FAIL",
+           shm_ring_read(r, size, out, 100) == (ssize_t) size);
+    ASSERT("shm::shm_ring_read...FAIL", memcmp(in, out, size) == 0);
+    // More bytes in than the size, a corrupt ring
+    atomic_store(&r->head, atomic_load(&r->tail) + size + 1);
+    ASSERT("shm::shm_ring_write...FAIL", shm_ring_write(r, size, in, 1) == -1);
+    ASSERT("shm::shm_ring_read...FAIL", shm_ring_read(r, size, out, 1) == -1);
+    free(r);
+    printf("shm::shm_ring_wraparound...OK\n");
+    return 0;
+}
+
+/*
+ * Tests the cache of the logins verified, a hit till the entry expires, a
+ * miss on another digest or once replaced in its slot
+ */
+static char *test_auth_cache(void) {
+    struct auth_cache cache;
+    auth_cache_init(&cache, 3);
+    ASSERT("authcache::auth_cache_init...FAIL", cache.mask == 3);
+    unsigned char a[AUTH_DIGEST_LEN], b[AUTH_DIGEST_LEN];
+    memset(a, 0x01, sizeof(a));
+    memset(b, 0x02, sizeof(b));
+    time_t now = 1000;
+    ASSERT("authcache::auth_cache_hit...FAIL",
+           !auth_cache_hit(&cache, a, now));
+    auth_cache_put(&cache, a, now);
+    ASSERT("authcache::auth_cache_hit...FAIL",
+           auth_cache_hit(&cache, a, now + AUTH_CACHE_TTL - 1));
+    ASSERT("authcache::auth_cache_hit...FAIL",
+           !auth_cache_hit(&cache, a, now + AUTH_CACHE_TTL));
+    ASSERT("authcache::auth_cache_hit...FAIL",
+           !auth_cache_hit(&cache, b, now));
+    // Same slot, differing past the bytes indexing it
+    memcpy(b, a, sizeof(size_t));
+    auth_cache_put(&cache, b, now);
+    ASSERT("authcache::auth_cache_hit...FAIL",
+           auth_cache_hit(&cache, b, now));
+    ASSERT("authcache::auth_cache_hit...FAIL",
+           !auth_cache_hit(&cache, a, now));
+    auth_cache_free(&cache);
+    // Disabled, nothing is ever a hit
+    auth_cache_init(&cache, 0);
+    auth_cache_put(&cache, a, now);
+    ASSERT("authcache::auth_cache_hit...FAIL",
+           !auth_cache_hit(&cache, a, now));
+    auth_cache_free(&cache);
+    printf("authcache::auth_cache...OK\n");
+    return 0;
+}
+
+/*
+ * Tests the per connection footprint of the structures allocated for every
+ * client, see the README before raising the budgets
+ */
+static char *test_connection_footprint(void) {
+    ASSERT("footprint::client...FAIL", sizeof(struct client) <= 512);
+    ASSERT("footprint::session...FAIL",
+           sizeof(struct client_session) + 3 * sizeof(List) <= 512);
+    printf("footprint::connection...OK\n");
+    return 0;
+}
+
 /*
  * All datastructure tests
  */
@@ -281,6 +719,7 @@ char *structures_test() {
     RUN_TEST(test_list_destroy);
     RUN_TEST(test_list_push);
     RUN_TEST(test_list_push_back);
+    RUN_TEST(test_list_pop);
     RUN_TEST(test_list_remove_node);
     RUN_TEST(test_list_iterator);
     RUN_TEST(test_trie_create_node);
@@ -290,6 +729,19 @@ char *structures_test() {
     RUN_TEST(test_trie_delete);
     RUN_TEST(test_trie_prefix_delete);
     RUN_TEST(test_trie_prefix_count);
+    RUN_TEST(test_histogram_percentile);
+    RUN_TEST(test_histogram_merge_sub);
+    RUN_TEST(test_cms_add);
+    RUN_TEST(test_heavy_hitters);
+    RUN_TEST(test_memorypool_grow);
+    RUN_TEST(test_acl_check);
+    RUN_TEST(test_acl_subscribe);
+    RUN_TEST(test_ratelimit_buckets);
+    RUN_TEST(test_wheel_due);
+    RUN_TEST(test_wheel_drain);
+    RUN_TEST(test_shm_ring_wraparound);
+    RUN_TEST(test_auth_cache);
+    RUN_TEST(test_connection_footprint);
 
     return 0;
 }